@@ -0,0 +1,1169 @@
+/** @file
+ * @brief End-to-end server benchmark.
+ *
+ * A ServerInstance is driven in-process by synthetic clients, over a
+ * simulated network running on a virtual clock. Each scenario plays a match
+ * with a given number of players, input script and lag window, and reports
+ * the cost of the server side only, and the delay of inputs between
+ * clients.
+ *
+ * Server and clients use distinct io_services: time and allocations are
+ * measured while the server's one is polled.
+ *
+ * Only the network and clocks of instances are virtual, timers run on real
+ * time. Paths driven by timers are thus not covered: the lag watchdog
+ * (LagBudgetTicks is 0), resume timeouts, spectator batches and keyframes,
+ * and client pings (disabled).
+ *
+ * Checks are also available, comparing fields of clients to the server's
+ * ones at the end of a match:
+ *  - resume: a client link is dropped during a match, the client reconnects
+ *    and resumes its player;
+ *  - input channel: inputs are sent over lossy datagrams while garbages are
+ *    dropped, then over real UDP sockets on the loopback interface;
+ *  - threads: clients are connected with in-process pipes, the server runs
+ *    on its own thread.
+ */
+
+#ifdef WIN32
+#include <winsock2.h>  // workaround for boost bug
+#endif
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/detail/socket_ops.hpp>
+#include "server.h"
+#include "client.h"
+#include "netsim.h"
+#include "inifile.h"
+#include "optget.h"
+#include "log.h"
+
+/// Default config file, for field configurations.
+#define CONF_FILE_DEFAULT  "panettopon.ini"
+
+
+/** @name Allocation counting.
+ *
+ * Replaceable allocation functions; array versions call them.
+ */
+//@{
+static std::atomic<unsigned long> g_allocations(0);
+
+void* operator new(size_t size)
+{
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  void* p = std::malloc(size ? size : 1);
+  if(!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+  std::free(p);
+}
+//@}
+
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+
+/// Input script of synthetic clients.
+enum class Script {
+  IDLE,  ///< no input
+  /** @brief Look for matching swaps, raise when none is found and the stack is low.
+   *
+   * Swaps alone rarely chain: settled fields are also periodically replaced
+   * by a stair grid, on the server and the owner's client (see seedChain()).
+   */
+  COMBO,
+};
+
+/// Period of stair grid seeding, in ticks.
+const Tick CHAIN_PERIOD = 600;
+
+/// Stair of horizontal matches, each one triggering the next: a 10-chain.
+const char* const GRID_CHAIN[FIELD_HEIGHT+1] = {
+  "......",
+  "......",
+  "......",
+  "......",
+  "..34..",
+  "..13..",
+  "..31..",
+  ".1224.",
+  ".3113.",
+  ".2121.",
+  "322124",
+  "111212",
+  "345123",
+};
+
+/** @brief Replace the grid of a settled field by a chain stair, periodically.
+ *
+ * Called before a step, with the same result on all instances simulating
+ * the field.
+ */
+void seedChain(Field& fld)
+{
+  if(fld.tick() == 0 || fld.tick() % CHAIN_PERIOD != 0 || fld.lost() || fld.isSwapping()) {
+    return;
+  }
+  // no garbage on the field, nothing moving
+  for(int y=1; y<=FIELD_HEIGHT; y++) {
+    for(int x=0; x<FIELD_WIDTH; x++) {
+      const Block& bk = fld.block(x, y);
+      if(!bk.isNone() && (!bk.isState(BkColor::REST) || bk.chaining)) {
+        return;
+      }
+    }
+  }
+  std::string data;
+  for(int y=0; y<=FIELD_HEIGHT; y++) {
+    const char* line = GRID_CHAIN[FIELD_HEIGHT-y];
+    for(int x=0; x<FIELD_WIDTH; x++) {
+      data.push_back(line[x] == '.' ? 0 : line[x] - '0');
+    }
+  }
+  if(!fld.setGridColorsFromBytes(data)) {
+    throw std::runtime_error("chain grid needs 5 colors");
+  }
+}
+
+
+/// Benchmark scenario.
+struct Scenario {
+  unsigned int players;
+  Script script;
+  unsigned int lag_window;  ///< tk_lag_max, in ticks
+  unsigned int loss_percent;  ///< packet loss of links
+  bool input_channel;  ///< send inputs in datagrams too
+};
+
+/// Measures of a scenario.
+struct Result {
+  Tick ticks = 0;  ///< measured match ticks
+  unsigned long steps = 0;  ///< field steps simulated by the server
+  Clock::duration server_time = Clock::duration::zero();
+  unsigned long allocations = 0;
+  unsigned long bytes = 0;  ///< bytes sent by the server
+  unsigned long packets = 0;  ///< packets sent by the server
+  unsigned long writes = 0;  ///< transport writes of the server
+  unsigned long chains = 0;  ///< chains of server fields
+  unsigned long garbages = 0;  ///< garbages dropped on server fields
+  /// Delays between the input of a player and its step on other clients, in microseconds (sorted)
+  std::vector<uint64_t> input_delays;
+};
+
+/// Send times of player inputs, and resulting delays.
+struct InputDelays {
+  bool enabled = false;
+  std::map<std::pair<PlId, Tick>, uint64_t> sent;
+  std::vector<uint64_t> delays;
+};
+
+
+/// Transport counting sent data, wrapping the server's end of a link.
+class CountingTransport: public netplay::Transport
+{
+ public:
+  CountingTransport(std::unique_ptr<netplay::Transport> transport, Result& result):
+      transport_(std::move(transport)), result_(result) {}
+
+  virtual void asyncRead(char* buf, size_t size, Handler handler) {
+    transport_->asyncRead(buf, size, handler);
+  }
+  virtual void asyncWrite(const char* buf, size_t size, Handler handler) {
+    result_.writes++;
+    result_.bytes += size;
+    // count packets from their size prefix
+    size_t pos = 0;
+    while(pos + 4 <= size) {
+      uint32_t n;
+      ::memcpy(&n, buf+pos, sizeof(n));
+      // highest bit flags compressed packets
+      pos += 4 + (boost::asio::detail::socket_ops::network_to_host_long(n) & 0x7fffffff);
+      result_.packets++;
+    }
+    transport_->asyncWrite(buf, size, handler);
+  }
+  virtual bool isOpen() const { return transport_->isOpen(); }
+  virtual void close() { transport_->close(); }
+
+ private:
+  std::unique_ptr<netplay::Transport> transport_;
+  Result& result_;
+};
+
+/// Datagram transport counting sent data, wrapping the server's one.
+class CountingDatagramTransport: public netplay::DatagramTransport
+{
+ public:
+  CountingDatagramTransport(std::shared_ptr<netplay::DatagramTransport> transport, Result& result):
+      transport_(transport), result_(result) {}
+
+  virtual void start(ReceiveHandler handler) { transport_->start(handler); }
+  virtual void sendTo(const Endpoint& endpoint, const std::string& data) {
+    result_.writes++;
+    result_.packets++;
+    result_.bytes += data.size();
+    transport_->sendTo(endpoint, data);
+  }
+  virtual bool isOpen() const { return transport_->isOpen(); }
+  virtual void close() { transport_->close(); }
+
+ private:
+  std::shared_ptr<netplay::DatagramTransport> transport_;
+  Result& result_;
+};
+
+
+/// Observer of the server, ignore everything.
+class ServerObserver: public ServerInstance::Observer
+{
+ public:
+  virtual void onChat(Player&, const std::string&) {}
+  virtual void onPlayerJoined(Player&) {}
+  virtual void onPlayerChangeNick(Player&, const std::string&) {}
+  virtual void onPlayerStateChange(Player&) {}
+  virtual void onPlayerChangeFieldConf(Player&) {}
+  virtual void onStateChange() {}
+  virtual void onServerChangeFieldConfs() {}
+  virtual void onPlayerStep(Player&) {}
+  virtual void onPlayerRanked(Player&) {}
+};
+
+
+/// Server seeding chains in fields of the combo script, counting them.
+class BenchServer: public ServerInstance
+{
+ public:
+  BenchServer(Observer& obs, boost::asio::io_service& io_service, Script script):
+      ServerInstance(obs, io_service), script_(script), chains_(0) {}
+  unsigned long chains() const { return chains_; }
+
+ protected:
+  virtual void stepField(Player& pl, KeyState keys) {
+    if(script_ == Script::COMBO) {
+      seedChain(*pl.field());
+    }
+    ServerInstance::stepField(pl, keys);
+    const Field::StepInfo& info = pl.field()->stepInfo();
+    if(info.combo > 0 && info.chain == 2) {
+      chains_++;
+    }
+  }
+
+ private:
+  Script script_;
+  unsigned long chains_;
+};
+
+
+/** @brief Synthetic client.
+ *
+ * Only the local field is simulated, remote fields are stepped blindly.
+ * Without simulated network, the real clock is used and input delays are
+ * not measured.
+ */
+class BenchClient: public ClientInstance::Observer
+{
+ public:
+  BenchClient(boost::asio::io_service& io_service, netplay::SimNetwork* net, Script script, InputDelays& delays):
+      instance_(*this, io_service), net_(net), script_(script), delays_(delays), player_(nullptr), disconnected_(false),
+      prev_keys_(0), has_target_(false)
+  {
+    if(net != nullptr) {
+      instance_.setClock([net]() { return net->time(); });
+    }
+    instance_.setPingPeriod(0);
+    instance_.setLocalFieldsOnly(true);
+  }
+
+  ClientInstance& instance() { return instance_; }
+  const Player* player() const { return player_; }
+  bool disconnected() const { return disconnected_; }
+
+  void join(const std::string& nick) {
+    instance_.newLocalPlayer(nick, [this](Player* pl, const std::string& msg) {
+      if(pl == nullptr) {
+        throw std::runtime_error("join failed: "+msg);
+      }
+      player_ = pl;
+      instance_.playerSetState(*pl, Player::State::LOBBY_READY);
+    });
+  }
+
+  /// Step the local player of one tick, if allowed by the lag window.
+  void step() {
+    if(player_ == nullptr || disconnected_ || instance_.state() != GameInstance::State::GAME) {
+      return;
+    }
+    const Field* fld = player_->field();
+    if(fld == nullptr || fld->lost() || fld->tick()+1 >= instance_.match().tick() + instance_.conf().tk_lag_max) {
+      return;
+    }
+    const KeyState keys = script_ == Script::COMBO ? this->comboInput(*fld) : 0;
+    prev_keys_ = keys;
+    if(delays_.enabled) {
+      delays_.sent[{player_->plid(), fld->tick()}] = net_->now();
+    }
+    instance_.playerStep(*player_, keys);
+  }
+
+  /** @name ClientInstance::Observer methods. */
+  //@{
+  virtual void onChat(Player&, const std::string&) {}
+  virtual void onPlayerJoined(Player&) {}
+  virtual void onPlayerChangeNick(Player&, const std::string&) {}
+  virtual void onPlayerStateChange(Player&) {}
+  virtual void onPlayerChangeFieldConf(Player&) {}
+  virtual void onStateChange() {
+    if(instance_.state() == GameInstance::State::GAME_READY && player_ != nullptr) {
+      instance_.playerSetState(*player_, Player::State::GAME_READY);
+    }
+  }
+  virtual void onServerChangeFieldConfs() {}
+  virtual void onPlayerStep(Player& pl) {
+    if(!delays_.enabled || pl.local()) {
+      return;
+    }
+    auto it = delays_.sent.find({pl.plid(), pl.field()->tick()-1});
+    if(it != delays_.sent.end()) {
+      delays_.delays.push_back(net_->now() - (*it).second);
+    }
+  }
+  virtual void onPlayerRanked(Player&) {}
+  virtual void onNotification(GameInstance::Severity, const std::string&) {}
+  virtual void onServerConnect(bool success) {
+    if(!success) {
+      throw std::runtime_error("connection failed");
+    }
+    disconnected_ = false;
+  }
+  virtual void onServerDisconnect() { disconnected_ = true; }
+  //@}
+
+ private:
+  /// Client instance, seeding chains of the local field.
+  class Instance: public ClientInstance
+  {
+   public:
+    Instance(BenchClient& client, boost::asio::io_service& io_service):
+        ClientInstance(client, io_service), client_(client) {}
+   protected:
+    virtual void stepField(Player& pl, KeyState keys) {
+      if(pl.local() && client_.script_ == Script::COMBO) {
+        seedChain(*pl.field());
+      }
+      ClientInstance::stepField(pl, keys);
+    }
+   private:
+    BenchClient& client_;
+  };
+
+  /// Return true if a block can be matched.
+  static bool isRestColor(const Field& fld, int x, int y, uint8_t color) {
+    if(x < 0 || x >= FIELD_WIDTH || y < 1 || y > FIELD_HEIGHT) {
+      return false;
+    }
+    const Block& bk = fld.block(x, y);
+    return bk.isState(BkColor::REST) && !bk.swapped && bk.bk_color.color == color;
+  }
+
+  /// Return true if a color put at a given position would be matched.
+  static bool matchesAt(const Field& fld, int x, int y, int from_x, uint8_t color) {
+    auto same = [&](int x2, int y2) { return x2 != from_x && isRestColor(fld, x2, y2, color); };
+    int h = 0;
+    for(int i=x-1; same(i, y); i--) h++;
+    for(int i=x+1; same(i, y); i++) h++;
+    int v = 0;
+    for(int j=y-1; same(x, j); j--) v++;
+    for(int j=y+1; same(x, j); j++) v++;
+    return h >= 2 || v >= 2;
+  }
+
+  /// Return the height of the highest column.
+  static int stackHeight(const Field& fld) {
+    for(int y=FIELD_HEIGHT; y>0; y--) {
+      for(int x=0; x<FIELD_WIDTH; x++) {
+        if(!fld.block(x, y).isNone()) {
+          return y;
+        }
+      }
+    }
+    return 0;
+  }
+
+  /// Look for a swap making a match, set the target position.
+  bool findTarget(const Field& fld) {
+    for(int y=1; y<FIELD_HEIGHT; y++) {
+      for(int x=0; x<FIELD_WIDTH-1; x++) {
+        const Block& bk1 = fld.block(x, y);
+        const Block& bk2 = fld.block(x+1, y);
+        if(!bk1.isState(BkColor::REST) || !bk2.isState(BkColor::REST) ||
+           bk1.bk_color.color == bk2.bk_color.color) {
+          continue;
+        }
+        if(matchesAt(fld, x, y, x+1, bk2.bk_color.color) || matchesAt(fld, x+1, y, x, bk1.bk_color.color)) {
+          target_ = FieldPos(x, y);
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  /// Return the next input of the combo script.
+  KeyState comboInput(const Field& fld) {
+    if(prev_keys_ != 0) {
+      return 0;  // release keys, so that the next press is processed
+    }
+    if(!has_target_) {
+      has_target_ = this->findTarget(fld);
+      if(!has_target_) {
+        // bring new blocks, unless the stack is already high
+        return stackHeight(fld) < FIELD_HEIGHT / 2 ? GAME_KEY_RAISE : 0;
+      }
+    }
+    const FieldPos& cursor = fld.cursor();
+    if(cursor.y < target_.y) {
+      return GAME_KEY_UP;
+    } else if(cursor.y > target_.y) {
+      return GAME_KEY_DOWN;
+    } else if(cursor.x < target_.x) {
+      return GAME_KEY_RIGHT;
+    } else if(cursor.x > target_.x) {
+      return GAME_KEY_LEFT;
+    }
+    has_target_ = false;
+    return GAME_KEY_SWAP;
+  }
+
+  Instance instance_;
+  netplay::SimNetwork* net_;
+  Script script_;
+  InputDelays& delays_;
+  Player* player_;
+  bool disconnected_;
+  KeyState prev_keys_;
+  bool has_target_;
+  FieldPos target_;
+};
+
+
+/// Play a scenario, return its measures.
+Result runScenario(IniFile cfg, const Scenario& scenario, Tick ticks)
+{
+  cfg.set("Server.PlayerNumber", scenario.players);
+  cfg.set("Server.LagTicksLimit", scenario.lag_window);
+  // watchdog and ping timers run on real time, disable them
+  cfg.set("Server.LagBudgetTicks", 0);
+  cfg.unset("Server.ReportPeriodTicks");
+  cfg.unset("Server.ReplayDir");
+  cfg.set("Server.InputChannel", scenario.input_channel ? 1 : 0);
+
+  Result result;
+  Clock::duration server_time = Clock::duration::zero();
+  unsigned long server_allocations = 0;
+
+  boost::asio::io_service io_server;
+  boost::asio::io_service io_clients;
+  netplay::SimNetwork net(io_server, 1);
+  net.setPollFunction([&](boost::asio::io_service& io) {
+    if(&io != &io_server) {
+      return io.poll();
+    }
+    const unsigned long allocations = g_allocations.load(std::memory_order_relaxed);
+    const auto t0 = Clock::now();
+    const size_t n = io.poll();
+    server_time += Clock::now() - t0;
+    server_allocations += g_allocations.load(std::memory_order_relaxed) - allocations;
+    return n;
+  });
+
+  ServerObserver observer;
+  BenchServer server(observer, io_server, scenario.script);
+  server.loadConf(cfg);
+  server.setClock([&net]() { return net.time(); });
+
+  netplay::SimNetwork::LinkConf link_conf;
+  link_conf.latency_usec = 10000;
+  link_conf.loss_percent = scenario.loss_percent;
+  Result traffic;  // server traffic, measured below
+  auto input_transport = net.newDatagramTransport(io_server, link_conf);
+  server.startServer(std::make_shared<CountingDatagramTransport>(input_transport, traffic));
+
+  InputDelays delays;
+  std::vector<std::unique_ptr<BenchClient>> clients;
+  for(unsigned int i=0; i<scenario.players; i++) {
+    clients.push_back(std::make_unique<BenchClient>(io_clients, &net, scenario.script, delays));
+    auto link = net.newLink(io_server, io_clients, link_conf, link_conf);
+    server.connectPeer(std::make_unique<CountingTransport>(std::move(link.first), traffic));
+    clients.back()->instance().setInputTransport(net.newDatagramTransport(io_clients, link_conf), input_transport->endpoint());
+    clients.back()->instance().connect(std::move(link.second));
+  }
+  net.runFor(100000);
+  for(unsigned int i=0; i<scenario.players; i++) {
+    clients[i]->join("bench-"+std::to_string(i));
+  }
+
+  // wait for match start
+  const unsigned int tk_usec = server.conf().tk_usec;
+  for(unsigned int i=0; server.state() != GameInstance::State::GAME; i++) {
+    if(i > 1000) {
+      throw std::runtime_error("match did not start");
+    }
+    net.runFor(tk_usec);
+  }
+
+  // play, measure server's work
+  server_time = Clock::duration::zero();
+  server_allocations = 0;
+  traffic = Result();
+  delays.enabled = true;
+  auto field_steps = [&server]() {
+    unsigned long n = 0;
+    for(auto& fld : server.match().fields()) {
+      n += fld->tick();
+    }
+    return n;
+  };
+  auto dropped_garbages = [&server]() {
+    unsigned long n = 0;
+    for(auto& fld : server.match().fields()) {
+      n += fld->droppedGarbageCount();
+    }
+    return n;
+  };
+  const Tick tick0 = server.match().tick();
+  const unsigned long steps0 = field_steps();
+  Tick last_tick = tick0;
+  unsigned long last_steps = steps0;
+  unsigned long last_garbages = dropped_garbages();
+  // the match may end early, keep the last known values
+  while(server.state() == GameInstance::State::GAME && last_tick < tick0 + ticks) {
+    for(auto& client : clients) {
+      if(client->disconnected()) {
+        throw std::runtime_error("client disconnected by the server");
+      }
+      client->step();
+    }
+    net.runFor(tk_usec);
+    if(server.state() == GameInstance::State::GAME) {
+      last_tick = server.match().tick();
+      last_steps = field_steps();
+      last_garbages = dropped_garbages();
+    }
+  }
+
+  result = traffic;
+  result.server_time = server_time;
+  result.allocations = server_allocations;
+  result.ticks = last_tick - tick0;
+  result.steps = last_steps - steps0;
+  result.chains = server.chains();
+  result.garbages = last_garbages;
+  result.input_delays = std::move(delays.delays);
+  std::sort(result.input_delays.begin(), result.input_delays.end());
+  return result;
+}
+
+
+/** @brief Compare fields of clients to the server's ones.
+ *
+ * Print a line per client, prefixed by \e check.
+ * Return true if all fields match.
+ */
+bool compareFields(ServerInstance& server, const std::vector<std::unique_ptr<BenchClient>>& clients, const char* check)
+{
+  bool ok = true;
+  for(unsigned int i=0; i<clients.size(); i++) {
+    const Player* pl = clients[i]->player();
+    const Player* server_pl = pl == nullptr ? nullptr : server.player(pl->plid());
+    if(pl == nullptr || pl->field() == nullptr || server_pl == nullptr || server_pl->field() == nullptr) {
+      printf("%s: client %u has no field\n", check, i);
+      ok = false;
+      continue;
+    }
+    const Field& fld = *pl->field();
+    const Field& server_fld = *server_pl->field();
+    const bool match = fld.tick() == server_fld.tick() && fld.stateHash() == server_fld.stateHash();
+    printf("%s: client %u: tick %u, hash %08x, server: tick %u, hash %08x%s\n",
+           check, i, fld.tick(), fld.stateHash(), server_fld.tick(), server_fld.stateHash(), match ? "" : " MISMATCH");
+    ok = ok && match;
+  }
+  return ok;
+}
+
+
+/** @brief Drop a client link during a match, resume it, compare fields.
+ *
+ * Return true if fields of clients match the server's ones.
+ */
+bool checkResume(IniFile cfg, Tick ticks)
+{
+  const unsigned int players = 2;
+  cfg.set("Server.PlayerNumber", players);
+  cfg.set("Server.LagTicksLimit", 60);
+  cfg.set("Server.LagBudgetTicks", 0);
+  cfg.set("Server.ResumeTimeoutMs", 60000);
+  // mismatching reports get the client kicked
+  cfg.set("Server.ReportPeriodTicks", 30);
+  cfg.set("Server.CheckPercent", 100);  // server fields are all simulated
+  cfg.unset("Server.ReplayDir");
+  cfg.set("Server.InputChannel", 0);
+
+  boost::asio::io_service io_server;
+  boost::asio::io_service io_clients;
+  netplay::SimNetwork net(io_server, 1);
+  ServerObserver observer;
+  BenchServer server(observer, io_server, Script::COMBO);
+  server.loadConf(cfg);
+  server.setClock([&net]() { return net.time(); });
+  server.startServer();
+
+  netplay::SimNetwork::LinkConf link_conf;
+  link_conf.latency_usec = 10000;
+  InputDelays delays;
+  std::vector<std::unique_ptr<BenchClient>> clients;
+  netplay::MemoryTransport* dropped_link = nullptr;  // client end, owned by its socket
+  for(unsigned int i=0; i<players; i++) {
+    clients.push_back(std::make_unique<BenchClient>(io_clients, &net, Script::COMBO, delays));
+    auto link = net.newLink(io_server, io_clients, link_conf, link_conf);
+    server.connectPeer(std::move(link.first));
+    if(i == 0) {
+      dropped_link = static_cast<netplay::MemoryTransport*>(link.second.get());
+    }
+    clients.back()->instance().connect(std::move(link.second));
+  }
+  net.runFor(100000);
+  for(unsigned int i=0; i<players; i++) {
+    clients[i]->join("bench-"+std::to_string(i));
+  }
+
+  const unsigned int tk_usec = server.conf().tk_usec;
+  for(unsigned int i=0; server.state() != GameInstance::State::GAME; i++) {
+    if(i > 1000) {
+      throw std::runtime_error("match did not start");
+    }
+    net.runFor(tk_usec);
+  }
+
+  const Tick drop_tick = ticks / 3;
+  const Tick resume_tick = drop_tick + 30;
+  for(Tick tk=0; tk<ticks && server.state() == GameInstance::State::GAME; tk++) {
+    if(tk == drop_tick) {
+      dropped_link->reset();
+    } else if(tk == resume_tick) {
+      if(!clients[0]->disconnected()) {
+        throw std::runtime_error("dropped client not disconnected");
+      }
+      auto link = net.newLink(io_server, io_clients, link_conf, link_conf);
+      server.connectPeer(std::move(link.first));
+      clients[0]->instance().connect(std::move(link.second));
+    } else if(tk > resume_tick) {
+      for(auto& client : clients) {
+        if(client->disconnected()) {
+          printf("resume: client disconnected by the server\n");
+          return false;
+        }
+      }
+    }
+    for(auto& client : clients) {
+      client->step();
+    }
+    net.runFor(tk_usec);
+  }
+  // deliver pending inputs
+  net.runFor(1000000);
+
+  if(server.state() != GameInstance::State::GAME) {
+    printf("resume: match ended before the end of the check\n");
+    return false;
+  }
+  return compareFields(server, clients, "resume");
+}
+
+
+/// Server config of real-time checks: field hashes checked.
+void setCheckConf(IniFile& cfg, unsigned int players, bool input_channel)
+{
+  cfg.set("Server.PlayerNumber", players);
+  cfg.set("Server.LagTicksLimit", 60);
+  cfg.set("Server.LagBudgetTicks", 0);
+  // mismatching reports get the client kicked
+  cfg.set("Server.ReportPeriodTicks", 30);
+  cfg.set("Server.CheckPercent", 100);
+  cfg.unset("Server.ReplayDir");
+  cfg.set("Server.InputChannel", input_channel ? 1 : 0);
+}
+
+
+/// Run handlers of an io_service for a given time, in real time.
+void runFor(boost::asio::io_service& io_service, unsigned int usec)
+{
+  const auto end = Clock::now() + std::chrono::microseconds(usec);
+  while(Clock::now() < end) {
+    // the io_service stops each time it runs out of handlers
+    if(io_service.stopped()) {
+      io_service.reset();
+    }
+    if(io_service.poll() == 0) {
+      ::usleep(500);
+    }
+  }
+}
+
+
+/** @brief Play over lossy links and datagrams, with garbages, compare fields.
+ *
+ * Datagram inputs of a field must not be applied before the garbage drops
+ * they depend on, which are sent over the stream.
+ * Return true if fields of clients match the server's ones.
+ */
+bool checkInputChannel(IniFile cfg, Tick ticks, unsigned int loss_percent)
+{
+  const unsigned int players = 2;
+  setCheckConf(cfg, players, true);
+
+  boost::asio::io_service io_server;
+  boost::asio::io_service io_clients;
+  netplay::SimNetwork net(io_server, 1);
+  ServerObserver observer;
+  BenchServer server(observer, io_server, Script::COMBO);
+  server.loadConf(cfg);
+  server.setClock([&net]() { return net.time(); });
+
+  netplay::SimNetwork::LinkConf link_conf;
+  link_conf.latency_usec = 10000;
+  link_conf.loss_percent = loss_percent;
+  auto input_transport = net.newDatagramTransport(io_server, link_conf);
+  server.startServer(input_transport);
+
+  InputDelays delays;
+  std::vector<std::unique_ptr<BenchClient>> clients;
+  for(unsigned int i=0; i<players; i++) {
+    clients.push_back(std::make_unique<BenchClient>(io_clients, &net, Script::COMBO, delays));
+    auto link = net.newLink(io_server, io_clients, link_conf, link_conf);
+    server.connectPeer(std::move(link.first));
+    clients.back()->instance().setInputTransport(net.newDatagramTransport(io_clients, link_conf), input_transport->endpoint());
+    clients.back()->instance().connect(std::move(link.second));
+  }
+  net.runFor(100000);
+  for(unsigned int i=0; i<players; i++) {
+    clients[i]->join("bench-"+std::to_string(i));
+  }
+
+  const unsigned int tk_usec = server.conf().tk_usec;
+  for(unsigned int i=0; server.state() != GameInstance::State::GAME; i++) {
+    if(i > 1000) {
+      throw std::runtime_error("match did not start");
+    }
+    net.runFor(tk_usec);
+  }
+
+  for(Tick tk=0; tk<ticks && server.state() == GameInstance::State::GAME; tk++) {
+    for(auto& client : clients) {
+      if(client->disconnected()) {
+        printf("input channel: client disconnected by the server\n");
+        return false;
+      }
+      client->step();
+    }
+    net.runFor(tk_usec);
+  }
+  // deliver pending inputs
+  net.runFor(1000000);
+
+  if(server.state() != GameInstance::State::GAME) {
+    printf("input channel: match ended before the end of the check\n");
+    return false;
+  }
+  unsigned long garbages = 0;
+  for(auto& fld : server.match().fields()) {
+    garbages += fld->droppedGarbageCount();
+  }
+  printf("input channel: %u%% loss, %lu chains, %lu garbages\n", loss_percent, server.chains(), garbages);
+  bool ok = garbages > 0;
+  for(unsigned int i=0; i<players; i++) {
+    if(!clients[i]->instance().inputChannel()) {
+      printf("input channel: not opened by client %u\n", i);
+      ok = false;
+    }
+  }
+  return compareFields(server, clients, "input channel") && ok;
+}
+
+
+/** @brief Play over real sockets on the loopback interface, compare fields.
+ *
+ * The server listens on \e port; clients open the input channel on their
+ * own UDP socket. Time is real: ticks are played at the server's pace.
+ * Return true if fields of clients match the server's ones.
+ */
+bool checkUdpLoopback(IniFile cfg, Tick ticks, int port)
+{
+  const unsigned int players = 2;
+  setCheckConf(cfg, players, true);
+
+  boost::asio::io_service io_service;
+  ServerObserver observer;
+  BenchServer server(observer, io_service, Script::COMBO);
+  server.loadConf(cfg);
+  server.startServer(port);
+
+  InputDelays delays;
+  std::vector<std::unique_ptr<BenchClient>> clients;
+  for(unsigned int i=0; i<players; i++) {
+    clients.push_back(std::make_unique<BenchClient>(io_service, nullptr, Script::COMBO, delays));
+    clients.back()->instance().connect("localhost", port, 3000);
+  }
+  runFor(io_service, 200000);
+  for(unsigned int i=0; i<players; i++) {
+    clients[i]->join("bench-"+std::to_string(i));
+  }
+
+  const unsigned int tk_usec = server.conf().tk_usec;
+  for(unsigned int i=0; server.state() != GameInstance::State::GAME; i++) {
+    if(i > 1000) {
+      throw std::runtime_error("match did not start");
+    }
+    runFor(io_service, tk_usec);
+  }
+
+  for(Tick tk=0; tk<ticks && server.state() == GameInstance::State::GAME; tk++) {
+    for(auto& client : clients) {
+      if(client->disconnected()) {
+        printf("udp loopback: client disconnected by the server\n");
+        return false;
+      }
+      client->step();
+    }
+    runFor(io_service, tk_usec);
+  }
+  // deliver pending inputs, without stepping
+  runFor(io_service, 200000);
+
+  if(server.state() != GameInstance::State::GAME) {
+    printf("udp loopback: match ended before the end of the check\n");
+    return false;
+  }
+  bool ok = true;
+  for(unsigned int i=0; i<players; i++) {
+    if(!clients[i]->instance().inputChannel()) {
+      printf("udp loopback: input channel not opened by client %u\n", i);
+      ok = false;
+    }
+  }
+  ok = compareFields(server, clients, "udp loopback") && ok;
+  for(auto& client : clients) {
+    client->instance().disconnect();
+  }
+  server.stopServer();
+  return ok;
+}
+
+
+/** @brief Play with clients on their own thread, over pipes, compare fields.
+ *
+ * The server's io_service is run by a second thread. Clients are connected
+ * with PipeTransport, its ends being used from both threads. Time is real.
+ * Return true if fields of clients match the server's ones.
+ */
+bool checkPipeThreads(IniFile cfg, Tick ticks)
+{
+  const unsigned int players = 2;
+  setCheckConf(cfg, players, false);
+
+  boost::asio::io_service io_server;
+  boost::asio::io_service io_clients;
+  ServerObserver observer;
+  BenchServer server(observer, io_server, Script::COMBO);
+  server.loadConf(cfg);
+  server.startServer();
+
+  InputDelays delays;
+  std::vector<std::unique_ptr<BenchClient>> clients;
+  for(unsigned int i=0; i<players; i++) {
+    clients.push_back(std::make_unique<BenchClient>(io_clients, nullptr, Script::COMBO, delays));
+    auto pipe = netplay::PipeTransport::newPair(io_server, io_clients);
+    server.connectPeer(std::move(pipe.first));
+    clients.back()->instance().connect(std::move(pipe.second));
+  }
+
+  // from now, the server is only accessed from its thread
+  auto work = std::make_unique<boost::asio::io_service::work>(io_server);
+  std::thread server_thread([&io_server]() { io_server.run(); });
+  bool ok = true;
+  try {
+    runFor(io_clients, 200000);
+    for(unsigned int i=0; i<players; i++) {
+      clients[i]->join("bench-"+std::to_string(i));
+    }
+
+    auto playing = [&clients]() {
+      for(auto& client : clients) {
+        if(client->instance().state() != GameInstance::State::GAME) {
+          return false;
+        }
+      }
+      return true;
+    };
+    const unsigned int tk_usec = clients[0]->instance().conf().tk_usec;
+    for(unsigned int i=0; !playing(); i++) {
+      if(i > 1000) {
+        throw std::runtime_error("match did not start");
+      }
+      runFor(io_clients, tk_usec);
+    }
+
+    for(Tick tk=0; tk<ticks && playing(); tk++) {
+      for(auto& client : clients) {
+        if(client->disconnected()) {
+          printf("pipes: client disconnected by the server\n");
+          ok = false;
+          break;
+        }
+        client->step();
+      }
+      if(!ok) {
+        break;
+      }
+      runFor(io_clients, tk_usec);
+    }
+    // deliver pending inputs, without stepping
+    runFor(io_clients, 200000);
+  } catch(...) {
+    io_server.stop();
+    server_thread.join();
+    throw;
+  }
+  work.reset();
+  io_server.stop();
+  server_thread.join();
+  if(!ok) {
+    return false;
+  }
+
+  if(server.state() != GameInstance::State::GAME) {
+    printf("pipes: match ended before the end of the check\n");
+    return false;
+  }
+  ok = compareFields(server, clients, "pipes");
+  for(auto& client : clients) {
+    client->instance().disconnect();
+  }
+  server.stopServer();
+  return ok;
+}
+
+
+/// Return a percentile of sorted values, in milliseconds.
+double percentileMs(const std::vector<uint64_t>& values, unsigned int percent)
+{
+  if(values.empty()) {
+    return 0;
+  }
+  return values[(values.size()-1) * percent / 100] / 1000.;
+}
+
+
+/// Parse a comma-separated list of numbers.
+std::vector<unsigned int> parseList(const char* s)
+{
+  std::vector<unsigned int> ret;
+  std::istringstream in(s);
+  std::string item;
+  while(std::getline(in, item, ',')) {
+    ret.push_back(std::stoul(item));
+  }
+  return ret;
+}
+
+
+/// Print program usage.
+void usage()
+{
+  printf(
+      "PaNettoPon server benchmark\n"
+      "\n"
+      "usage: panettopon_bench [OPTIONS]\n"
+      "\n"
+      " -c  --conf       configuration file, for field configurations\n"
+      " -p  --players    comma-separated player counts (default: 2,4,8,16)\n"
+      " -l  --lag        comma-separated lag windows, in ticks (default: 10,60)\n"
+      " -t  --ticks      match ticks per scenario (default: 3600)\n"
+      " -L  --loss       packet loss of links, in percent (default: 0, 5 for -d)\n"
+      " -u  --udp        also send inputs in datagrams (input channel)\n"
+      " -r  --resume     check match resumption, instead of benchmarking\n"
+      " -d  --datagrams  check the input channel, instead of benchmarking;\n"
+      "                  loopback sockets use the configured port\n"
+      " -T  --threads    check in-process pipes, with the server on its own thread,\n"
+      "                  instead of benchmarking\n"
+      " -o, --log-file   log messages to the given file, \"-\" for stderr\n"
+      " -h, --help       display this help\n"
+    );
+}
+
+}
+
+
+/** @brief Entry point.
+ *
+ * @retval  0  benchmark completed
+ * @retval  1  fatal error, or failed check
+ * @retval  2  invalid arguments
+ */
+int main(int /*argc*/, char** argv)
+{
+  try {
+    OptGetItem opts[] = {
+      { 'c', "conf", OPTGET_STR, {} },
+      { 'p', "players", OPTGET_STR, {} },
+      { 'l', "lag", OPTGET_STR, {} },
+      { 't', "ticks", OPTGET_INT, {} },
+      { 'L', "loss", OPTGET_INT, {} },
+      { 'u', "udp", OPTGET_FLAG, {} },
+      { 'r', "resume", OPTGET_FLAG, {} },
+      { 'd', "datagrams", OPTGET_FLAG, {} },
+      { 'T', "threads", OPTGET_FLAG, {} },
+      { 'o', "log-file", OPTGET_STR, {} },
+      { 'h', "help", OPTGET_FLAG, {} },
+      { 0, 0, OPTGET_NONE, {} }
+    };
+
+    const char* conf_file = CONF_FILE_DEFAULT;
+    std::vector<unsigned int> players_list = {2, 4, 8, 16};
+    std::vector<unsigned int> lag_list = {10, 60};
+    Tick ticks = 3600;
+    int loss_percent = -1;  // negative if not set
+    bool input_channel = false;
+    bool resume = false;
+    bool datagrams = false;
+    bool threads = false;
+
+    char* const* opt_args = argv+1;
+    OptGetItem* opt;
+    int ret;
+    for(;;) {
+      ret = optget_parse(opts, &opt_args, &opt);
+      if( ret != OPTGET_OK ) {
+        break;
+      }
+      switch( opt->short_name ) {
+        case 'c':
+          conf_file = opt->value.str;
+          break;
+        case 'p':
+          players_list = parseList(opt->value.str);
+          break;
+        case 'l':
+          lag_list = parseList(opt->value.str);
+          break;
+        case 't':
+          ticks = opt->value.i;
+          break;
+        case 'L':
+          loss_percent = opt->value.i;
+          break;
+        case 'u':
+          input_channel = true;
+          break;
+        case 'r':
+          resume = true;
+          break;
+        case 'd':
+          datagrams = true;
+          break;
+        case 'T':
+          threads = true;
+          break;
+        case 'o':
+          Logger::setLogger(std::make_unique<FileLogger>(opt->value.str));
+          break;
+        case 'h':
+          usage();
+          return 0;
+        default:
+          fprintf(stderr, "unexpected argument\n");
+          return 2;
+      }
+    }
+    if( ret != OPTGET_LAST ) {
+      fprintf(stderr, "invalid arguments, see --help\n");
+      return 2;
+    }
+
+    IniFile cfg;
+    if( !cfg.load(conf_file) ) {
+      fprintf(stderr, "failed to load configuration file: %s\n", conf_file);
+      return 1;
+    }
+
+    if(resume) {
+      const bool ok = checkResume(cfg, ticks);
+      printf("resume: %s\n", ok ? "ok" : "FAILED");
+      return ok ? 0 : 1;
+    }
+    if(datagrams) {
+      bool ok = checkInputChannel(cfg, ticks, loss_percent < 0 ? 5 : loss_percent);
+      // real time: play fewer ticks
+      ok = checkUdpLoopback(cfg, ticks / 4, cfg.get<int>("Global.Port", DEFAULT_PNP_PORT)) && ok;
+      printf("datagrams: %s\n", ok ? "ok" : "FAILED");
+      return ok ? 0 : 1;
+    }
+    if(threads) {
+      // real time: play fewer ticks
+      const bool ok = checkPipeThreads(cfg, ticks / 4);
+      printf("pipes: %s\n", ok ? "ok" : "FAILED");
+      return ok ? 0 : 1;
+    }
+    if(loss_percent < 0) {
+      loss_percent = 0;
+    }
+
+    printf("%7s %6s %4s %7s %10s %10s %9s %9s %9s %9s %9s %6s %8s\n",
+           "players", "script", "lag", "ticks", "ticks/s", "steps/s", "bytes/tk", "pkts/tk", "allocs/tk",
+           "delay50ms", "delay99ms", "chains", "garbages");
+    for(auto script : {Script::IDLE, Script::COMBO}) {
+      for(auto players : players_list) {
+        for(auto lag : lag_list) {
+          const Result r = runScenario(cfg, Scenario{players, script, lag, static_cast<unsigned int>(loss_percent), input_channel}, ticks);
+          const double dt = std::chrono::duration<double>(r.server_time).count();
+          const double tk = r.ticks > 0 ? r.ticks : 1;
+          printf("%7u %6s %4u %7u %10.0f %10.0f %9.1f %9.2f %9.1f %9.1f %9.1f %6lu %8lu\n",
+                 players, script == Script::IDLE ? "idle" : "combo", lag, r.ticks,
+                 r.ticks / dt, r.steps / dt, r.bytes / tk, r.packets / tk, r.allocations / tk,
+                 percentileMs(r.input_delays, 50), percentileMs(r.input_delays, 99), r.chains, r.garbages);
+          fflush(stdout);
+          if(script == Script::COMBO && (r.chains == 0 || r.garbages == 0)) {
+            fprintf(stderr, "combo script produced no chain or no garbage\n");
+            return 1;
+          }
+        }
+      }
+    }
+    return 0;
+  } catch(const std::exception& e) {
+    fprintf(stderr, "fatal error: %s\n", e.what());
+    return 1;
+  }
+}
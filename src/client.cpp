@@ -1,3 +1,6 @@
+#include <functional>
+#include <algorithm>
+#include <random>
 #include "client.h"
 #include "game.h"
 #include "log.h"
@@ -6,13 +9,21 @@ namespace asio = boost::asio;
 using namespace asio::ip;
 
 
+const unsigned int ClientInstance::PING_PERIOD_MS = 1000;
+const unsigned int ClientInstance::REMOTE_REPORT_FIELDS = 2;
+
 ClientInstance::ClientInstance(Observer& obs, asio::io_service& io_service):
-    observer_(obs), socket_(std::make_shared<netplay::ClientSocket>(*this, io_service))
+    observer_(obs), io_service_(io_service), socket_(std::make_shared<netplay::ClientSocket>(*this, io_service)),
+    port_(0), ping_timer_(io_service), ping_period_ms_(PING_PERIOD_MS), local_fields_only_(false),
+    report_offset_(std::random_device()()), rtt_(0), has_match_start_(false),
+    awaiting_match_state_(false), server_field_conf_hashes_(false), input_timer_(io_service), input_timer_active_(false)
 {
 }
 
 ClientInstance::~ClientInstance()
 {
+  ping_timer_.cancel();
+  input_timer_.cancel();
   if(socket_) {
     socket_->close();
   }
@@ -21,13 +32,64 @@ ClientInstance::~ClientInstance()
 void ClientInstance::connect(const char* host, int port, int tout)
 {
   LOG("connecting to %s:%d ...", host, port);
+  host_ = host;
+  port_ = port;
+  this->resetSocket();
   socket_->connect(host, port, tout);
 }
 
+void ClientInstance::connect(std::unique_ptr<netplay::Transport> transport)
+{
+  host_.clear();
+  this->resetSocket();
+  socket_->connect(std::move(transport));
+}
+
+bool ClientInstance::reconnect(int tout)
+{
+  if( host_.empty() || !this->canResume() ) {
+    return false;
+  }
+  const std::string host = host_;  // copied, connect() sets it
+  this->connect(host.c_str(), port_, tout);
+  return true;
+}
+
+bool ClientInstance::canResume() const
+{
+  if( state_ != State::GAME || !match_.started() ) {
+    return false;
+  }
+  for(auto& p : players_) {
+    const Player& pl = *p.second;
+    if( pl.local() && pl.field() != nullptr && !pl.field()->lost() && resume_tokens_.count(pl.plid()) ) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void ClientInstance::setInputTransport(std::shared_ptr<netplay::DatagramTransport> transport, const netplay::DatagramTransport::Endpoint& server)
+{
+  input_transport_ = transport;
+  input_server_ = server;
+}
+
+void ClientInstance::resetSocket()
+{
+  server_field_conf_hashes_ = false;
+  field_conf_pins_.clear();
+  if( !socket_ || state_ != State::NONE ) {
+    // reconnection, don't keep anything from the previous connection
+    socket_ = std::make_shared<netplay::ClientSocket>(*this, io_service_);
+  }
+}
+
 void ClientInstance::disconnect()
 {
   //XXX send a proper "quit" message
   state_ = State::NONE;
+  ping_timer_.cancel();
   socket_->close();
   socket_.reset();
 }
@@ -43,6 +105,25 @@ void ClientInstance::newLocalPlayer(const std::string& nick, std::function<void(
   socket_->sendClientCommand(std::move(command), cb2);
 }
 
+uint64_t ClientInstance::resumeToken(PlId plid) const
+{
+  auto it = resume_tokens_.find(plid);
+  return it == resume_tokens_.end() ? 0 : (*it).second;
+}
+
+void ClientInstance::resumePlayer(PlId plid, uint64_t token, NewPlayerCallback cb)
+{
+  resume_tokens_[plid] = token;
+  auto command = std::make_unique<netplay::ClientCommand>();
+  auto* np_resume = command->mutable_player_resume();
+  np_resume->set_plid(plid);
+  np_resume->set_token(token);
+  auto cb2 = [this,plid,cb](const netplay::ServerResponse& response) {
+    this->processResumeResponse(response, plid, cb);
+  };
+  socket_->sendClientCommand(std::move(command), cb2);
+}
+
 
 void ClientInstance::playerSetNick(Player& pl, const std::string& nick)
 {
@@ -64,13 +145,24 @@ void ClientInstance::playerSetFieldConf(Player& pl, const FieldConf& conf)
 {
   assert(pl.local());
   assert(pl.state() == Player::State::LOBBY);
-  //TODO compare with current conf/name
+  if(conf == pl.fieldConf()) {
+    return;  // not changed
+  }
+
+  bool hash = false;
+  if(server_field_conf_hashes_) {
+    auto it = field_conf_pins_.find(conf.hash());
+    hash = this->isServerFieldConf(conf) || (it != field_conf_pins_.end() && *it->second == conf);
+    // the server keeps the first custom configurations sent in full
+    if(!hash && conf.name.empty() && field_conf_pins_.size() < FIELD_CONF_PINS_MAX) {
+      field_conf_pins_.emplace(conf.hash(), std::make_shared<const FieldConf>(conf));
+    }
+  }
 
   auto command = std::make_unique<netplay::ClientCommand>();
   auto* np_conf = command->mutable_player_conf();
   np_conf->set_plid(pl.plid());
-  auto* np_fc = np_conf->mutable_field_conf();
-  conf.toPacket(*np_fc);
+  this->fieldConfToPacket(conf, *np_conf, hash);
   socket_->sendClientCommand(std::move(command), nullptr);
 }
 
@@ -109,7 +201,11 @@ void ClientInstance::playerSendChat(Player& pl, const std::string& msg)
 void ClientInstance::playerStep(Player& pl, KeyState keys)
 {
   assert(pl.local() && pl.field() != nullptr);
+  if( awaiting_match_state_ || !socket_ || !socket_->connected() ) {
+    return;  // field is frozen until the player is resumed
+  }
   Tick tk = pl.field()->tick();
+  const unsigned int drops = pl.field()->droppedGarbageCount();
   this->doStepPlayer(pl, keys);
 
   // send packet
@@ -119,11 +215,88 @@ void ClientInstance::playerStep(Player& pl, KeyState keys)
   np_input->set_tick(tk);
   np_input->add_keys(keys);
   socket_->sendClientEvent(std::move(event));
+
+  if( socket_->inputChannel() ) {
+    input_history_[pl.plid()].add(tk, TickInput{keys, drops}, socket_->inputRedundancy());
+    this->scheduleInputDatagram();
+    // the match tick may have moved, lifting the lag limit
+    this->applyDatagramInputs();
+  }
+}
+
+
+void ClientInstance::doStepPlayer(Player& pl, KeyState keys)
+{
+  GameInstance::doStepPlayer(pl, keys);
+  if( conf_.tk_report_period > 0 ) {
+    this->sendFieldReport(pl);
+  }
+}
+
+void ClientInstance::stepField(Player& pl, KeyState keys)
+{
+  if( local_fields_only_ && !pl.local() ) {
+    pl.field()->stepBlind(0, 1, false, false);
+  } else {
+    GameInstance::stepField(pl, keys);
+  }
+}
+
+bool ClientInstance::isFieldSimulated(const Field& fld) const
+{
+  if( !local_fields_only_ ) {
+    return true;
+  }
+  const Player* pl = this->player(&fld);
+  return pl != nullptr && pl->local();
+}
+
+void ClientInstance::sendFieldReport(const Player& pl)
+{
+  const Field& fld = *pl.field();
+  const Field::StepInfo& info = fld.stepInfo();
+  // hashes of unsimulated fields are meaningless
+  // only a sample of remote fields is reported, to not grow with the number of players
+  const bool hash_tick = fld.tick() % conf_.tk_report_period == 0 && this->isFieldSimulated(fld) &&
+      (pl.local() || this->isRemoteReportSampled(fld));
+  if( !hash_tick && !(pl.local() && (info.combo > 0 || info.chain_end || fld.lost())) ) {
+    return;  // nothing to report
+  }
+
+  auto event = std::make_unique<netplay::ClientEvent>();
+  auto* np_report = event->mutable_field_report();
+  np_report->set_plid(pl.plid());
+  np_report->set_tick(fld.tick());
+  if( pl.local() ) {
+    np_report->set_combo(info.combo);
+    np_report->set_chain(info.chain);
+    np_report->set_chain_end(info.chain_end);
+    np_report->set_lost(fld.lost());
+  }
+  if( hash_tick ) {
+    np_report->set_hash(fld.stateHash());
+    np_report->set_events(fld.eventsDigest());
+  }
+  socket_->sendClientEvent(std::move(event));
+}
+
+bool ClientInstance::isRemoteReportSampled(const Field& fld) const
+{
+  const uint64_t period = fld.tick() / conf_.tk_report_period;
+  const uint64_t index = fld.fldid() + report_offset_ + period * REMOTE_REPORT_FIELDS;
+  return index % match_.fields().size() < REMOTE_REPORT_FIELDS;
 }
 
 
 void ClientInstance::onServerEvent(const netplay::ServerEvent& event)
 {
+  if(!socket_) {
+    return;  // disconnected, ignore already received packets
+  }
+  if( awaiting_match_state_ && (event.has_input() || event.has_new_garbage() || event.has_update_garbage() ||
+                                event.has_garbage_state() || event.has_player_rank() || event.has_match_stats()) ) {
+    return;  // match state not received yet, events will be included in it
+  }
   if(event.has_input()) {
     this->processPktInput(event.input());
   } else if(event.has_new_garbage()) {
@@ -148,17 +321,72 @@ void ClientInstance::onServerEvent(const netplay::ServerEvent& event)
     this->processPktPlayerRank(event.player_rank());
   } else if(event.has_player_field()) {
     this->processPktPlayerField(event.player_field());
+  } else if(event.has_pong()) {
+    this->processPktPong(event.pong());
+  } else if(event.has_match_stats()) {
+    this->processPktMatchStats(event.match_stats());
+  } else if(event.has_match_state()) {
+    // sent when connecting during a match, as a spectator
+    if( awaiting_match_state_ ) {
+      this->restoreMatchState(event.match_state());
+    }
   } else {
     throw netplay::CallbackError("invalid packet field");
   }
 }
 
+void ClientInstance::onServerDatagram(const netplay::Datagram& dgram)
+{
+  if( state_ != State::GAME || awaiting_match_state_ ) {
+    return;
+  }
+  for(auto& np_ack : dgram.acks()) {
+    const Player* pl = this->player(np_ack.plid());
+    if( pl != nullptr && pl->local() ) {
+      Tick& tick = input_acks_[np_ack.plid()];
+      tick = std::max(tick, np_ack.tick());
+    }
+  }
+  for(auto& np_input : dgram.inputs()) {
+    const Player* pl = this->player(np_input.plid());
+    if( pl == nullptr || pl->local() || pl->field() == nullptr || pl->field()->lost() ) {
+      continue;
+    }
+    // other fields may lag more here than on the server, keep some margin
+    this->bufferDatagramInput(datagram_inputs_[pl->plid()], np_input, pl->field()->tick(), match_.tick() + 2*conf_.tk_lag_max);
+  }
+  this->applyDatagramInputs();
+}
+
 void ClientInstance::onServerConnect(bool success)
 {
   if(success) {
     LOG("connected");
-    state_ = State::LOBBY;
-    conf_.toDefault();
+    if( state_ == State::GAME && match_.started() ) {
+      // connection lost during the match, resume playing local players
+      // others have been removed by the server
+      awaiting_match_state_ = true;
+      std::vector<Player*> removed;
+      for(auto& p : players_) {
+        Player& pl = *p.second;
+        if( !pl.local() ) {
+          continue;
+        }
+        auto it = resume_tokens_.find(pl.plid());
+        if( pl.field() != nullptr && !pl.field()->lost() && it != resume_tokens_.end() ) {
+          this->resumePlayer(pl.plid(), (*it).second, nullptr);
+        } else {
+          removed.push_back(&pl);
+        }
+      }
+      for(auto* pl : removed) {
+        this->forgetPlayer(*pl);
+      }
+    } else {
+      state_ = State::LOBBY;
+      conf_.toDefault();
+    }
+    this->schedulePing();
   }
   observer_.onServerConnect(success);
 }
@@ -166,6 +394,7 @@ void ClientInstance::onServerConnect(bool success)
 void ClientInstance::onServerDisconnect()
 {
   LOG("disconnected");
+  ping_timer_.cancel();
   observer_.onServerDisconnect();
 }
 
@@ -185,18 +414,30 @@ void ClientInstance::processPktInput(const netplay::PktInput& pkt)
   Field& fld = *pl->field();
 
   Tick tick = pkt.tick();
+  const int keys_nb = pkt.keys_size();
+  int first_key = 0;
   if( tick < fld.tick() ) {
-    throw netplay::CallbackError("input tick in the past");
+    if( !socket_->inputChannel() ) {
+      throw netplay::CallbackError("input tick in the past");
+    }
+    // already applied from datagrams
+    if( static_cast<uint64_t>(tick) + keys_nb <= fld.tick() ) {
+      return;
+    }
+    first_key = fld.tick() - tick;
+    tick = fld.tick();
   }
   // skipped frames
   while(fld.tick() < tick) {
     this->stepRemotePlayer(*pl, 0);
   }
   // provided frames
-  const int keys_nb = pkt.keys_size();
-  for( int i=0; i<keys_nb; i++ ) {
+  for( int i=first_key; i<keys_nb; i++ ) {
     this->stepRemotePlayer(*pl, pkt.keys(i));
   }
+  if( !datagram_inputs_.empty() ) {
+    this->applyDatagramInputs();
+  }
 }
 
 void ClientInstance::processPktNewGarbage(const netplay::PktNewGarbage& pkt)
@@ -308,12 +549,12 @@ void ClientInstance::processPktGarbageState(const netplay::PktGarbageState& pkt)
       np_state->set_gbid(gb.gbid);
       np_state->set_state(netplay::PktGarbageState::DROP);
       socket_->sendClientEvent(std::move(event));
-      gb.to->dropNextGarbage();
+      this->dropNextGarbage(*gb.to);
     }
 
   } else if( state == netplay::PktGarbageState::DROP ) {
     // drop garbage
-    const Match::GarbageMap gbs_wait = match_.waitingGarbages();
+    const Match::GarbageMap& gbs_wait = match_.waitingGarbages();
     Match::GarbageMap::const_iterator it = gbs_wait.find(pkt.gbid());
     if( it == gbs_wait.end() ) {
       throw netplay::CallbackError("garbage not found");
@@ -324,11 +565,16 @@ void ClientInstance::processPktGarbageState(const netplay::PktGarbageState& pkt)
     if( pl == NULL ) {
       throw netplay::CallbackError("invalid player");
     }
-    if( !pl->local() ) { // ignore our garbages (already dropped)
-      if(fld->waitingGarbages().size() == 0 || fld->waitingGarbages().front()->gbid != gb.gbid) {
-        throw netplay::CallbackError("invalid dropped garbage");
-      }
-      pl->field()->dropNextGarbage();
+    if( pl->local() ) {
+      // our garbages are dropped on WAIT, server should not send them back
+      throw netplay::CallbackError("invalid dropped garbage");
+    }
+    if(fld->waitingGarbages().size() == 0 || fld->waitingGarbages().front()->gbid != gb.gbid) {
+      throw netplay::CallbackError("invalid dropped garbage");
+    }
+    this->dropNextGarbage(*fld);
+    if( !datagram_inputs_.empty() ) {
+      this->applyDatagramInputs();
     }
   }
 }
@@ -349,7 +595,7 @@ void ClientInstance::processPktNotification(const netplay::PktNotification& pkt)
 
 void ClientInstance::processPktServerConf(const netplay::PktServerConf& pkt)
 {
-  if(state_ != State::LOBBY) {
+  if(state_ != State::LOBBY && !awaiting_match_state_) {
     throw netplay::CallbackError("invalid in current state");
   }
 #define SERVER_CONF_EXPR_PKT(n,ini) \
@@ -360,7 +606,8 @@ void ClientInstance::processPktServerConf(const netplay::PktServerConf& pkt)
   if( np_fcs.size() > 0 ) {
     google::protobuf::RepeatedPtrField<netplay::FieldConf>::const_iterator fcit;
     std::set<std::string> field_conf_names; // to check for duplicates
-    conf_.field_confs.clear();
+    std::vector<FieldConf> field_confs;
+    field_confs.reserve(np_fcs.size());
     for( fcit=np_fcs.begin(); fcit!=np_fcs.end(); ++fcit ) {
       const std::string& name = fcit->name();
       if(name.empty()) {
@@ -369,15 +616,27 @@ void ClientInstance::processPktServerConf(const netplay::PktServerConf& pkt)
       if(!field_conf_names.insert(name).second) {
         throw netplay::CallbackError("duplicate field configuration name: "+name);
       }
-      conf_.field_confs.emplace_back();
-      conf_.field_confs.back().fromPacket(*fcit);
+      field_confs.emplace_back();
+      field_confs.back().fromPacket(*fcit);
     }
+    this->setServerFieldConfs(field_confs);
   }
   // even when np_fcs.size() > 0 to handle the init case (first conf packet)
   if( conf_.field_confs.size() == 0 ) {
     throw netplay::CallbackError("no field configuration");
   }
 
+  if(pkt.compress_min_size() > 0) {
+    socket_->enableCompression(pkt.compress_min_size());
+  }
+  if(pkt.field_conf_hash()) {
+    server_field_conf_hashes_ = true;
+    socket_->enableFieldConfHashes();
+  }
+  if(pkt.input_channel()) {
+    socket_->requestInputChannel(std::move(input_transport_), input_server_);
+  }
+
   if(np_fcs.size() > 0) {
     observer_.onServerChangeFieldConfs();
   }
@@ -387,6 +646,9 @@ void ClientInstance::processPktServerState(const netplay::PktServerState& pkt)
 {
   //TODO check whether state change is valid
   State new_state = static_cast<State>(pkt.state());
+  if(new_state == State::LOBBY) {
+    awaiting_match_state_ = false;  // end of the match
+  }
   if(new_state == state_) {
     return; // nothing to do, should not happen though
   }
@@ -410,6 +672,11 @@ void ClientInstance::processPktServerState(const netplay::PktServerState& pkt)
     match_.start();
     observer_.onStateChange();
 
+  } else if(new_state == State::GAME && state_ == State::LOBBY) {
+    // connected during the match, ignore it until its state is received
+    awaiting_match_state_ = true;
+    LOG("client: match is running");
+
   } else if(new_state == State::GAME) {
     state_ = new_state;
     // implicit player state changes
@@ -419,6 +686,11 @@ void ClientInstance::processPktServerState(const netplay::PktServerState& pkt)
       }
     }
 
+    // server started the match about half a RTT ago
+    match_start_ = this->now() - std::chrono::microseconds(rtt_/2);
+    has_match_start_ = true;
+    this->startReplay();
+
     LOG("client: state set to GAME");
     observer_.onStateChange();
 
@@ -442,19 +714,12 @@ void ClientInstance::processPktPlayerConf(const netplay::PktPlayerConf& pkt)
       pl->setNick( pkt.nick() );
       observer_.onPlayerChangeNick(*pl, old_nick);
     }
-    if( pkt.has_field_conf() ) {
-      const std::string name = pkt.field_conf().name();
-      if( name.empty() ) {
-        FieldConf conf;
-        conf.fromPacket(pkt.field_conf());
-        pl->setFieldConf(conf);
-      } else {
-        auto* fc = conf_.fieldConf(name);
-        if(!fc) {
-          throw netplay::CallbackError("invalid configuration name: "+name);
-        }
-        pl->setFieldConf(*fc);
+    if( pkt.has_field_conf() || pkt.field_conf_hash() != 0 ) {
+      auto fc = this->fieldConfFromPacket(pkt);
+      if(!fc) {
+        throw netplay::CallbackError("invalid configuration name: "+pkt.field_conf().name());
       }
+      pl->setFieldConf(std::move(fc));
       observer_.onPlayerChangeFieldConf(*pl);
     }
   }
@@ -483,7 +748,7 @@ void ClientInstance::processPktPlayerState(const netplay::PktPlayerState& pkt)
       if(pl->field() != NULL) {
         pl->field()->abort();
         match_.updateTick(); // field lost, tick must be updated
-        pl->setField(NULL);
+        this->setPlayerField(*pl, NULL);
       }
       erase_player = true;
       state_valid = true;
@@ -498,8 +763,11 @@ void ClientInstance::processPktPlayerState(const netplay::PktPlayerState& pkt)
     case Player::State::GAME_READY:
       state_valid = state_ == State::GAME_READY && old_state == Player::State::GAME_INIT;
       break;
-    case Player::State::GAME_INIT:
     case Player::State::GAME:
+      // implicit on match start, sent to clients connected during the match
+      state_valid = awaiting_match_state_;
+      break;
+    case Player::State::GAME_INIT:
     default:
       throw netplay::CallbackError("unsettable state");
   }
@@ -526,11 +794,82 @@ void ClientInstance::processPktPlayerRank(const netplay::PktPlayerRank& pkt)
   if( pl == NULL || pl->field() == NULL ) {
     throw netplay::CallbackError("invalid player");
   }
-  pl->field()->setRank(pkt.rank()); //TODO may fail if already set
+  Field* fld = pl->field();
+  if( !fld->lost() && pkt.rank() > 1 ) {
+    // field aborted by the server
+    LOG("%s(%u): field aborted", pl->nick().c_str(), pl->plid());
+    fld->abort();
+    match_.updateTick();
+  }
+  fld->setRank(pkt.rank()); //TODO may fail if already set
   LOG("%s(%u): ranked %u", pl->nick().c_str(), pl->plid(), pl->field()->rank());
   observer_.onPlayerRanked(*pl);
 }
 
+void ClientInstance::processPktPong(const netplay::PktPong& pkt)
+{
+  const auto now = this->now();
+  const int64_t now_usec = std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch()).count();
+  const int64_t sample = now_usec - static_cast<int64_t>(pkt.client_time());
+  if( sample < 0 ) {
+    throw netplay::CallbackError("invalid pong time");
+  }
+  const unsigned int rtt = sample;
+  // compare to the estimation before this sample
+  const bool delayed = rtt_ != 0 && rtt > 2*rtt_;
+  rtt_ = rtt_ == 0 ? rtt : rtt_ - rtt_/8 + rtt/8;
+
+  // delayed samples give poor estimations, ignore them
+  if( state_ != State::GAME || pkt.match_time() == 0 || !has_match_start_ || delayed ) {
+    return;
+  }
+  const auto match_start = now - std::chrono::microseconds(rtt/2 + pkt.match_time());
+  match_start_ += (match_start - match_start_) / 8;
+}
+
+void ClientInstance::processPktMatchStats(const netplay::PktMatchStats& pkt)
+{
+  if(state_ != State::GAME) {
+    throw netplay::CallbackError("invalid in current state");
+  }
+  match_stats_.clear();
+  for(auto& np_field : pkt.fields()) {
+    match_stats_[np_field.plid()].fromPacket(np_field);
+  }
+}
+
+bool ClientInstance::referenceMatchStart(std::chrono::steady_clock::time_point& start) const
+{
+  if( !has_match_start_ ) {
+    return false;
+  }
+  start = match_start_;
+  return true;
+}
+
+void ClientInstance::schedulePing()
+{
+  if( ping_period_ms_ == 0 ) {
+    return;
+  }
+  ping_timer_.expires_from_now(boost::posix_time::milliseconds(ping_period_ms_));
+  ping_timer_.async_wait(std::bind(&ClientInstance::onPingTimer, this, std::placeholders::_1));
+}
+
+void ClientInstance::onPingTimer(const boost::system::error_code& ec)
+{
+  if( ec == boost::asio::error::operation_aborted || !socket_ ) {
+    return;
+  }
+  auto event = std::make_unique<netplay::ClientEvent>();
+  auto* np_ping = event->mutable_ping();
+  const auto now = this->now().time_since_epoch();
+  np_ping->set_client_time(std::chrono::duration_cast<std::chrono::microseconds>(now).count());
+  socket_->sendClientEvent(std::move(event));
+  this->schedulePing();
+}
+
+
 void ClientInstance::processPktPlayerField(const netplay::PktPlayerField& pkt)
 {
   //XXX support sending of current game fields to new clients
@@ -546,9 +885,9 @@ void ClientInstance::processPktPlayerField(const netplay::PktPlayerField& pkt)
   }
 
   Field& fld = match_.addField(pl->fieldConf(), pkt.seed());
-  pl->setField(&fld);
-  if( pkt.blocks_size() > 0 ) {
-    if(!fld.setGridContentFromPacket(pkt.blocks())) {
+  this->setPlayerField(*pl, &fld);
+  if( !pkt.grid().empty() ) {
+    if(!fld.setGridContentFromBytes(pkt.grid())) {
       throw netplay::CallbackError("invalid field content");
     }
   }
@@ -561,6 +900,7 @@ void ClientInstance::processNewPlayerResponse(const netplay::ServerResponse& res
       throw netplay::CallbackError("missing response field");
     }
     Player& pl = this->createNewPlayer(response.player_join(), true);
+    resume_tokens_[pl.plid()] = response.player_join().resume_token();
     cb(&pl, response.reason());
   } else {
     cb(nullptr, response.reason());
@@ -569,33 +909,296 @@ void ClientInstance::processNewPlayerResponse(const netplay::ServerResponse& res
 
 Player& ClientInstance::createNewPlayer(const netplay::PktPlayerConf& pkt, bool local)
 {
-  if(pkt.nick().empty() || !pkt.has_field_conf()) {
+  if(pkt.nick().empty() || (!pkt.has_field_conf() && pkt.field_conf_hash() == 0)) {
     throw netplay::CallbackError("missing fields");
   }
+  auto fc = this->fieldConfFromPacket(pkt);
+  if(!fc) {
+    throw netplay::CallbackError("invalid configuration name: "+pkt.field_conf().name());
+  }
   auto pl_ptr = std::make_unique<Player>(pkt.plid(), local);
   Player& pl = *pl_ptr.get();
   pl.setState(Player::State::LOBBY);
   pl.setNick(pkt.nick());
   players_.emplace(pl.plid(), std::move(pl_ptr));
-  FieldConf conf;
-  conf.fromPacket(pkt.field_conf());
-  pl.setFieldConf(conf);
+  pl.setFieldConf(std::move(fc));
   observer_.onPlayerJoined(pl);
   return pl;
 }
 
+void ClientInstance::processResumeResponse(const netplay::ServerResponse& response, PlId plid, NewPlayerCallback cb)
+{
+  Player* pl = this->player(plid);
+  if(response.result() != netplay::ServerResponse::OK) {
+    LOG("player %u not resumed: %s", plid, response.reason().c_str());
+    resume_tokens_.erase(plid);
+    if( pl != nullptr && pl->local() ) {
+      this->forgetPlayer(*pl);  // removed by the server
+    }
+    if( awaiting_match_state_ && match_.started() ) {
+      bool playing = false;
+      for(auto const& p : players_) {
+        playing = playing || (p.second->local() && p.second->field() != nullptr);
+      }
+      if( !playing ) {
+        this->stopMatch();  // nothing to resume, ignore the end of the match
+      }
+    }
+    if(cb) {
+      cb(nullptr, response.reason());
+    }
+    return;
+  }
+
+  if(!response.has_player_resume()) {
+    throw netplay::CallbackError("missing response field");
+  }
+  if( pl == nullptr ) {
+    throw netplay::CallbackError("invalid player");
+  }
+  // once the state is known, received events keep remote fields up-to-date
+  if( awaiting_match_state_ ) {
+    this->restoreMatchState(response.player_resume());
+  }
+  if( pl->field() == nullptr ) {
+    throw netplay::CallbackError("resumed player without a field");
+  }
+  pl->setLocal(true);
+  LOG("%s(%u): resumed at tick %u", pl->nick().c_str(), pl->plid(), pl->field()->tick());
+  this->catchUpPlayer(*pl);
+  if(cb) {
+    cb(pl, response.reason());
+  }
+}
+
+void ClientInstance::restoreMatchState(const netplay::PktMatchState& pkt)
+{
+  if( pkt.fields_size() == 0 ) {
+    throw netplay::CallbackError("empty match state");
+  }
+
+  std::vector<PlId> playing;
+  for(auto& p : players_) {
+    if( p.second->field() != nullptr ) {
+      playing.push_back(p.first);
+      this->setPlayerField(*p.second, nullptr);
+    }
+  }
+  this->stopReplay();  // a partial match cannot be recorded
+  if( match_.started() ) {
+    match_.stop();
+  }
+  match_.clear();
+  this->clearInputChannel();
+
+  // fields keep a reference to their configuration
+  restored_field_confs_.clear();
+  restored_field_confs_.resize(pkt.fields_size());
+  for(int i=0; i<pkt.fields_size(); i++) {
+    const auto& np_field = pkt.fields(i);
+    FieldConf& conf = restored_field_confs_[i];
+    conf.fromPacket(np_field.field_conf());
+    Field& fld = match_.addField(conf, np_field.state().seed());
+    if( np_field.plid() != 0 ) {
+      Player* pl = this->player(np_field.plid());
+      if( pl == nullptr || pl->field() != nullptr ) {
+        throw netplay::CallbackError("invalid player");
+      }
+      this->setPlayerField(*pl, &fld);
+    }
+  }
+  match_.start();
+
+  // fields must all exist before adding garbages
+  const auto& fields = match_.fields();
+  auto new_garbage = [&fields](const netplay::PktMatchState::Garbage& np_gb, Field& fld) {
+    auto gb = std::make_unique<Garbage>();
+    gb->gbid = np_gb.gbid();
+    gb->to = &fld;
+    if( np_gb.fldid_from() > fields.size() ) {
+      throw netplay::CallbackError("invalid garbage origin");
+    }
+    gb->from = np_gb.fldid_from() == 0 ? nullptr : fields[np_gb.fldid_from()-1].get();
+    gb->type = static_cast<Garbage::Type>(np_gb.type());
+    if( gb->type != Garbage::Type::CHAIN && gb->type != Garbage::Type::COMBO ) {
+      throw netplay::CallbackError("invalid garbage type");
+    }
+    gb->size = FieldPos(np_gb.size() & 0xff, np_gb.size() >> 8);
+    if( gb->size.x == 0 || gb->size.y == 0 ) {
+      throw netplay::CallbackError("invalid garbage size");
+    }
+    return gb;
+  };
+  for(int i=0; i<pkt.fields_size(); i++) {
+    const auto& np_field = pkt.fields(i);
+    Field& fld = *fields[i];
+    if( !fld.setStateFromPacket(np_field.state()) ) {
+      throw netplay::CallbackError("invalid field state");
+    }
+    for(auto& np_gb : np_field.hanging()) {
+      match_.addGarbage(new_garbage(np_gb, fld), fld.hangingGarbageCount());
+    }
+    for(auto& np_gb : np_field.waiting()) {
+      auto gb = new_garbage(np_gb, fld);
+      const Garbage& gb_ref = *gb;
+      match_.addGarbage(std::move(gb), fld.hangingGarbageCount());
+      match_.waitGarbageDrop(gb_ref);
+    }
+  }
+  match_.updateTick();
+
+  // players without a field left during the disconnection
+  for(auto plid : playing) {
+    Player* pl = this->player(plid);
+    if( pl != nullptr && pl->field() == nullptr && !pl->local() ) {
+      this->forgetPlayer(*pl);
+    }
+  }
+
+  if( !has_match_start_ ) {
+    match_start_ = this->now() - std::chrono::microseconds(rtt_/2 + pkt.match_time());
+    has_match_start_ = true;
+  }
+  awaiting_match_state_ = false;
+  state_ = State::GAME;
+  LOG("client: match state restored, tick %u", match_.tick());
+  observer_.onStateChange();
+}
+
+void ClientInstance::catchUpPlayer(Player& pl)
+{
+  if( conf_.tk_usec == 0 ) {
+    return;
+  }
+  const auto elapsed = this->now() - match_start_;
+  if( elapsed.count() < 0 ) {
+    return;
+  }
+  const Tick ref_tick = elapsed / std::chrono::microseconds(conf_.tk_usec);
+  Field& fld = *pl.field();
+  const Tick start_tick = fld.tick();
+  // don't exceed the lag limit, other players will catch up
+  while( fld.tick() < ref_tick && !fld.lost() && fld.tick()+1 < match_.tick() + conf_.tk_lag_max ) {
+    this->playerStep(pl, 0);
+  }
+  if( fld.tick() != start_tick ) {
+    LOG("%s(%u): caught up from tick %u to %u", pl.nick().c_str(), pl.plid(), start_tick, fld.tick());
+  }
+}
+
+void ClientInstance::forgetPlayer(Player& pl)
+{
+  if(pl.field() != NULL) {
+    pl.field()->abort();
+    match_.updateTick(); // field lost, tick must be updated
+    this->setPlayerField(pl, NULL);
+  }
+  pl.setState(Player::State::QUIT);
+  LOG("%s(%u): state set to QUIT", pl.nick().c_str(), pl.plid());
+  observer_.onPlayerStateChange(pl);
+  resume_tokens_.erase(pl.plid());
+  players_.erase(pl.plid());
+}
+
 
 void ClientInstance::stopMatch()
 {
   LOG("stop match");
 
+  this->stopReplay();
   PlayerContainer::iterator it;
   for(it=players_.begin(); it!=players_.end(); ++it) {
-    (*it).second->setField(NULL);
+    this->setPlayerField(*(*it).second, NULL);
   }
   match_.stop();
+  this->clearInputChannel();
+  has_match_start_ = false;
   state_ = State::LOBBY;
   LOG("client: state set to LOBBY");
   observer_.onStateChange();
 }
 
+
+
+void ClientInstance::applyDatagramInputs()
+{
+  // a step may lift the lag limit of other fields, loop until no progress
+  bool stepped;
+  do {
+    stepped = false;
+    for(auto it = datagram_inputs_.begin(); it != datagram_inputs_.end(); ) {
+      Player* pl = this->player((*it).first);
+      Field* fld = pl == nullptr ? nullptr : pl->field();
+      InputBuffer& buffer = (*it).second;
+      while( fld != nullptr && !fld->lost() && !buffer.empty() ) {
+        auto buffer_it = buffer.begin();
+        if( (*buffer_it).first < fld->tick() ) {
+          buffer.erase(buffer_it);  // already received in an event
+          continue;
+        } else if( (*buffer_it).first > fld->tick() || (*buffer_it).second.drops != fld->droppedGarbageCount() ||
+                   fld->tick()+1 >= match_.tick() + conf_.tk_lag_max ) {
+          break;
+        }
+        const KeyState keys = (*buffer_it).second.keys;
+        buffer.erase(buffer_it);
+        this->stepRemotePlayer(*pl, keys);
+        stepped = true;
+      }
+      if( fld == nullptr || fld->lost() || buffer.empty() ) {
+        it = datagram_inputs_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  } while( stepped );
+}
+
+void ClientInstance::scheduleInputDatagram()
+{
+  if( input_timer_active_ ) {
+    return;
+  }
+  input_timer_active_ = true;
+  input_timer_.expires_from_now(boost::posix_time::microseconds(0));
+  input_timer_.async_wait(std::bind(&ClientInstance::onInputTimer, this, std::placeholders::_1));
+}
+
+void ClientInstance::onInputTimer(const boost::system::error_code& ec)
+{
+  if( ec == asio::error::operation_aborted ) {
+    return;
+  }
+  input_timer_active_ = false;
+  if( state_ != State::GAME || !socket_ || !socket_->inputChannel() ) {
+    return;
+  }
+
+  // local inputs not acknowledged yet, and acknowledgements of remote ones
+  netplay::Datagram dgram;
+  for(auto const& h : input_history_) {
+    auto ack_it = input_acks_.find(h.first);
+    h.second.toDatagram(dgram, h.first, ack_it == input_acks_.end() ? 0 : (*ack_it).second);
+  }
+  for(auto const& p : players_) {
+    const Player& pl = *p.second;
+    if( pl.local() || pl.field() == nullptr || pl.field()->lost() ) {
+      continue;
+    }
+    Tick tick = pl.field()->tick();
+    auto buffer_it = datagram_inputs_.find(pl.plid());
+    if( buffer_it != datagram_inputs_.end() ) {
+      tick = nextMissingTick((*buffer_it).second, tick);
+    }
+    auto* np_ack = dgram.add_acks();
+    np_ack->set_plid(pl.plid());
+    np_ack->set_tick(tick);
+  }
+  socket_->sendDatagram(dgram);
+}
+
+void ClientInstance::clearInputChannel()
+{
+  input_history_.clear();
+  input_acks_.clear();
+  datagram_inputs_.clear();
+}
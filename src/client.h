@@ -4,6 +4,7 @@
 #include <memory>
 #include "instance.h"
 #include "netplay.h"
+#include "stats.h"
 
 
 /// Instance for remote games.
@@ -29,12 +30,57 @@ class ClientInstance: public GameInstance,
    * Timeout is given in milliseconds, -1 to wait indefinitely.
    * Once the method returned the client still have to wait for server
    * configuration (or to be rejected).
+   *
+   * When reconnecting after a connection loss during a match, local players
+   * are resumed (see resumePlayer()).
    */
   void connect(const char* host, int port, int tout);
+  /// Connect to a server using an in-process transport.
+  void connect(std::unique_ptr<netplay::Transport> transport);
+  /** @brief Reconnect to the last server, to resume local players.
+   *
+   * Return false if there is nothing to resume (no running match, no
+   * playing local player) or if the last connection was not made to a
+   * host. Otherwise, the connection is started: observer's
+   * onServerConnect() is called as for connect(), then the match state is
+   * received (see resumePlayer()).
+   */
+  bool reconnect(int tout);
+  /// Return true if a local player has a running field to resume.
+  bool canResume() const;
+  /** @brief Set the datagram transport of the input channel.
+   *
+   * By default, a UDP socket is opened if the server supports the channel
+   * and the connection uses TCP. \e server is the endpoint of the server's
+   * datagram transport. The transport is used by the next connection only.
+   */
+  void setInputTransport(std::shared_ptr<netplay::DatagramTransport> transport, const netplay::DatagramTransport::Endpoint& server);
+  /// Return true if the server accepted the input channel.
+  bool inputChannel() const { return socket_ && socket_->inputChannel(); }
 
   /// Close connection to the server.
   void disconnect();
 
+  /// Return the measured round-trip time to the server, in microseconds (0 if unknown).
+  unsigned int rtt() const { return rtt_; }
+  /** @brief Set the period of RTT measures, in milliseconds.
+   *
+   * Must be called before connecting. Pings are disabled if null.
+   */
+  void setPingPeriod(unsigned int ms) { ping_period_ms_ = ms; }
+  /** @brief Only simulate fields of local players.
+   *
+   * Remote fields are stepped blindly and their hashes are not reported.
+   * Used by synthetic clients, whose cost would otherwise grow with the
+   * number of players.
+   */
+  void setLocalFieldsOnly(bool v) { local_fields_only_ = v; }
+  virtual bool isFieldSimulated(const Field& fld) const;
+  virtual bool referenceMatchStart(std::chrono::steady_clock::time_point& start) const;
+
+  /// Statistics of the last match, sent by the server, indexed by PlId.
+  const std::map<PlId, FieldStats>& matchStats() const { return match_stats_; }
+
   typedef std::function<void(Player*, const std::string&)> NewPlayerCallback;
   /** @brief Create a new local player
    *
@@ -43,6 +89,16 @@ class ClientInstance: public GameInstance,
    */
   void newLocalPlayer(const std::string& nick, NewPlayerCallback cb);
 
+  /// Return the token to resume a local player, 0 if unknown.
+  uint64_t resumeToken(PlId plid) const;
+  /** @brief Resume a player of the running match, after a disconnection.
+   *
+   * The match state is received from the server, then local fields are
+   * stepped with empty input up to the reference tick. On success, the
+   * callback is called with the player, which is now local.
+   */
+  void resumePlayer(PlId plid, uint64_t token, NewPlayerCallback cb);
+
   /** @name Local player operations. */
   //@{
   virtual void playerSetNick(Player& pl, const std::string& nick);
@@ -57,10 +113,13 @@ class ClientInstance: public GameInstance,
   virtual void onServerConnect(bool success);
   virtual void onServerDisconnect();
   virtual void onServerEvent(const netplay::ServerEvent& event);
+  virtual void onServerDatagram(const netplay::Datagram& dgram);
   //@}
 
  protected:
   GameInstance::Observer& observer() const { return observer_; }
+  /// Step a player field, blindly if not simulated.
+  virtual void stepField(Player& pl, KeyState keys);
 
  private:
   Observer& observer_;
@@ -83,6 +142,8 @@ class ClientInstance: public GameInstance,
   void processPktPlayerState(const netplay::PktPlayerState& pkt);
   void processPktPlayerRank(const netplay::PktPlayerRank& pkt);
   void processPktPlayerField(const netplay::PktPlayerField& pkt);
+  void processPktPong(const netplay::PktPong& pkt);
+  void processPktMatchStats(const netplay::PktMatchStats& pkt);
   //@}
 
   /** @brief Create and register new player from its conf
@@ -90,10 +151,101 @@ class ClientInstance: public GameInstance,
    */
   Player& createNewPlayer(const netplay::PktPlayerConf& pkt, bool local);
   void processNewPlayerResponse(const netplay::ServerResponse& response, NewPlayerCallback cb);
-
+  void processResumeResponse(const netplay::ServerResponse& response, PlId plid, NewPlayerCallback cb);
+  /** @brief Replace the match by a state sent by the server.
+   *
+   * Players missing from the match state left during the disconnection,
+   * they are removed.
+   */
+  void restoreMatchState(const netplay::PktMatchState& pkt);
+  /// Step a resumed local player with empty input, up to the reference tick.
+  void catchUpPlayer(Player& pl);
+  /// Remove a player which left the server while disconnected.
+  void forgetPlayer(Player& pl);
+
+  /// Create a new socket, if the current one has already been used.
+  void resetSocket();
   void stopMatch();
 
+  /// Step a player field, send a field report if needed.
+  virtual void doStepPlayer(Player& pl, KeyState keys);
+  /// Send a report of a field's last step, if needed.
+  void sendFieldReport(const Player& pl);
+  /// Number of remote fields whose hash is reported, per report period
+  static const unsigned int REMOTE_REPORT_FIELDS;
+  /** @brief Return true if the hash of a remote field is reported at its tick.
+   *
+   * A different sample of remote fields is reported on each period, at an
+   * offset specific to the client.
+   */
+  bool isRemoteReportSampled(const Field& fld) const;
+
+  /** @name Input channel.
+   *
+   * If the server supports it, inputs of local players are also sent in
+   * datagrams, repeated until acknowledged by the server (up to the
+   * server's redundancy). Inputs of remote players received in datagrams
+   * are buffered. They are applied once they follow the field's tick and
+   * the field dropped the same garbage count than on the server.
+   */
+  //@{
+  /// Step remote fields with buffered datagram inputs, if possible.
+  void applyDatagramInputs();
+  /// Schedule sending of a datagram, if not already scheduled.
+  void scheduleInputDatagram();
+  void onInputTimer(const boost::system::error_code& ec);
+  /// Reset the input channel state of the match.
+  void clearInputChannel();
+  //@}
+
+  /** @name Clock synchronization. */
+  //@{
+  static const unsigned int PING_PERIOD_MS;
+  void schedulePing();
+  void onPingTimer(const boost::system::error_code& ec);
+  //@}
+
+  boost::asio::io_service& io_service_;
   std::shared_ptr<netplay::ClientSocket> socket_;
+  /// Host and port of the last connection, empty host for other transports
+  std::string host_;
+  int port_;
+  boost::asio::monotone_timer ping_timer_;
+  unsigned int ping_period_ms_;
+  bool local_fields_only_;
+  /// Offset of the sample of reported remote fields
+  unsigned int report_offset_;
+  /// Smoothed round-trip time, in microseconds
+  unsigned int rtt_;
+  /// Estimated local time of the server's match start
+  std::chrono::steady_clock::time_point match_start_;
+  bool has_match_start_;
+  std::map<PlId, FieldStats> match_stats_;
+  /// Resume tokens of local players
+  std::map<PlId, uint64_t> resume_tokens_;
+  /** @brief Set when connected during a match, until its state is received.
+   *
+   * Match events are ignored meanwhile.
+   */
+  bool awaiting_match_state_;
+  /// Configurations of fields restored from a match state
+  std::vector<FieldConf> restored_field_confs_;
+  /// Server understands field configuration hashes
+  bool server_field_conf_hashes_;
+  /// Custom configurations sent in full, known by the server
+  FieldConfPins field_conf_pins_;
+
+  /// Transport of the input channel for the next connection, may be null
+  std::shared_ptr<netplay::DatagramTransport> input_transport_;
+  netplay::DatagramTransport::Endpoint input_server_;
+  /// Last inputs of local players
+  std::map<PlId, InputHistory> input_history_;
+  /// Next input tick of local players not acknowledged by the server
+  std::map<PlId, Tick> input_acks_;
+  /// Inputs of remote players received in datagrams, not applied yet
+  std::map<PlId, InputBuffer> datagram_inputs_;
+  boost::asio::monotone_timer input_timer_;
+  bool input_timer_active_;
 };
 
 #endif
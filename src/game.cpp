@@ -1,10 +1,44 @@
 #include <memory>
+#include <algorithm>
 #include "game.h"
 #include "netplay.h"
 #include "inifile.h"
 #include "log.h"
 
 
+/// FNV-1a initial hash value
+static const uint32_t FNV_OFFSET_BASIS = 2166136261u;
+
+/// Update a FNV-1a hash with a 32-bit value, in little-endian order
+static void fnv1aUpdate(uint32_t& h, uint32_t v)
+{
+  for( int i=0; i<4; i++ ) {
+    h ^= (v >> (8*i)) & 0xff;
+    h *= 16777619u;
+  }
+}
+
+/// FNV-1a 64-bit initial hash value
+static const uint64_t FNV64_OFFSET_BASIS = 14695981039346656037u;
+
+/// Update a 64-bit FNV-1a hash with a buffer
+static void fnv1aUpdate64(uint64_t& h, const void* data, size_t size)
+{
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  for( size_t i=0; i<size; i++ ) {
+    h ^= p[i];
+    h *= 1099511628211u;
+  }
+}
+
+/// Update a 64-bit FNV-1a hash with a 16-bit value, in little-endian order
+static void fnv1aUpdate64(uint64_t& h, uint16_t v)
+{
+  const uint8_t bytes[2] = { static_cast<uint8_t>(v), static_cast<uint8_t>(v >> 8) };
+  fnv1aUpdate64(h, bytes, sizeof(bytes));
+}
+
+
 bool FieldConf::isValid() const
 {
   // raise_change_speed values must be increasing
@@ -29,6 +63,40 @@ bool FieldConf::isValid() const
       && color_nb > 3 && color_nb < 16;
 }
 
+uint64_t FieldConf::hash() const
+{
+  uint64_t h = FNV64_OFFSET_BASIS;
+  // include the size, so that the name cannot overlap with other fields
+  fnv1aUpdate64(h, static_cast<uint16_t>(name.size()));
+  fnv1aUpdate64(h, name.data(), name.size());
+#define FIELD_CONF_EXPR_HASH(n,ini) \
+  fnv1aUpdate64(h, n);
+  FIELD_CONF_APPLY(FIELD_CONF_EXPR_HASH);
+#undef FIELD_CONF_EXPR_HASH
+  fnv1aUpdate64(h, static_cast<uint16_t>(raise_speeds.size()));
+  for(uint16_t v : raise_speeds) {
+    fnv1aUpdate64(h, v);
+  }
+  fnv1aUpdate64(h, static_cast<uint16_t>(raise_speed_changes.size()));
+  for(uint16_t v : raise_speed_changes) {
+    fnv1aUpdate64(h, v);
+  }
+  fnv1aUpdate64(h, static_cast<uint16_t>(raise_adjacent));
+  return h;
+}
+
+bool FieldConf::operator==(const FieldConf& o) const
+{
+#define FIELD_CONF_EXPR_CMP(n,ini) \
+  if(n != o.n) return false;
+  FIELD_CONF_APPLY(FIELD_CONF_EXPR_CMP);
+#undef FIELD_CONF_EXPR_CMP
+  return name == o.name
+      && raise_speeds == o.raise_speeds
+      && raise_speed_changes == o.raise_speed_changes
+      && raise_adjacent == o.raise_adjacent;
+}
+
 void FieldConf::fromPacket(const netplay::FieldConf& pkt)
 {
   name = pkt.name();
@@ -114,7 +182,9 @@ void Field::initMatch()
   stop_dt_ = 0;
   transformed_nb_ = 0;
   raised_lines_ = 0;
+  events_digest_ = FNV_OFFSET_BASIS;
   ::memset(gb_drop_pos_, 0, sizeof(gb_drop_pos_));
+  dropped_nb_ = 0;
 
   step_info_ = StepInfo();
   enable_swap_ = false;
@@ -328,6 +398,7 @@ void Field::step(KeyState keys)
               bk.ntick = tick_ + (bk.combo_info.group_end - bk.combo_info.pos - 1) * conf_.pop_tk + 1;
             }
             step_info_.blocks.popped.push_back(bk.combo_info);
+            step_info_.blocks.mutated++;
           } else if(bkg.state == BkGarbage::TRANSFORMED) {
             bkg.state = BkGarbage::REST;
             bk.ntick = 0;
@@ -467,13 +538,14 @@ void Field::step(KeyState keys)
       }
     }
 
-    LOG("[%u|%u] match +%d x%d  gb:%d", fldid_, tick_, step_info_.combo, step_info_.chain, garbage_end);
+    LOG_DEBUG("[%u|%u] match +%d x%d  gb:%d", fldid_, tick_, step_info_.combo, step_info_.chain, garbage_end);
+    this->addEventToDigest(step_info_.combo, step_info_.chain);
   }
 
 
   // Process dropping garbages
   if( !gbs_drop_.empty() && !full && raise ) {
-    LOG("[%u|%u] gb: dropping", fldid_, tick_);
+    LOG_DEBUG("[%u|%u] gb: dropping", fldid_, tick_);
     //TODO drop condition: no drop when flashing/chain
     gbs_field_.push_back(std::move(gbs_drop_.front()));
     gbs_drop_.pop_front();
@@ -619,8 +691,10 @@ void Field::step(KeyState keys)
       }
     }
     if( cancel ) {
-      LOG("[%u|%u] end of chain", fldid_, tick_);
+      LOG_DEBUG("[%u|%u] end of chain", fldid_, tick_);
       chain_ = 1;
+      step_info_.chain_end = true;
+      this->addEventToDigest(0, 1);
     }
   }
 
@@ -653,6 +727,7 @@ void Field::step(KeyState keys)
     if(lost_dt_ == 0) {
       lost_ = true;
       chain_ = 1; // just in case
+      this->addEventToDigest(0, 0);
       return;
     }
   } else if(!full && raise && stop_dt_ == 0) {
@@ -667,35 +742,113 @@ void Field::step(KeyState keys)
   if(raise_speed_index_ < conf_.raise_speed_changes.size() &&
      tick_ >= conf_.raise_speed_changes[raise_speed_index_]) {
     raise_speed_index_++;
-    LOG("[%u|%u] speed up", fldid_, tick_);
+    LOG_DEBUG("[%u|%u] speed up", fldid_, tick_);
   }
 }
 
 
+void Field::stepBlind(unsigned int combo, unsigned int chain, bool chain_end, bool lost)
+{
+  assert( !lost_ );
+
+  step_info_ = StepInfo();
+  tick_++;
+  // garbages are not simulated, discard the dropped ones
+  gbs_drop_.clear();
+
+  if( combo > 0 ) {
+    step_info_.combo = combo;
+    step_info_.chain = chain;
+    if( chain > 1 ) {
+      chain_ = chain;
+    }
+    this->addEventToDigest(combo, chain);
+  } else if( chain_end ) {
+    chain_ = 1;
+    step_info_.chain_end = true;
+    this->addEventToDigest(0, 1);
+  }
+  if( lost ) {
+    lost_ = true;
+    chain_ = 1;
+    this->addEventToDigest(0, 0);
+  }
+}
+
+uint32_t Field::stateHash() const
+{
+  uint32_t h = FNV_OFFSET_BASIS;
+  fnv1aUpdate(h, tick_);
+  fnv1aUpdate(h, chain_);
+  fnv1aUpdate(h, seed_);
+  fnv1aUpdate(h, lost_);
+  fnv1aUpdate(h, (uint8_t)cursor_.x | (uint8_t)cursor_.y << 8);
+  fnv1aUpdate(h, swap_dt_);
+  fnv1aUpdate(h, raise_progress_);
+  fnv1aUpdate(h, stop_dt_);
+  fnv1aUpdate(h, events_digest_);
+  for( int y=0; y<=FIELD_HEIGHT; y++ ) {
+    for( int x=0; x<FIELD_WIDTH; x++ ) {
+      const Block& bk = grid_[x][y];
+      uint32_t v = bk.type | bk.swapped << 4 | bk.chaining << 5;
+      if( bk.isColor() ) {
+        v |= bk.bk_color.state << 8 | bk.bk_color.color << 16;
+      } else if( bk.isGarbage() ) {
+        v |= bk.bk_garbage.state << 8;
+      }
+      fnv1aUpdate(h, v);
+      fnv1aUpdate(h, bk.ntick);
+    }
+  }
+  return h;
+}
+
+void Field::addEventToDigest(unsigned int combo, unsigned int chain)
+{
+  fnv1aUpdate(events_digest_, tick_);
+  fnv1aUpdate(events_digest_, combo);
+  fnv1aUpdate(events_digest_, chain);
+}
+
+
 void Field::waitGarbageDrop(const Garbage& gb)
 {
-  LOG("[%u|%u] waitGarbageDrop(%u)", fldid_, tick_, gb.gbid);
+  LOG_DEBUG("[%u|%u] waitGarbageDrop(%u)", fldid_, tick_, gb.gbid);
   gbs_wait_.push_back(this->removeHangingGarbage(gb));
 }
 
 void Field::dropNextGarbage()
 {
-  LOG("[%u|%u] dropNextGarbage()", fldid_, tick_);
+  LOG_DEBUG("[%u|%u] dropNextGarbage()", fldid_, tick_);
   std::unique_ptr<Garbage> gb = std::move(gbs_wait_.front());
   gbs_wait_.pop_front();
   gb->gbid = 0;
   gbs_drop_.push_back(std::move(gb));
+  dropped_nb_++;
+}
+
+void Field::dropGarbage(Garbage::Type type, const FieldPos& size)
+{
+  LOG_DEBUG("[%u|%u] dropGarbage()", fldid_, tick_);
+  auto gb = std::make_unique<Garbage>();
+  gb->gbid = 0;
+  gb->from = NULL;
+  gb->to = this;
+  gb->type = type;
+  gb->size = size;
+  gbs_drop_.push_back(std::move(gb));
+  dropped_nb_++;
 }
 
 void Field::insertHangingGarbage(std::unique_ptr<Garbage> gb, unsigned int pos)
 {
-  LOG("[%u|%u] insertHangingGarbage(%u, %u)", fldid_, tick_, gb->gbid, pos);
+  LOG_DEBUG("[%u|%u] insertHangingGarbage(%u, %u)", fldid_, tick_, gb->gbid, pos);
   gbs_hang_.insert(gbs_hang_.begin()+pos, std::move(gb));
 }
 
 std::unique_ptr<Garbage> Field::removeHangingGarbage(const Garbage& gb)
 {
-  LOG("[%u|%u] removeHangingGarbage(%u)", fldid_, tick_, gb.gbid);
+  LOG_DEBUG("[%u|%u] removeHangingGarbage(%u)", fldid_, tick_, gb.gbid);
   for(auto it=gbs_hang_.begin(); it!=gbs_hang_.end(); ++it) {
     if(it->get() == &gb) {
       std::unique_ptr<Garbage> ret = std::move(*it);
@@ -726,71 +879,372 @@ void Field::abort()
 }
 
 
-void Field::setGridContentToPacket(google::protobuf::RepeatedPtrField<netplay::PktPlayerField_Block>& grid)
+/** @name Packed block attributes.
+ *
+ * Shared by grid bytes and field states, see FieldState.grid for the format.
+ */
+//@{
+static const uint32_t BK_TYPE_MASK = 0x3;
+static const uint32_t BK_SWAPPED = 1 << 2;
+static const uint32_t BK_CHAINING = 1 << 3;
+static const unsigned int BK_STATE_SHIFT = 4;
+static const unsigned int BK_COLOR_SHIFT = 8;
+static const uint32_t BK_EXTRA = 1 << 12;
+//@}
+
+/** @brief Pack block attributes into an integer.
+ *
+ * The \e extra flag is not set.
+ */
+static uint32_t packBlock(const Block& bk)
+{
+  uint32_t v = bk.type | (bk.swapped ? BK_SWAPPED : 0) | (bk.chaining ? BK_CHAINING : 0);
+  if( bk.isColor() ) {
+    v |= bk.bk_color.state << BK_STATE_SHIFT | bk.bk_color.color << BK_COLOR_SHIFT;
+  } else if( bk.isGarbage() ) {
+    v |= bk.bk_garbage.state << BK_STATE_SHIFT;
+  }
+  return v;
+}
+
+/** @brief Reset a block from packed attributes.
+ *
+ * Garbage pointer is not set.
+ * @return \e false on invalid attributes.
+ */
+static bool unpackBlock(uint32_t v, unsigned int color_nb, Block& bk)
+{
+  bk = Block();
+  bk.type = static_cast<Block::Type>(v & BK_TYPE_MASK);
+  bk.swapped = v & BK_SWAPPED;
+  bk.chaining = v & BK_CHAINING;
+  const unsigned int state = (v >> BK_STATE_SHIFT) & 0xf;
+  const unsigned int color = (v >> BK_COLOR_SHIFT) & 0xf;
+  if( bk.isColor() ) {
+    if( state < BkColor::REST || state > BkColor::TRANSFORMED || color >= color_nb ) {
+      return false;
+    }
+    bk.bk_color.state = static_cast<BkColor::State>(state);
+    bk.bk_color.color = color;
+  } else if( bk.isGarbage() ) {
+    if( state < BkGarbage::REST || state > BkGarbage::TRANSFORMED ) {
+      return false;
+    }
+    bk.bk_garbage.state = static_cast<BkGarbage::State>(state);
+  } else if( !bk.isNone() ) {
+    return false;
+  }
+  return true;
+}
+
+/// Append a varint to a string.
+static void appendVarint(std::string& data, uint32_t v)
+{
+  while( v >= 0x80 ) {
+    data.push_back(static_cast<char>(v | 0x80));
+    v >>= 7;
+  }
+  data.push_back(static_cast<char>(v));
+}
+
+/// Read a varint, return \e false on truncated or too long data.
+static bool readVarint(const uint8_t*& p, const uint8_t* end, uint32_t& v)
+{
+  v = 0;
+  for( int shift=0; ; shift+=7 ) {
+    if( p == end || shift > 28 ) {
+      return false;
+    }
+    const uint8_t b = *p++;
+    v |= static_cast<uint32_t>(b & 0x7f) << shift;
+    if( !(b & 0x80) ) {
+      return true;
+    }
+  }
+}
+
+void Field::setGridContentToBytes(std::string& data) const
+{
+  data.clear();
+  // worst case: two bytes per block, plus a 5-byte varint
+  data.reserve(FIELD_WIDTH*(FIELD_HEIGHT+1)*7);
+  int32_t prev_ntick = 0;
+  for(int y=0; y<=FIELD_HEIGHT; y++) {
+    for(int x=0; x<FIELD_WIDTH; x++) {
+      const Block& bk = grid_[x][y];
+      appendVarint(data, packBlock(bk) | (bk.ntick != 0 ? BK_EXTRA : 0));
+      if( bk.ntick != 0 ) {
+        // zigzag varint
+        const int32_t delta = static_cast<int32_t>(bk.ntick) - prev_ntick;
+        prev_ntick = bk.ntick;
+        appendVarint(data, (static_cast<uint32_t>(delta) << 1) ^ static_cast<uint32_t>(delta >> 31));
+      }
+    }
+  }
+}
+
+bool Field::setGridContentFromBytes(const std::string& data)
+{
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(data.data());
+  const uint8_t* const end = p + data.size();
+  int32_t prev_ntick = 0;
+  for(int y=0; y<=FIELD_HEIGHT; y++) {
+    for(int x=0; x<FIELD_WIDTH; x++) {
+      uint32_t v;
+      if( !readVarint(p, end, v) ) {
+        return false;
+      }
+      Block& bk = grid_[x][y];
+      if( !unpackBlock(v, conf_.color_nb, bk) || bk.isGarbage() ) {
+        return false;  // garbages are not supported
+      }
+      if( v & BK_EXTRA ) {
+        uint32_t delta;
+        if( !readVarint(p, end, delta) ) {
+          return false;
+        }
+        prev_ntick += static_cast<int32_t>((delta >> 1) ^ -(delta & 1));
+        bk.ntick = prev_ntick;
+      }
+    }
+  }
+  return p == end;
+}
+
+void Field::setGridColorsToBytes(std::string& data) const
+{
+  data.clear();
+  data.reserve(FIELD_WIDTH*(FIELD_HEIGHT+1));
+  for(int y=0; y<=FIELD_HEIGHT; y++) {
+    for(int x=0; x<FIELD_WIDTH; x++) {
+      const Block& bk = grid_[x][y];
+      const uint32_t v = packBlock(bk);
+      data.push_back(static_cast<char>(bk.isColor() ? (v >> BK_COLOR_SHIFT) + 1 : 0));
+    }
+  }
+}
+
+bool Field::setGridColorsFromBytes(const std::string& data)
+{
+  if( data.size() != FIELD_WIDTH*(FIELD_HEIGHT+1) ) {
+    return false;
+  }
+  std::string::const_iterator it = data.begin();
+  for(int y=0; y<=FIELD_HEIGHT; y++) {
+    for(int x=0; x<FIELD_WIDTH; x++) {
+      const unsigned int c = static_cast<uint8_t>(*it++);
+      const uint32_t v = c == 0 ? static_cast<uint32_t>(Block::NONE) :
+          Block::COLOR | BkColor::REST << BK_STATE_SHIFT | (c - 1) << BK_COLOR_SHIFT;
+      if( c > 0x10 || !unpackBlock(v, conf_.color_nb, grid_[x][y]) ) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/// Pack a field position into an integer.
+static uint32_t packFieldPos(const FieldPos& pos)
+{
+  return static_cast<uint8_t>(pos.x) | static_cast<uint8_t>(pos.y) << 8;
+}
+
+/// Unpack a field position from an integer.
+static FieldPos unpackFieldPos(uint32_t v)
+{
+  return FieldPos(static_cast<int8_t>(v & 0xff), static_cast<int8_t>((v >> 8) & 0xff));
+}
+
+void Field::setStateToPacket(netplay::FieldState& pkt) const
 {
-  grid.Clear();
+  pkt.Clear();
+  pkt.set_tick(tick_);
+  pkt.set_seed(seed_);
+  pkt.set_chain(chain_);
+  pkt.set_lost(lost_);
+  pkt.set_lost_dt(lost_dt_);
+  pkt.set_rank(rank_);
+  pkt.set_enable_swap(enable_swap_);
+  pkt.set_enable_raise(enable_raise_);
+  pkt.set_cursor(packFieldPos(cursor_));
+  pkt.set_swap(packFieldPos(swap_));
+  pkt.set_swap_dt(swap_dt_);
+  pkt.set_key_state(key_state_);
+  pkt.set_key_repeat(key_repeat_);
+  pkt.set_raise_progress(raise_progress_);
+  pkt.set_raise_speed_index(raise_speed_index_);
+  pkt.set_manual_raise(manual_raise_);
+  pkt.set_stop_dt(stop_dt_);
+  pkt.set_transformed_nb(transformed_nb_);
+  pkt.set_raised_lines(raised_lines_);
+  pkt.set_events_digest(events_digest_);
+  pkt.set_gb_drop_pos(gb_drop_pos_, sizeof(gb_drop_pos_));
+  pkt.set_dropped_nb(dropped_nb_);
+
+  std::vector<const Garbage*> garbages;
+  for(auto& gb : gbs_field_) {
+    garbages.push_back(gb.get());
+    netplay::FieldState::Garbage* np_gb = pkt.add_garbages();
+    np_gb->set_type(static_cast<netplay::GarbageType>(gb->type));
+    np_gb->set_pos(packFieldPos(gb->pos));
+    np_gb->set_size(packFieldPos(gb->size));
+  }
+  for(auto& gb : gbs_drop_) {
+    netplay::FieldState::Garbage* np_gb = pkt.add_drops();
+    np_gb->set_type(static_cast<netplay::GarbageType>(gb->type));
+    np_gb->set_pos(packFieldPos(gb->pos));
+    np_gb->set_size(packFieldPos(gb->size));
+  }
+
+  auto& grid = *pkt.mutable_grid();
   grid.Reserve(FIELD_WIDTH*(FIELD_HEIGHT+1));
-  int x, y;
-  for( y=0; y<=FIELD_HEIGHT; y++ ) {
-    for( x=0; x<FIELD_WIDTH; x++ ) {
-      netplay::PktPlayerField_Block* np_bk = grid.Add();
-      const Block& bk = block(x,y);
-      np_bk->set_swapped( bk.swapped );
-      np_bk->set_chaining( bk.chaining );
-      np_bk->set_ntick( bk.ntick );
-      if( bk.type == Block::COLOR ) {
-        netplay::PktPlayerField_BkColor* np_bk_color = np_bk->mutable_bk_color();
-        const BkColor& bk_color = bk.bk_color;
-        np_bk_color->set_state( static_cast<netplay::PktPlayerField_BkColor::State>(bk_color.state) );
-        np_bk_color->set_color( bk_color.color );
-      } else if( bk.type == Block::GARBAGE ) {
-        netplay::PktPlayerField_BkGarbage* np_bk_garbage = np_bk->mutable_bk_garbage();
-        const BkGarbage& bk_garbage = bk.bk_garbage;
-        np_bk_garbage->set_state( static_cast<netplay::PktPlayerField_BkGarbage::State>(bk_garbage.state) );
-      } else {
-        // NONE, do nothing
+  for(int y=0; y<=FIELD_HEIGHT; y++) {
+    for(int x=0; x<FIELD_WIDTH; x++) {
+      const Block& bk = grid_[x][y];
+      const ComboInfo& info = bk.combo_info;
+      const bool extra = bk.ntick != 0 || info.chain != 0 || info.pos != 0 || info.group_end != 0;
+      grid.Add(packBlock(bk) | (extra ? BK_EXTRA : 0));
+      if( extra ) {
+        grid.Add(bk.ntick);
+        grid.Add(info.chain);
+        grid.Add(info.pos);
+        grid.Add(info.group_end);
+      }
+      if( bk.isGarbage() ) {
+        auto it = std::find(garbages.begin(), garbages.end(), bk.bk_garbage.garbage);
+        assert( it != garbages.end() );
+        grid.Add(it - garbages.begin());
       }
     }
   }
 }
 
-bool Field::setGridContentFromPacket(const google::protobuf::RepeatedPtrField<netplay::PktPlayerField_Block>& grid)
+bool Field::setStateFromPacket(const netplay::FieldState& pkt)
 {
-  if( grid.size() != FIELD_WIDTH*(FIELD_HEIGHT+1) ) {
+  // values are used as grid and array indexes, check them
+  if( pkt.gb_drop_pos().size() != sizeof(gb_drop_pos_) ) {
     return false;
   }
-  google::protobuf::RepeatedPtrField<netplay::PktPlayerField_Block>::const_iterator it = grid.begin();
+  for(unsigned int w=1; w<sizeof(gb_drop_pos_); w++) {
+    if( static_cast<uint8_t>(pkt.gb_drop_pos()[w]) + w > FIELD_WIDTH ) {
+      return false;
+    }
+  }
+  const FieldPos cursor = unpackFieldPos(pkt.cursor());
+  if( cursor.x < 0 || cursor.x > FIELD_WIDTH-2 || cursor.y < 1 || cursor.y > FIELD_HEIGHT-1 ) {
+    return false;
+  }
+  const FieldPos swap = unpackFieldPos(pkt.swap());
+  if( pkt.swap_dt() != 0 && (swap.x < 0 || swap.x > FIELD_WIDTH-2 || swap.y < 1 || swap.y > FIELD_HEIGHT) ) {
+    return false;
+  }
+  if( pkt.raise_speed_index() >= conf_.raise_speeds.size() ) {
+    return false;
+  }
+  auto valid_garbage = [](const netplay::FieldState::Garbage& np_gb) {
+    const auto type = static_cast<Garbage::Type>(np_gb.type());
+    const FieldPos size = unpackFieldPos(np_gb.size());
+    return (type == Garbage::Type::COMBO || type == Garbage::Type::CHAIN) &&
+        size.x >= 1 && size.x <= FIELD_WIDTH && size.y >= 1;
+  };
+
+  tick_ = pkt.tick();
+  seed_ = pkt.seed();
+  chain_ = pkt.chain();
+  lost_ = pkt.lost();
+  lost_dt_ = pkt.lost_dt();
+  rank_ = pkt.rank();
+  enable_swap_ = pkt.enable_swap();
+  enable_raise_ = pkt.enable_raise();
+  cursor_ = cursor;
+  swap_ = swap;
+  swap_dt_ = pkt.swap_dt();
+  key_state_ = pkt.key_state();
+  key_repeat_ = pkt.key_repeat();
+  raise_progress_ = pkt.raise_progress();
+  raise_speed_index_ = pkt.raise_speed_index();
+  manual_raise_ = pkt.manual_raise();
+  stop_dt_ = pkt.stop_dt();
+  transformed_nb_ = pkt.transformed_nb();
+  raised_lines_ = pkt.raised_lines();
+  events_digest_ = pkt.events_digest();
+  ::memcpy(gb_drop_pos_, pkt.gb_drop_pos().data(), sizeof(gb_drop_pos_));
+  dropped_nb_ = pkt.dropped_nb();
+  step_info_ = StepInfo();
+
+  gbs_hang_.clear();
+  gbs_wait_.clear();
+  gbs_drop_.clear();
+  gbs_field_.clear();
+  std::vector<Garbage*> garbages;
+  for(auto& np_gb : pkt.garbages()) {
+    const FieldPos pos = unpackFieldPos(np_gb.pos());
+    if( !valid_garbage(np_gb) || pos.x < 0 || pos.x + unpackFieldPos(np_gb.size()).x > FIELD_WIDTH ||
+        pos.y < 1 || pos.y > FIELD_HEIGHT ) {
+      return false;
+    }
+    auto gb = std::make_unique<Garbage>();
+    gb->gbid = 0;
+    gb->from = NULL;
+    gb->to = this;
+    gb->type = static_cast<Garbage::Type>(np_gb.type());
+    gb->pos = unpackFieldPos(np_gb.pos());
+    gb->size = unpackFieldPos(np_gb.size());
+    garbages.push_back(gb.get());
+    gbs_field_.push_back(std::move(gb));
+  }
+  for(auto& np_gb : pkt.drops()) {
+    if( !valid_garbage(np_gb) ) {
+      return false;
+    }
+    auto gb = std::make_unique<Garbage>();
+    gb->gbid = 0;
+    gb->from = NULL;
+    gb->to = this;
+    gb->type = static_cast<Garbage::Type>(np_gb.type());
+    gb->pos = unpackFieldPos(np_gb.pos());
+    gb->size = unpackFieldPos(np_gb.size());
+    gbs_drop_.push_back(std::move(gb));
+  }
+
+  auto it = pkt.grid().begin();
+  auto end = pkt.grid().end();
   for(int y=0; y<=FIELD_HEIGHT; y++) {
     for(int x=0; x<FIELD_WIDTH; x++) {
+      if( it == end ) {
+        return false;
+      }
+      const uint32_t v = *it++;
       Block& bk = grid_[x][y];
-      const netplay::PktPlayerField_Block& np_bk = (*it++);
-      if( np_bk.has_bk_color() ) {
-        if( np_bk.has_bk_garbage() ) {
-          return false; // mutually exclusive fields
+      if( !unpackBlock(v, conf_.color_nb, bk) ) {
+        return false;
+      }
+      if( v & BK_EXTRA ) {
+        if( end - it < 4 ) {
+          return false;
         }
-        const netplay::PktPlayerField_BkColor& np_bk_color = np_bk.bk_color();
-        bk.type = Block::COLOR;
-        BkColor& bk_color = bk.bk_color;
-        bk_color.state = static_cast<BkColor::State>(np_bk_color.state());
-        bk_color.color = np_bk_color.color();
-      } else if ( np_bk.has_bk_garbage() ) {
-        assert( !"not supported yet" );
+        bk.ntick = *it++;
+        bk.combo_info.chain = *it++;
+        bk.combo_info.pos = *it++;
+        bk.combo_info.group_end = *it++;
       } else {
-        bk.type = Block::NONE;
+        bk.combo_info = ComboInfo{0, 0, 0};
+      }
+      if( bk.isGarbage() ) {
+        if( it == end || *it >= garbages.size() ) {
+          return false;
+        }
+        bk.bk_garbage.garbage = garbages[*it++];
       }
-      // invalid states may be set (eg. type=GARBAGE, swapped=true)
-      bk.swapped = np_bk.swapped();
-      bk.chaining = np_bk.chaining();
-      bk.ntick = np_bk.ntick();
     }
   }
-  return true;
+  return it == end;
 }
 
 
 void Field::raise()
 {
-  LOG("[%u|%u] raise", fldid_, tick_);
+  LOG_DEBUG("[%u|%u] raise", fldid_, tick_);
 
   for(int x=0; x<FIELD_WIDTH; x++) {
     for(int y=FIELD_HEIGHT; y>0; y--) {
@@ -1139,6 +1593,13 @@ void Match::addGarbage(std::unique_ptr<Garbage> gb, unsigned int pos)
   gbs_hang_[p->gbid] = p;
 }
 
+void Match::dropNextGarbage(Field& fld)
+{
+  assert( !fld.waitingGarbages().empty() );
+  gbs_wait_.erase(fld.waitingGarbages().front()->gbid);
+  fld.dropNextGarbage();
+}
+
 void Match::waitGarbageDrop(const Garbage& gb)
 {
   assert(gb.to != nullptr);
@@ -1153,113 +1614,91 @@ void Match::waitGarbageDrop(const Garbage& gb)
 
 
 GarbageDistributor::GarbageDistributor(Match& match, Observer& obs):
-    match_(match), observer_(obs), current_gbid_(0)
+    match_(match), observer_(obs), chain_bucket_min_(0), current_gbid_(0)
 {
 }
 
 void GarbageDistributor::reset()
 {
-  gbs_chain_.clear();
-  targets_chain_.clear();
-  targets_combo_.clear();
   drop_ticks_.clear();
+  states_.clear();
+  chain_buckets_.clear();
+  chain_buckets_.push_back({0, 0});
+  chain_bucket_min_ = 0;
+
+  const FieldContainer& fields = match_.fields();
+  states_.resize(fields.size());
+  FldId prev = 0;
+  for(auto& fld : fields) {
+    assert( fld->fldid() == prev+1 );  // IDs are consecutive
+    FieldState& st = this->state(*fld);
+    st.field = fld.get();
+    st.gb_chain = NULL;
+    st.chain_nb = 0;
+    st.target_combo = fld->fldid();
+    st.alive = true;
+    st.ring_prev = prev;
+    if(prev != 0) {
+      this->state(prev).ring_next = fld->fldid();
+    }
+    this->bucketAppend(st);
+    prev = fld->fldid();
+  }
+  // close the ring
+  if(prev != 0) {
+    states_.front().ring_prev = prev;
+    states_.back().ring_next = 1;
+  }
 }
 
 void GarbageDistributor::updateGarbages(Field& fld)
 {
+  FieldState& st = this->state(fld);
+
   // cancel chain garbage
   if(fld.chain() < 2) {
-    gbs_chain_.erase(&fld);
+    st.gb_chain = NULL;
   }
 
   // check whether a garbage should be dropped (at most one per step)
   if(fld.hangingGarbageCount() > 0) {
     const Garbage& gb = fld.hangingGarbage(0);
-    GbChainMap::iterator it = gbs_chain_.find(gb.from);
     // don't drop garbage of an active chain
-    if( it == gbs_chain_.end() && (*it).second != &gb ) {
+    if( gb.from == NULL || this->state(*gb.from).gb_chain != &gb ) {
       GbDropTickMap::iterator it2 = drop_ticks_.find(&gb);
       assert( it2 != drop_ticks_.end() );
       if( (*it2).second <= fld.tick() ) {
         drop_ticks_.erase(it2);
+        if( gb.type == Garbage::Type::CHAIN ) {
+          this->updateChainCount(st, -1);
+        }
         observer_.onGarbageDrop(gb);
       }
     }
   }
 
+  if( fld.lost() ) {
+    if( st.alive ) {
+      this->removeField(st);
+    }
+    return;
+  }
+
   const Field::StepInfo info = fld.stepInfo();
   if( info.combo == 0 ) {
     return; // no match, no new garbages
   }
-  const FieldContainer& fields = match_.fields();
-
-  // check if there is an opponent
-  // if there is only one, keep it (faster target choice for 2-player game)
-  bool opponent_found = false;
-  Field* single_opponent = NULL;
-  for(auto& it_fld : fields) {
-    if(it_fld.get() == &fld || it_fld->lost()) {
-      continue;
-    }
-    opponent_found = true;
-    if( single_opponent == NULL ) {
-      single_opponent = it_fld.get();
-    } else {
-      single_opponent = NULL;
-      break;
-    }
-  }
-  if( !opponent_found ) {
-    return; // no opponent, no target
-  }
-
-  // note: opponent count will never increase, we don't have to update targets
-  // maps it if there is only one opponent
 
   if( info.chain == 2 ) {
-    Field* target_fld = single_opponent;
+    Field* target_fld = this->nextChainTarget(fld);
     if( target_fld == NULL ) {
-      // get player with the least chain garbages
-      GbTargetMap::iterator targets_it = targets_chain_.find(&fld);
-      assert( targets_it != targets_chain_.end() );
-      FieldContainer::const_iterator it = (*targets_it).second;
-      unsigned int min = -1; // overflow: max value
-      FieldContainer::const_iterator it_min = fields.end();
-      do {
-        if( it == fields.end() ) {
-          it = fields.begin();
-        }
-        Field* fld2 = it->get();
-        if(fld2 == &fld || fld2->lost()) {
-          continue;
-        }
-        size_t nb_chain = 0;
-        const size_t nb_gb = fld2->hangingGarbageCount();
-        for( nb_chain=0; nb_chain<nb_gb; nb_chain++ ) {
-          // chain garbages are put at the beginning
-          if( fld2->hangingGarbage(nb_chain).type != Garbage::Type::CHAIN ) {
-            break;
-          }
-        }
-        if( nb_chain < min ) {
-          min = nb_chain;
-          target_fld = fld2;
-          it_min = it;
-          if( min == 0 ) {
-            break; // 0 is the least we can found
-          }
-        }
-      } while( it != (*targets_it).second );
-      assert( target_fld != NULL );
-      (*targets_it).second = it_min;
+      return; // no opponent, no target
     }
     this->newGarbage(&fld, target_fld, Garbage::Type::CHAIN, 1);
 
-  } else if( info.chain > 2 ) {
+  } else if( info.chain > 2 && st.gb_chain != NULL ) {
     // increase chain garbage
-    GbChainMap::iterator it = gbs_chain_.find(&fld);
-    assert( it != gbs_chain_.end() );
-    Garbage& gb = *(*it).second;
+    Garbage& gb = *st.gb_chain;
     assert(gb.type == Garbage::Type::CHAIN);
     gb.size.y++;
     drop_ticks_[&gb] = fld.tick() + fld.conf().gb_hang_tk;
@@ -1269,24 +1708,9 @@ void GarbageDistributor::updateGarbages(Field& fld)
   // combo garbage
   // with a width of 6, values match the original PdP rules
   if( info.combo > 3 ) {
-    Field* target_fld = single_opponent;
+    Field* target_fld = this->nextComboTarget(fld);
     if( target_fld == NULL ) {
-      // get the next target player
-      GbTargetMap::iterator targets_it = targets_combo_.find(&fld);
-      assert( targets_it != targets_combo_.end() );
-      FieldContainer::const_iterator it;
-      for( it=++(*targets_it).second; ; ++it ) {
-        if( it == fields.end() ) {
-          it = fields.begin();
-        }
-        target_fld = it->get();
-        if(target_fld == &fld || target_fld->lost()) {
-          continue;
-        }
-        (*targets_it).second = it;
-        break;
-      }
-      assert( target_fld != NULL );
+      return; // no opponent, no target
     }
 
     if( info.combo-1 <= FIELD_WIDTH ) {
@@ -1317,6 +1741,116 @@ void GarbageDistributor::updateGarbages(Field& fld)
 }
 
 
+void GarbageDistributor::removeField(FieldState& st)
+{
+  assert( st.alive );
+  st.alive = false;
+  this->bucketUnlink(st);
+  // keep ring links of the removed field: they are used to continue
+  // iterating from it and always lead back to a playing field
+  this->state(st.ring_prev).ring_next = st.ring_next;
+  this->state(st.ring_next).ring_prev = st.ring_prev;
+}
+
+void GarbageDistributor::bucketUnlink(FieldState& st)
+{
+  ChainBucket& bucket = chain_buckets_[st.chain_nb];
+  if( st.bucket_prev == 0 ) {
+    bucket.head = st.bucket_next;
+  } else {
+    this->state(st.bucket_prev).bucket_next = st.bucket_next;
+  }
+  if( st.bucket_next == 0 ) {
+    bucket.tail = st.bucket_prev;
+  } else {
+    this->state(st.bucket_next).bucket_prev = st.bucket_prev;
+  }
+  st.bucket_prev = st.bucket_next = 0;
+}
+
+void GarbageDistributor::bucketAppend(FieldState& st)
+{
+  if( st.chain_nb >= chain_buckets_.size() ) {
+    chain_buckets_.resize(st.chain_nb+1, {0, 0});
+  }
+  ChainBucket& bucket = chain_buckets_[st.chain_nb];
+  const FldId fldid = st.field->fldid();
+  st.bucket_prev = bucket.tail;
+  st.bucket_next = 0;
+  if( bucket.tail == 0 ) {
+    bucket.head = fldid;
+  } else {
+    this->state(bucket.tail).bucket_next = fldid;
+  }
+  bucket.tail = fldid;
+  if( st.chain_nb < chain_bucket_min_ ) {
+    chain_bucket_min_ = st.chain_nb;
+  }
+}
+
+void GarbageDistributor::updateChainCount(FieldState& st, int delta)
+{
+  if( !st.alive ) {
+    st.chain_nb += delta;
+    return;
+  }
+  this->bucketUnlink(st);
+  st.chain_nb += delta;
+  this->bucketAppend(st);
+}
+
+
+Field* GarbageDistributor::nextChainTarget(const Field& fld)
+{
+  const FldId self = fld.fldid();
+  for(unsigned int i=chain_bucket_min_; i<chain_buckets_.size(); i++) {
+    FldId fldid = chain_buckets_[i].head;
+    while( fldid != 0 ) {
+      FieldState& st = this->state(fldid);
+      fldid = st.bucket_next;
+      if( st.field->lost() ) {
+        this->removeField(st);
+        continue;
+      }
+      if( st.field->fldid() != self ) {
+        return st.field;
+      }
+    }
+    // bucket is empty, or contains only the field itself
+    if( chain_buckets_[i].head == 0 && i == chain_bucket_min_ ) {
+      chain_bucket_min_ = i+1;
+    }
+  }
+  return NULL;
+}
+
+Field* GarbageDistributor::nextComboTarget(const Field& fld)
+{
+  FieldState& st = this->state(fld);
+  FldId fldid = st.target_combo;
+  for(;;) {
+    fldid = this->state(fldid).ring_next;
+    FieldState& st2 = this->state(fldid);
+    if( !st2.alive ) {
+      continue;  // removed field, links lead back to the ring
+    }
+    if( st2.field->lost() ) {
+      this->removeField(st2);
+      continue;
+    }
+    if( fldid == fld.fldid() ) {
+      // back to the field itself
+      if( st.alive && st2.ring_next == fldid ) {
+        return NULL;  // no opponent
+      }
+      continue;
+    }
+    st.target_combo = fldid;
+    return st2.field;
+  }
+}
+
+
 void GarbageDistributor::newGarbage(Field* from, Field* to, Garbage::Type type, int size)
 {
   assert( to != NULL );
@@ -1348,7 +1882,8 @@ void GarbageDistributor::newGarbage(Field* from, Field* to, Garbage::Type type,
 
   match_.addGarbage(std::move(gb_unique), pos);
   if( type == Garbage::Type::CHAIN ) {
-    gbs_chain_[from] = &gb;
+    this->state(*from).gb_chain = &gb;
+    this->updateChainCount(this->state(*to), +1);
   }
 
   observer_.onGarbageAdd(gb, pos);
@@ -1357,8 +1892,8 @@ void GarbageDistributor::newGarbage(Field* from, Field* to, Garbage::Type type,
 
 GbId GarbageDistributor::nextGarbageId()
 {
-  const Match::GarbageMap gbs_wait = match_.waitingGarbages();
-  const Match::GarbageMap gbs_hang = match_.hangingGarbages();
+  const Match::GarbageMap& gbs_wait = match_.waitingGarbages();
+  const Match::GarbageMap& gbs_hang = match_.hangingGarbages();
   for(;;) {
     current_gbid_++;
     if( current_gbid_ <= 0 ) { // overflow
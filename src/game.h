@@ -61,6 +61,13 @@ struct FieldConf
 
   /// Check field validity.
   bool isValid() const;
+  /** @brief Compute a hash of the configuration content
+   *
+   * The hash identifies an interned configuration (see FieldConfTable).
+   */
+  uint64_t hash() const;
+  bool operator==(const FieldConf& o) const;
+  bool operator!=(const FieldConf& o) const { return !(*this == o); }
   /** @brief Set configuration from a packet
    * @note Configuration validity is checked.
    */
@@ -215,6 +222,7 @@ class Field
   struct StepInfo {
     unsigned int combo = 0;  ///< Combo count (0 if no match)
     unsigned int chain = 1;  ///< Chain count (default: 1)
+    bool chain_end = false;  ///< Active chain ended
     bool raised = false;  ///< Field lifted up
     bool swap = false;  ///< Start a swap
     bool move = false;  ///< Cursor moved
@@ -223,6 +231,7 @@ class Field
       unsigned int laid = 0;  ///< Blocks that fall to the ground
       /// Chain and combo position of popped blocks and mutated garbages
       std::vector<ComboInfo> popped;
+      unsigned int mutated = 0;  ///< Mutated garbage blocks (also in popped)
     } blocks;
   };
   typedef std::deque<std::unique_ptr<Garbage>> GarbageList;
@@ -242,6 +251,9 @@ class Field
   unsigned int swapDelay() const { return swap_dt_; }
   unsigned int rank() const { return rank_; }
   uint32_t raiseProgress() const { return raise_progress_; }
+  unsigned int raiseSpeedIndex() const { return raise_speed_index_; }
+  /// Return remaining stop ticks (raise is stopped while non-zero).
+  unsigned int stopDelay() const { return stop_dt_; }
 
   void enableSwap(bool v) { enable_swap_ = v; }
   void enableRaise(bool v) { enable_raise_ = v; }
@@ -259,6 +271,10 @@ class Field
   const Garbage& hangingGarbage(size_t pos) const { return *gbs_hang_[pos]; }
   size_t hangingGarbageCount() const { return gbs_hang_.size(); }
   const GarbageList& waitingGarbages() const { return gbs_wait_; }
+  /// Return dropped garbages, waiting to fall.
+  const GarbageList& droppedGarbages() const { return gbs_drop_; }
+  /// Return the number of garbages dropped since match start.
+  unsigned int droppedGarbageCount() const { return dropped_nb_; }
 
   /** @brief Init for match.
    *
@@ -273,6 +289,30 @@ class Field
    */
   void step(KeyState keys);
 
+  /** @brief Advance of one frame without simulation.
+   *
+   * Step results are provided (usually reported by the field's owner) instead
+   * of being computed. Blocks are not updated, dropped garbages are
+   * discarded.
+   *
+   * Only step information, chain, lost state and event digest are updated,
+   * which is enough to distribute garbages.
+   */
+  void stepBlind(unsigned int combo, unsigned int chain, bool chain_end, bool lost);
+
+  /** @brief Return a hash of the field state.
+   *
+   * The hash covers grid content, cursor, chain, tick, random seed and the
+   * event digest. Hanging and waiting garbages are not covered, since their
+   * timing depends on network delays.
+   */
+  uint32_t stateHash() const;
+  /** @brief Return a digest of the step events.
+   *
+   * The digest is updated on combos, chain ends and when the field is lost.
+   */
+  uint32_t eventsDigest() const { return events_digest_; }
+
   /// Move a hanging garbage to wait list.
   void waitGarbageDrop(const Garbage& gb);
   /** @brief Drop the next waiting garbage.
@@ -280,6 +320,12 @@ class Field
    * Garbage will fall on the field as soon as possible.
    */
   void dropNextGarbage();
+  /** @brief Drop a new garbage immediately.
+   *
+   * Hanging and waiting steps are skipped, the garbage is dropped from no
+   * field. Used to replay logged drops.
+   */
+  void dropGarbage(Garbage::Type type, const FieldPos& size);
 
   /** @brief Insert a hanging garbage at a given position.
    *
@@ -310,12 +356,39 @@ class Field
     rank_ = rank;
   }
 
-  /// Fill a packet message with grid content.
-  void setGridContentToPacket(google::protobuf::RepeatedPtrField<netplay::PktPlayerField_Block>& grid);
-  /** @brief Set grid content from a packet.
+  /** @brief Fill a string with grid content.
+   *
+   * One or two bytes per block, plus a delta-encoded \e ntick if set.
+   * See PktPlayerField.grid for the format.
+   */
+  void setGridContentToBytes(std::string& data) const;
+  /** @brief Set grid content from bytes.
+   * @return \e false on invalid data.
+   * @note Garbage blocks are not supported.
+   */
+  bool setGridContentFromBytes(const std::string& data);
+
+  /** @brief Fill a string with grid colors.
+   *
+   * A byte per block, line by line from the raising line: 0 for no block,
+   * color+1 for color blocks. Block states are not stored, this is intended
+   * for initial grids.
+   */
+  void setGridColorsToBytes(std::string& data) const;
+  /** @brief Set grid content from colors, with blocks at rest.
+   * @return \e false on invalid data.
+   */
+  bool setGridColorsFromBytes(const std::string& data);
+
+  /** @brief Fill a packet message with the full field state.
+   *
+   * Hanging and waiting garbages are not saved.
+   */
+  void setStateToPacket(netplay::FieldState& pkt) const;
+  /** @brief Restore the full field state from a packet.
    * @return \e false on invalid packet data.
    */
-  bool setGridContentFromPacket(const google::protobuf::RepeatedPtrField<netplay::PktPlayerField_Block>& grid);
+  bool setStateFromPacket(const netplay::FieldState& pkt);
 
  private:
 
@@ -366,6 +439,9 @@ class Field
   void transformGarbage(int x, int y);
 
 
+  /// Update the events digest with an event of the current tick.
+  void addEventToDigest(unsigned int combo, unsigned int chain);
+
   /** @brief Reentrant random number generator.
    *
    * Don't rely on the libc's \e rand_r() to ensure a unique implementation among
@@ -423,9 +499,13 @@ class Field
   unsigned int transformed_nb_;
   /// Number of lines which have been raised.
   unsigned int raised_lines_;
+  /// Digest of step events, see eventsDigest().
+  uint32_t events_digest_;
 
   /// Drop positions for combo garbages.
   uint8_t gb_drop_pos_[FIELD_WIDTH+1];
+  /// Number of dropped garbages, see droppedGarbageCount().
+  unsigned int dropped_nb_;
 
   /// Garbages before they are dropped (first to be dropped at front).
   GarbageList gbs_hang_;
@@ -495,6 +575,8 @@ class Match
   void addGarbage(std::unique_ptr<Garbage> gb, unsigned int pos);
   /// Move a hanging garbage to wait list.
   void waitGarbageDrop(const Garbage& gb);
+  /// Drop the next waiting garbage of a field.
+  void dropNextGarbage(Field& fld);
 
  protected:
   FieldContainer fields_;
@@ -515,6 +597,11 @@ class Match
  * This class decides how new garbages are distributed among players on
  * chain/combo. It is responsible for using unique garbage IDs.
  *
+ * Targets are chosen using indexed structures so that the cost of a chain or
+ * combo does not depend on the number of fields: playing fields are linked in
+ * a ring (for combos) and in buckets sorted by chain garbage count (for
+ * chains). Lost fields are removed lazily, when encountered.
+ *
  * It is intended to be used by a server.
  */
 class GarbageDistributor
@@ -536,7 +623,10 @@ class GarbageDistributor
   GarbageDistributor(Match& match, Observer& obs);
   ~GarbageDistributor() {}
 
-  /// Clear state for a new match.
+  /** @brief Clear state for a new match.
+   *
+   * Must be called after match fields have been added.
+   */
   void reset();
 
   /** @brief Update and distribute garbages after a field step.
@@ -547,6 +637,53 @@ class GarbageDistributor
   void updateGarbages(Field& fld);
 
  private:
+  /** @brief Distribution state of a field.
+   *
+   * States are indexed by FldId-1. Field ID 0 is never used, thus it is used
+   * as "none" value for links.
+   */
+  struct FieldState {
+    Field* field;
+    /// Garbage of the active chain, or \e NULL
+    Garbage* gb_chain;
+    /// Number of hanging chain garbages sent to this field
+    unsigned int chain_nb;
+    /// Last field targeted by a combo, field itself if none
+    FldId target_combo;
+    /// Previous and next fields in the ring of playing fields
+    FldId ring_prev, ring_next;
+    /// Previous and next fields in the chain bucket
+    FldId bucket_prev, bucket_next;
+    /// True if the field is in the ring and in a bucket
+    bool alive;
+  };
+
+  /// Double-ended list of fields with the same chain garbage count.
+  struct ChainBucket {
+    FldId head, tail;
+  };
+
+  FieldState& state(const Field& fld) { return states_[fld.fldid()-1]; }
+  FieldState& state(FldId fldid) { return states_[fldid-1]; }
+
+  /// Remove a lost field from the ring and the chain buckets.
+  void removeField(FieldState& st);
+  /// Unlink a field from its chain bucket.
+  void bucketUnlink(FieldState& st);
+  /// Append a field to the chain bucket matching its chain garbage count.
+  void bucketAppend(FieldState& st);
+  /// Change chain garbage count of a field, move it to its new bucket.
+  void updateChainCount(FieldState& st, int delta);
+
+  /** @brief Return the target of a new chain garbage, or \e NULL.
+   *
+   * The playing opponent with the least hanging chain garbages is chosen.
+   * Among equal fields, the least recently targeted one is chosen.
+   */
+  Field* nextChainTarget(const Field& fld);
+  /// Return the target of a new combo garbage, or \e NULL.
+  Field* nextComboTarget(const Field& fld);
+
   /** @brief Create, add and return a new (hanging) garbage.
    *
    * The garbage is added to the match.
@@ -560,14 +697,12 @@ class GarbageDistributor
   Match& match_;
   Observer& observer_;
 
-  /// Store garbages of active chains.
-  typedef std::map<Field*, Garbage*> GbChainMap;
-  GbChainMap gbs_chain_;
-
-  /// Store last garbage field for each field.
-  typedef std::map<Field*, FieldContainer::const_iterator> GbTargetMap;
-  GbTargetMap targets_chain_;
-  GbTargetMap targets_combo_;
+  /// Field states, indexed by FldId-1.
+  std::vector<FieldState> states_;
+  /// Chain buckets, indexed by chain garbage count.
+  std::vector<ChainBucket> chain_buckets_;
+  /// Lowest chain bucket which may not be empty.
+  unsigned int chain_bucket_min_;
 
   /// Store drop tick of hanging garbages.
   typedef std::map<const Garbage*, Tick> GbDropTickMap;
@@ -221,6 +221,7 @@ void GuiInterface::startClient(const std::string& host, int port)
   auto ptr = std::make_unique<ClientInstance>(*this, io_service_);
   client_instance_ = ptr.get();
   instance_ = std::move(ptr);
+  client_instance_->setReplayDir(cfg_->get("Client.ReplayDir", ""));
   client_instance_->connect(host.c_str(), port, 3000);
 }
 
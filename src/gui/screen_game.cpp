@@ -1,6 +1,7 @@
 #include "screen_game.h"
 #include "screen_menus.h"
 #include "interface.h"
+#include "../client.h"
 #include "../log.h"
 
 namespace gui {
@@ -100,13 +101,19 @@ void StyleField::load(const StyleLoader& loader, const StyleGlobal& global)
 
 ScreenGame::ScreenGame(GuiInterface& intf):
     Screen(intf, "ScreenGame"),
-    input_scheduler_(*intf.instance(), *this, intf.io_service())
+    input_scheduler_(*intf.instance(), *this, intf.io_service()),
+    rtt_label_(nullptr), rtt_ms_(0), resuming_(false)
 {
 }
 
 void ScreenGame::enter()
 {
   style_field_.load(StyleLoaderPrefix(*this, "Field"), intf_.style());
+  if(intf_.client()) {
+    rtt_label_ = &container_.addWidget<WLabel>(*this, "RttLabel");
+    rtt_ms_ = 0;
+    rtt_label_->setText(intf_.res_mgr().getLang({name_, "Rtt"}) + " - ms");
+  }
 }
 
 void ScreenGame::exit()
@@ -117,6 +124,9 @@ void ScreenGame::exit()
 
 void ScreenGame::redraw()
 {
+  if(rtt_label_) {
+    this->updateRttLabel();
+  }
   Screen::redraw();
   sf::RenderWindow& w = intf_.window();
   for(const auto& pair : field_displays_) {
@@ -155,8 +165,25 @@ bool ScreenGame::onInputEvent(const sf::Event& ev)
   return false;
 }
 
+void ScreenGame::onServerConnect(bool success)
+{
+  if(!success) {
+    auto new_screen = std::make_unique<ScreenStart>(intf_);
+    new_screen->addNotification({Notification::Severity::ERROR, "failed to reconnect to server"});
+    intf_.swapScreen(std::move(new_screen));
+  } else if(resuming_) {
+    this->addNotification({Notification::Severity::NOTICE, "reconnected, resuming the match"});
+  }
+}
+
 void ScreenGame::onServerDisconnect()
 {
+  input_scheduler_.stop();
+  if(intf_.client() && intf_.client()->reconnect(3000)) {
+    resuming_ = true;
+    this->addNotification({Notification::Severity::ERROR, "connection lost, reconnecting..."});
+    return;
+  }
   auto new_screen = std::make_unique<ScreenStart>(intf_);
   new_screen->addNotification({Notification::Severity::ERROR, "disconnected from server"});
   intf_.swapScreen(std::move(new_screen));
@@ -191,39 +218,7 @@ void ScreenGame::onStateChange()
     input_scheduler_.stop();
 
   } else if(state == GameInstance::State::GAME_READY) {
-    const auto& fields = intf_.instance()->match().fields();
-    // compute values for field display position and size
-    const auto screen_size = intf_.window().getView().getSize();
-    const float min_width = fields.size() * GuiInterface::REF_FIELD_SIZE.x;
-    float scale = 1;
-    if(screen_size.x < min_width) {
-      // zoom-out for all fields to fit
-      scale = screen_size.x / min_width;
-    } else {
-      scale = 1;
-    }
-    // evenly separate the extra space as margins (avoid large gap between
-    // fields and smaller margins on screen sides)
-    const float space_x = (screen_size.x / scale - GuiInterface::REF_FIELD_SIZE.x * fields.size()) / (fields.size() + 1);
-
-    // once dx has been computed, apply block_size scaling
-    scale *= GuiInterface::REF_BLOCK_SIZE / static_cast<float>(style_field_.bk_size);
-    // restrict to 0.25 zoom steps to avoid ugly scaling
-    scale = std::ceil(4 * scale) / 4.;
-
-    // create a field display for each playing player
-    float x = -0.5 * (GuiInterface::REF_FIELD_SIZE.x + space_x) * (fields.size() - 1);
-    for(const auto& field : fields) {
-      if(intf_.style().colors.size() - 1 < field->conf().color_nb) {
-        throw std::runtime_error("not enough configured colors to display fields");
-      }
-      FldId fldid = field->fldid(); // intermediate variable because a ref is required
-      auto fdp = std::make_unique<FieldDisplay>(intf_, *field, style_field_);
-      fdp->scale(scale, scale);
-      fdp->move(x, 0);
-      field_displays_.emplace(fldid, std::move(fdp));
-      x += GuiInterface::REF_FIELD_SIZE.x + space_x;
-    }
+    this->createFieldDisplays();
 
     for(auto& pair : intf_.instance()->players()) {
       Player& pl = *pair.second;
@@ -233,11 +228,54 @@ void ScreenGame::onStateChange()
     }
 
   } else if(state == GameInstance::State::GAME) {
+    if(resuming_) {
+      // fields have been replaced by the resumed match state
+      resuming_ = false;
+      this->createFieldDisplays();
+    }
     LOG("match start");
     input_scheduler_.start();
   }
 }
 
+void ScreenGame::createFieldDisplays()
+{
+  field_displays_.clear();
+  const auto& fields = intf_.instance()->match().fields();
+  // compute values for field display position and size
+  const auto screen_size = intf_.window().getView().getSize();
+  const float min_width = fields.size() * GuiInterface::REF_FIELD_SIZE.x;
+  float scale = 1;
+  if(screen_size.x < min_width) {
+    // zoom-out for all fields to fit
+    scale = screen_size.x / min_width;
+  } else {
+    scale = 1;
+  }
+  // evenly separate the extra space as margins (avoid large gap between
+  // fields and smaller margins on screen sides)
+  const float space_x = (screen_size.x / scale - GuiInterface::REF_FIELD_SIZE.x * fields.size()) / (fields.size() + 1);
+
+  // once dx has been computed, apply block_size scaling
+  scale *= GuiInterface::REF_BLOCK_SIZE / static_cast<float>(style_field_.bk_size);
+  // restrict to 0.25 zoom steps to avoid ugly scaling
+  scale = std::ceil(4 * scale) / 4.;
+
+  // create a field display for each playing player
+  float x = -0.5 * (GuiInterface::REF_FIELD_SIZE.x + space_x) * (fields.size() - 1);
+  for(const auto& field : fields) {
+    if(intf_.style().colors.size() - 1 < field->conf().color_nb) {
+      throw std::runtime_error("not enough configured colors to display fields");
+    }
+    FldId fldid = field->fldid(); // intermediate variable because a ref is required
+    auto fdp = std::make_unique<FieldDisplay>(intf_, *field, style_field_);
+    fdp->scale(scale, scale);
+    fdp->move(x, 0);
+    field_displays_.emplace(fldid, std::move(fdp));
+    x += GuiInterface::REF_FIELD_SIZE.x + space_x;
+  }
+}
+
 
 KeyState ScreenGame::getNextInput(const Player& pl)
 {
@@ -262,6 +300,17 @@ void ScreenGame::setPlayerMapping(const Player& pl, const InputMapping& mapping)
 }
 
 
+void ScreenGame::updateRttLabel()
+{
+  const unsigned int rtt_ms = intf_.client()->rtt() / 1000;
+  if(rtt_ms == rtt_ms_) {
+    return;
+  }
+  rtt_ms_ = rtt_ms;
+  rtt_label_->setText(intf_.res_mgr().getLang({name_, "Rtt"}) + " " + std::to_string(rtt_ms) + " ms");
+}
+
+
 const unsigned int FieldDisplay::CROUCH_DURATION = 8;
 const float FieldDisplay::BOUNCE_SYMBOL_SIZE =  80/128.;
 const float FieldDisplay::BOUNCE_WIDTH_MIN   =  72/128.;
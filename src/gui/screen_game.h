@@ -80,6 +80,11 @@ struct StyleField
 };
 
 
+/** @brief Game screen
+ *
+ * Style entries:
+ *  - RttLabel: round-trip time to the server (remote games only)
+ */
 class ScreenGame: public Screen, public GameInputScheduler::InputProvider
 {
  public:
@@ -88,6 +93,7 @@ class ScreenGame: public Screen, public GameInputScheduler::InputProvider
   virtual void exit();
   virtual void redraw();
   virtual bool onInputEvent(const sf::Event& ev);
+  virtual void onServerConnect(bool success);
   virtual void onServerDisconnect();
   virtual void onPlayerStep(Player& pl);
   virtual void onPlayerRanked(Player& pl);
@@ -99,12 +105,22 @@ class ScreenGame: public Screen, public GameInputScheduler::InputProvider
   void setPlayerMapping(const Player& pl, const InputMapping& mapping);
 
  private:
+  /// Update the RTT label text, if needed
+  void updateRttLabel();
+  /// Create displays of match fields.
+  void createFieldDisplays();
+
   GameInputScheduler input_scheduler_;
   StyleField style_field_;
   typedef std::map<FldId, std::unique_ptr<FieldDisplay>> FieldDisplayContainer;
   FieldDisplayContainer field_displays_;
   typedef std::map<PlId, InputMapping> InputMappingContainer;
   InputMappingContainer input_mappings_;
+  WLabel* rtt_label_;
+  /// Displayed round-trip time, in milliseconds
+  unsigned int rtt_ms_;
+  /// Set while reconnecting to resume the match
+  bool resuming_;
 };
 
 
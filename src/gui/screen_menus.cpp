@@ -631,7 +631,7 @@ void ScreenLobby::WPlayerFrame::updateConfItems()
     WChoice::ItemContainer items;
     items.reserve(confs.size());
     for(auto& conf : confs) {
-      items.push_back(conf.name);
+      items.push_back(conf->name);
     }
     choice_conf_->setItems(items);
     // reselect previous value
@@ -690,7 +690,7 @@ void ScreenLobby::WPlayerFrame::onConfChange()
   if(player_.local()) {
     if(player_.fieldConf().name != choice_conf_->value()) {
       auto instance = screen_.intf().instance();
-      auto* fc = instance->conf().fieldConf(choice_conf_->value());
+      auto fc = instance->conf().fieldConf(choice_conf_->value());
       if(fc) {  // should always be true
         instance->playerSetFieldConf(player_, *fc);
       }
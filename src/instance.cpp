@@ -1,6 +1,8 @@
 #include <functional>
+#include <algorithm>
 #include "instance.h"
 #include "netplay.h"
+#include "replay.h"
 #include "log.h"
 
 
@@ -13,17 +15,52 @@ void ServerConf::toDefault()
 #undef SERVER_CONF_EXPR_INIT
 }
 
-const FieldConf* ServerConf::fieldConf(const std::string& name) const
+FieldConfTable::Ptr ServerConf::fieldConf(const std::string& name) const
 {
   for(auto& conf : field_confs) {
-    if(conf.name == name) {
-      return &conf;
+    if(conf->name == name) {
+      return conf;
     }
   }
   return nullptr;
 }
 
 
+FieldConfTable::Ptr FieldConfTable::intern(const FieldConf& conf)
+{
+  const uint64_t h = conf.hash();
+  auto it = entries_.find(h);
+  if(it != entries_.end()) {
+    if(*it->second == conf) {
+      return it->second;
+    }
+    // hash collision, keep the conf out of the table
+    return std::make_shared<const FieldConf>(conf);
+  }
+  this->purge();
+  auto ptr = std::make_shared<const FieldConf>(conf);
+  entries_.emplace(h, ptr);
+  return ptr;
+}
+
+FieldConfTable::Ptr FieldConfTable::find(uint64_t hash) const
+{
+  auto it = entries_.find(hash);
+  return it == entries_.end() ? nullptr : it->second;
+}
+
+void FieldConfTable::purge()
+{
+  for(auto it = entries_.begin(); it != entries_.end(); ) {
+    if(it->second.use_count() == 1) {
+      it = entries_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+
 
 Player::Player(PlId plid, bool local):
     plid_(plid), local_(local), state_(State::NONE), field_(NULL)
@@ -46,6 +83,49 @@ GameInstance::~GameInstance()
 }
 
 
+void GameInstance::fieldConfToPacket(const FieldConf& conf, netplay::PktPlayerConf& pkt, bool hash) const
+{
+  if(hash) {
+    pkt.set_field_conf_hash(conf.hash());
+  } else {
+    conf.toPacket(*pkt.mutable_field_conf());
+  }
+}
+
+bool GameInstance::isServerFieldConf(const FieldConf& conf) const
+{
+  auto fc = conf.name.empty() ? nullptr : conf_.fieldConf(conf.name);
+  return fc && (fc.get() == &conf || *fc == conf);
+}
+
+FieldConfTable::Ptr GameInstance::fieldConfFromPacket(const netplay::PktPlayerConf& pkt)
+{
+  if(pkt.field_conf_hash() != 0) {
+    auto conf = field_conf_table_.find(pkt.field_conf_hash());
+    if(!conf) {
+      throw netplay::CallbackError("unknown field configuration hash");
+    }
+    return conf;
+  }
+  const std::string& name = pkt.field_conf().name();
+  if(!name.empty()) {
+    return conf_.fieldConf(name);
+  }
+  FieldConf conf;
+  conf.fromPacket(pkt.field_conf());
+  return field_conf_table_.intern(conf);
+}
+
+void GameInstance::setServerFieldConfs(const std::vector<FieldConf>& confs)
+{
+  conf_.field_confs.clear();
+  conf_.field_confs.reserve(confs.size());
+  for(auto& conf : confs) {
+    conf_.field_confs.push_back(field_conf_table_.intern(conf));
+  }
+}
+
+
 Player* GameInstance::player(PlId plid)
 {
   PlayerContainer::iterator it = players_.find(plid);
@@ -53,16 +133,38 @@ Player* GameInstance::player(PlId plid)
 }
 
 Player* GameInstance::player(const Field* fld)
+{
+  return const_cast<Player*>(static_cast<const GameInstance*>(this)->player(fld));
+}
+
+const Player* GameInstance::player(const Field* fld) const
 {
   if( fld == NULL ) {
     return NULL;
   }
-  for(auto& kv : players_) {
-    if(fld == kv.second->field() ) {
-      return kv.second.get();
+  const FldId fldid = fld->fldid();
+  if( fldid == 0 || fldid > fields_players_.size() ) {
+    return NULL;
+  }
+  const Player* pl = fields_players_[fldid-1];
+  // field may be a stale one, from a previous match
+  return pl != NULL && pl->field() == fld ? pl : NULL;
+}
+
+void GameInstance::setPlayerField(Player& pl, Field* fld)
+{
+  const FldId prev_fldid = pl.fldid();
+  if( prev_fldid != 0 && prev_fldid <= fields_players_.size() && fields_players_[prev_fldid-1] == &pl ) {
+    fields_players_[prev_fldid-1] = NULL;
+  }
+  pl.setField(fld);
+  if( fld != NULL ) {
+    const FldId fldid = fld->fldid();
+    if( fldid > fields_players_.size() ) {
+      fields_players_.resize(fldid, NULL);
     }
+    fields_players_[fldid-1] = &pl;
   }
-  return NULL;
 }
 
 
@@ -79,7 +181,10 @@ void GameInstance::doStepPlayer(Player& pl, KeyState keys)
     fld->enableRaise(true);
   }
 
-  fld->step(keys);
+  this->stepField(pl, keys);
+  if(replay_recorder_) {
+    replay_recorder_->recordInput(*fld, prev_tick, keys);
+  }
   if( prev_tick == match_.tick() ) {
     // don't update tick_ when it will obviously not be modified
     //XXX:check condition
@@ -88,6 +193,100 @@ void GameInstance::doStepPlayer(Player& pl, KeyState keys)
   observer().onPlayerStep(pl);
 }
 
+void GameInstance::stepField(Player& pl, KeyState keys)
+{
+  pl.field()->step(keys);
+}
+
+
+void GameInstance::InputHistory::add(Tick tk, const TickInput& input, size_t size)
+{
+  if( tk != tick + inputs.size() ) {
+    inputs.clear();  // not contiguous (e.g. resumed player)
+    tick = tk;
+  }
+  inputs.push_back(input);
+  while( inputs.size() > size ) {
+    inputs.pop_front();
+    tick++;
+  }
+}
+
+void GameInstance::InputHistory::toDatagram(netplay::Datagram& dgram, PlId plid, Tick from) const
+{
+  netplay::PktInput* np_input = nullptr;
+  for( size_t i = from > tick ? from - tick : 0; i < inputs.size(); i++ ) {
+    const TickInput& input = inputs[i];
+    if( np_input == nullptr || np_input->gb_drops() != input.drops ) {
+      np_input = dgram.add_inputs();
+      np_input->set_plid(plid);
+      np_input->set_tick(tick + i);
+      np_input->set_gb_drops(input.drops);
+    }
+    np_input->add_keys(input.keys);
+  }
+}
+
+void GameInstance::bufferDatagramInput(InputBuffer& buffer, const netplay::PktInput& pkt, Tick first, Tick end)
+{
+  const int keys_nb = pkt.keys_size();
+  for( int i=0; i<keys_nb; i++ ) {
+    const Tick tk = pkt.tick() + i;
+    if( tk >= end ) {
+      break;
+    } else if( tk >= first ) {
+      buffer.emplace(tk, TickInput{static_cast<KeyState>(pkt.keys(i)), pkt.gb_drops()});
+    }
+  }
+}
+
+Tick GameInstance::nextMissingTick(const InputBuffer& buffer, Tick tick)
+{
+  for( auto it = buffer.find(tick); it != buffer.end() && (*it).first == tick; ++it ) {
+    tick++;
+  }
+  return tick;
+}
+
+
+void GameInstance::startReplay()
+{
+  replay_recorder_.reset();
+  if(replay_dir_.empty()) {
+    return;
+  }
+  const std::string filename = ReplayRecorder::newFileName(replay_dir_);
+  try {
+    replay_recorder_ = std::make_unique<ReplayRecorder>(filename);
+  } catch(const std::exception& e) {
+    // don't prevent the match from being played
+    LOG_ERROR("cannot record replay to %s: %s", filename.c_str(), e.what());
+    return;
+  }
+  LOG("recording replay to %s", filename.c_str());
+  replay_recorder_->recordMatch(*this);
+}
+
+void GameInstance::stopReplay()
+{
+  if(!replay_recorder_) {
+    return;
+  }
+  for(auto& fld : match_.fields()) {
+    replay_recorder_->recordFieldEnd(*fld);
+  }
+  replay_recorder_.reset();
+}
+
+void GameInstance::dropNextGarbage(Field& fld)
+{
+  if(replay_recorder_) {
+    assert( !fld.waitingGarbages().empty() );
+    replay_recorder_->recordDrop(fld, *fld.waitingGarbages().front());
+  }
+  match_.dropNextGarbage(fld);
+}
+
 void GameInstance::stepRemotePlayer(Player& pl, KeyState keys)
 {
   Field* fld = pl.field();
@@ -102,8 +301,12 @@ void GameInstance::stepRemotePlayer(Player& pl, KeyState keys)
 }
 
 
+const long GameInputScheduler::TICK_ADJUST_PERCENT = 5;
+const GameInputScheduler::Clock::duration GameInputScheduler::SPIN_DURATION = std::chrono::microseconds(500);
+const GameInputScheduler::Clock::duration GameInputScheduler::LATE_DURATION = std::chrono::milliseconds(1);
+
 GameInputScheduler::GameInputScheduler(GameInstance& instance, InputProvider& input, boost::asio::io_service& io_service):
-    instance_(instance), input_(input), timer_(io_service)
+    instance_(instance), input_(input), tick_count_(0), timer_(io_service), stats_()
 {
 }
 
@@ -124,16 +327,22 @@ void GameInputScheduler::start()
   }
 
   // start timer
-  boost::posix_time::time_duration dt = boost::posix_time::microseconds(instance_.conf().tk_usec);
-  tick_clock_ = boost::posix_time::microsec_clock::universal_time() + dt;
-  timer_.expires_from_now(dt);
-  timer_.async_wait(std::bind(&GameInputScheduler::onInputTick, this, std::placeholders::_1));
+  stats_ = Stats();
+  const Clock::time_point now = Clock::now();
+  tick_clock_ = now + std::chrono::microseconds(instance_.conf().tk_usec);
+  tick_count_ = 1;
+  this->scheduleTick(now);
 }
 
 void GameInputScheduler::stop()
 {
   timer_.cancel();
   players_.clear();
+  if( stats_.ticks > 0 ) {
+    LOG("scheduler: %lu ticks, %lu late, max jitter %ld us", stats_.ticks, stats_.late_ticks,
+        static_cast<long>(std::chrono::duration_cast<std::chrono::microseconds>(stats_.max_jitter).count()));
+    stats_.ticks = 0;
+  }
 }
 
 
@@ -144,7 +353,26 @@ void GameInputScheduler::onInputTick(const boost::system::error_code& ec)
   }
   assert( !ec );
 
+  // timer expires a bit early, actively wait for the deadline
+  // if woken up too early, wait again for the timer instead
+  Clock::time_point now = Clock::now();
+  if( tick_clock_ - now > SPIN_DURATION ) {
+    this->scheduleTick(now);
+    return;
+  }
+  while( now < tick_clock_ ) {
+    now = Clock::now();
+  }
+  stats_.max_jitter = std::max(stats_.max_jitter, now - tick_clock_);
+
+  unsigned int tick_nb = 0;
   for(;;) {
+    if( now - tick_clock_ > LATE_DURATION ) {
+      stats_.late_ticks++;
+    }
+    stats_.ticks++;
+    tick_nb++;
+
     PlayerContainer::iterator it;
     for(it=players_.begin(); it!=players_.end(); ) {
       Player& pl = *(*it);
@@ -175,13 +403,39 @@ void GameInputScheduler::onInputTick(const boost::system::error_code& ec)
       return;
     }
 
-    tick_clock_ += boost::posix_time::microseconds(instance_.conf().tk_usec);
-    boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
-    if( tick_clock_ >= now ) {
-      timer_.expires_from_now(tick_clock_ - now);
-      timer_.async_wait(std::bind(&GameInputScheduler::onInputTick, this, std::placeholders::_1));
+    tick_clock_ += this->nextTickPeriod();
+    now = Clock::now();
+    // when late, let other handlers run before catching up
+    if( tick_clock_ > now || tick_nb == Stats::CATCHUP_MAX ) {
       break;
     }
   }
+  stats_.catchup[tick_nb-1]++;
+  // if still late, the timer expires immediately
+  this->scheduleTick(now);
+}
+
+void GameInputScheduler::scheduleTick(Clock::time_point now)
+{
+  const Clock::duration delay = tick_clock_ - SPIN_DURATION - now;
+  const long delay_usec = std::chrono::duration_cast<std::chrono::microseconds>(delay).count();
+  timer_.expires_from_now(boost::posix_time::microseconds(std::max(0L, delay_usec)));
+  timer_.async_wait(std::bind(&GameInputScheduler::onInputTick, this, std::placeholders::_1));
 }
 
+GameInputScheduler::Clock::duration GameInputScheduler::nextTickPeriod()
+{
+  const long tk_usec = instance_.conf().tk_usec;
+  long period = tk_usec;
+  Clock::time_point ref_start;
+  if( instance_.referenceMatchStart(ref_start) ) {
+    // compare with the reference deadline, positive offset if clock is late
+    const Clock::time_point ref_tick_clock = ref_start + std::chrono::microseconds(tk_usec * tick_count_);
+    const long offset = std::chrono::duration_cast<std::chrono::microseconds>(tick_clock_ - ref_tick_clock).count();
+    // smoothly nudge the period
+    const long adjust_max = tk_usec * TICK_ADJUST_PERCENT / 100;
+    period -= std::max(-adjust_max, std::min(adjust_max, offset / 8));
+  }
+  tick_count_++;
+  return std::chrono::microseconds(period);
+}
@@ -3,11 +3,42 @@
 
 #include <memory>
 #include <vector>
+#include <deque>
 #include <map>
+#include <unordered_map>
+#include <array>
+#include <chrono>
+#include <functional>
 #include <boost/asio/io_service.hpp>
 #include "monotone_timer.hpp"
 #include "game.h"
 
+class ReplayRecorder;
+
+
+/** @brief Interned field configurations, indexed by content hash.
+ *
+ * Players and server configuration share interned entries instead of owning
+ * copies. Unreferenced entries are dropped when new ones are added.
+ */
+class FieldConfTable
+{
+ public:
+  typedef std::shared_ptr<const FieldConf> Ptr;
+
+  /// Return the interned entry equal to a configuration, add it if needed
+  Ptr intern(const FieldConf& conf);
+  /// Return the entry of a given hash, \e nullptr if not found
+  Ptr find(uint64_t hash) const;
+  void clear() { entries_.clear(); }
+
+ private:
+  /// Drop entries only referenced by the table
+  void purge();
+
+  std::unordered_map<uint64_t, Ptr> entries_;
+};
+
 
 /** @brief Server configuration values.
  */
@@ -32,10 +63,17 @@ struct ServerConf
   /// Duration of start countdown
   uint32_t tk_start_countdown;
 
-  /// Field configurations
-  std::vector<FieldConf> field_confs;
+  /** @brief Period of field state reports.
+   *
+   * If not null, clients report their field events and the hash of a sample
+   * of fields and the server does not simulate all fields (light relay mode).
+   */
+  uint32_t tk_report_period;
+
+  /// Field configurations, interned
+  std::vector<FieldConfTable::Ptr> field_confs;
   /// Retrieve a configuration by its name, \e nullptr if not found
-  const FieldConf* fieldConf(const std::string& name) const;
+  FieldConfTable::Ptr fieldConf(const std::string& name) const;
 };
 
 /** @brief Generic macro for server configuration fields.
@@ -48,6 +86,7 @@ struct ServerConf
   expr(tk_usec,      TickPeriod   ); \
   expr(tk_lag_max,   LagTicksLimit); \
   expr(tk_start_countdown, StartCountdownTicks); \
+  expr(tk_report_period, ReportPeriodTicks); \
 }
 
 
@@ -77,23 +116,30 @@ class Player
 
   PlId plid() const { return plid_; }
   bool local() const { return local_; }
+  /// Set local flag, for players resumed by a new client.
+  void setLocal(bool v) { local_ = v; }
   const std::string& nick() const { return nick_; }
   void setNick(const std::string& v) { nick_ = v; }
   State state() const { return state_; }
   void setState(State v) { state_ = v; }
-  const FieldConf& fieldConf() const { return field_conf_; }
-  void setFieldConf(const FieldConf& conf) { field_conf_ = conf; }
+  const FieldConf& fieldConf() const { return *field_conf_; }
+  const FieldConfTable::Ptr& fieldConfPtr() const { return field_conf_; }
+  /// Set field configuration, to an interned entry
+  void setFieldConf(FieldConfTable::Ptr conf) { field_conf_ = std::move(conf); }
   const Field* field() const { return field_; }
   Field* field() { return field_; }
   FldId fldid() const { return field_ ? field_->fldid() : 0; }
-  void setField(Field* fld) { field_ = fld; }
 
  private:
+  /// Set by GameInstance::setPlayerField(), which keeps fields_players_ up-to-date
+  void setField(Field* fld) { field_ = fld; }
+  friend class GameInstance;
+
   PlId plid_;   ///< Player ID
   bool local_;  ///< \e true for local players
   std::string nick_;
   State state_;  ///< player actual state
-  FieldConf field_conf_;
+  FieldConfTable::Ptr field_conf_;
   Field* field_;
 };
 
@@ -167,12 +213,119 @@ class GameInstance
   Player* player(PlId plid);
   /// Return the player associated to a given field, or \e NULL.
   Player* player(const Field* fld);
+  const Player* player(const Field* fld) const;
+
+  /** @brief Get the local time of the reference match start.
+   *
+   * Used by GameInputScheduler to align its tick clock on the reference one.
+   *
+   * @return \e false if not available.
+   */
+  virtual bool referenceMatchStart(std::chrono::steady_clock::time_point&) const { return false; }
+
+  /// Return true if a field is simulated, thus its hash is valid.
+  virtual bool isFieldSimulated(const Field&) const { return true; }
+
+  /// Set the directory of match replays, empty to disable recording.
+  void setReplayDir(const std::string& dir) { replay_dir_ = dir; }
+
+  /// Time source, returning a steady clock time.
+  typedef std::function<std::chrono::steady_clock::time_point()> ClockFunction;
+  /** @brief Set the time source used for match timing and RTT measures.
+   *
+   * Default is std::chrono::steady_clock::now(). Simulations use it to run
+   * instances on a virtual clock. Timers are not affected and always expire
+   * on real time.
+   */
+  void setClock(ClockFunction clock) { clock_ = clock; }
 
  protected:
+  /// Return the current time, from the instance's time source.
+  std::chrono::steady_clock::time_point now() const { return clock_ ? clock_() : std::chrono::steady_clock::now(); }
+
+  /// Set or unset a player field, keep fields_players_ up-to-date.
+  void setPlayerField(Player& pl, Field* fld);
+
+  /** @name Field configurations in player configuration packets.
+   *
+   * Configurations known by both ends are sent as a hash, if the receiver
+   * supports it (see PktPlayerConf), others in full.
+   */
+  //@{
+  /// Maximum number of custom configurations known from a client's connection
+  static const size_t FIELD_CONF_PINS_MAX = 16;
+  /// Configurations kept alive for a connection, indexed by hash
+  typedef std::map<uint64_t, FieldConfTable::Ptr> FieldConfPins;
+  /// Set the configuration of a packet, as a hash or in full.
+  void fieldConfToPacket(const FieldConf& conf, netplay::PktPlayerConf& pkt, bool hash) const;
+  /// Return true if a configuration is a server one.
+  bool isServerFieldConf(const FieldConf& conf) const;
+  /** @brief Get the interned configuration of a packet
+   *
+   * Return \e nullptr for unknown configuration names.
+   * Throw a netplay::CallbackError for unknown hashes and invalid content.
+   */
+  FieldConfTable::Ptr fieldConfFromPacket(const netplay::PktPlayerConf& pkt);
+  /// Replace server field configurations, intern them
+  void setServerFieldConfs(const std::vector<FieldConf>& confs);
+  //@}
+
   /// Step a player field, update match tick.
   virtual void doStepPlayer(Player& pl, KeyState keys);
   /// Like doStepPlayer() but throw netplay::CallbackError.
   void stepRemotePlayer(Player& pl, KeyState keys);
+  /** @brief Step a player field.
+   *
+   * Called by doStepPlayer(), the field is simulated by default.
+   */
+  virtual void stepField(Player& pl, KeyState keys);
+
+  /** @name Input channel.
+   *
+   * Inputs are also sent in datagrams, which may arrive before the garbage
+   * drops preceding them (drops are only sent in events). Each input thus
+   * carries the drop count of its field before the step, see
+   * Field::droppedGarbageCount(). It is applied only once the receiver
+   * dropped the same count.
+   */
+  //@{
+  /// Input of a tick, with the drop count of its field.
+  struct TickInput {
+    KeyState keys;
+    unsigned int drops;
+  };
+  /// Last inputs of a field, to be repeated in datagrams.
+  struct InputHistory {
+    Tick tick = 0;  ///< tick of the first input
+    std::deque<TickInput> inputs;
+    /// Add the input of a tick, keep at most \e size inputs
+    void add(Tick tk, const TickInput& input, size_t size);
+    /// Add inputs from a given tick to a datagram, grouped by drop count
+    void toDatagram(netplay::Datagram& dgram, PlId plid, Tick from) const;
+  };
+  /// Inputs received in datagrams, by tick.
+  typedef std::map<Tick, TickInput> InputBuffer;
+  /** @brief Buffer inputs of a datagram.
+   *
+   * Ticks before \e first or not before \e end are ignored.
+   */
+  static void bufferDatagramInput(InputBuffer& buffer, const netplay::PktInput& pkt, Tick first, Tick end);
+  /// Return the first tick, from \e tick, missing from a buffer.
+  static Tick nextMissingTick(const InputBuffer& buffer, Tick tick);
+  //@}
+
+  /** @name Replay recording.
+   *
+   * Replays are recorded if a replay directory has been set.
+   */
+  //@{
+  /// Start recording a match, fields must have been initialized.
+  void startReplay();
+  /// Record final field states, stop recording.
+  void stopReplay();
+  /// Drop the next waiting garbage of a field, record it.
+  void dropNextGarbage(Field& fld);
+  //@}
 
   /**@ brief Observer accessor.
    *
@@ -184,6 +337,16 @@ class GameInstance
   Match match_;
   State state_;
   ServerConf conf_;
+  /// Interned field configurations, of server configuration and players
+  FieldConfTable field_conf_table_;
+
+  /// Players associated to fields, indexed by FldId-1.
+  std::vector<Player*> fields_players_;
+
+ private:
+  std::string replay_dir_;
+  std::unique_ptr<ReplayRecorder> replay_recorder_;
+  ClockFunction clock_;
 };
 
 
@@ -191,15 +354,34 @@ class GameInstance
  *
  * When running, send appropriate calls to GameInstance::playerStep().
  * Local players are assumed to not change when the game is running.
+ *
+ * Ticks are scheduled on absolute deadlines of a monotonic clock. The timer
+ * expires slightly before the deadline, which is then actively waited for,
+ * for at most SPIN_DURATION. When late, at most CATCHUP_MAX ticks are
+ * processed at once; remaining ones are caught up on next wake-ups, after
+ * other handlers had a chance to run. No tick is skipped.
  */
 class GameInputScheduler
 {
  public:
+  typedef std::chrono::steady_clock Clock;
+
   struct InputProvider {
     /// Return next input for a given player.
     virtual KeyState getNextInput(const Player& pl) = 0;
   };
 
+  /// Scheduling statistics.
+  struct Stats {
+    /// Maximum number of ticks processed in a single wake-up.
+    static constexpr unsigned int CATCHUP_MAX = 4;
+    unsigned long ticks;  ///< Processed ticks.
+    unsigned long late_ticks;  ///< Ticks processed more than 1ms late.
+    Clock::duration max_jitter;  ///< Maximum delay of a wake-up.
+    /// Number of wake-ups per count of processed ticks (index 0: 1 tick).
+    std::array<unsigned long, CATCHUP_MAX> catchup;
+  };
+
   GameInputScheduler(GameInstance& instance, InputProvider& input_, boost::asio::io_service& io_service);
   ~GameInputScheduler();
 
@@ -208,15 +390,32 @@ class GameInputScheduler
   void start();
   void stop();
 
+  const Stats& stats() const { return stats_; }
+
  private:
+  /// Maximum adjustment of the tick period, in percents
+  static const long TICK_ADJUST_PERCENT;
+  /// Maximum duration of the active wait before a deadline
+  static const Clock::duration SPIN_DURATION;
+  /// Delay after which a tick is considered late
+  static const Clock::duration LATE_DURATION;
+
   GameInstance& instance_;
   InputProvider& input_;
   void onInputTick(const boost::system::error_code& ec);
+  /// Return the period to the next tick, adjusted to the reference clock.
+  Clock::duration nextTickPeriod();
+  /// Set the timer to wake up on the next tick.
+  void scheduleTick(Clock::time_point now);
 
   typedef std::vector<Player*> PlayerContainer;
   PlayerContainer players_;  ///< Local players still playing.
-  boost::posix_time::ptime tick_clock_;
+  /// Deadline of the next tick.
+  Clock::time_point tick_clock_;
+  /// Number of the next scheduled tick, since start.
+  unsigned long tick_count_;
   boost::asio::monotone_timer timer_;
+  Stats stats_;
 };
 
 
@@ -12,7 +12,7 @@ const std::string CursesInterface::CONF_SECTION("Curses");
 CursesInterface::CursesInterface():
     cfg_(0), instance_(*this, io_service_),
     input_scheduler_(instance_, *this, io_service_),
-    player_(NULL), wmsg_(NULL)
+    player_(NULL), resuming_(false), wmsg_(NULL)
 {
   keys_.up    = KEY_UP;
   keys_.down  = KEY_DOWN;
@@ -52,6 +52,7 @@ bool CursesInterface::run(IniFile& cfg)
 
   int port = cfg.get<int>("Global.Port", DEFAULT_PNP_PORT);
   const std::string host = cfg.get("Client.Hostname", "localhost");
+  instance_.setReplayDir(cfg.get("Client.ReplayDir", ""));
 
   if( !this->initCurses() ) {
     LOG("terminal initialization failed");
@@ -189,16 +190,24 @@ void CursesInterface::onNotification(GameInstance::Severity sev, const std::stri
 
 void CursesInterface::onServerConnect(bool success)
 {
-  if(success) {
-    instance_.newLocalPlayer(cfg_->get("Client.Nick", "Player"), nullptr);
-  } else {
+  if(!success) {
     io_service_.stop();
+  } else if(resuming_) {
+    this->addMessage(3, "reconnected, resuming the match");
+  } else {
+    instance_.newLocalPlayer(cfg_->get("Client.Nick", "Player"), nullptr);
   }
 }
 
 void CursesInterface::onServerDisconnect()
 {
-  io_service_.stop();
+  input_scheduler_.stop();
+  if(instance_.reconnect(3000)) {
+    resuming_ = true;
+    this->addMessage(7, "connection lost, reconnecting...");
+  } else {
+    io_service_.stop();
+  }
 }
 
 void CursesInterface::onPlayerJoined(Player& pl)
@@ -263,23 +272,34 @@ void CursesInterface::onStateChange()
     assert( wmsg_ != NULL ); //XXX error
     ::scrollok(wmsg_, TRUE);
 
-    for(const auto& fld : instance_.match().fields()) {
-      auto fdp = std::make_unique<FieldDisplay>(*this, *fld, fdisplays_.size());
-      auto it = fdisplays_.emplace(fld.get(), std::move(fdp)).first;
-      it->second->draw();
-    }
-    ::redrawwin(stdscr);
-    ::refresh();
+    this->createFieldDisplays();
     if( player_ != NULL ) {
       instance_.playerSetState(*player_, Player::State::GAME_READY);
     }
 
   } else if(state == GameInstance::State::GAME) {
+    if(resuming_) {
+      // fields have been replaced by the resumed match state
+      resuming_ = false;
+      this->createFieldDisplays();
+    }
     LOG("START");
     input_scheduler_.start();
   }
 }
 
+void CursesInterface::createFieldDisplays()
+{
+  fdisplays_.clear();
+  for(const auto& fld : instance_.match().fields()) {
+    auto fdp = std::make_unique<FieldDisplay>(*this, *fld, fdisplays_.size());
+    auto it = fdisplays_.emplace(fld.get(), std::move(fdp)).first;
+    it->second->draw();
+  }
+  ::redrawwin(stdscr);
+  ::refresh();
+}
+
 void CursesInterface::onServerChangeFieldConfs()
 {
 }
@@ -384,6 +404,14 @@ void FieldDisplay::draw()
   }
   mvwaddnstr(wfield_, FIELD_HEIGHT+3, 0, nick, FIELD_WIDTH+2);
 
+  // round-trip time, for local players
+  if( pl != NULL && pl->local() ) {
+    char buf_rtt[2*FIELD_WIDTH+3];
+    ::snprintf(buf_rtt, sizeof(buf_rtt), "rtt %4u ms", intf_.instance_.rtt()/1000);
+    ::wcolor_set(wfield_, 0, NULL);
+    mvwaddnstr(wfield_, FIELD_HEIGHT+4, 0, buf_rtt, 2*FIELD_WIDTH+2);
+  }
+
   // hanging garbages
 
   wcolor_set(wfield_, 0, NULL); // required, don't know why
@@ -49,12 +49,16 @@ class CursesInterface: public ClientInstance::Observer,
 
   bool initCurses();
   void endCurses();
+  /// Create displays of match fields.
+  void createFieldDisplays();
 
   boost::asio::io_service io_service_;
   IniFile* cfg_;
   ClientInstance instance_;
   GameInputScheduler input_scheduler_;
   Player* player_;
+  /// Set while reconnecting to resume the match
+  bool resuming_;
   /// Window for messages.
   WINDOW* wmsg_;
 
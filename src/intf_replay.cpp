@@ -0,0 +1,228 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <dirent.h>
+#include "intf_replay.h"
+#include "replay.h"
+#include "inifile.h"
+#include "log.h"
+
+
+const std::string ReplayInterface::CONF_SECTION("Replay");
+
+
+ReplayInterface::ReplayInterface():
+    collect_stats_(false), seek_period_(0), next_replay_(0)
+{
+}
+
+
+bool ReplayInterface::run(IniFile& cfg)
+{
+  const std::string path = cfg.get({CONF_SECTION, "Path"}, "");
+  if(path.empty()) {
+    LOG("no replay given");
+    return false;
+  }
+  filenames_ = listReplays(path);
+  if(filenames_.empty()) {
+    LOG("no replay found in %s", path.c_str());
+    return false;
+  }
+  results_.resize(filenames_.size());
+  next_replay_ = 0;
+  const std::string stats_file = cfg.get({CONF_SECTION, "StatsFile"}, "");
+  collect_stats_ = !stats_file.empty();
+  seek_period_ = cfg.get({CONF_SECTION, "SeekPeriod"}, 0u);
+
+  unsigned int nthreads = cfg.get({CONF_SECTION, "Threads"}, 0u);
+  if(nthreads == 0) {
+    nthreads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  nthreads = std::min<size_t>(nthreads, filenames_.size());
+
+  LOG("verifying %zu replays, using %u threads", filenames_.size(), nthreads);
+  const auto t0 = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for(unsigned int i=0; i<nthreads; i++) {
+    threads.emplace_back(&ReplayInterface::runWorker, this);
+  }
+  for(auto& thread : threads) {
+    thread.join();
+  }
+  const std::chrono::duration<double> dt = std::chrono::steady_clock::now() - t0;
+
+  unsigned long ticks = 0;
+  unsigned int failed = 0;
+  unsigned long seeks = 0;
+  std::chrono::steady_clock::duration seek_time = std::chrono::steady_clock::duration::zero();
+  std::chrono::steady_clock::duration seek_time_max = std::chrono::steady_clock::duration::zero();
+  for(size_t i=0; i<filenames_.size(); i++) {
+    const Result& result = results_[i];
+    ticks += result.ticks;
+    seeks += result.seeks;
+    seek_time += result.seek_time;
+    seek_time_max = std::max(seek_time_max, result.seek_time_max);
+    if(!result.ok) {
+      failed++;
+      LOG_ERROR("%s: %s", filenames_[i].c_str(), result.error.c_str());
+    }
+  }
+  LOG("%zu replays, %u failed, %lu ticks in %.3f s (%.0f ticks/s)",
+      filenames_.size(), failed, ticks, dt.count(), ticks / dt.count());
+  if(seeks > 0) {
+    typedef std::chrono::duration<double, std::milli> Ms;
+    LOG("%lu seeks checked: %.3f ms average, %.3f ms max",
+        seeks, Ms(seek_time).count() / seeks, Ms(seek_time_max).count());
+  }
+  if(collect_stats_ && !this->writeStats(stats_file)) {
+    return false;
+  }
+  return failed == 0;
+}
+
+
+std::vector<std::string> ReplayInterface::listReplays(const std::string& path)
+{
+  std::vector<std::string> filenames;
+  struct stat st;
+  if(::stat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+    filenames.push_back(path);
+    return filenames;
+  }
+
+  DIR* dir = ::opendir(path.c_str());
+  if(dir == NULL) {
+    throw std::runtime_error("cannot open directory "+path);
+  }
+  static const std::string ext(".pnpr");
+  while(struct dirent* ent = ::readdir(dir)) {
+    const std::string name = ent->d_name;
+    if(name.size() > ext.size() && name.compare(name.size()-ext.size(), ext.size(), ext) == 0) {
+      filenames.push_back(path + "/" + name);
+    }
+  }
+  ::closedir(dir);
+  std::sort(filenames.begin(), filenames.end());
+  return filenames;
+}
+
+
+void ReplayInterface::runWorker()
+{
+  for(;;) {
+    const size_t i = next_replay_++;
+    if(i >= filenames_.size()) {
+      break;
+    }
+    Result& result = results_[i];
+    result.ok = false;
+    result.ticks = 0;
+    result.seeks = 0;
+    result.seek_time = result.seek_time_max = std::chrono::steady_clock::duration::zero();
+    try {
+      Replay replay;
+      replay.load(filenames_[i]);
+      ReplayVerifier verifier(replay, collect_stats_);
+      std::unique_ptr<ReplayFile> file;
+      if(seek_period_ > 0) {
+        file = std::make_unique<ReplayFile>(filenames_[i]);
+        verifier.checkSeeks(*file, seek_period_);
+      }
+      result.ok = verifier.run();
+      result.ticks = verifier.ticks();
+      result.error = verifier.error();
+      result.seeks = verifier.seeks();
+      result.seek_time = verifier.seekTime();
+      result.seek_time_max = verifier.seekTimeMax();
+      if(result.ok && collect_stats_) {
+        formatStatsRows(result.stats_rows, filenames_[i], replay, verifier.stats());
+      }
+    } catch(const std::exception& e) {
+      result.error = e.what();
+    }
+  }
+}
+
+
+
+/// Quote a CSV value, if needed.
+static std::string csvQuote(const std::string& s)
+{
+  if(s.find_first_of(",\"\r\n") == std::string::npos) {
+    return s;
+  }
+  std::string ret = "\"";
+  for(char c : s) {
+    if(c == '"') {
+      ret += '"';
+    }
+    ret += c;
+  }
+  ret += '"';
+  return ret;
+}
+
+
+bool ReplayInterface::writeStats(const std::string& filename) const
+{
+  FILE* fp = ::fopen(filename.c_str(), "w");
+  if(fp == NULL) {
+    LOG_ERROR("cannot open %s: %s", filename.c_str(), ::strerror(errno));
+    return false;
+  }
+  ::fputs("replay,fldid,plid,nick,ticks,lost,rank,apm,swaps,moves,raises,max_chain,chains", fp);
+  for(unsigned int n=3; n<FieldStats::COMBO_MAX; n++) {
+    ::fprintf(fp, ",combo_%u", n);
+  }
+  ::fprintf(fp, ",combo_%u_plus", FieldStats::COMBO_MAX);
+  ::fputs(",gb_sent,gb_received,gb_cleared,stop_ticks,raise_speed_index\n", fp);
+
+  size_t rows = 0;
+  for(auto& result : results_) {
+    for(auto& row : result.stats_rows) {
+      ::fputs(row.c_str(), fp);
+      rows++;
+    }
+  }
+  const bool ok = !::ferror(fp);
+  if(::fclose(fp) != 0 || !ok) {
+    LOG_ERROR("cannot write %s", filename.c_str());
+    return false;
+  }
+  LOG("%zu field statistics written to %s", rows, filename.c_str());
+  return true;
+}
+
+
+void ReplayInterface::formatStatsRows(std::vector<std::string>& rows, const std::string& filename,
+                                      const Replay& replay, const std::vector<FieldStats>& stats)
+{
+  const unsigned int tk_usec = replay.match.tk_usec();
+  for(auto& data : replay.fields) {
+    const FieldStats& st = stats[data.info->fldid()-1];
+    char buf[256];
+    std::string row = csvQuote(filename);
+    ::snprintf(buf, sizeof(buf), ",%u,%u,", data.info->fldid(), data.info->plid());
+    row += buf;
+    row += csvQuote(data.info->nick());
+    ::snprintf(buf, sizeof(buf), ",%u,%d,%u,%.1f,%lu,%lu,%lu,%u,%lu",
+               st.ticks, data.has_end && data.end.lost(), data.has_end ? data.end.rank() : 0,
+               st.apm(tk_usec), st.swaps, st.moves, st.raises, st.max_chain, st.chains);
+    row += buf;
+    for(unsigned int n=3; n<=FieldStats::COMBO_MAX; n++) {
+      ::snprintf(buf, sizeof(buf), ",%lu", st.comboCount(n));
+      row += buf;
+    }
+    ::snprintf(buf, sizeof(buf), ",%lu,%lu,%lu,%u,%u\n",
+               st.gb_sent, st.gb_received, st.gb_cleared, st.stop_ticks, st.raise_speed_index);
+    row += buf;
+    rows.push_back(std::move(row));
+  }
+}
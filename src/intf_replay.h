@@ -0,0 +1,67 @@
+#ifndef INTF_REPLAY_H_
+#define INTF_REPLAY_H_
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include "stats.h"
+
+class IniFile;
+struct Replay;
+
+
+/** @brief Headless replay verifier.
+ *
+ * Replays are re-simulated at full speed, in parallel. Results and
+ * simulation speed are logged.
+ *
+ * Field statistics of verified replays can be written to a CSV file, one row
+ * per field.
+ *
+ * Seeking can also be checked and timed: matches are periodically restored
+ * from replay keyframes, and compared to the simulation.
+ */
+class ReplayInterface
+{
+  static const std::string CONF_SECTION;
+
+ public:
+  ReplayInterface();
+  /// Verify replays, return \e false if any replay failed.
+  bool run(IniFile& cfg);
+
+ private:
+  /// Result of a replay verification.
+  struct Result {
+    bool ok;
+    unsigned long ticks;
+    std::string error;
+    /// Statistics of each field, if collected
+    std::vector<std::string> stats_rows;
+    /// Checked seeks and their duration
+    unsigned long seeks;
+    std::chrono::steady_clock::duration seek_time;
+    std::chrono::steady_clock::duration seek_time_max;
+  };
+
+  /// Return replay files of a path, either a file or a directory.
+  static std::vector<std::string> listReplays(const std::string& path);
+  /// Worker thread, verify replays until there are none left.
+  void runWorker();
+  /// Write collected statistics to a CSV file, return \e false on error.
+  bool writeStats(const std::string& filename) const;
+  /// Format statistics CSV rows of a verified replay.
+  static void formatStatsRows(std::vector<std::string>& rows, const std::string& filename,
+                              const Replay& replay, const std::vector<FieldStats>& stats);
+
+  std::vector<std::string> filenames_;
+  std::vector<Result> results_;
+  bool collect_stats_;
+  /// Period of seek checks, in ticks (0 if disabled)
+  unsigned int seek_period_;
+  /// Index of the next replay to verify.
+  std::atomic<size_t> next_replay_;
+};
+
+#endif
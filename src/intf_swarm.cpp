@@ -0,0 +1,395 @@
+#include <functional>
+#include "intf_swarm.h"
+#include "inifile.h"
+#include "log.h"
+
+
+const std::string SwarmInterface::CONF_SECTION("Swarm");
+constexpr unsigned int SwarmInterface::CATCHUP_MAX;
+const unsigned int SwarmInterface::CONNECT_TIMEOUT_MS = 10000;
+
+
+/// Return a duration in microseconds.
+static uint64_t to_usec(SwarmInterface::Clock::duration d)
+{
+  return std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(d).count());
+}
+
+
+SwarmClient::SwarmClient(SwarmInterface& swarm, unsigned int index, boost::asio::io_service& io_service):
+    swarm_(swarm), instance_(*this, io_service), index_(index),
+    connected_(false), player_(nullptr), rng_(index+1)
+{
+  instance_.setLocalFieldsOnly(true);
+}
+
+void SwarmClient::start(const std::string& host, int port)
+{
+  request_time_ = Clock::now();
+  instance_.connect(host.c_str(), port, SwarmInterface::CONNECT_TIMEOUT_MS);
+}
+
+void SwarmClient::stop()
+{
+  if(connected_) {
+    connected_ = false;
+    player_ = nullptr;
+    instance_.disconnect();
+  }
+}
+
+void SwarmClient::stepTicks()
+{
+  if(player_ == nullptr || instance_.state() != GameInstance::State::GAME) {
+    return;
+  }
+  Clock::time_point start;
+  if(!instance_.referenceMatchStart(start)) {
+    return;
+  }
+  const auto now = Clock::now();
+  const Tick target = to_usec(now - start) / instance_.conf().tk_usec + 1;
+  for(unsigned int i=0; i<SwarmInterface::CATCHUP_MAX; i++) {
+    // note: a step may end the match, check everything again
+    const Field* fld = player_->field();
+    if(fld == nullptr || fld->lost() || instance_.state() != GameInstance::State::GAME) {
+      break;
+    }
+    const Tick tk = fld->tick();
+    if(tk >= target || tk+1 >= instance_.match().tick() + instance_.conf().tk_lag_max) {
+      break;
+    }
+    swarm_.recordInput(player_->plid(), tk, now);
+    instance_.playerStep(*player_, this->nextInput());
+  }
+}
+
+
+void SwarmClient::onChat(Player&, const std::string&) {}
+void SwarmClient::onPlayerJoined(Player&) {}
+void SwarmClient::onPlayerChangeNick(Player&, const std::string&) {}
+
+void SwarmClient::onPlayerStateChange(Player& pl)
+{
+  if(&pl != player_) {
+    return;
+  }
+  if(pl.state() == Player::State::LOBBY_READY) {
+    swarm_.lat_ready_.add(to_usec(Clock::now() - request_time_));
+  } else if(pl.state() == Player::State::QUIT) {
+    player_ = nullptr;
+  }
+}
+
+void SwarmClient::onPlayerChangeFieldConf(Player&) {}
+
+void SwarmClient::onStateChange()
+{
+  auto state = instance_.state();
+  if(state == GameInstance::State::LOBBY) {
+    if(index_ == 0) {
+      swarm_.matchEnded();
+    }
+    this->setReady();
+  } else if(state == GameInstance::State::GAME_READY) {
+    // players joined during a match are not part of it
+    if(player_ != nullptr && player_->state() == Player::State::GAME_INIT) {
+      instance_.playerSetState(*player_, Player::State::GAME_READY);
+    }
+  } else if(state == GameInstance::State::GAME) {
+    if(index_ == 0) {
+      swarm_.matchStarted();
+    }
+    swarm_.startTicks(instance_.conf().tk_usec);
+  }
+}
+
+void SwarmClient::onServerChangeFieldConfs() {}
+void SwarmClient::onPlayerStep(Player&) {}
+void SwarmClient::onPlayerRanked(Player&) {}
+
+void SwarmClient::onNotification(GameInstance::Severity, const std::string&)
+{
+  swarm_.nb_notifications_++;
+}
+
+void SwarmClient::onServerConnect(bool success)
+{
+  connected_ = success;
+  swarm_.clientConnected(*this, success);
+  if(!success) {
+    return;
+  }
+  swarm_.lat_connect_.add(to_usec(Clock::now() - request_time_));
+  char nick[32];
+  snprintf(nick, sizeof(nick), "swarm-%u", index_);
+  request_time_ = Clock::now();
+  instance_.newLocalPlayer(nick, [this](Player* pl, const std::string& msg) {
+    if(pl == nullptr) {
+      LOG_ERROR("swarm-%u: join failed: %s", index_, msg.c_str());
+      return;
+    }
+    swarm_.lat_join_.add(to_usec(Clock::now() - request_time_));
+    player_ = pl;
+    swarm_.clientJoined(*this);
+    this->setReady();
+  });
+}
+
+void SwarmClient::onServerDisconnect()
+{
+  if(connected_) {
+    connected_ = false;
+    player_ = nullptr;
+    swarm_.clientDisconnected(*this);
+  }
+}
+
+
+void SwarmClient::Instance::onServerEvent(const netplay::ServerEvent& event)
+{
+  client_.timestampEvent(event);
+  ClientInstance::onServerEvent(event);
+}
+
+void SwarmClient::timestampEvent(const netplay::ServerEvent& event)
+{
+  const auto now = Clock::now();
+  if(event.has_pong()) {
+    // pings are sent using the default clock
+    const int64_t now_usec = std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch()).count();
+    const int64_t sample = now_usec - static_cast<int64_t>(event.pong().client_time());
+    if(sample >= 0) {
+      swarm_.lat_rtt_.add(sample);
+    }
+  } else if(event.has_input()) {
+    const netplay::PktInput& pkt = event.input();
+    if(pkt.keys_size() > 0) {
+      const Clock::time_point t = swarm_.inputTime(pkt.plid(), pkt.tick() + pkt.keys_size() - 1);
+      if(t != Clock::time_point()) {
+        swarm_.lat_input_.add(to_usec(now - t));
+      }
+    }
+  }
+}
+
+void SwarmClient::setReady()
+{
+  if(player_ == nullptr || player_->state() != Player::State::LOBBY) {
+    return;
+  }
+  request_time_ = Clock::now();
+  instance_.playerSetState(*player_, Player::State::LOBBY_READY);
+}
+
+KeyState SwarmClient::nextInput()
+{
+  static const KeyState keys[] = {
+    GAME_KEY_UP, GAME_KEY_DOWN, GAME_KEY_LEFT, GAME_KEY_RIGHT, GAME_KEY_SWAP, GAME_KEY_SWAP,
+  };
+  if(std::uniform_int_distribution<unsigned int>(0, 99)(rng_) >= swarm_.key_rate_) {
+    return GAME_KEY_NONE;
+  }
+  return keys[std::uniform_int_distribution<size_t>(0, sizeof(keys)/sizeof(*keys)-1)(rng_)];
+}
+
+
+
+SwarmInterface::SwarmInterface():
+    port_(0), key_rate_(0), connect_rate_(0), clients_started_(0),
+    connect_timer_(io_service_), tick_timer_(io_service_), end_timer_(io_service_),
+    ticking_(false), tick_period_(0),
+    all_connected_time_(0), all_joined_time_(0),
+    nb_connected_(0), nb_connect_failed_(0), nb_joined_(0), nb_disconnected_(0),
+    nb_notifications_(0), nb_matches_(0), nb_inputs_(0)
+{
+}
+
+SwarmInterface::~SwarmInterface()
+{
+}
+
+
+bool SwarmInterface::run(IniFile& cfg)
+{
+  host_ = cfg.get("Client.Hostname", "localhost");
+  port_ = cfg.get<int>("Global.Port", DEFAULT_PNP_PORT);
+  const unsigned int nb_clients = cfg.get({CONF_SECTION, "Clients"}, 16u);
+  connect_rate_ = cfg.get({CONF_SECTION, "ConnectRate"}, 0u);
+  key_rate_ = std::min(100u, cfg.get({CONF_SECTION, "KeyRate"}, 20u));
+  const unsigned int duration = cfg.get({CONF_SECTION, "Duration"}, 60u);
+  if(nb_clients == 0) {
+    LOG("no swarm client");
+    return false;
+  }
+
+  for(unsigned int i=0; i<nb_clients; i++) {
+    clients_.push_back(std::make_unique<SwarmClient>(*this, i, io_service_));
+  }
+  LOG("swarm: %u clients to %s:%d, for %u s", nb_clients, host_.c_str(), port_, duration);
+
+  start_time_ = Clock::now();
+  this->onConnectTimer(boost::system::error_code());
+  end_timer_.expires_from_now(boost::posix_time::seconds(duration));
+  end_timer_.async_wait(std::bind(&SwarmInterface::onEndTimer, this, std::placeholders::_1));
+  io_service_.run();
+
+  this->report();
+  clients_.clear();
+  return nb_connect_failed_ == 0 && nb_disconnected_ == 0;
+}
+
+
+void SwarmInterface::onConnectTimer(const boost::system::error_code& ec)
+{
+  if(ec == boost::asio::error::operation_aborted) {
+    return;
+  }
+  size_t target = clients_.size();
+  if(connect_rate_ > 0) {
+    const uint64_t elapsed = to_usec(Clock::now() - start_time_);
+    target = std::min<size_t>(target, 1 + elapsed * connect_rate_ / 1000000);
+  }
+  while(clients_started_ < target) {
+    clients_[clients_started_++]->start(host_, port_);
+  }
+  if(clients_started_ < clients_.size()) {
+    connect_timer_.expires_from_now(boost::posix_time::microseconds(1000000 / connect_rate_));
+    connect_timer_.async_wait(std::bind(&SwarmInterface::onConnectTimer, this, std::placeholders::_1));
+  }
+}
+
+void SwarmInterface::startTicks(unsigned int tk_usec)
+{
+  if(ticking_) {
+    return;
+  }
+  ticking_ = true;
+  tick_period_ = std::chrono::microseconds(tk_usec);
+  tick_clock_ = Clock::now();
+  this->onTickTimer(boost::system::error_code());
+}
+
+void SwarmInterface::onTickTimer(const boost::system::error_code& ec)
+{
+  if(ec == boost::asio::error::operation_aborted) {
+    return;
+  }
+  for(auto& client : clients_) {
+    client->stepTicks();
+  }
+  // absolute deadlines, skip missed ones
+  const auto now = Clock::now();
+  tick_clock_ += tick_period_;
+  if(tick_clock_ < now) {
+    tick_clock_ = now;
+  }
+  tick_timer_.expires_from_now(boost::posix_time::microseconds(to_usec(tick_clock_ - now)));
+  tick_timer_.async_wait(std::bind(&SwarmInterface::onTickTimer, this, std::placeholders::_1));
+}
+
+void SwarmInterface::onEndTimer(const boost::system::error_code& ec)
+{
+  if(ec == boost::asio::error::operation_aborted) {
+    return;
+  }
+  LOG("swarm: end of run, stopping clients");
+  connect_timer_.cancel();
+  tick_timer_.cancel();
+  for(auto& client : clients_) {
+    client->stop();
+  }
+}
+
+
+void SwarmInterface::clientConnected(SwarmClient&, bool success)
+{
+  if(!success) {
+    nb_connect_failed_++;
+    return;
+  }
+  nb_connected_++;
+  if(nb_connected_ == clients_.size()) {
+    all_connected_time_ = Clock::now() - start_time_;
+    LOG("swarm: all clients connected in %.3f s", to_usec(all_connected_time_) / 1e6);
+  }
+}
+
+void SwarmInterface::clientJoined(SwarmClient&)
+{
+  nb_joined_++;
+  if(nb_joined_ == clients_.size()) {
+    all_joined_time_ = Clock::now() - start_time_;
+    LOG("swarm: all clients joined in %.3f s", to_usec(all_joined_time_) / 1e6);
+  }
+}
+
+void SwarmInterface::clientDisconnected(SwarmClient& client)
+{
+  nb_disconnected_++;
+  LOG_ERROR("swarm-%u: disconnected by the server", client.index());
+}
+
+void SwarmInterface::matchStarted()
+{
+  nb_matches_++;
+  LOG("swarm: match %u started", nb_matches_);
+}
+
+void SwarmInterface::matchEnded()
+{
+  LOG("swarm: match %u ended", nb_matches_);
+  input_times_.clear();
+}
+
+
+void SwarmInterface::recordInput(PlId plid, Tick tick, Clock::time_point t)
+{
+  auto& times = input_times_[plid];
+  if(times.empty()) {
+    times.resize(INPUT_TIMES_MAX, InputTime{0, Clock::time_point()});
+  }
+  times[tick % INPUT_TIMES_MAX] = {tick, t};
+  nb_inputs_++;
+}
+
+SwarmInterface::Clock::time_point SwarmInterface::inputTime(PlId plid, Tick tick) const
+{
+  auto it = input_times_.find(plid);
+  if(it == input_times_.end()) {
+    return Clock::time_point();
+  }
+  const InputTime& input = it->second[tick % INPUT_TIMES_MAX];
+  return input.tick == tick ? input.time : Clock::time_point();
+}
+
+
+void SwarmInterface::report() const
+{
+  const double elapsed = to_usec(Clock::now() - start_time_) / 1e6;
+  LOG("swarm: %zu clients, %u connected, %u failed, %u joined, %u disconnected",
+      clients_.size(), nb_connected_, nb_connect_failed_, nb_joined_, nb_disconnected_);
+  LOG("swarm: %u matches, %lu inputs in %.1f s (%.0f inputs/s), %u notifications",
+      nb_matches_, nb_inputs_, elapsed, nb_inputs_ / elapsed, nb_notifications_);
+  if(all_joined_time_ != Clock::duration::zero()) {
+    LOG("swarm: storm: all connected in %.3f s, all joined in %.3f s",
+        to_usec(all_connected_time_) / 1e6, to_usec(all_joined_time_) / 1e6);
+  }
+  reportLatency("connect", lat_connect_);
+  reportLatency("join", lat_join_);
+  reportLatency("ready", lat_ready_);
+  reportLatency("rtt", lat_rtt_);
+  reportLatency("input", lat_input_);
+}
+
+void SwarmInterface::reportLatency(const char* name, const LatencyHistogram& h)
+{
+  if(h.count() == 0) {
+    LOG("swarm: %-7s no sample", name);
+    return;
+  }
+  LOG("swarm: %-7s n=%lu  p50=%.2f  p90=%.2f  p99=%.2f  p99.9=%.2f  max=%.2f ms",
+      name, static_cast<unsigned long>(h.count()),
+      h.percentile(50) / 1e3, h.percentile(90) / 1e3, h.percentile(99) / 1e3,
+      h.percentile(99.9) / 1e3, h.max() / 1e3);
+}
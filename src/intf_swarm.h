@@ -0,0 +1,198 @@
+#ifndef INTF_SWARM_H_
+#define INTF_SWARM_H_
+
+#include <memory>
+#include <vector>
+#include <map>
+#include <random>
+#include <chrono>
+#include "client.h"
+#include "stats.h"
+
+class IniFile;
+class SwarmInterface;
+
+
+/** @brief Synthetic client of a swarm.
+ *
+ * Join with a single local player, go ready and play random inputs.
+ * Events are timestamped to measure latencies.
+ *
+ * Only the local field is simulated (see ClientInstance::setLocalFieldsOnly()).
+ * Otherwise each client would simulate the whole match, and the swarm's
+ * cost would grow with the square of its size.
+ */
+class SwarmClient: public ClientInstance::Observer
+{
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  SwarmClient(SwarmInterface& swarm, unsigned int index, boost::asio::io_service& io_service);
+
+  unsigned int index() const { return index_; }
+  const ClientInstance& instance() const { return instance_; }
+
+  /// Connect to the server.
+  void start(const std::string& host, int port);
+  /// Close the connection.
+  void stop();
+  /// Step the local player up to the reference tick.
+  void stepTicks();
+
+  /** @name ClientInstance::Observer methods. */
+  //@{
+  virtual void onChat(Player& pl, const std::string& msg);
+  virtual void onPlayerJoined(Player& pl);
+  virtual void onPlayerChangeNick(Player& pl, const std::string& nick);
+  virtual void onPlayerStateChange(Player& pl);
+  virtual void onPlayerChangeFieldConf(Player& pl);
+  virtual void onStateChange();
+  virtual void onServerChangeFieldConfs();
+  virtual void onPlayerStep(Player& pl);
+  virtual void onPlayerRanked(Player& pl);
+  virtual void onNotification(GameInstance::Severity, const std::string&);
+  virtual void onServerConnect(bool success);
+  virtual void onServerDisconnect();
+  //@}
+
+ private:
+  /// Client instance, timestamping received events.
+  class Instance: public ClientInstance
+  {
+   public:
+    Instance(SwarmClient& client, boost::asio::io_service& io_service):
+        ClientInstance(client, io_service), client_(client) {}
+    virtual void onServerEvent(const netplay::ServerEvent& event);
+   private:
+    SwarmClient& client_;
+  };
+
+  /// Measure latencies of a received event, before its processing.
+  void timestampEvent(const netplay::ServerEvent& event);
+  /// Set the local player ready, if in the lobby.
+  void setReady();
+  /// Return next random input.
+  KeyState nextInput();
+
+  SwarmInterface& swarm_;
+  Instance instance_;
+  unsigned int index_;
+  bool connected_;
+  Player* player_;
+  std::minstd_rand rng_;
+  /// Time of the pending request (connect, join or ready).
+  Clock::time_point request_time_;
+};
+
+
+/** @brief Load generator: swarm of synthetic clients.
+ *
+ * Open many client connections to a server, in a single thread. Clients
+ * join, go ready and play random inputs at the server's tick rate, until
+ * the configured duration is elapsed. Then latency percentiles are logged:
+ *  - connect: TCP connection establishment
+ *  - join: player join request to server response
+ *  - ready: ready state request to server acknowledgement
+ *  - rtt: ping round-trip time
+ *  - input: input step of a player to its reception by other clients
+ *
+ * Inputs of all clients are stepped by a single timer, so that a large
+ * swarm does not saturate its own thread before the server's one.
+ *
+ * Matches start once the server has \e PlayerNumber ready players, it
+ * should thus be configured with the swarm size.
+ */
+class SwarmInterface
+{
+  friend class SwarmClient;
+  static const std::string CONF_SECTION;
+
+ public:
+  typedef SwarmClient::Clock Clock;
+
+  SwarmInterface();
+  ~SwarmInterface();
+  bool run(IniFile& cfg);
+
+ private:
+  /// Maximum number of ticks stepped at once, per client.
+  static constexpr unsigned int CATCHUP_MAX = 4;
+  static const unsigned int CONNECT_TIMEOUT_MS;
+
+  /** @name Latency samples. */
+  //@{
+  LatencyHistogram lat_connect_;
+  LatencyHistogram lat_join_;
+  LatencyHistogram lat_ready_;
+  LatencyHistogram lat_rtt_;
+  LatencyHistogram lat_input_;
+  //@}
+
+  /// Start the next clients, according to the connection rate.
+  void onConnectTimer(const boost::system::error_code& ec);
+  void onTickTimer(const boost::system::error_code& ec);
+  void onEndTimer(const boost::system::error_code& ec);
+  /// Start the tick timer, if not already running.
+  void startTicks(unsigned int tk_usec);
+
+  /** @name Client notifications. */
+  //@{
+  void clientConnected(SwarmClient& client, bool success);
+  void clientJoined(SwarmClient& client);
+  void clientDisconnected(SwarmClient& client);
+  void matchStarted();
+  void matchEnded();
+  //@}
+
+  /// Record the time of a local input, for a given player and tick.
+  void recordInput(PlId plid, Tick tick, Clock::time_point t);
+  /// Return the time of a recorded input, or a null time point.
+  Clock::time_point inputTime(PlId plid, Tick tick) const;
+
+  /// Log results.
+  void report() const;
+  static void reportLatency(const char* name, const LatencyHistogram& h);
+
+  boost::asio::io_service io_service_;
+  std::vector<std::unique_ptr<SwarmClient>> clients_;
+  std::string host_;
+  int port_;
+  unsigned int key_rate_;  ///< percentage of ticks with a key press
+  unsigned int connect_rate_;  ///< clients started per second, 0 for all at once
+  size_t clients_started_;
+  boost::asio::monotone_timer connect_timer_;
+  boost::asio::monotone_timer tick_timer_;
+  boost::asio::monotone_timer end_timer_;
+  bool ticking_;
+  Clock::duration tick_period_;
+  Clock::time_point tick_clock_;  ///< deadline of the next tick
+
+  /** @brief Number of input times kept per player.
+   *
+   * Inputs received later than that are not measured.
+   */
+  static constexpr size_t INPUT_TIMES_MAX = 512;
+  /// Time of a local input.
+  struct InputTime {
+    Tick tick;
+    Clock::time_point time;
+  };
+  /// Time of recent local inputs, indexed by PlId then tick modulo INPUT_TIMES_MAX
+  std::map<PlId, std::vector<InputTime>> input_times_;
+
+  /** @name Storm and session counters. */
+  //@{
+  Clock::time_point start_time_;
+  Clock::duration all_connected_time_;
+  Clock::duration all_joined_time_;
+  unsigned int nb_connected_;
+  unsigned int nb_connect_failed_;
+  unsigned int nb_joined_;
+  unsigned int nb_disconnected_;
+  unsigned int nb_notifications_;
+  unsigned int nb_matches_;
+  unsigned long nb_inputs_;
+  //@}
+};
+
+#endif
@@ -2,11 +2,39 @@
 #include <cstring>
 #include <cerrno>
 #include <stdexcept>
+#include <chrono>
 #include "log.h"
 
 
+std::string LogRecord::format() const
+{
+  if(formatter == nullptr) {
+    return data;
+  }
+  char buf[256];
+  int n = formatter(buf, sizeof(buf), fmt, data);
+  if(n < 0) {
+    return fmt;  // invalid format, log it raw
+  } else if(static_cast<size_t>(n) < sizeof(buf)) {
+    return buf;
+  }
+  std::string s(n+1, '\0');
+  formatter(&s[0], s.size(), fmt, data);
+  s.resize(n);
+  return s;
+}
+
+
 std::unique_ptr<Logger> Logger::logger_;
 
+/// Prefix of messages for each level.
+static const char* const log_level_prefixes[] = {
+  "debug: ",
+  "",
+  "warning: ",
+  "error: ",
+};
+
 void Logger::flog(const char* fmt, ...)
 {
   va_list ap;
@@ -26,6 +54,18 @@ void Logger::vlog(const char* fmt, va_list ap)
   this->log(msg);
 }
 
+LogRecord* Logger::acquireRecord()
+{
+  static thread_local LogRecord record;
+  return &record;
+}
+
+void Logger::commitRecord(LogRecord& rec)
+{
+  const std::string msg = log_level_prefixes[rec.level] + rec.format();
+  this->log(msg.c_str());
+}
+
 void Logger::glog(const char* fmt, ...)
 {
   if(!logger_) {
@@ -42,6 +82,11 @@ void Logger::setLogger(std::unique_ptr<Logger> logger)
   logger_ = std::move(logger);
 }
 
+std::unique_ptr<Logger> Logger::releaseLogger()
+{
+  return std::move(logger_);
+}
+
 
 FileLogger::FileLogger(): fp_(stderr) {}
 
@@ -87,3 +132,100 @@ void FileLogger::log(const char* msg)
   ::fflush(fp_);
 }
 
+
+/// Ring of the current thread, for a given AsyncLogger.
+static thread_local struct {
+  unsigned int logger_id;
+  void* ring;
+} async_logger_thread_ring = {0, nullptr};
+
+static std::atomic<unsigned int> async_logger_next_id(1);
+
+
+AsyncLogger::AsyncLogger(std::unique_ptr<Logger> sink):
+    sink_(std::move(sink)), id_(async_logger_next_id++), stop_(false)
+{
+  thread_ = std::thread(&AsyncLogger::run, this);
+}
+
+AsyncLogger::~AsyncLogger()
+{
+  stop_ = true;
+  thread_.join();
+  this->flush();
+}
+
+void AsyncLogger::log(const char* msg)
+{
+  LogRecord* rec = this->acquireRecord();
+  if(!rec) {
+    return;
+  }
+  rec->level = LOG_LEVEL_INFO;
+  rec->fmt = nullptr;
+  rec->formatter = nullptr;
+  ::strncpy(rec->data, msg, LogRecord::DATA_SIZE-1);
+  rec->data[LogRecord::DATA_SIZE-1] = '\0';
+  this->commitRecord(*rec);
+}
+
+LogRecord* AsyncLogger::acquireRecord()
+{
+  Ring& ring = this->threadRing();
+  const size_t head = ring.head.load(std::memory_order_relaxed);
+  if(head - ring.tail.load(std::memory_order_acquire) >= Ring::SIZE) {
+    ring.dropped.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+  }
+  return &ring.records[head & (Ring::SIZE-1)];
+}
+
+void AsyncLogger::commitRecord(LogRecord&)
+{
+  Ring& ring = this->threadRing();
+  ring.head.store(ring.head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+AsyncLogger::Ring& AsyncLogger::threadRing()
+{
+  if(async_logger_thread_ring.logger_id != id_) {
+    // first record of this thread, create its ring
+    auto ring = std::make_unique<Ring>();
+    async_logger_thread_ring.logger_id = id_;
+    async_logger_thread_ring.ring = ring.get();
+    std::lock_guard<std::mutex> lock(rings_mutex_);
+    rings_.push_back(std::move(ring));
+  }
+  return *static_cast<Ring*>(async_logger_thread_ring.ring);
+}
+
+size_t AsyncLogger::flush()
+{
+  std::lock_guard<std::mutex> lock(rings_mutex_);
+  size_t count = 0;
+  for(auto& ring : rings_) {
+    const size_t head = ring->head.load(std::memory_order_acquire);
+    size_t tail = ring->tail.load(std::memory_order_relaxed);
+    for(; tail != head; ++tail) {
+      const LogRecord& rec = ring->records[tail & (Ring::SIZE-1)];
+      const std::string msg = log_level_prefixes[rec.level] + rec.format();
+      ring->tail.store(tail + 1, std::memory_order_release);
+      sink_->log(msg.c_str());
+      count++;
+    }
+    const unsigned long dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+    if(dropped > 0) {
+      sink_->flog("%lu log messages dropped", dropped);
+    }
+  }
+  return count;
+}
+
+void AsyncLogger::run()
+{
+  while(!stop_) {
+    if(this->flush() == 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+  }
+}
@@ -6,10 +6,105 @@
  */
 
 #include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <string>
 #include <memory>
+#include <vector>
+#include <tuple>
+#include <utility>
+#include <type_traits>
+#include <atomic>
+#include <mutex>
+#include <thread>
 
-/// Logging macro, for convenience.
-#define LOG (::Logger::glog)
+/** @name Log levels.
+ *
+ * Messages below LOG_LEVEL_MIN are removed at compile time.
+ */
+//@{
+#define LOG_LEVEL_DEBUG    0
+#define LOG_LEVEL_INFO     1
+#define LOG_LEVEL_WARNING  2
+#define LOG_LEVEL_ERROR    3
+
+#ifndef LOG_LEVEL_MIN
+# ifdef NDEBUG
+#  define LOG_LEVEL_MIN  LOG_LEVEL_INFO
+# else
+#  define LOG_LEVEL_MIN  LOG_LEVEL_DEBUG
+# endif
+#endif
+//@}
+
+/** @name Logging macros, for convenience.
+ *
+ * Arguments are also given to logCheckFormat(), never called, so that the
+ * compiler checks them against the format.
+ */
+//@{
+#define LOG_POST(level, ...)  (false ? ::logCheckFormat(__VA_ARGS__) : ::Logger::post(level, __VA_ARGS__))
+#if LOG_LEVEL_MIN <= LOG_LEVEL_DEBUG
+# define LOG_DEBUG(...)  LOG_POST(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+# define LOG_DEBUG(...)  ((void)0)
+#endif
+#define LOG(...)  LOG_POST(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARNING(...)  LOG_POST(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define LOG_ERROR(...)  LOG_POST(LOG_LEVEL_ERROR, __VA_ARGS__)
+//@}
+
+#ifdef __GNUC__
+__attribute__((format(printf, 1, 2)))
+#endif
+inline void logCheckFormat(const char*, ...) {}
+
+
+/** @brief Unformatted log message.
+ *
+ * Arguments are packed in \e data, formatting is deferred.
+ */
+struct LogRecord
+{
+  static constexpr size_t DATA_SIZE = 192;
+  /// Format the message, return the result of snprintf().
+  typedef int (*Formatter)(char* buf, size_t size, const char* fmt, const char* data);
+
+  int level;
+  const char* fmt;
+  Formatter formatter;  ///< NULL if data is the formatted message
+  char data[DATA_SIZE];
+
+  /// Format the message into a string.
+  std::string format() const;
+};
+
+
+/** @brief Packing of a log argument.
+ *
+ * Values are copied as-is; strings are copied, since they may not exist
+ * anymore when the message is formatted.
+ */
+template <class T> struct LogArg
+{
+  static_assert(std::is_trivially_copyable<T>::value, "unsupported log argument type");
+  typedef T type;
+  static size_t size(T) { return sizeof(T); }
+  static void pack(char*& p, T v) { std::memcpy(p, &v, sizeof(T)); p += sizeof(T); }
+  static T unpack(const char*& p) { T v; std::memcpy(&v, p, sizeof(T)); p += sizeof(T); return v; }
+};
+
+template <> struct LogArg<const char*>
+{
+  typedef const char* type;
+  /// Replace null strings, like glibc's printf()
+  static const char* str(const char* s) { return s ? s : "(null)"; }
+  static size_t size(const char* s) { return std::strlen(str(s)) + 1; }
+  static void pack(char*& p, const char* s) { s = str(s); size_t n = std::strlen(s) + 1; std::memcpy(p, s, n); p += n; }
+  static const char* unpack(const char*& p) { const char* s = p; p += std::strlen(p) + 1; return s; }
+};
+
+template <> struct LogArg<char*>: public LogArg<const char*> {};
 
 
 class Logger
@@ -22,19 +117,40 @@ class Logger
   void vlog(const char* fmt, va_list ap);
   virtual void log(const char* msg) = 0;
 
-  /// Global logging method.
+  /** @name Record interface.
+   *
+   * Default implementation formats and logs records synchronously.
+   */
+  //@{
+  /// Get a record to fill, \e NULL if it cannot be logged.
+  virtual LogRecord* acquireRecord();
+  /// Log a record returned by acquireRecord().
+  virtual void commitRecord(LogRecord& rec);
+  //@}
+
+  /// Global logging method, used by logging macros.
+  template <class... Args> static void post(int level, const char* fmt, Args... args);
+  /// Global logging method, with immediate formatting.
   static void glog(const char* fmt, ...);
 
+  /// Get global logger
   static Logger* getLogger() { return logger_.get(); }
   /** @brief Set global logger.
    * @note The given pointer is owned by the Logger class.
    */
   static void setLogger(std::unique_ptr<Logger> logger);
-  /// Get global logger
+  /// Unset global logger and return it.
+  static std::unique_ptr<Logger> releaseLogger();
 
  private:
   /// Global logger instance.
   static std::unique_ptr<Logger> logger_;
+
+  /// Unpack record arguments and format them.
+  template <class... Args>
+  static int formatRecord(char* buf, size_t size, const char* fmt, const char* data);
+  template <class... Args, size_t... I>
+  static int formatRecordArgs(char* buf, size_t size, const char* fmt, const char* data, std::index_sequence<I...>);
 };
 
 
@@ -62,4 +178,99 @@ class FileLogger: public Logger
 };
 
 
+/** @brief Asynchronous logger.
+ *
+ * Records are stored in per-thread ring buffers, then formatted and written
+ * to another logger by a background thread. Records are dropped when a
+ * ring is full, logging never blocks.
+ */
+class AsyncLogger: public Logger
+{
+ public:
+  AsyncLogger(std::unique_ptr<Logger> sink);
+  virtual ~AsyncLogger();
+
+  virtual void log(const char* msg);
+  virtual LogRecord* acquireRecord();
+  virtual void commitRecord(LogRecord& rec);
+
+ private:
+  /// Single-producer single-consumer ring of records.
+  struct Ring {
+    static constexpr size_t SIZE = 1024;  // must be a power of 2
+    LogRecord records[SIZE];
+    std::atomic<size_t> head{0};  ///< written by the producer
+    std::atomic<size_t> tail{0};  ///< written by the consumer
+    std::atomic<unsigned long> dropped{0};
+  };
+
+  /// Return the ring of the current thread.
+  Ring& threadRing();
+  /// Write pending records, return the number of written records.
+  size_t flush();
+  void run();
+
+  std::unique_ptr<Logger> sink_;
+  const unsigned int id_;
+  std::mutex rings_mutex_;
+  std::vector<std::unique_ptr<Ring>> rings_;
+  std::atomic<bool> stop_;
+  std::thread thread_;
+};
+
+
+template <class... Args, size_t... I>
+int Logger::formatRecordArgs(char* buf, size_t size, const char* fmt, const char* data, std::index_sequence<I...>)
+{
+  // note: arguments of a braced list are evaluated in order
+  const std::tuple<typename LogArg<Args>::type...> args{LogArg<Args>::unpack(data)...};
+  (void)data;  // unused when there are no arguments
+  (void)args;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#pragma GCC diagnostic ignored "-Wformat-security"
+  return snprintf(buf, size, fmt, std::get<I>(args)...);
+#pragma GCC diagnostic pop
+}
+
+template <class... Args>
+int Logger::formatRecord(char* buf, size_t size, const char* fmt, const char* data)
+{
+  return formatRecordArgs<Args...>(buf, size, fmt, data, std::index_sequence_for<Args...>());
+}
+
+template <class... Args>
+void Logger::post(int level, const char* fmt, Args... args)
+{
+  Logger* logger = logger_.get();
+  if(!logger) {
+    return;
+  }
+  LogRecord* rec = logger->acquireRecord();
+  if(!rec) {
+    return;
+  }
+  rec->level = level;
+  rec->fmt = fmt;
+  typedef int expand[];
+  size_t size = 0;
+  (void)expand{0, (size += LogArg<Args>::size(args), 0)...};
+  if(size <= LogRecord::DATA_SIZE) {
+    rec->formatter = &formatRecord<Args...>;
+    char* p = rec->data;
+    (void)expand{0, (LogArg<Args>::pack(p, args), 0)...};
+    (void)p;  // unused when there are no arguments
+  } else {
+    // too large, format it now (truncated)
+    rec->formatter = nullptr;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#pragma GCC diagnostic ignored "-Wformat-security"
+    snprintf(rec->data, LogRecord::DATA_SIZE, fmt, args...);
+#pragma GCC diagnostic pop
+  }
+  logger->commitRecord(*rec);
+}
+
+
 #endif
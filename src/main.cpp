@@ -20,6 +20,12 @@
 #ifndef WITHOUT_INTF_GUI
 #include "gui/interface.h"
 #endif
+#ifndef WITHOUT_INTF_REPLAY
+#include "intf_replay.h"
+#endif
+#ifndef WITHOUT_INTF_SWARM
+#include "intf_swarm.h"
+#endif
 
 /// Default config file.
 #define CONF_FILE_DEFAULT  "panettopon.ini"
@@ -74,11 +80,23 @@ void usage(void)
 #endif
 #ifndef WITHOUT_INTF_CURSES
       "                      curses  text-based interface\n"
+#endif
+#ifndef WITHOUT_INTF_REPLAY
+      "                      replay  replay verifier\n"
+#endif
+#ifndef WITHOUT_INTF_SWARM
+      "                      swarm   load generator, many synthetic clients\n"
 #endif
       " -n  --nick       nickname\n"
       " -h, --help       display this help\n"
       " -o, --log-file   log messages to the given file (messages are still\n"
       "                  displayed), use \"-\" to write to stderr\n"
+#ifndef WITHOUT_INTF_REPLAY
+      " -r, --replay     verify a replay file, or a directory of replays\n"
+      "                  (implies \"-i replay\")\n"
+      " -s, --stats      write field statistics of verified replays to the\n"
+      "                  given CSV file\n"
+#endif
     );
 }
 
@@ -100,6 +118,8 @@ int main(int /*argc*/, char** argv)
       { 'i', "interface", OPTGET_STR, {} },
       { 'n', "nick", OPTGET_STR, {} },
       { 'o', "log-file", OPTGET_STR, {} },
+      { 'r', "replay", OPTGET_STR, {} },
+      { 's', "stats", OPTGET_STR, {} },
       { 'h', "help", OPTGET_FLAG, {} },
       { 0, 0, OPTGET_NONE, {} }
     };
@@ -114,6 +134,8 @@ int main(int /*argc*/, char** argv)
     char* host = NULL;
     const char* nick = NULL;
     const char* intfarg = NULL;
+    const char* replay = NULL;
+    const char* stats = NULL;
 
     char* const* opt_args = argv+1;
     OptGetItem* opt;
@@ -150,6 +172,12 @@ int main(int /*argc*/, char** argv)
           case 'o':
             file_logger.setFile( opt->value.str );
             break;
+          case 'r':
+            replay = opt->value.str;
+            break;
+          case 's':
+            stats = opt->value.str;
+            break;
           case 'h':
             usage();
             return 0;
@@ -183,6 +211,9 @@ int main(int /*argc*/, char** argv)
       return 2;
     }
 
+    // log file is set, log asynchronously from now
+    Logger::setLogger(std::make_unique<AsyncLogger>(Logger::releaseLogger()));
+
     // load configuration
     IniFile cfg;
     if( conf_file == NULL && ::access(CONF_FILE_DEFAULT, R_OK) == 0 ) {
@@ -207,6 +238,13 @@ int main(int /*argc*/, char** argv)
     if( nick != NULL ) {
       cfg.set("Client.Nick", nick);
     }
+    if( replay != NULL ) {
+      cfg.set("Global.Interface", "replay");
+      cfg.set("Replay.Path", replay);
+    }
+    if( stats != NULL ) {
+      cfg.set("Replay.StatsFile", stats);
+    }
 
     // init randomness
     ::srand( current_time() );
@@ -229,6 +267,18 @@ int main(int /*argc*/, char** argv)
       gui::GuiInterface intf;
       ret = intf.run(cfg);
     } else
+#endif
+#ifndef WITHOUT_INTF_REPLAY
+    if( intfstr == "replay" ) {
+      ReplayInterface intf;
+      ret = intf.run(cfg);
+    } else
+#endif
+#ifndef WITHOUT_INTF_SWARM
+    if( intfstr == "swarm" ) {
+      SwarmInterface intf;
+      ret = intf.run(cfg);
+    } else
 #endif
     {
       LOG("invalid interface: '%s'", intfstr.c_str());
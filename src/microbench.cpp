@@ -0,0 +1,537 @@
+/** @file
+ * @brief Game engine microbenchmarks.
+ *
+ * A corpus of fixed scenarios (initial grid and input script) is played on a
+ * single field. For each scenario, the time of Field::step() is measured
+ * over the script. Only the public API is used: the cost of raise() is the
+ * extra time of a step raising the initial state, and garbage matching is
+ * timed as the step of the script which first matches garbage blocks.
+ *
+ * Only the game engine is linked: no networking, no interface. Scenarios are
+ * deterministic and results are medians over several runs, so that output can
+ * be compared between revisions. The field state hash at the end of each
+ * script tells whether the engine still does the same work.
+ */
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include <chrono>
+#include "game.h"
+#include "optget.h"
+
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+/// Seed of scenario fields.
+const uint32_t FIELD_SEED = 42;
+/// Number of timed single steps per run, for raise and garbage match.
+const unsigned int CALLS_PER_RUN = 100;
+
+
+/// Input script, played from the initial state.
+enum class Script {
+  IDLE,  ///< no input
+  PLAY,  ///< cursor walk, with a swap after each move
+  SWAP,  ///< a single swap, then no input
+  RAISE,  ///< manual raise key held down
+};
+
+/// Benchmark scenario.
+struct Scenario {
+  const char* name;
+  /** @brief Initial grid, top line first, raising line last.
+   *
+   * One character per block: '.' for none, '1' to '5' for colors.
+   * If \e NULL, \e fill random lines are generated.
+   */
+  const char* const* grid;
+  int fill;
+  /// Full-width combo garbages, dropped and laid before the measure
+  unsigned int garbages;
+  FieldPos cursor;  ///< cursor position, reached before the measure
+  Script script;
+  Tick ticks;
+};
+
+/// Stair of horizontal matches, each one triggering the next: a 10-chain.
+const char* const GRID_CHAIN10[FIELD_HEIGHT+1] = {
+  "......",
+  "......",
+  "......",
+  "......",
+  "..34..",
+  "..13..",
+  "..31..",
+  ".1224.",
+  ".3113.",
+  ".2121.",
+  "322124",
+  "111212",
+  "345123",
+};
+
+/// A swap on the bottom line matches blocks under stacked garbages.
+const char* const GRID_GARBAGE[FIELD_HEIGHT+1] = {
+  "......",
+  "......",
+  "......",
+  "......",
+  "......",
+  "......",
+  "......",
+  "......",
+  "......",
+  "......",
+  "......",
+  "112134",
+  "345123",
+};
+
+const Scenario SCENARIOS[] = {
+  { "empty", nullptr, 0, 0, FieldPos(2,6), Script::IDLE, 600 },
+  { "start", nullptr, 6, 0, FieldPos(2,3), Script::PLAY, 600 },
+  { "tall", nullptr, 11, 0, FieldPos(2,6), Script::PLAY, 600 },
+  { "chain10", GRID_CHAIN10, 0, 0, FieldPos(2,6), Script::IDLE, 1200 },
+  { "garbage", GRID_GARBAGE, 0, 4, FieldPos(2,1), Script::SWAP, 600 },
+  { "raise", nullptr, 2, 0, FieldPos(2,6), Script::RAISE, 180 },
+};
+
+
+/// Field configuration of all scenarios, values of the default "level 1".
+FieldConf benchFieldConf()
+{
+  FieldConf conf;
+  conf.name = "bench";
+  conf.swap_tk = 3;
+  conf.manual_raise_speed = 3276;
+  conf.raise_speeds = {66, 69, 78};
+  conf.raise_speed_changes = {900, 1800};
+  conf.raise_steps = 1;
+  conf.stop_combo_0 = 60;
+  conf.stop_combo_k = 20;
+  conf.stop_chain_0 = 120;
+  conf.stop_chain_k = 20;
+  conf.lost_tk = 120;
+  conf.gb_hang_tk = 90;
+  conf.flash_tk = 44;
+  conf.levitate_tk = 12;
+  conf.pop_tk = 9;
+  conf.pop0_tk = 22;
+  conf.transform_tk = 40;
+  conf.color_nb = 5;
+  conf.raise_adjacent = FieldConf::RaiseAdjacent::ALWAYS;
+  assert( conf.isValid() );
+  return conf;
+}
+
+
+/// Return the median of samples.
+double median(std::vector<double> v)
+{
+  assert( !v.empty() );
+  std::nth_element(v.begin(), v.begin() + v.size()/2, v.end());
+  return v[v.size()/2];
+}
+
+/// Return the time of an empty timed section, in nanoseconds.
+double timerOverhead()
+{
+  std::vector<double> samples;
+  for(unsigned int i=0; i<1000; i++) {
+    const auto t0 = Clock::now();
+    const auto t1 = Clock::now();
+    samples.push_back(std::chrono::duration<double, std::nano>(t1 - t0).count());
+  }
+  return median(samples);
+}
+
+}
+
+
+/// Measures of a scenario.
+struct FieldBenchmarkResult
+{
+  Tick steps = 0;  ///< steps played by the script
+  double step_ns = 0;
+  double raise_ns = -1;  ///< extra time of a raising step, negative if no raise
+  double match_garbage_ns = -1;  ///< step matching garbages, negative if none
+  uint32_t hash = 0;  ///< field state hash at the end of the script
+};
+
+
+/** @brief Field driven through a scenario.
+ *
+ * The initial state is saved once the field is set up, and restored before
+ * each timed run.
+ */
+class FieldBenchmark
+{
+ public:
+  typedef FieldBenchmarkResult Result;
+
+  FieldBenchmark(const FieldConf& conf, const Scenario& scenario);
+
+  /// Run the scenario several times, return median timings.
+  Result run(unsigned int runs, double overhead_ns);
+
+ private:
+  /// Set up the initial grid, garbages and cursor.
+  void setUp();
+  /// Return true if all blocks are at rest and no garbage is dropping.
+  bool isSettled() const;
+  /// Build the key of each scripted tick.
+  void buildKeys();
+  /// Play the script, save the state before the first garbage match.
+  void findGarbageMatch();
+  /// Restore a saved state.
+  void restore(const netplay::FieldState& state);
+  /// Return the median time of a single step from a given state.
+  double timeStep(const netplay::FieldState& state, KeyState keys, unsigned int runs, double overhead_ns);
+
+  const Scenario& scenario_;
+  Field field_;
+  netplay::FieldState initial_state_;
+  std::vector<KeyState> keys_;
+  /// State before the step which first matches garbages
+  netplay::FieldState garbage_match_state_;
+  KeyState garbage_match_keys_;
+  bool has_garbage_match_;
+};
+
+
+FieldBenchmark::FieldBenchmark(const FieldConf& conf, const Scenario& scenario):
+    scenario_(scenario), field_(1, conf, FIELD_SEED),
+    garbage_match_keys_(0), has_garbage_match_(false)
+{
+  this->setUp();
+  this->buildKeys();
+  this->findGarbageMatch();
+}
+
+void FieldBenchmark::setUp()
+{
+  Field& fld = field_;
+  fld.initMatch();
+  if(scenario_.grid) {
+    std::string data;
+    for(int y=0; y<=FIELD_HEIGHT; y++) {
+      const char* line = scenario_.grid[FIELD_HEIGHT-y];
+      assert( ::strlen(line) == FIELD_WIDTH );
+      for(int x=0; x<FIELD_WIDTH; x++) {
+        data.push_back(line[x] == '.' ? 0 : line[x] - '0');
+      }
+    }
+    if(!fld.setGridColorsFromBytes(data)) {
+      throw std::runtime_error(std::string("invalid grid: ")+scenario_.name);
+    }
+  } else {
+    fld.fillRandom(scenario_.fill);
+  }
+  fld.enableSwap(true);
+  fld.enableRaise(true);
+
+  for(unsigned int i=0; i<scenario_.garbages; i++) {
+    auto gb = std::make_unique<Garbage>();
+    gb->gbid = i+1;
+    gb->from = nullptr;
+    gb->to = &fld;
+    gb->type = Garbage::Type::COMBO;
+    gb->size = FieldPos(FIELD_WIDTH, 1);
+    fld.insertHangingGarbage(std::move(gb), i);
+  }
+  while(fld.hangingGarbageCount() > 0) {
+    fld.waitGarbageDrop(fld.hangingGarbage(0));
+    fld.dropNextGarbage();
+  }
+
+  // move the cursor and let garbages fall, releasing keys between moves
+  const FieldPos& target = scenario_.cursor;
+  KeyState keys = 0;
+  for(unsigned int i=0; ; i++) {
+    const FieldPos& cursor = fld.cursor();
+    if(cursor.x == target.x && cursor.y == target.y && this->isSettled()) {
+      break;
+    }
+    if(i > 1000) {
+      throw std::runtime_error(std::string("scenario setup failed: ")+scenario_.name);
+    }
+    if(keys != 0) {
+      keys = 0;
+    } else if(cursor.y != target.y) {
+      keys = cursor.y < target.y ? GAME_KEY_UP : GAME_KEY_DOWN;
+    } else if(cursor.x != target.x) {
+      keys = cursor.x < target.x ? GAME_KEY_RIGHT : GAME_KEY_LEFT;
+    }
+    fld.step(keys);
+  }
+
+  fld.setStateToPacket(initial_state_);
+}
+
+bool FieldBenchmark::isSettled() const
+{
+  if(!field_.droppedGarbages().empty()) {
+    return false;
+  }
+  for(int y=1; y<=FIELD_HEIGHT; y++) {
+    for(int x=0; x<FIELD_WIDTH; x++) {
+      const Block& bk = field_.block(x, y);
+      if(!bk.isNone() && !bk.isState(BkColor::REST) && !bk.isState(BkGarbage::REST)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void FieldBenchmark::buildKeys()
+{
+  // moves end on the starting position
+  static const KeyState PLAY_MOVES[] = {
+    GAME_KEY_RIGHT, GAME_KEY_UP, GAME_KEY_RIGHT, GAME_KEY_DOWN,
+    GAME_KEY_LEFT, GAME_KEY_DOWN, GAME_KEY_LEFT, GAME_KEY_UP,
+  };
+  static const size_t PLAY_MOVES_NB = sizeof(PLAY_MOVES)/sizeof(*PLAY_MOVES);
+
+  keys_.assign(scenario_.ticks, 0);
+  switch(scenario_.script) {
+    case Script::IDLE:
+      break;
+    case Script::PLAY:
+      // move, release, swap, release
+      for(size_t i=0; i<keys_.size(); i+=4) {
+        keys_[i] = PLAY_MOVES[(i/4) % PLAY_MOVES_NB];
+        if(i+2 < keys_.size()) {
+          keys_[i+2] = GAME_KEY_SWAP;
+        }
+      }
+      break;
+    case Script::SWAP:
+      keys_[0] = GAME_KEY_SWAP;
+      break;
+    case Script::RAISE:
+      std::fill(keys_.begin(), keys_.end(), GAME_KEY_RAISE);
+      break;
+  }
+}
+
+void FieldBenchmark::findGarbageMatch()
+{
+  Field& fld = field_;
+  auto has_flashing_garbage = [&fld]() {
+    for(int y=1; y<=FIELD_HEIGHT; y++) {
+      for(int x=0; x<FIELD_WIDTH; x++) {
+        if(fld.block(x, y).isState(BkGarbage::FLASH)) {
+          return true;
+        }
+      }
+    }
+    return false;
+  };
+
+  this->restore(initial_state_);
+  netplay::FieldState state;
+  for(KeyState keys : keys_) {
+    if(fld.lost()) {
+      break;
+    }
+    fld.setStateToPacket(state);
+    fld.step(keys);
+    if(has_flashing_garbage()) {
+      garbage_match_state_.Swap(&state);
+      garbage_match_keys_ = keys;
+      has_garbage_match_ = true;
+      break;
+    }
+  }
+}
+
+void FieldBenchmark::restore(const netplay::FieldState& state)
+{
+  if(!field_.setStateFromPacket(state)) {
+    throw std::runtime_error("failed to restore field state");
+  }
+}
+
+double FieldBenchmark::timeStep(const netplay::FieldState& state, KeyState keys, unsigned int runs, double overhead_ns)
+{
+  Field& fld = field_;
+  std::vector<double> samples;
+  for(unsigned int i=0; i<runs*CALLS_PER_RUN; i++) {
+    this->restore(state);
+    const auto t0 = Clock::now();
+    fld.step(keys);
+    const auto t1 = Clock::now();
+    samples.push_back(std::chrono::duration<double, std::nano>(t1 - t0).count());
+  }
+  return std::max(0., median(samples) - overhead_ns);
+}
+
+FieldBenchmark::Result FieldBenchmark::run(unsigned int runs, double overhead_ns)
+{
+  Result result;
+  Field& fld = field_;
+  std::vector<double> samples;
+
+  // steps
+  for(unsigned int i=0; i<runs; i++) {
+    this->restore(initial_state_);
+    Tick steps = 0;
+    const auto t0 = Clock::now();
+    for(KeyState keys : keys_) {
+      if(fld.lost()) {
+        break;
+      }
+      fld.step(keys);
+      steps++;
+    }
+    const auto t1 = Clock::now();
+    if(i == 0) {
+      result.steps = steps;
+      result.hash = fld.stateHash();
+    } else if(fld.stateHash() != result.hash) {
+      throw std::runtime_error(std::string("scenario is not deterministic: ")+scenario_.name);
+    }
+    samples.push_back(std::chrono::duration<double, std::nano>(t1 - t0).count() / std::max<Tick>(steps, 1));
+  }
+  result.step_ns = median(samples);
+
+  // raise, on the initial state: a full raise progress raises on next step
+  {
+    netplay::FieldState idle_state = initial_state_;
+    idle_state.set_raise_progress(0);
+    netplay::FieldState raise_state = initial_state_;
+    raise_state.set_raise_progress(Field::RAISE_PROGRESS_MAX);
+    const double idle_ns = this->timeStep(idle_state, 0, runs, overhead_ns);
+    const double raise_ns = this->timeStep(raise_state, 0, runs, overhead_ns);
+    if(fld.stepInfo().raised) {
+      result.raise_ns = std::max(0., raise_ns - idle_ns);
+    }  // else: raise is stopped (e.g. matching or full field)
+  }
+
+  // first garbage match of the script
+  if(has_garbage_match_) {
+    result.match_garbage_ns = this->timeStep(garbage_match_state_, garbage_match_keys_, runs, overhead_ns);
+  }
+
+  return result;
+}
+
+
+namespace {
+
+/// Print program usage.
+void usage()
+{
+  printf(
+      "PaNettoPon game engine microbenchmarks\n"
+      "\n"
+      "usage: panettopon_microbench [OPTIONS] [SCENARIO ...]\n"
+      "\n"
+      " -n, --runs       timed runs per scenario (default: 25)\n"
+      " -h, --help       display this help\n"
+      "\n"
+      "Scenarios:"
+    );
+  for(const auto& scenario : SCENARIOS) {
+    printf(" %s", scenario.name);
+  }
+  printf("\n");
+}
+
+}
+
+
+/** @brief Entry point.
+ *
+ * @retval  0  benchmark completed
+ * @retval  1  fatal error
+ * @retval  2  invalid arguments
+ */
+int main(int /*argc*/, char** argv)
+{
+  try {
+    OptGetItem opts[] = {
+      { 'n', "runs", OPTGET_INT, {} },
+      { 'h', "help", OPTGET_FLAG, {} },
+      { 0, 0, OPTGET_NONE, {} }
+    };
+
+    unsigned int runs = 25;
+    std::vector<std::string> names;
+
+    char* const* opt_args = argv+1;
+    OptGetItem* opt;
+    int ret;
+    for(;;) {
+      ret = optget_parse(opts, &opt_args, &opt);
+      if( ret != OPTGET_OK ) {
+        break;
+      }
+      switch( opt->short_name ) {
+        case 'n':
+          if( opt->value.i <= 0 ) {
+            fprintf(stderr, "invalid number of runs\n");
+            return 2;
+          }
+          runs = opt->value.i;
+          break;
+        case 'h':
+          usage();
+          return 0;
+        case 0:
+          names.push_back(opt->value.str);
+          break;
+        default:
+          fprintf(stderr, "unexpected argument\n");
+          return 2;
+      }
+    }
+    if( ret != OPTGET_LAST ) {
+      fprintf(stderr, "invalid arguments, see --help\n");
+      return 2;
+    }
+    for(const auto& name : names) {
+      if(std::none_of(std::begin(SCENARIOS), std::end(SCENARIOS),
+                      [&name](const Scenario& s) { return name == s.name; })) {
+        fprintf(stderr, "unknown scenario: %s\n", name.c_str());
+        return 2;
+      }
+    }
+
+    const FieldConf conf = benchFieldConf();
+    const double overhead_ns = timerOverhead();
+    printf("%-8s %6s %9s %9s %10s %8s\n",
+           "scenario", "steps", "ns/step", "ns/raise", "ns/gbstep", "hash");
+    for(const auto& scenario : SCENARIOS) {
+      if(!names.empty() && std::find(names.begin(), names.end(), scenario.name) == names.end()) {
+        continue;
+      }
+      FieldBenchmark bench(conf, scenario);
+      const FieldBenchmark::Result r = bench.run(runs, overhead_ns);
+      char raise[16] = "-";
+      if(r.raise_ns >= 0) {
+        snprintf(raise, sizeof(raise), "%.0f", r.raise_ns);
+      }
+      char match_garbage[16] = "-";
+      if(r.match_garbage_ns >= 0) {
+        snprintf(match_garbage, sizeof(match_garbage), "%.0f", r.match_garbage_ns);
+      }
+      printf("%-8s %6u %9.1f %9s %10s %08x\n",
+             scenario.name, r.steps, r.step_ns, raise, match_garbage, r.hash);
+      fflush(stdout);
+    }
+    return 0;
+  } catch(const std::exception& e) {
+    fprintf(stderr, "fatal error: %s\n", e.what());
+    return 1;
+  }
+}
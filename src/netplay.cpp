@@ -1,6 +1,12 @@
 #include <cstring>
+#include <cstdio>
+#include <algorithm>
 #include <functional>
 #include <boost/asio.hpp>
+#include <zlib.h>
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+#include <sys/stat.h>
+#endif
 #include "netplay.h"
 #include "netplay.pb.h"
 #include "log.h"
@@ -13,10 +19,232 @@ using namespace asio::ip;
 namespace netplay {
 
 
+TcpTransport::TcpTransport(asio::io_service& io_service):
+    socket_(io_service)
+{
+}
+
+void TcpTransport::asyncRead(char* buf, size_t size, Handler handler)
+{
+  asio::async_read(socket_, asio::buffer(buf, size),
+                   [handler](const boost::system::error_code& ec, size_t) { handler(ec); });
+}
+
+void TcpTransport::asyncWrite(const char* buf, size_t size, Handler handler)
+{
+  asio::async_write(socket_, asio::buffer(buf, size),
+                    [handler](const boost::system::error_code& ec, size_t) { handler(ec); });
+}
+
+void TcpTransport::close()
+{
+  socket_.close();
+}
+
+
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+LocalTransport::LocalTransport(asio::io_service& io_service):
+    socket_(io_service)
+{
+}
+
+void LocalTransport::asyncRead(char* buf, size_t size, Handler handler)
+{
+  asio::async_read(socket_, asio::buffer(buf, size),
+                   [handler](const boost::system::error_code& ec, size_t) { handler(ec); });
+}
+
+void LocalTransport::asyncWrite(const char* buf, size_t size, Handler handler)
+{
+  asio::async_write(socket_, asio::buffer(buf, size),
+                    [handler](const boost::system::error_code& ec, size_t) { handler(ec); });
+}
+
+void LocalTransport::close()
+{
+  socket_.close();
+}
+#endif
+
+
+struct PipeTransport::Buffer
+{
+  std::mutex mutex;
+  std::string data;  ///< written data, not read yet
+  size_t pos = 0;  ///< position of unread data
+  bool eof = false;  ///< writing end closed
+  bool reader_open = true;  ///< false once the reading end is closed
+  /// io_service of the reading end
+  asio::io_service* io_service = nullptr;
+
+  /** @name Pending read. */
+  //@{
+  char* read_buf = nullptr;
+  size_t read_size = 0;
+  Handler read_handler;
+  //@}
+};
+
+PipeTransport::Pair PipeTransport::newPair(asio::io_service& io_first, asio::io_service& io_second)
+{
+  auto buffer_up = std::make_shared<Buffer>();
+  buffer_up->io_service = &io_second;
+  auto buffer_down = std::make_shared<Buffer>();
+  buffer_down->io_service = &io_first;
+  Pair ret;
+  ret.first.reset(new PipeTransport(io_first, buffer_down, buffer_up));
+  ret.second.reset(new PipeTransport(io_second, buffer_up, buffer_down));
+  return ret;
+}
+
+PipeTransport::PipeTransport(asio::io_service& io_service, std::shared_ptr<Buffer> in, std::shared_ptr<Buffer> out):
+    io_service_(io_service), in_(in), out_(out), open_(true)
+{
+}
+
+PipeTransport::~PipeTransport()
+{
+  if(open_) {
+    this->close();
+  }
+}
+
+void PipeTransport::asyncRead(char* buf, size_t size, Handler handler)
+{
+  if(!open_) {
+    io_service_.post(std::bind(handler, asio::error::operation_aborted));
+    return;
+  }
+  std::lock_guard<std::mutex> lock(in_->mutex);
+  assert( !in_->read_handler );
+  in_->read_buf = buf;
+  in_->read_size = size;
+  in_->read_handler = handler;
+  completeRead(*in_);
+}
+
+void PipeTransport::asyncWrite(const char* buf, size_t size, Handler handler)
+{
+  if(!open_) {
+    io_service_.post(std::bind(handler, asio::error::operation_aborted));
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(out_->mutex);
+    if(out_->reader_open) {
+      out_->data.append(buf, size);
+      completeRead(*out_);
+    }
+  }
+  // data is buffered by the other end
+  io_service_.post(std::bind(handler, boost::system::error_code()));
+}
+
+void PipeTransport::close()
+{
+  if(!open_) {
+    return;
+  }
+  open_ = false;
+  {
+    std::lock_guard<std::mutex> lock(in_->mutex);
+    in_->reader_open = false;
+    in_->data.clear();
+    in_->pos = 0;
+    if(in_->read_handler) {
+      io_service_.post(std::bind(std::move(in_->read_handler), asio::error::operation_aborted));
+      in_->read_handler = nullptr;
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(out_->mutex);
+    out_->eof = true;
+    completeRead(*out_);
+  }
+}
+
+void PipeTransport::completeRead(Buffer& buffer)
+{
+  if(!buffer.read_handler) {
+    return;
+  }
+  boost::system::error_code ec;
+  if(buffer.data.size() - buffer.pos >= buffer.read_size) {
+    ::memcpy(buffer.read_buf, buffer.data.data() + buffer.pos, buffer.read_size);
+    buffer.pos += buffer.read_size;
+    // drop read data once it is the largest part of the buffer
+    if(buffer.pos == buffer.data.size()) {
+      buffer.data.clear();
+      buffer.pos = 0;
+    } else if(buffer.pos > 4096 && 2*buffer.pos > buffer.data.size()) {
+      buffer.data.erase(0, buffer.pos);
+      buffer.pos = 0;
+    }
+  } else if(buffer.eof) {
+    ec = asio::error::eof;
+  } else {
+    return;
+  }
+  buffer.io_service->post(std::bind(std::move(buffer.read_handler), ec));
+  buffer.read_handler = nullptr;
+  buffer.read_buf = nullptr;
+  buffer.read_size = 0;
+}
+
+
+UdpTransport::UdpTransport(asio::io_service& io_service, const Endpoint& local):
+    socket_(io_service, local), buf_(65536)
+{
+  socket_.non_blocking(true);
+}
+
+void UdpTransport::start(ReceiveHandler handler)
+{
+  handler_ = handler;
+  this->receiveNext();
+}
+
+void UdpTransport::sendTo(const Endpoint& endpoint, const std::string& data)
+{
+  // datagrams are not queued: drop them if the socket buffer is full
+  boost::system::error_code ec;
+  socket_.send_to(asio::buffer(data), endpoint, 0, ec);
+}
+
+void UdpTransport::close()
+{
+  handler_ = nullptr;
+  socket_.close();
+}
+
+void UdpTransport::receiveNext()
+{
+  auto self = shared_from_this();
+  socket_.async_receive_from(
+      asio::buffer(buf_), sender_,
+      std::bind(&UdpTransport::onReceive, self, std::placeholders::_1, std::placeholders::_2));
+}
+
+void UdpTransport::onReceive(const boost::system::error_code& ec, size_t size)
+{
+  if( ec == asio::error::operation_aborted || !socket_.is_open() ) {
+    return;
+  }
+  if( !ec && handler_ ) {
+    handler_(sender_, std::string(buf_.data(), size));
+  }
+  // errors (e.g. ICMP port unreachable) are not fatal
+  if( socket_.is_open() ) {
+    this->receiveNext();
+  }
+}
+
+
 const uint32_t BaseSocket::pkt_size_max = 50*1024;
+const uint32_t BaseSocket::pkt_compressed_flag = 0x80000000;
 
 BaseSocket::BaseSocket(asio::io_service& io_service):
-    socket_(io_service)
+    io_service_(io_service), transport_(std::make_unique<TcpTransport>(io_service))
 {
 }
 
@@ -27,21 +255,29 @@ BaseSocket::~BaseSocket()
 void BaseSocket::close()
 {
   // socket may be closed due to the error, but we still have to trigger events
-  if( socket_.is_open() ) {
-    socket_.close();
+  if( transport_->isOpen() ) {
+    transport_->close();
   }
 }
 
+tcp::socket& BaseSocket::tcpSocket()
+{
+  assert( dynamic_cast<TcpTransport*>(transport_.get()) != nullptr );
+  return static_cast<TcpTransport&>(*transport_).socket();
+}
+
 
 PacketSocket::PacketSocket(asio::io_service& io_service):
     BaseSocket(io_service),
-    delayed_close_(false), read_size_(0), read_buf_(NULL), read_buf_size_(0)
+    delayed_close_(false), write_queue_size_(0), compress_min_size_(0),
+    read_size_(0), read_compressed_(false), read_buf_(NULL), read_buf_size_(0), inflate_buf_(NULL)
 {
 }
 
 PacketSocket::~PacketSocket()
 {
   delete[] read_buf_;
+  delete[] inflate_buf_;
 }
 
 void PacketSocket::closeAfterWrites()
@@ -61,6 +297,8 @@ void PacketSocket::onReadSize(const boost::system::error_code& ec)
     uint32_t n_size;
     ::memcpy(&n_size, read_size_buf_, sizeof(n_size));
     read_size_ = asio::detail::socket_ops::network_to_host_long(n_size);
+    read_compressed_ = (read_size_ & pkt_compressed_flag) != 0;
+    read_size_ &= ~pkt_compressed_flag;
     if( read_size_ > pkt_size_max ) {
       this->processError("packet is too large");
     } else if( read_size_ == 0 ) {
@@ -80,8 +318,8 @@ void PacketSocket::onReadSize(const boost::system::error_code& ec)
         read_buf_ = new char[read_buf_size_];
       }
       auto self = std::static_pointer_cast<PacketSocket>(shared_from_this());
-      asio::async_read(
-          socket_, asio::buffer(read_buf_, read_size_),
+      transport_->asyncRead(
+          read_buf_, read_size_,
           std::bind(&PacketSocket::onReadData, self, std::placeholders::_1));
     }
   } else {
@@ -95,8 +333,26 @@ void PacketSocket::onReadData(const boost::system::error_code& ec)
     return;
   }
   if( !ec ) {
+    const char* data = read_buf_;
+    uLongf data_size = read_size_;
+    if( read_compressed_ ) {
+      if( inflate_buf_ == NULL ) {
+        inflate_buf_ = new char[pkt_size_max];
+      }
+      data = inflate_buf_;
+      data_size = pkt_size_max;
+      int ret = ::uncompress(reinterpret_cast<Bytef*>(inflate_buf_), &data_size,
+                             reinterpret_cast<const Bytef*>(read_buf_), read_size_);
+      if( ret == Z_BUF_ERROR ) {
+        this->processError("packet is too large");
+        return;
+      } else if( ret != Z_OK ) {
+        this->processError("invalid compressed packet");
+        return;
+      }
+    }
     Packet pkt;
-    if(!pkt.ParseFromArray(read_buf_, read_size_)) {
+    if(!pkt.ParseFromArray(data, data_size)) {
       this->processError("invalid packet");
     } else if(pkt.pkt_case() == Packet::PKT_NOT_SET) {
       LOG("packet without data");
@@ -115,7 +371,7 @@ void PacketSocket::onReadData(const boost::system::error_code& ec)
   }
 }
 
-std::string PacketSocket::serializePacket(const Packet& pkt)
+std::string PacketSocket::serializePacket(const Packet& pkt, size_t compress_min_size)
 {
   // prepare buffer
   uint32_t pkt_size = pkt.ByteSize();
@@ -131,14 +387,38 @@ std::string PacketSocket::serializePacket(const Packet& pkt)
     throw std::runtime_error("packet serialization failed");
   }
 
-  return std::string(buf, sizeof(buf));
+  std::string data(buf, sizeof(buf));
+  if( compress_min_size > 0 && pkt_size >= compress_min_size ) {
+    std::string z_data = compressSerialized(data);
+    if( !z_data.empty() ) {
+      return z_data;
+    }
+  }
+  return data;
+}
+
+std::string PacketSocket::compressSerialized(const std::string& data)
+{
+  const size_t header_size = sizeof(uint32_t);
+  const uLong pkt_size = data.size() - header_size;
+  uLongf z_size = ::compressBound(pkt_size);
+  std::string z_data(header_size + z_size, '\0');
+  int ret = ::compress(reinterpret_cast<Bytef*>(&z_data[header_size]), &z_size,
+                       reinterpret_cast<const Bytef*>(data.data() + header_size), pkt_size);
+  if( ret != Z_OK || z_size >= pkt_size ) {
+    return std::string();
+  }
+  z_data.resize(header_size + z_size);
+  uint32_t n_size = asio::detail::socket_ops::host_to_network_long(z_size | pkt_compressed_flag);
+  ::memcpy(&z_data[0], &n_size, sizeof(n_size));
+  return z_data;
 }
 
 void PacketSocket::readNext()
 {
   auto self = std::static_pointer_cast<PacketSocket>(shared_from_this());
-  asio::async_read(
-      socket_, asio::buffer(read_size_buf_, sizeof(read_size_buf_)),
+  transport_->asyncRead(
+      read_size_buf_, sizeof(read_size_buf_),
       std::bind(&PacketSocket::onReadSize, self, std::placeholders::_1));
 }
 
@@ -148,6 +428,7 @@ void PacketSocket::onWrite(const boost::system::error_code& ec)
     return;
   }
   if( !ec ) {
+    write_queue_size_ -= write_queue_.front()->size();
     write_queue_.pop();
     if( ! write_queue_.empty() ) {
       this->writeNext();
@@ -166,16 +447,24 @@ void PacketSocket::onWrite(const boost::system::error_code& ec)
 void PacketSocket::writeNext()
 {
   auto self = std::static_pointer_cast<PacketSocket>(shared_from_this());
-  asio::async_write(
-      socket_, asio::buffer(write_queue_.front()),
+  const std::string& data = *write_queue_.front();
+  transport_->asyncWrite(
+      data.data(), data.size(),
       std::bind(&PacketSocket::onWrite, self, std::placeholders::_1));
 }
 
 void PacketSocket::writeRaw(const std::string& s)
 {
   assert( s.size() > 0 && s.size() <= pkt_size_max );
+  this->writeShared(std::make_shared<const std::string>(s));
+}
+
+void PacketSocket::writeShared(std::shared_ptr<const std::string> data)
+{
+  assert( data->size() > 0 );
   bool process_next = write_queue_.empty();
-  write_queue_.push(s);
+  write_queue_size_ += data->size();
+  write_queue_.push(std::move(data));
   if( process_next ) {
     this->writeNext();
   }
@@ -184,7 +473,9 @@ void PacketSocket::writeRaw(const std::string& s)
 
 PeerSocket::PeerSocket(ServerSocket& server):
     PacketSocket(server.io_service()),
-    server_(&server), has_error_(false)
+    server_(&server), input_token_(0), has_input_endpoint_(false),
+    has_error_(false), field_conf_hashes_(false), spectator_(false), spectator_synced_(false),
+    index_(0), batch_seq_(0), batch_offset_(0)
 {
 }
 
@@ -214,7 +505,18 @@ void PeerSocket::processError(const std::string& msg, const boost::system::error
 void PeerSocket::processPacket(const Packet& pkt)
 {
   if(server_) {
-    if(pkt.has_client_event()) {
+    if(pkt.has_framing()) {
+      // options are cumulative
+      if(pkt.framing().compression()) {
+        this->setCompressMinSize(server_->compress_min_size_);
+      }
+      if(pkt.framing().input_channel() && server_->input_channel_ && input_token_ == 0) {
+        this->openInputChannel();
+      }
+      if(pkt.framing().field_conf_hash()) {
+        field_conf_hashes_ = true;
+      }
+    } else if(pkt.has_client_event()) {
       server_->observer_.onPeerClientEvent(*this, pkt.client_event());
     } else if(pkt.has_client_command()) {
       server_->observer_.onPeerClientCommand(*this, pkt.client_command());
@@ -222,21 +524,42 @@ void PeerSocket::processPacket(const Packet& pkt)
   }
 }
 
+void PeerSocket::openInputChannel()
+{
+  // tokens identify peers, they must be unique, not null and unpredictable
+  do {
+    auto& rng = server_->input_token_rng_;
+    input_token_ = static_cast<uint64_t>(rng()) << 32 | rng();
+  } while(input_token_ == 0 || !server_->input_peers_.emplace(input_token_, this).second);
+
+  Packet pkt;
+  auto* framing = pkt.mutable_framing();
+  framing->set_input_token(input_token_);
+  framing->set_input_redundancy(server_->input_redundancy_);
+  this->writePacket(pkt);
+}
+
+void PeerSocket::sendDatagram(const Datagram& dgram)
+{
+  if(server_ && has_input_endpoint_) {
+    server_->input_transport_->sendTo(input_endpoint_, dgram.SerializeAsString());
+  }
+}
+
 void PeerSocket::close()
 {
   PacketSocket::close();
   // remove from server peers
   if(server_) {
-    ServerSocket::PeerSocketContainer& peers = server_->peers_;
-    for(auto it=peers.begin(); it!=peers.end(); ++it) {
-      if( (*it).get() == this ) {
-        peers.erase(it);
-        server_->observer_.onPeerDisconnect(*(*it).get());
-        server_ = nullptr;
-        return;
-      }
+    // keep the peer alive until the observer is notified
+    auto self = std::static_pointer_cast<PeerSocket>(shared_from_this());
+    ServerSocket* server = server_;
+    server_ = nullptr;
+    if(input_token_ != 0) {
+      server->input_peers_.erase(input_token_);
     }
-    assert( !"peer not found" );
+    ServerSocket::erasePeer(spectator_ ? server->spectators_ : server->peers_, *this);
+    server->observer_.onPeerDisconnect(*this);
   }
 }
 
@@ -254,14 +577,28 @@ void PeerSocket::sendServerResponse(std::unique_ptr<ServerResponse> response)
   this->writePacket(pkt);
 }
 
+void PeerSocket::sendServerEvents(std::shared_ptr<const std::string> events)
+{
+  if(!events->empty()) {
+    this->writeShared(std::move(events));
+  }
+}
+
 
 ServerSocket::ServerSocket(Observer& obs, asio::io_service& io_service):
-    acceptor_(io_service), started_(false), observer_(obs)
+    acceptor_(io_service), started_(false), observer_(obs),
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+    local_acceptor_(io_service),
+#endif
+    spectator_batch_seq_(0), spectator_timer_(io_service), spectator_timer_active_(false),
+    spectator_batch_usec_(0), spectator_delay_usec_(0), spectator_queue_max_(1024*1024),
+    compress_min_size_(0), input_channel_(false), input_redundancy_(8)
 {
 }
 
 ServerSocket::~ServerSocket()
 {
+  spectator_timer_.cancel();
 }
 
 void ServerSocket::start(int port)
@@ -272,8 +609,133 @@ void ServerSocket::start(int port)
   acceptor_.set_option(asio::socket_base::reuse_address(true));
   acceptor_.bind(endpoint);
   acceptor_.listen();
+  if( input_channel_ && !input_transport_ ) {
+    input_transport_ = std::make_shared<UdpTransport>(io_service(), udp::endpoint(udp::v6(), port));
+  }
   started_ = true;
   this->acceptNext();
+  this->startInputChannel();
+}
+
+void ServerSocket::start()
+{
+  assert( started_ == false );
+  assert( !input_channel_ || input_transport_ );
+  started_ = true;
+  this->startInputChannel();
+}
+
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+void ServerSocket::listenLocal(const std::string& path)
+{
+  assert( started_ );
+  const asio::local::stream_protocol::endpoint endpoint(path);
+  local_acceptor_.open(endpoint.protocol());
+  boost::system::error_code ec;
+  local_acceptor_.bind(endpoint, ec);
+  struct stat st;
+  if( ec == asio::error::address_in_use && ::stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode) ) {
+    // replace the socket if no server is listening on it anymore
+    asio::local::stream_protocol::socket probe(io_service());
+    boost::system::error_code probe_ec;
+    probe.connect(endpoint, probe_ec);
+    if( probe_ec == asio::error::connection_refused ) {
+      std::remove(path.c_str());
+      local_acceptor_.bind(endpoint, ec);
+    }
+  }
+  if( ec ) {
+    local_acceptor_.close();
+    throw boost::system::system_error(ec, "cannot listen on "+path);
+  }
+  local_acceptor_.listen();
+  local_path_ = path;
+  this->acceptNextLocal();
+}
+#endif
+
+bool ServerSocket::fieldConfHashes() const
+{
+  for(auto& peer : peers_) {
+    if(!peer->field_conf_hashes_) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void ServerSocket::enableInputChannel(std::shared_ptr<DatagramTransport> transport)
+{
+  assert( started_ == false );
+  input_channel_ = true;
+  input_transport_ = transport;
+}
+
+void ServerSocket::startInputChannel()
+{
+  if( !input_transport_ ) {
+    return;
+  }
+  // the server is owned by the instance, which outlives the transport
+  std::weak_ptr<ServerSocket> wself = shared_from_this();
+  input_transport_->start([wself](const DatagramTransport::Endpoint& sender, const std::string& data) {
+    if(auto self = wself.lock()) {
+      self->onDatagram(sender, data);
+    }
+  });
+}
+
+/// Compare addresses, IPv4-mapped IPv6 addresses match their IPv4 address
+static bool sameAddress(const asio::ip::address& a, const asio::ip::address& b)
+{
+  auto unmap = [](const asio::ip::address& addr) -> asio::ip::address {
+    if(addr.is_v6() && addr.to_v6().is_v4_mapped()) {
+      return addr.to_v6().to_v4();
+    }
+    return addr;
+  };
+  return unmap(a) == unmap(b);
+}
+
+void ServerSocket::onDatagram(const DatagramTransport::Endpoint& sender, const std::string& data)
+{
+  // invalid or unknown datagrams are silently ignored
+  Datagram dgram;
+  if(!dgram.ParseFromString(data)) {
+    return;
+  }
+  auto it = input_peers_.find(dgram.token());
+  if(it == input_peers_.end()) {
+    return;
+  }
+  PeerSocket& peer = *(*it).second;
+  // TCP peers must send datagrams from their TCP address
+  // (other peers use local links and have no address)
+  auto tcp_address = peer.peer_.address();
+  if(!tcp_address.is_unspecified() && !sameAddress(tcp_address, sender.address())) {
+    return;
+  }
+  peer.input_endpoint_ = sender;
+  peer.has_input_endpoint_ = true;
+  try {
+    observer_.onPeerDatagram(peer, dgram);
+  } catch(const CallbackError& e) {
+    LOG("datagram processing failed:\n%s", dgram.DebugString().c_str());
+    peer.PacketSocket::processError(std::string("datagram processing failed: ")+e.what());
+  }
+}
+
+void ServerSocket::addPeer(std::unique_ptr<Transport> transport)
+{
+  assert( started_ );
+  auto peer = std::make_shared<PeerSocket>(*this);
+  peer->transport_ = std::move(transport);
+  insertPeer(peers_, peer);
+  try {
+    observer_.onPeerConnect(*peer);
+  } catch(const CallbackError& e) {
+    peer->PacketSocket::processError(std::string("peer connection failed: ")+e.what());
+  }
 }
 
 void ServerSocket::close()
@@ -282,23 +744,256 @@ void ServerSocket::close()
   if( acceptor_.is_open() ) {
     acceptor_.close();
   }
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+  if( local_acceptor_.is_open() ) {
+    local_acceptor_.close();
+    std::remove(local_path_.c_str());
+  }
+#endif
+  if( input_transport_ && input_transport_->isOpen() ) {
+    input_transport_->close();
+  }
+  spectator_timer_.cancel();
+  spectator_timer_active_ = false;
+  spectator_ring_.clear();
+  spectator_batch_.clear();
+  spectator_keyframe_.reset();
   // close all peers
   while(!peers_.empty()) {
     peers_.back()->close();
   }
+  while(!spectators_.empty()) {
+    spectators_.back()->close();
+  }
 }
 
 
+std::string ServerSocket::serializeEvents(std::vector<std::unique_ptr<ServerEvent>> events)
+{
+  std::string data;
+  for(auto& event : events) {
+    Packet pkt;
+    pkt.set_allocated_server_event(event.release());
+    data += PacketSocket::serializePacket(pkt);
+  }
+  return data;
+}
+
 void ServerSocket::broadcastEvent(std::unique_ptr<ServerEvent> event, const PeerSocket* except)
 {
   Packet pkt;
   pkt.set_allocated_server_event(event.release());
-  const std::string s = PacketSocket::serializePacket(pkt);
+  auto data = std::make_shared<const std::string>(PacketSocket::serializePacket(pkt));
+  // compressed on demand, once for all peers accepting it
+  std::shared_ptr<const std::string> z_data;
+  bool compress = compress_min_size_ > 0 && data->size() - sizeof(uint32_t) >= compress_min_size_;
   for(auto& peer : peers_) {
-    if(peer.get() != except) {
-      peer->writeRaw(s);
+    if(peer.get() == except) {
+      continue;
+    }
+    const bool peer_compress = peer->compressMinSize() > 0;
+    if(compress && peer_compress && !z_data) {
+      std::string z = PacketSocket::compressSerialized(*data);
+      if(z.empty()) {
+        compress = false;  // not worth it
+      } else {
+        z_data = std::make_shared<const std::string>(std::move(z));
+      }
+    }
+    peer->writeShared(z_data && peer_compress ? z_data : data);
+  }
+
+  if(spectators_.empty() && spectator_delay_usec_ == 0) {
+    return;  // delayed events are kept for future spectators
+  }
+  // the batch is shared, a spectator cannot be excluded
+  assert( except == nullptr || !except->spectator_ );
+  spectator_batch_ += *data;
+  if(spectator_batch_usec_ == 0) {
+    this->flushSpectators();
+  }
+  this->scheduleSpectatorTimer();
+}
+
+
+void ServerSocket::setSpectatorDelivery(unsigned int batch_usec, unsigned int delay_usec, size_t queue_max)
+{
+  spectator_batch_usec_ = batch_usec;
+  spectator_delay_usec_ = delay_usec;
+  spectator_queue_max_ = queue_max;
+}
+
+void ServerSocket::setSpectator(PeerSocket& peer, bool spectator)
+{
+  assert( peer.server_ == this );
+  if(peer.spectator_ == spectator) {
+    return;
+  }
+  auto self = std::static_pointer_cast<PeerSocket>(peer.shared_from_this());
+  if(spectator) {
+    erasePeer(peers_, peer);
+    insertPeer(spectators_, self);
+    peer.spectator_synced_ = spectator_delay_usec_ == 0;
+    peer.batch_seq_ = spectator_batch_seq_;
+    peer.batch_offset_ = spectator_batch_.size();
+  } else {
+    // send events queued before the change
+    std::string data;
+    for(auto& batch : spectator_ring_) {
+      if(batch.seq >= peer.batch_seq_) {
+        data.append(*batch.events, batch.seq == peer.batch_seq_ ? peer.batch_offset_ : 0, std::string::npos);
+      }
+    }
+    data.append(spectator_batch_, spectator_batch_seq_ == peer.batch_seq_ ? peer.batch_offset_ : 0, std::string::npos);
+    if(!data.empty()) {
+      peer.writeShared(std::make_shared<const std::string>(std::move(data)));
     }
+    erasePeer(spectators_, peer);
+    insertPeer(peers_, self);
+  }
+  peer.spectator_ = spectator;
+}
+
+void ServerSocket::addSpectatorKeyframe(std::shared_ptr<const std::string> events)
+{
+  // the keyframe applies to events broadcast from now
+  if(!spectator_batch_.empty()) {
+    this->closeSpectatorBatch();
+  }
+  spectator_keyframe_ = std::move(events);
+  this->scheduleSpectatorTimer();
+}
+
+bool ServerSocket::hasSpectatorKeyframe() const
+{
+  if(spectator_keyframe_) {
+    return true;
+  }
+  for(auto& batch : spectator_ring_) {
+    if(batch.keyframe) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void ServerSocket::insertPeer(PeerSocketContainer& peers, std::shared_ptr<PeerSocket> peer)
+{
+  peer->index_ = peers.size();
+  peers.push_back(std::move(peer));
+}
+
+void ServerSocket::erasePeer(PeerSocketContainer& peers, PeerSocket& peer)
+{
+  assert( peer.index_ < peers.size() && peers[peer.index_].get() == &peer );
+  // move the last peer to the freed position
+  if(peer.index_ + 1 < peers.size()) {
+    peers[peer.index_] = std::move(peers.back());
+    peers[peer.index_]->index_ = peer.index_;
+  }
+  peers.pop_back();
+}
+
+void ServerSocket::closeSpectatorBatch()
+{
+  if(spectator_batch_.empty() && !spectator_keyframe_) {
+    return;
   }
+  SpectatorBatch batch;
+  batch.seq = spectator_batch_seq_++;
+  batch.time = this->now();
+  batch.keyframe = std::move(spectator_keyframe_);
+  batch.events = std::make_shared<const std::string>(std::move(spectator_batch_));
+  spectator_ring_.push_back(std::move(batch));
+  spectator_batch_.clear();
+  spectator_keyframe_.reset();
+}
+
+void ServerSocket::flushSpectators()
+{
+  this->closeSpectatorBatch();
+  const auto release_time = this->now() - std::chrono::microseconds(spectator_delay_usec_);
+  while(!spectator_ring_.empty() && spectator_ring_.front().time <= release_time) {
+    this->releaseSpectatorBatch(spectator_ring_.front());
+    spectator_ring_.pop_front();
+  }
+}
+
+void ServerSocket::releaseSpectatorBatch(const SpectatorBatch& batch)
+{
+  std::vector<std::shared_ptr<PeerSocket>> slow_peers;
+  for(auto& peer : spectators_) {
+    if(peer->has_error_) {
+      continue;
+    }
+    bool with_keyframe = false;
+    if(!peer->spectator_synced_) {
+      if(!batch.keyframe) {
+        continue;  // events cannot be applied without a keyframe
+      }
+      // start from the keyframe, events before are not needed
+      with_keyframe = true;
+      peer->batch_seq_ = batch.seq;
+      peer->batch_offset_ = 0;
+    } else if(batch.seq != peer->batch_seq_) {
+      continue;  // already sent
+    }
+    const size_t offset = peer->batch_offset_;
+    const size_t size = (with_keyframe ? batch.keyframe->size() : 0) + batch.events->size() - offset;
+    peer->spectator_synced_ = true;
+    peer->batch_seq_ = batch.seq + 1;
+    peer->batch_offset_ = 0;
+    if(peer->pendingWriteSize() + size > spectator_queue_max_) {
+      slow_peers.push_back(peer);
+      continue;
+    }
+    if(with_keyframe && !batch.keyframe->empty()) {
+      peer->writeShared(batch.keyframe);
+    }
+    if(offset == 0 && !batch.events->empty()) {
+      peer->writeShared(batch.events);
+    } else if(offset < batch.events->size()) {
+      // joined after the first events of the batch
+      peer->writeShared(std::make_shared<const std::string>(batch.events->substr(offset)));
+    }
+  }
+  // errors may remove peers, don't send them while iterating
+  for(auto& peer : slow_peers) {
+    peer->sendError("spectator is too slow");
+  }
+}
+
+void ServerSocket::scheduleSpectatorTimer()
+{
+  const auto now = this->now();
+  auto deadline = std::chrono::steady_clock::time_point::max();
+  if(!spectator_batch_.empty() || spectator_keyframe_) {
+    deadline = now + std::chrono::microseconds(spectator_batch_usec_);
+  }
+  if(!spectator_ring_.empty()) {
+    deadline = std::min(deadline, spectator_ring_.front().time + std::chrono::microseconds(spectator_delay_usec_));
+  }
+  if(deadline == std::chrono::steady_clock::time_point::max()) {
+    return;  // nothing to send
+  }
+  if(spectator_timer_active_ && spectator_timer_deadline_ <= deadline) {
+    return;
+  }
+  spectator_timer_active_ = true;
+  spectator_timer_deadline_ = deadline;
+  const auto delay = std::chrono::duration_cast<std::chrono::microseconds>(deadline - now).count();
+  spectator_timer_.expires_from_now(boost::posix_time::microseconds(std::max<long>(0, delay)));
+  spectator_timer_.async_wait(std::bind(&ServerSocket::onSpectatorTimer, shared_from_this(), std::placeholders::_1));
+}
+
+void ServerSocket::onSpectatorTimer(const boost::system::error_code& ec)
+{
+  if(ec == asio::error::operation_aborted) {
+    return;
+  }
+  spectator_timer_active_ = false;
+  this->flushSpectators();
+  this->scheduleSpectatorTimer();
 }
 
 
@@ -308,7 +1003,7 @@ void ServerSocket::acceptNext()
   peer_accept_ = std::make_shared<PeerSocket>(*this);
   auto self = shared_from_this();
   acceptor_.async_accept(
-      peer_accept_->socket_, peer_accept_->peer(),
+      peer_accept_->tcpSocket(), peer_accept_->peer(),
       std::bind(&ServerSocket::onAccept, self, std::placeholders::_1));
 }
 
@@ -317,11 +1012,11 @@ void ServerSocket::onAccept(const boost::system::error_code& ec)
   if( ec == asio::error::operation_aborted ) {
     return;
   } else if( !ec ) {
-    peers_.push_back(peer_accept_);
+    insertPeer(peers_, peer_accept_);
+    PeerSocket& peer = *peer_accept_;
     peer_accept_.reset();
-    PeerSocket& peer = *peers_.back();
     try {
-      peer.socket_.set_option(tcp::no_delay(true));
+      peer.tcpSocket().set_option(tcp::no_delay(true));
     } catch(const boost::exception& e) {
       // setting no delay may fail on some systems, ignore error
     }
@@ -338,10 +1033,36 @@ void ServerSocket::onAccept(const boost::system::error_code& ec)
   this->acceptNext();
 }
 
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+void ServerSocket::acceptNextLocal()
+{
+  assert(!local_accept_);
+  local_accept_ = std::make_unique<LocalTransport>(io_service());
+  auto self = shared_from_this();
+  local_acceptor_.async_accept(
+      local_accept_->socket(),
+      std::bind(&ServerSocket::onAcceptLocal, self, std::placeholders::_1));
+}
+
+void ServerSocket::onAcceptLocal(const boost::system::error_code& ec)
+{
+  if( ec == asio::error::operation_aborted ) {
+    return;
+  } else if( !ec ) {
+    this->addPeer(std::move(local_accept_));
+  } else {
+    LOG("local accept error: %s", ec.message().c_str());
+    local_accept_.reset();
+  }
+  this->acceptNextLocal();
+}
+#endif
+
 
 ClientSocket::ClientSocket(Observer& obs, asio::io_service& io_service):
     PacketSocket(io_service),
-    observer_(obs), timer_(io_service), connected_(false)
+    observer_(obs), timer_(io_service), connected_(false), field_conf_hashes_(false),
+    input_token_(0), input_redundancy_(0)
 {
 }
 
@@ -352,19 +1073,44 @@ ClientSocket::~ClientSocket()
 
 void ClientSocket::connect(const char* host, int port, int tout)
 {
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+  if( ::strncmp(host, "unix:", 5) == 0 ) {
+    this->connectLocal(host+5, tout);
+    return;
+  }
+#endif
   tcp::resolver resolver(io_service());
   auto ep_it = resolver.resolve({host, std::to_string(port)});
+  // the socket may have been used with another transport
+  transport_ = std::make_unique<TcpTransport>(io_service());
   auto self = std::static_pointer_cast<ClientSocket>(shared_from_this());
-  boost::asio::async_connect(socket_, ep_it, std::bind(&ClientSocket::onConnect, self, std::placeholders::_1));
+  boost::asio::async_connect(this->tcpSocket(), ep_it, std::bind(&ClientSocket::onConnect, self, std::placeholders::_1));
   try {
-    socket_.set_option(tcp::no_delay(true));
+    this->tcpSocket().set_option(tcp::no_delay(true));
   } catch(const boost::exception& e) {
     // setting no delay may fail on some systems, ignore error
   }
-  if( tout >= 0 ) {
-    timer_.expires_from_now(boost::posix_time::milliseconds(tout));
-    timer_.async_wait(std::bind(&ClientSocket::onTimeout, self, std::placeholders::_1));
-  }
+  this->startConnectTimer(tout);
+}
+
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+void ClientSocket::connectLocal(const std::string& path, int tout)
+{
+  auto transport = std::make_unique<LocalTransport>(io_service());
+  asio::local::stream_protocol::socket& socket = transport->socket();
+  transport_ = std::move(transport);
+  auto self = std::static_pointer_cast<ClientSocket>(shared_from_this());
+  socket.async_connect(asio::local::stream_protocol::endpoint(path),
+                       std::bind(&ClientSocket::onConnect, self, std::placeholders::_1));
+  this->startConnectTimer(tout);
+}
+#endif
+
+void ClientSocket::connect(std::unique_ptr<Transport> transport)
+{
+  transport_ = std::move(transport);
+  auto self = std::static_pointer_cast<ClientSocket>(shared_from_this());
+  io_service().post(std::bind(&ClientSocket::onConnect, self, boost::system::error_code()));
 }
 
 void ClientSocket::close()
@@ -374,6 +1120,9 @@ void ClientSocket::close()
   }
   connected_ = false;
   PacketSocket::close();
+  if( input_transport_ && input_transport_->isOpen() ) {
+    input_transport_->close();
+  }
   observer_.onServerDisconnect();
 }
 
@@ -393,9 +1142,97 @@ void ClientSocket::sendClientCommand(std::unique_ptr<ClientCommand> command, Com
 }
 
 
+void ClientSocket::enableCompression(size_t min_size)
+{
+  if(this->compressMinSize() == 0) {
+    Packet pkt;
+    pkt.mutable_framing()->set_compression(true);
+    this->writePacket(pkt);
+  }
+  this->setCompressMinSize(min_size);
+}
+
+void ClientSocket::enableFieldConfHashes()
+{
+  if(!field_conf_hashes_) {
+    Packet pkt;
+    pkt.mutable_framing()->set_field_conf_hash(true);
+    this->writePacket(pkt);
+    field_conf_hashes_ = true;
+  }
+}
+
+void ClientSocket::requestInputChannel(std::shared_ptr<DatagramTransport> transport, const DatagramTransport::Endpoint& server)
+{
+  if( input_transport_ ) {
+    return;  // already requested
+  }
+  if( transport ) {
+    input_transport_ = transport;
+    input_server_ = server;
+  } else if( dynamic_cast<TcpTransport*>(transport_.get()) != nullptr ) {
+    boost::system::error_code ec;
+    const tcp::endpoint remote = this->tcpSocket().remote_endpoint(ec);
+    if( ec ) {
+      return;
+    }
+    input_server_ = udp::endpoint(remote.address(), remote.port());
+    try {
+      input_transport_ = std::make_shared<UdpTransport>(io_service(), udp::endpoint(input_server_.protocol(), 0));
+    } catch(const boost::system::system_error& e) {
+      LOG("Client: cannot open input channel: %s", e.what());
+      return;
+    }
+  } else {
+    return;
+  }
+
+  std::weak_ptr<ClientSocket> wself = std::static_pointer_cast<ClientSocket>(shared_from_this());
+  input_transport_->start([wself](const DatagramTransport::Endpoint& sender, const std::string& data) {
+    if(auto self = wself.lock()) {
+      self->onDatagram(sender, data);
+    }
+  });
+  Packet pkt;
+  pkt.mutable_framing()->set_input_channel(true);
+  this->writePacket(pkt);
+}
+
+void ClientSocket::sendDatagram(Datagram& dgram)
+{
+  if( input_token_ != 0 ) {
+    dgram.set_token(input_token_);
+    input_transport_->sendTo(input_server_, dgram.SerializeAsString());
+  }
+}
+
+void ClientSocket::onDatagram(const DatagramTransport::Endpoint& sender, const std::string& data)
+{
+  // ignore datagrams from other sources, and invalid ones
+  if( !connected_ || input_token_ == 0 || sender != input_server_ ) {
+    return;
+  }
+  Datagram dgram;
+  if(!dgram.ParseFromString(data)) {
+    return;
+  }
+  try {
+    observer_.onServerDatagram(dgram);
+  } catch(const CallbackError& e) {
+    LOG("datagram processing failed:\n%s", dgram.DebugString().c_str());
+    this->PacketSocket::processError(std::string("datagram processing failed: ")+e.what());
+  }
+}
+
+
 void ClientSocket::processPacket(const Packet& pkt)
 {
-  if(pkt.has_server_event()) {
+  if(pkt.has_framing()) {
+    if( input_transport_ && pkt.framing().input_token() != 0 ) {
+      input_token_ = pkt.framing().input_token();
+      input_redundancy_ = pkt.framing().input_redundancy();
+    }
+  } else if(pkt.has_server_event()) {
     observer_.onServerEvent(pkt.server_event());
   } else if(pkt.has_server_response()) {
     if(command_callbacks_.size()) {
@@ -423,6 +1260,15 @@ void ClientSocket::processError(const std::string& msg, const boost::system::err
   this->close();
 }
 
+void ClientSocket::startConnectTimer(int tout)
+{
+  if( tout >= 0 ) {
+    auto self = std::static_pointer_cast<ClientSocket>(shared_from_this());
+    timer_.expires_from_now(boost::posix_time::milliseconds(tout));
+    timer_.async_wait(std::bind(&ClientSocket::onTimeout, self, std::placeholders::_1));
+  }
+}
+
 void ClientSocket::onTimeout(const boost::system::error_code& ec)
 {
   if( ec != asio::error::operation_aborted ) {
@@ -5,8 +5,20 @@
  * @brief Netplay protocol handling and sockets.
  *
  * Messages are serialized using protocol buffers and prefixed by their size
- * (16-bit, network order).
+ * (32-bit, network order). If the highest bit of the size is set, the message
+ * is compressed with zlib; peers send compressed messages only when the other
+ * end accepts them (see PktFraming).
  * See netplay.proto for message structure and meaning.
+ *
+ * Sockets exchange data through a Transport, which is a TCP socket by
+ * default. Co-located clients may use a Unix-domain socket (LocalTransport)
+ * or, in the server's process, an in-process pipe (PipeTransport). Other
+ * transports can be provided to server peers and clients (e.g. simulated
+ * links, see netsim.h).
+ *
+ * Inputs may also be exchanged over a DatagramTransport (the input channel),
+ * so that a lost TCP segment does not delay them. Datagrams are not prefixed
+ * by their size.
  */
 
 #include <stdint.h>
@@ -14,8 +26,16 @@
 #include <memory>
 #include <vector>
 #include <queue>
+#include <deque>
+#include <map>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <mutex>
 #include <stdexcept>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
 #include "monotone_timer.hpp"
 
 
@@ -26,6 +46,7 @@ class ServerEvent;
 class ClientEvent;
 class ClientCommand;
 class ServerResponse;
+class Datagram;
 class PeerSocket;
 class ServerSocket;
 
@@ -52,13 +73,152 @@ class CommandError: public std::runtime_error
 };
 
 
+/** @brief Stream transport of a socket.
+ *
+ * Operations are asynchronous: handlers are always called from the
+ * io_service, never from the initiating call. Pending operations complete
+ * with \e operation_aborted when the transport is closed.
+ */
+class Transport
+{
+ public:
+  typedef std::function<void(const boost::system::error_code&)> Handler;
+
+  virtual ~Transport() {}
+
+  /// Read exactly \e size bytes into \e buf.
+  virtual void asyncRead(char* buf, size_t size, Handler handler) = 0;
+  /// Write \e size bytes of \e buf, which must remain valid until completion.
+  virtual void asyncWrite(const char* buf, size_t size, Handler handler) = 0;
+  virtual bool isOpen() const = 0;
+  virtual void close() = 0;
+};
+
+/// TCP transport.
+class TcpTransport: public Transport
+{
+ public:
+  TcpTransport(boost::asio::io_service& io_service);
+  virtual ~TcpTransport() {}
+
+  boost::asio::ip::tcp::socket& socket() { return socket_; }
+
+  virtual void asyncRead(char* buf, size_t size, Handler handler);
+  virtual void asyncWrite(const char* buf, size_t size, Handler handler);
+  virtual bool isOpen() const { return socket_.is_open(); }
+  virtual void close();
+
+ private:
+  boost::asio::ip::tcp::socket socket_;
+};
+
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+/// Unix-domain socket transport, for clients on the server's host.
+class LocalTransport: public Transport
+{
+ public:
+  LocalTransport(boost::asio::io_service& io_service);
+  virtual ~LocalTransport() {}
+
+  boost::asio::local::stream_protocol::socket& socket() { return socket_; }
+
+  virtual void asyncRead(char* buf, size_t size, Handler handler);
+  virtual void asyncWrite(const char* buf, size_t size, Handler handler);
+  virtual bool isOpen() const { return socket_.is_open(); }
+  virtual void close();
+
+ private:
+  boost::asio::local::stream_protocol::socket socket_;
+};
+#endif
+
+/** @brief In-process transport, for clients living in the server's process.
+ *
+ * Written data is copied to the other end, without system calls. Ends may
+ * use distinct io_services, run from distinct threads.
+ */
+class PipeTransport: public Transport
+{
+ public:
+  typedef std::pair<std::unique_ptr<PipeTransport>, std::unique_ptr<PipeTransport>> Pair;
+  /// Create both ends of a pipe, using the given io_services.
+  static Pair newPair(boost::asio::io_service& io_first, boost::asio::io_service& io_second);
+  virtual ~PipeTransport();
+
+  virtual void asyncRead(char* buf, size_t size, Handler handler);
+  virtual void asyncWrite(const char* buf, size_t size, Handler handler);
+  virtual bool isOpen() const { return open_; }
+  virtual void close();
+
+ private:
+  /// One direction of a pipe.
+  struct Buffer;
+  PipeTransport(boost::asio::io_service& io_service, std::shared_ptr<Buffer> in, std::shared_ptr<Buffer> out);
+  /// Complete the pending read of a buffer if possible, its mutex must be locked.
+  static void completeRead(Buffer& buffer);
+
+  boost::asio::io_service& io_service_;
+  std::shared_ptr<Buffer> in_;
+  std::shared_ptr<Buffer> out_;
+  bool open_;
+};
+
+
+/** @brief Datagram transport, for the input channel.
+ *
+ * Datagrams may be lost, duplicated or reordered. Send errors are ignored.
+ * The receive handler is called from the io_service, until the transport is
+ * closed.
+ */
+class DatagramTransport
+{
+ public:
+  typedef boost::asio::ip::udp::endpoint Endpoint;
+  typedef std::function<void(const Endpoint&, const std::string&)> ReceiveHandler;
+
+  virtual ~DatagramTransport() {}
+
+  /// Start receiving datagrams.
+  virtual void start(ReceiveHandler handler) = 0;
+  virtual void sendTo(const Endpoint& endpoint, const std::string& data) = 0;
+  virtual bool isOpen() const = 0;
+  virtual void close() = 0;
+};
+
+/// UDP transport.
+class UdpTransport: public DatagramTransport, public std::enable_shared_from_this<UdpTransport>
+{
+ public:
+  /// Open a socket bound to a local endpoint (port 0 for any).
+  UdpTransport(boost::asio::io_service& io_service, const Endpoint& local);
+  virtual ~UdpTransport() {}
+
+  virtual void start(ReceiveHandler handler);
+  virtual void sendTo(const Endpoint& endpoint, const std::string& data);
+  virtual bool isOpen() const { return socket_.is_open(); }
+  virtual void close();
+
+ private:
+  void receiveNext();
+  void onReceive(const boost::system::error_code& ec, size_t size);
+
+  boost::asio::ip::udp::socket socket_;
+  ReceiveHandler handler_;
+  Endpoint sender_;  ///< sender of the datagram being received
+  std::vector<char> buf_;
+};
+
+
 /// Base socket for both server and clients.
 class BaseSocket: public std::enable_shared_from_this<BaseSocket>
 {
  protected:
   /// Maximum packet size (without size indicator)
   static const uint32_t pkt_size_max;
+  /// Flag of the size indicator, for compressed packets
+  static const uint32_t pkt_compressed_flag;
  public:
+  /// Create a socket using a TCP transport.
   BaseSocket(boost::asio::io_service& io_service);
   virtual ~BaseSocket();
 
@@ -68,10 +228,14 @@ class BaseSocket: public std::enable_shared_from_this<BaseSocket>
    */
   virtual void close();
 
-  boost::asio::io_service& io_service() { return socket_.get_io_service(); }
+  boost::asio::io_service& io_service() { return io_service_; }
 
  protected:
-  boost::asio::ip::tcp::socket socket_;
+  /// Return the TCP socket of the transport, which must be a TCP one.
+  boost::asio::ip::tcp::socket& tcpSocket();
+
+  boost::asio::io_service& io_service_;
+  std::unique_ptr<Transport> transport_;
 };
 
 /// Handle packet read/write operations.
@@ -91,17 +255,34 @@ class PacketSocket: public BaseSocket
   /// Process an incoming packet.
   virtual void processPacket(const Packet& pkt) = 0;
 
-  static std::string serializePacket(const Packet& pkt);
+  /** @brief Serialize a packet, with its size indicator
+   *
+   * Packets of at least \e compress_min_size bytes are compressed, if it
+   * makes them smaller. Use 0 to never compress.
+   */
+  static std::string serializePacket(const Packet& pkt, size_t compress_min_size=0);
+  /// Return the compressed form of a serialized packet, empty if not smaller
+  static std::string compressSerialized(const std::string& data);
 
  public:
   void readNext();
  protected:
   void writeNext();
   void writeRaw(const std::string& s);
+  /** @brief Write serialized packets, shared with other sockets.
+   *
+   * Data may contain several packets, it is not copied.
+   */
+  void writeShared(std::shared_ptr<const std::string> data);
   void writePacket(const Packet& pkt)
   {
-    return this->writeRaw(serializePacket(pkt));
+    return this->writeRaw(serializePacket(pkt, compress_min_size_));
   }
+  /// Set the minimum size of compressed packets, 0 to disable compression
+  void setCompressMinSize(size_t n) { compress_min_size_ = n; }
+  size_t compressMinSize() const { return compress_min_size_; }
+  /// Return the size of data waiting to be written.
+  size_t pendingWriteSize() const { return write_queue_size_; }
 
   /** @brief Do pending write operations and close.
    *
@@ -116,13 +297,18 @@ class PacketSocket: public BaseSocket
 
  private:
   bool delayed_close_;    ///< closeAfterWrites() has been called
-  std::queue<std::string> write_queue_;
+  std::queue<std::shared_ptr<const std::string>> write_queue_;
+  size_t write_queue_size_;  ///< total size of write_queue_ data
+  /// Minimum size of compressed packets, 0 if the peer does not accept them
+  size_t compress_min_size_;
   /** @name Attributes for packet reading. */
   //@{
   uint32_t read_size_;    ///< size of the next packet
+  bool read_compressed_;  ///< true if the next packet is compressed
   char read_size_buf_[sizeof(read_size_)]; ///< buffer for the size of the next read packet
   char* read_buf_;        ///< buffer for the read packet
   size_t read_buf_size_;  ///< allocated size of read_buf_
+  char* inflate_buf_;     ///< buffer for decompressed packets, allocated on first use
   //@}
 };
 
@@ -136,6 +322,8 @@ class PeerSocket: public PacketSocket
   PeerSocket(ServerSocket& server);
   virtual ~PeerSocket() {}
   boost::asio::ip::tcp::endpoint& peer() { return peer_; }
+  /// Return true if the peer is a spectator (see ServerSocket::setSpectator()).
+  bool spectator() const { return spectator_; }
 
   /// Close the socket and remove the peer from the server.
   virtual void close();
@@ -143,16 +331,51 @@ class PeerSocket: public PacketSocket
   void sendServerEvent(std::unique_ptr<ServerEvent> event);
   /// Send a ServerResponse to the peer
   void sendServerResponse(std::unique_ptr<ServerResponse> response);
+  /** @brief Send ServerEvents at once, in a single write.
+   *
+   * Events are serialized with ServerSocket::serializeEvents(), the buffer
+   * may be shared with other peers.
+   */
+  void sendServerEvents(std::shared_ptr<const std::string> events);
   /// Send an error notification and close the socket.
   void sendError(const std::string& msg) { PacketSocket::processError(msg); }
+  /// Return true if the peer uses the input channel.
+  bool inputChannel() const { return input_token_ != 0; }
+  /// Return true if the peer understands field configuration hashes.
+  bool fieldConfHashes() const { return field_conf_hashes_; }
+  /** @brief Send a datagram on the input channel.
+   *
+   * Datagrams are sent once the peer's endpoint is known, from its own
+   * datagrams.
+   */
+  void sendDatagram(const Datagram& dgram);
 
  protected:
   virtual void processError(const std::string& msg, const boost::system::error_code& ec) final;
   virtual void processPacket(const Packet& pkt) final;
  private:
+  /// Accept the input channel, send the token to the peer
+  void openInputChannel();
+
   ServerSocket* server_;
   boost::asio::ip::tcp::endpoint peer_;
+  /** @name Input channel. */
+  //@{
+  uint64_t input_token_;  ///< 0 if not used
+  bool has_input_endpoint_;
+  DatagramTransport::Endpoint input_endpoint_;
+  //@}
   bool has_error_; ///< Avoid multiple processError() calls.
+  bool field_conf_hashes_;
+  bool spectator_;
+  /// Spectator receives batches, see ServerSocket::setSpectatorDelivery()
+  bool spectator_synced_;
+  size_t index_;  ///< position in the server's peer container
+  /** @name Position of the next spectator event to send. */
+  //@{
+  uint64_t batch_seq_;
+  size_t batch_offset_;
+  //@}
 };
 
 
@@ -171,6 +394,8 @@ class ServerSocket: public std::enable_shared_from_this<ServerSocket>
     virtual void onPeerClientEvent(PeerSocket& peer, const ClientEvent& event) = 0;
     /// Called on ClientCommand packet from a peer, must call peer.sendServerResponse()
     virtual void onPeerClientCommand(PeerSocket& peer, const ClientCommand& command) = 0;
+    /// Called on datagram from a peer, on the input channel
+    virtual void onPeerDatagram(PeerSocket& peer, const Datagram& dgram) = 0;
   };
 
   ServerSocket(Observer& obs, boost::asio::io_service& io_service);
@@ -178,27 +403,169 @@ class ServerSocket: public std::enable_shared_from_this<ServerSocket>
 
   /// Start server on a given port.
   void start(int port);
+  /// Start server without listening, peers are added with addPeer().
+  void start();
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+  /** @brief Also accept peers on a Unix-domain socket.
+   *
+   * The server must have been started. A socket file left by a server no
+   * longer running is replaced. The file is removed when the server is
+   * closed.
+   */
+  void listenLocal(const std::string& path);
+#endif
+  /** @brief Add a peer using an already connected transport.
+   *
+   * The peer is handled like an accepted TCP peer.
+   */
+  void addPeer(std::unique_ptr<Transport> transport);
   /// Return true if the server has been started.
   bool started() const { return started_; }
   /// Close the server, if not already closed.
   void close();
   boost::asio::io_service& io_service() { return acceptor_.get_io_service(); }
 
-  /// Send a ServerEvent to all peers, excepting \e except.
+  /** @brief Send a ServerEvent to all peers, excepting \e except.
+   *
+   * Events are queued for spectators, see setSpectator().
+   */
   void broadcastEvent(std::unique_ptr<ServerEvent> event, const PeerSocket* except=nullptr);
+  /// Serialize events, to be sent at once to several peers.
+  static std::string serializeEvents(std::vector<std::unique_ptr<ServerEvent>> events);
+  /** @brief Set the minimum size of compressed packets, 0 to disable compression
+   *
+   * Compression is used only for peers which accept it.
+   */
+  void setCompressMinSize(size_t n) { compress_min_size_ = n; }
+  /// Return true if all peers understand field configuration hashes.
+  bool fieldConfHashes() const;
+
+  /** @name Input channel.
+   *
+   * Peers requesting the input channel receive a random token, set in their
+   * datagrams. The source of the last datagram with the token of a peer is
+   * used to send datagrams to it. Datagrams of TCP peers are only accepted
+   * from the peer's TCP address.
+   */
+  //@{
+  /** @brief Enable the input channel, before start()
+   *
+   * If \e transport is null, start(int) opens a UDP socket on the listening
+   * port.
+   */
+  void enableInputChannel(std::shared_ptr<DatagramTransport> transport=nullptr);
+  bool inputChannel() const { return input_channel_; }
+  /// Set the count of input ticks repeated in datagrams, sent to peers
+  void setInputRedundancy(unsigned int n) { input_redundancy_ = n; }
+  //@}
+
+  /** @name Spectators.
+   *
+   * Spectators receive broadcast events with a lower priority: events are
+   * batched every \e batch_usec, using a single buffer shared by all
+   * spectators. Batches are kept in a time-indexed ring and sent after
+   * \e delay_usec. Spectators whose pending data would exceed \e queue_max
+   * bytes are disconnected.
+   *
+   * With a delay, new spectators wait for a keyframe: events describing the
+   * state on which the following batches apply. They start from the last
+   * keyframe queued before they joined, or else from the next one (see
+   * hasSpectatorKeyframe()).
+   *
+   * Batch times use the clock set with setClock().
+   */
+  //@{
+  /// Configure spectator delivery, 0 to send events immediately.
+  void setSpectatorDelivery(unsigned int batch_usec, unsigned int delay_usec, size_t queue_max);
+  typedef std::function<std::chrono::steady_clock::time_point()> ClockFunction;
+  /// Set the clock of spectator batches, default is std::chrono::steady_clock::now().
+  void setClock(ClockFunction clock) { clock_ = clock; }
+  /** @brief Set or unset the spectator flag of a peer.
+   *
+   * Without delay, a new spectator starts with the events broadcast after
+   * it joined.
+   * Events queued for a peer which is no longer a spectator are sent to it
+   * first, so that events are received in order.
+   */
+  void setSpectator(PeerSocket& peer, bool spectator);
+  /// Set the keyframe of the events broadcast afterwards, serialized.
+  void addSpectatorKeyframe(std::shared_ptr<const std::string> events);
+  /// Return true if a keyframe is queued, not sent to spectators yet.
+  bool hasSpectatorKeyframe() const;
+  size_t spectatorCount() const { return spectators_.size(); }
+  //@}
 
  private:
+  typedef std::vector<std::shared_ptr<PeerSocket>> PeerSocketContainer;
+
   void acceptNext();
   void onAccept(const boost::system::error_code& ec);
+  /// Start receiving datagrams of the input channel.
+  void startInputChannel();
+  void onDatagram(const DatagramTransport::Endpoint& sender, const std::string& data);
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+  void acceptNextLocal();
+  void onAcceptLocal(const boost::system::error_code& ec);
+#endif
+  /// Add a peer to a container, in constant time.
+  static void insertPeer(PeerSocketContainer& peers, std::shared_ptr<PeerSocket> peer);
+  /// Remove a peer from a container, in constant time.
+  static void erasePeer(PeerSocketContainer& peers, PeerSocket& peer);
+  /// Batch of events for spectators.
+  struct SpectatorBatch {
+    uint64_t seq;
+    std::chrono::steady_clock::time_point time;  ///< closing time
+    std::shared_ptr<const std::string> keyframe;  ///< may be null
+    std::shared_ptr<const std::string> events;
+  };
+  std::chrono::steady_clock::time_point now() const { return clock_ ? clock_() : std::chrono::steady_clock::now(); }
+  /// Move the current batch to the ring.
+  void closeSpectatorBatch();
+  /// Close the current batch, send batches older than the delay.
+  void flushSpectators();
+  /// Send a batch to spectators.
+  void releaseSpectatorBatch(const SpectatorBatch& batch);
+  /// Set the timer to the next batch closing or release, if needed.
+  void scheduleSpectatorTimer();
+  void onSpectatorTimer(const boost::system::error_code& ec);
 
   boost::asio::ip::tcp::acceptor acceptor_;
   bool started_;
   Observer& observer_;
 
-  typedef std::vector<std::shared_ptr<PeerSocket>> PeerSocketContainer;
-  /// Sockets of connected accepted clients.
+  /// Sockets of connected accepted clients, excepting spectators.
   PeerSocketContainer peers_;
+  PeerSocketContainer spectators_;
   std::shared_ptr<PeerSocket> peer_accept_; ///< currently accepted peer
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+  boost::asio::local::stream_protocol::acceptor local_acceptor_;
+  std::string local_path_;
+  std::unique_ptr<LocalTransport> local_accept_;  ///< currently accepted local peer
+#endif
+
+  /// Closed batches, not sent yet
+  std::deque<SpectatorBatch> spectator_ring_;
+  /** @name Current batch. */
+  //@{
+  uint64_t spectator_batch_seq_;
+  std::string spectator_batch_;  ///< serialized events
+  std::shared_ptr<const std::string> spectator_keyframe_;
+  //@}
+  boost::asio::monotone_timer spectator_timer_;
+  bool spectator_timer_active_;
+  std::chrono::steady_clock::time_point spectator_timer_deadline_;
+  unsigned int spectator_batch_usec_;
+  unsigned int spectator_delay_usec_;
+  size_t spectator_queue_max_;
+  ClockFunction clock_;
+  size_t compress_min_size_;
+
+  bool input_channel_;
+  std::shared_ptr<DatagramTransport> input_transport_;
+  unsigned int input_redundancy_;
+  /// Peers using the input channel, by token
+  std::map<uint64_t, PeerSocket*> input_peers_;
+  std::random_device input_token_rng_;
 };
 
 
@@ -214,6 +581,8 @@ class ClientSocket: public PacketSocket
     virtual void onServerDisconnect() = 0;
     /// Called on ServerEvent packet from a peer
     virtual void onServerEvent(const ServerEvent& event) = 0;
+    /// Called on datagram from the server, on the input channel
+    virtual void onServerDatagram(const Datagram& dgram) = 0;
   };
 
   ClientSocket(Observer& obs, boost::asio::io_service& io_service);
@@ -222,8 +591,18 @@ class ClientSocket: public PacketSocket
   /** @brief Connect to a server.
    *
    * Timeout is given in milliseconds, -1 to wait indefinitely.
+   * A "unix:<path>" host is a Unix-domain socket, \e port is ignored.
    */
   void connect(const char* host, int port, int tout);
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+  /// Connect to a server on a Unix-domain socket.
+  void connectLocal(const std::string& path, int tout);
+#endif
+  /** @brief Connect using an already connected transport.
+   *
+   * The connection callback is called asynchronously.
+   */
+  void connect(std::unique_ptr<Transport> transport);
   /// Return true if the client is connected.
   bool connected() const { return connected_; }
 
@@ -234,18 +613,57 @@ class ClientSocket: public PacketSocket
   void sendClientEvent(std::unique_ptr<ClientEvent> event);
   /// Send a ClientCommand to the server
   void sendClientCommand(std::unique_ptr<ClientCommand> command, CommandCallback cb);
+  /** @brief Accept compressed packets, compress our own ones
+   *
+   * Must be called after the server announced its support.
+   */
+  void enableCompression(size_t min_size);
+  /** @brief Announce support of field configuration hashes
+   *
+   * Must be called after the server announced its own support.
+   */
+  void enableFieldConfHashes();
+
+  /** @name Input channel. */
+  //@{
+  /** @brief Request the input channel
+   *
+   * Must be called after the server announced it. Datagrams are exchanged
+   * with \e server over \e transport. If \e transport is null, a UDP socket
+   * is opened to the server's port; it requires a TCP transport, otherwise
+   * the channel is not requested.
+   */
+  void requestInputChannel(std::shared_ptr<DatagramTransport> transport, const DatagramTransport::Endpoint& server);
+  /// Return true if the server accepted the input channel.
+  bool inputChannel() const { return input_token_ != 0; }
+  /// Return the maximum count of input ticks per field in a datagram
+  unsigned int inputRedundancy() const { return input_redundancy_; }
+  /// Send a datagram on the input channel, set its token.
+  void sendDatagram(Datagram& dgram);
+  //@}
 
  protected:
   virtual void processError(const std::string& msg, const boost::system::error_code& ec) final;
   virtual void processPacket(const Packet& pkt) final;
  private:
+  /// Start the connection timeout, if \e tout is not negative.
+  void startConnectTimer(int tout);
   void onTimeout(const boost::system::error_code& ec);
   void onConnect(const boost::system::error_code& ec);
+  void onDatagram(const DatagramTransport::Endpoint& sender, const std::string& data);
 
   Observer& observer_;
   std::queue<CommandCallback> command_callbacks_;  ///< callbacks for command responses
   boost::asio::monotone_timer timer_; ///< for timeouts
   bool connected_;
+  bool field_conf_hashes_;  ///< support announced to the server
+  /** @name Input channel. */
+  //@{
+  std::shared_ptr<DatagramTransport> input_transport_;
+  DatagramTransport::Endpoint input_server_;
+  uint64_t input_token_;  ///< 0 until accepted by the server
+  unsigned int input_redundancy_;
+  //@}
 };
 
 
@@ -0,0 +1,327 @@
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/error.hpp>
+#include "netsim.h"
+
+
+namespace asio = boost::asio;
+
+
+namespace netplay {
+
+
+/// One direction of a link.
+struct SimNetwork::Pipe
+{
+  LinkConf conf;
+  uint64_t free_time = 0;  ///< end of the last emission (bandwidth limit)
+  uint64_t next_send = 0;  ///< sequence number of the next sent segment
+  uint64_t next_recv = 0;  ///< sequence number of the next segment to read
+  /// Segments received out of order, by sequence number
+  std::map<uint64_t, std::string> arrived;
+  std::string buffer;  ///< data received in order, not read yet
+  bool eof = false;  ///< end of stream received
+  bool reset = false;  ///< connection reset, data is dropped
+  bool reader_open = true;  ///< false once the reading end is closed
+  /// io_service of the reading end
+  asio::io_service* io_service = nullptr;
+
+  /** @name Pending read. */
+  //@{
+  char* read_buf = nullptr;
+  size_t read_size = 0;
+  Transport::Handler read_handler;
+  //@}
+};
+
+
+SimNetwork::SimNetwork(asio::io_service& io_service, uint32_t seed):
+    io_service_(io_service), io_services_{&io_service}, rng_(seed), now_(0), next_order_(0),
+    next_datagram_port_(10000)
+{
+}
+
+SimNetwork::~SimNetwork()
+{
+}
+
+
+SimNetwork::TransportPair SimNetwork::newLink(asio::io_service& io_first, asio::io_service& io_second,
+                                              const LinkConf& up, const LinkConf& down)
+{
+  for(auto* io : {&io_first, &io_second}) {
+    if(std::find(io_services_.begin(), io_services_.end(), io) == io_services_.end()) {
+      io_services_.push_back(io);
+    }
+  }
+  auto pipe_up = std::make_shared<Pipe>();
+  pipe_up->conf = up;
+  pipe_up->io_service = &io_second;
+  auto pipe_down = std::make_shared<Pipe>();
+  pipe_down->conf = down;
+  pipe_down->io_service = &io_first;
+  TransportPair ret;
+  ret.first.reset(new MemoryTransport(*this, io_first, pipe_down, pipe_up));
+  ret.second.reset(new MemoryTransport(*this, io_second, pipe_up, pipe_down));
+  return ret;
+}
+
+std::shared_ptr<MemoryDatagramTransport> SimNetwork::newDatagramTransport(asio::io_service& io_service, const LinkConf& conf)
+{
+  if(std::find(io_services_.begin(), io_services_.end(), &io_service) == io_services_.end()) {
+    io_services_.push_back(&io_service);
+  }
+  const DatagramTransport::Endpoint endpoint(asio::ip::address_v4::loopback(), next_datagram_port_++);
+  auto transport = std::make_shared<MemoryDatagramTransport>(*this, io_service, conf, endpoint);
+  datagram_transports_[endpoint] = transport;
+  return transport;
+}
+
+std::chrono::steady_clock::time_point SimNetwork::time() const
+{
+  return std::chrono::steady_clock::time_point(std::chrono::microseconds(now_));
+}
+
+
+void SimNetwork::runUntil(uint64_t t)
+{
+  this->poll();
+  while(!segments_.empty() && segments_.top().time <= t) {
+    now_ = segments_.top().time;
+    while(!segments_.empty() && segments_.top().time == now_) {
+      Segment seg = segments_.top();
+      segments_.pop();
+      this->deliver(seg);
+    }
+    this->poll();
+  }
+  if(t > now_) {
+    now_ = t;
+  }
+  this->poll();
+}
+
+void SimNetwork::poll()
+{
+  // handlers may post to other io_services, loop until all are idle
+  size_t n;
+  do {
+    n = 0;
+    for(auto* io : io_services_) {
+      // simulated operations are not asio work, the io_service stops each
+      // time it runs out of handlers
+      if(io->stopped()) {
+        io->reset();
+      }
+      n += poll_function_ ? poll_function_(*io) : io->poll();
+    }
+  } while(n > 0 && io_services_.size() > 1);
+}
+
+
+uint64_t SimNetwork::sendTime(const LinkConf& conf, Pipe* pipe, size_t size, bool& lost)
+{
+  stats_.segments++;
+  stats_.bytes += size;
+
+  uint64_t time = now_;
+  if(pipe) {
+    time = std::max(time, pipe->free_time);
+    if(conf.bandwidth > 0) {
+      time += size * 1000000 / conf.bandwidth;
+      pipe->free_time = time;
+    }
+  } else if(conf.bandwidth > 0) {
+    time += size * 1000000 / conf.bandwidth;
+  }
+  time += conf.latency_usec;
+  if(conf.jitter_usec > 0) {
+    time += std::uniform_int_distribution<unsigned int>(0, conf.jitter_usec)(rng_);
+  }
+  if(conf.reorder_percent > 0 && std::uniform_int_distribution<unsigned int>(0, 99)(rng_) < conf.reorder_percent) {
+    time += conf.latency_usec;
+  }
+  lost = conf.loss_percent > 0 && std::uniform_int_distribution<unsigned int>(0, 99)(rng_) < conf.loss_percent;
+  if(lost) {
+    stats_.lost++;
+  }
+  return time;
+}
+
+void SimNetwork::send(const std::shared_ptr<Pipe>& pipe, std::string data)
+{
+  bool lost;
+  uint64_t time = this->sendTime(pipe->conf, pipe.get(), data.size(), lost);
+  if(lost) {
+    time += pipe->conf.retransmit_usec;
+  }
+  segments_.push(Segment{time, next_order_++, pipe, pipe->next_send++, std::move(data), nullptr, {}});
+}
+
+void SimNetwork::sendDatagram(MemoryDatagramTransport& from, const DatagramTransport::Endpoint& to, const std::string& data)
+{
+  bool lost;
+  const uint64_t time = this->sendTime(from.conf_, nullptr, data.size(), lost);
+  auto it = datagram_transports_.find(to);
+  if(lost || it == datagram_transports_.end()) {
+    return;
+  }
+  auto transport = (*it).second.lock();
+  if(!transport) {
+    datagram_transports_.erase(it);
+    return;
+  }
+  segments_.push(Segment{time, next_order_++, nullptr, 0, data, transport, from.endpoint()});
+}
+
+void SimNetwork::deliver(Segment& seg)
+{
+  if(!seg.pipe) {
+    MemoryDatagramTransport& to = *seg.to;
+    if(to.open_ && to.handler_) {
+      to.io_service_.post(std::bind(to.handler_, seg.from, std::move(seg.data)));
+    }
+    return;
+  }
+  Pipe& pipe = *seg.pipe;
+  if(!pipe.reader_open || pipe.reset) {
+    return;  // reading end closed or link reset, drop data
+  }
+  pipe.arrived.emplace(seg.seq, std::move(seg.data));
+  // append contiguous segments
+  for(;;) {
+    auto it = pipe.arrived.find(pipe.next_recv);
+    if(it == pipe.arrived.end()) {
+      break;
+    }
+    if(it->second.empty()) {
+      pipe.eof = true;
+    } else {
+      pipe.buffer += it->second;
+    }
+    pipe.arrived.erase(it);
+    pipe.next_recv++;
+  }
+  this->completeRead(pipe);
+}
+
+void SimNetwork::completeRead(Pipe& pipe)
+{
+  if(!pipe.read_handler) {
+    return;
+  }
+  if(pipe.reset) {
+    post(*pipe.io_service, std::move(pipe.read_handler), asio::error::connection_reset);
+  } else if(pipe.buffer.size() >= pipe.read_size) {
+    ::memcpy(pipe.read_buf, pipe.buffer.data(), pipe.read_size);
+    pipe.buffer.erase(0, pipe.read_size);
+    post(*pipe.io_service, std::move(pipe.read_handler), boost::system::error_code());
+  } else if(pipe.eof) {
+    post(*pipe.io_service, std::move(pipe.read_handler), asio::error::eof);
+  } else {
+    return;
+  }
+  pipe.read_handler = nullptr;
+  pipe.read_buf = nullptr;
+  pipe.read_size = 0;
+}
+
+void SimNetwork::post(asio::io_service& io_service, Transport::Handler handler, const boost::system::error_code& ec)
+{
+  io_service.post(std::bind(handler, ec));
+}
+
+
+MemoryTransport::MemoryTransport(SimNetwork& net, asio::io_service& io_service,
+                                 std::shared_ptr<SimNetwork::Pipe> in, std::shared_ptr<SimNetwork::Pipe> out):
+    net_(net), io_service_(io_service), in_(in), out_(out), open_(true)
+{
+}
+
+MemoryTransport::~MemoryTransport()
+{
+  if(open_) {
+    this->close();
+  }
+}
+
+void MemoryTransport::asyncRead(char* buf, size_t size, Handler handler)
+{
+  if(!open_) {
+    SimNetwork::post(io_service_, handler, asio::error::operation_aborted);
+    return;
+  }
+  assert( !in_->read_handler );
+  in_->read_buf = buf;
+  in_->read_size = size;
+  in_->read_handler = handler;
+  net_.completeRead(*in_);
+}
+
+void MemoryTransport::asyncWrite(const char* buf, size_t size, Handler handler)
+{
+  if(!open_) {
+    SimNetwork::post(io_service_, handler, asio::error::operation_aborted);
+    return;
+  } else if(out_->reset) {
+    SimNetwork::post(io_service_, handler, asio::error::connection_reset);
+    return;
+  }
+  if(size > 0) {
+    net_.send(out_, std::string(buf, size));
+  }
+  // data is buffered, like in a kernel socket buffer
+  SimNetwork::post(io_service_, handler, boost::system::error_code());
+}
+
+void MemoryTransport::close()
+{
+  if(!open_) {
+    return;
+  }
+  open_ = false;
+  in_->reader_open = false;
+  in_->buffer.clear();
+  in_->arrived.clear();
+  if(in_->read_handler) {
+    SimNetwork::post(io_service_, std::move(in_->read_handler), asio::error::operation_aborted);
+    in_->read_handler = nullptr;
+  }
+  net_.send(out_, std::string());  // end of stream
+}
+
+void MemoryTransport::reset()
+{
+  for(auto* pipe : {in_.get(), out_.get()}) {
+    pipe->reset = true;
+    pipe->buffer.clear();
+    pipe->arrived.clear();
+    net_.completeRead(*pipe);
+  }
+}
+
+
+MemoryDatagramTransport::MemoryDatagramTransport(SimNetwork& net, asio::io_service& io_service,
+                                                 const SimNetwork::LinkConf& conf, const Endpoint& endpoint):
+    net_(net), io_service_(io_service), conf_(conf), endpoint_(endpoint), open_(true)
+{
+}
+
+void MemoryDatagramTransport::sendTo(const Endpoint& endpoint, const std::string& data)
+{
+  if(open_) {
+    net_.sendDatagram(*this, endpoint, data);
+  }
+}
+
+void MemoryDatagramTransport::close()
+{
+  open_ = false;
+  handler_ = nullptr;
+  net_.datagram_transports_.erase(endpoint_);
+}
+
+
+}
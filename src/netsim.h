@@ -0,0 +1,245 @@
+#ifndef NETSIM_H_
+#define NETSIM_H_
+
+/** @file
+ * @brief In-process network simulation.
+ *
+ * Simulated links connect sockets of the same process, with configurable
+ * latency, jitter, bandwidth, reordering and loss. Datagram transports can
+ * also be created, for the input channel. Time is virtual: data is only
+ * delivered when the simulation clock is advanced, so that whole matches can
+ * run faster than real time.
+ *
+ * Only data delivery and clocks of instances are virtual. asio timers still
+ * expire on real time: the server's lag watchdog, resume and spectator
+ * timers, the clients' ping timer and connection timeouts. Simulations are
+ * only deterministic if these timers are disabled or never expire.
+ */
+
+#include <stdint.h>
+#include <string>
+#include <memory>
+#include <vector>
+#include <map>
+#include <queue>
+#include <random>
+#include <chrono>
+#include <functional>
+#include "netplay.h"
+
+
+namespace netplay {
+
+class MemoryTransport;
+class MemoryDatagramTransport;
+
+
+/** @brief Simulated network, driven by a virtual clock.
+ *
+ * Links behave like TCP connections: data is reliable and read in order.
+ * Reordered, jittered or lost (thus retransmitted) segments delay the
+ * following ones (head-of-line blocking). Datagrams are not ordered, lost
+ * ones are dropped.
+ *
+ * Completion handlers are posted to the io_service, which is polled by the
+ * network when the clock is advanced. Random values are drawn from a seeded
+ * generator, a simulation is thus reproducible.
+ */
+class SimNetwork
+{
+  friend class MemoryTransport;
+  friend class MemoryDatagramTransport;
+ public:
+  /// Configuration of a link direction.
+  struct LinkConf {
+    unsigned int latency_usec = 0;  ///< one-way delay
+    unsigned int jitter_usec = 0;  ///< maximum random extra delay
+    unsigned long bandwidth = 0;  ///< bytes per second, 0 for unlimited
+    /// Percentage of segments delayed by an extra latency
+    unsigned int reorder_percent = 0;
+    /// Percentage of lost segments and datagrams
+    unsigned int loss_percent = 0;
+    /// Extra delay of lost segments, until they are retransmitted
+    unsigned int retransmit_usec = 200000;
+  };
+
+  /// Traffic statistics, for all links.
+  struct Stats {
+    unsigned long segments = 0;  ///< sent segments (one per write) and datagrams
+    unsigned long bytes = 0;  ///< sent bytes
+    unsigned long lost = 0;  ///< lost segments and datagrams
+  };
+
+  typedef std::pair<std::unique_ptr<Transport>, std::unique_ptr<Transport>> TransportPair;
+  /// Function running ready handlers of an io_service, return their count.
+  typedef std::function<size_t(boost::asio::io_service&)> PollFunction;
+
+  SimNetwork(boost::asio::io_service& io_service, uint32_t seed=0);
+  ~SimNetwork();
+  SimNetwork(const SimNetwork&) = delete;
+  SimNetwork& operator=(const SimNetwork&) = delete;
+
+  /** @brief Create a link, return its two ends.
+   *
+   * \e up applies to data sent by the first end, \e down to the other
+   * direction.
+   */
+  TransportPair newLink(const LinkConf& up, const LinkConf& down) {
+    return this->newLink(io_service_, io_service_, up, down);
+  }
+  TransportPair newLink(const LinkConf& conf) { return this->newLink(conf, conf); }
+  /** @brief Create a link between two io_services.
+   *
+   * Handlers of each end are posted to its own io_service. It allows to
+   * tell apart the work of each side, see setPollFunction().
+   */
+  TransportPair newLink(boost::asio::io_service& io_first, boost::asio::io_service& io_second,
+                        const LinkConf& up, const LinkConf& down);
+
+  /** @brief Create a datagram transport, with its own endpoint.
+   *
+   * \e conf applies to sent datagrams. Datagrams sent to unknown or closed
+   * endpoints are dropped.
+   */
+  std::shared_ptr<MemoryDatagramTransport> newDatagramTransport(const LinkConf& conf) {
+    return this->newDatagramTransport(io_service_, conf);
+  }
+  std::shared_ptr<MemoryDatagramTransport> newDatagramTransport(boost::asio::io_service& io_service, const LinkConf& conf);
+
+  /// Virtual time, in microseconds.
+  uint64_t now() const { return now_; }
+  /** @brief Virtual time, as a steady clock time.
+   *
+   * Used as time source of instances (see GameInstance::setClock()), for
+   * match timing and RTT measures; it does not drive their timers.
+   */
+  std::chrono::steady_clock::time_point time() const;
+
+  /** @brief Advance the virtual clock up to a given time.
+   *
+   * Data is delivered in time order; the io_service is polled after each
+   * delivery time, so that replies are sent at the right virtual time.
+   */
+  void runUntil(uint64_t t);
+  void runFor(uint64_t usec) { this->runUntil(now_ + usec); }
+
+  const Stats& stats() const { return stats_; }
+
+  /** @brief Set the function used to poll io_services.
+   *
+   * Default is io_service::poll(). It may be used to measure the time spent
+   * in handlers.
+   */
+  void setPollFunction(PollFunction f) { poll_function_ = f; }
+
+ private:
+  struct Pipe;
+
+  /// Segment or datagram in flight.
+  struct Segment {
+    uint64_t time;  ///< delivery time
+    uint64_t order;  ///< tie-breaker, for a stable delivery order
+    std::shared_ptr<Pipe> pipe;  ///< null for datagrams
+    uint64_t seq;  ///< sequence number in the pipe
+    std::string data;  ///< empty for end of stream
+    /** @name Datagram destination and source. */
+    //@{
+    std::shared_ptr<MemoryDatagramTransport> to;
+    DatagramTransport::Endpoint from;
+    //@}
+    bool operator>(const Segment& o) const {
+      return time != o.time ? time > o.time : order > o.order;
+    }
+  };
+
+  /// Return the delivery time of sent data, update stats and pipe state.
+  uint64_t sendTime(const LinkConf& conf, Pipe* pipe, size_t size, bool& lost);
+  /// Send data on a pipe (empty data for end of stream).
+  void send(const std::shared_ptr<Pipe>& pipe, std::string data);
+  /// Send a datagram from a transport.
+  void sendDatagram(MemoryDatagramTransport& from, const DatagramTransport::Endpoint& to, const std::string& data);
+  /// Deliver a segment to its pipe, or a datagram.
+  void deliver(Segment& seg);
+  /// Complete the pending read of a pipe, if possible.
+  void completeRead(Pipe& pipe);
+  /// Post a handler to an io_service.
+  static void post(boost::asio::io_service& io_service, Transport::Handler handler, const boost::system::error_code& ec);
+  /// Run ready handlers of all io_services.
+  void poll();
+
+  boost::asio::io_service& io_service_;
+  /// All io_services with link ends, polled in order
+  std::vector<boost::asio::io_service*> io_services_;
+  PollFunction poll_function_;
+  std::mt19937 rng_;
+  uint64_t now_;
+  uint64_t next_order_;
+  std::priority_queue<Segment, std::vector<Segment>, std::greater<Segment>> segments_;
+  Stats stats_;
+  /// Open datagram transports, by endpoint
+  std::map<DatagramTransport::Endpoint, std::weak_ptr<MemoryDatagramTransport>> datagram_transports_;
+  unsigned short next_datagram_port_;
+};
+
+
+/// Transport over a simulated link.
+class MemoryTransport: public Transport
+{
+  friend class SimNetwork;
+ public:
+  virtual ~MemoryTransport();
+
+  virtual void asyncRead(char* buf, size_t size, Handler handler);
+  virtual void asyncWrite(const char* buf, size_t size, Handler handler);
+  virtual bool isOpen() const { return open_; }
+  /// Close the transport, the other end reads the end of stream.
+  virtual void close();
+  /** @brief Break the link, as a network failure.
+   *
+   * Data in flight is dropped. Reads and writes of both ends fail with
+   * connection_reset.
+   */
+  void reset();
+
+ private:
+  MemoryTransport(SimNetwork& net, boost::asio::io_service& io_service,
+                  std::shared_ptr<SimNetwork::Pipe> in, std::shared_ptr<SimNetwork::Pipe> out);
+
+  SimNetwork& net_;
+  boost::asio::io_service& io_service_;
+  std::shared_ptr<SimNetwork::Pipe> in_;
+  std::shared_ptr<SimNetwork::Pipe> out_;
+  bool open_;
+};
+
+
+/// Datagram transport over the simulated network.
+class MemoryDatagramTransport: public DatagramTransport
+{
+  friend class SimNetwork;
+ public:
+  MemoryDatagramTransport(SimNetwork& net, boost::asio::io_service& io_service,
+                          const SimNetwork::LinkConf& conf, const Endpoint& endpoint);
+  virtual ~MemoryDatagramTransport() {}
+
+  /// Return the endpoint of the transport, to send datagrams to it.
+  const Endpoint& endpoint() const { return endpoint_; }
+
+  virtual void start(ReceiveHandler handler) { handler_ = handler; }
+  virtual void sendTo(const Endpoint& endpoint, const std::string& data);
+  virtual bool isOpen() const { return open_; }
+  virtual void close();
+
+ private:
+  SimNetwork& net_;
+  boost::asio::io_service& io_service_;
+  SimNetwork::LinkConf conf_;
+  Endpoint endpoint_;
+  ReceiveHandler handler_;
+  bool open_;
+};
+
+
+}
+
+#endif
@@ -0,0 +1,788 @@
+#include <cassert>
+#include <cstring>
+#include <cerrno>
+#include <cstdarg>
+#include <ctime>
+#include <stdexcept>
+#include <algorithm>
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "replay.h"
+#include "replay.pb.h"
+#include "instance.h"
+#include "game.h"
+#include "log.h"
+
+
+const char ReplayRecorder::MAGIC[4] = {'P', 'N', 'P', 'R'};
+const char ReplayRecorder::INDEX_MAGIC[4] = {'P', 'N', 'P', 'I'};
+const uint32_t ReplayRecorder::VERSION = 2;
+const size_t ReplayRecorder::INPUT_CHUNK_RUNS = 256;
+const Tick ReplayRecorder::HASH_PERIOD = 120;
+const Tick ReplayRecorder::KEYFRAME_PERIOD = 600;
+
+/// Size of the index trailer: offset and magic.
+static const size_t INDEX_TRAILER_SIZE = 12;
+
+/// Maximum length of an input run.
+static const uint32_t INPUT_RUN_MAX = (1u << 26) - 1;
+
+
+/// Append a 32-bit big-endian integer to a string.
+static void appendUint32(std::string& s, uint32_t v)
+{
+  const char buf[4] = {
+    static_cast<char>(v >> 24),
+    static_cast<char>(v >> 16),
+    static_cast<char>(v >> 8),
+    static_cast<char>(v),
+  };
+  s.append(buf, sizeof(buf));
+}
+
+/// Append a 64-bit big-endian integer to a string.
+static void appendUint64(std::string& s, uint64_t v)
+{
+  appendUint32(s, v >> 32);
+  appendUint32(s, v & 0xffffffff);
+}
+
+/// Read a 32-bit big-endian integer.
+static uint32_t readUint32(const char* p)
+{
+  const uint8_t* b = reinterpret_cast<const uint8_t*>(p);
+  return b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+}
+
+/// Read a 64-bit big-endian integer.
+static uint64_t readUint64(const char* p)
+{
+  return static_cast<uint64_t>(readUint32(p)) << 32 | readUint32(p+4);
+}
+
+
+ReplayRecorder::ReplayRecorder(const std::string& filename):
+    offset_(0), stop_(false)
+{
+  fp_ = ::fopen(filename.c_str(), "wb");
+  if(fp_ == NULL) {
+    throw std::runtime_error(::strerror(errno));
+  }
+  std::string header(MAGIC, sizeof(MAGIC));
+  appendUint32(header, VERSION);
+  this->writeData(std::move(header));
+  thread_ = std::thread(&ReplayRecorder::run, this);
+}
+
+ReplayRecorder::~ReplayRecorder()
+{
+  const uint64_t index_offset = offset_;
+  replay::Record rec;
+  rec.mutable_index()->Swap(&index_);
+  this->write(rec);
+  std::string trailer;
+  appendUint64(trailer, index_offset);
+  trailer.append(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  this->writeData(std::move(trailer));
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cond_.notify_one();
+  thread_.join();
+  ::fclose(fp_);
+}
+
+
+std::string ReplayRecorder::newFileName(const std::string& dir)
+{
+  char buf[32];
+  const time_t t = ::time(NULL);
+  ::strftime(buf, sizeof(buf), "%Y%m%d-%H%M%S", ::localtime(&t));
+  const std::string base = dir.empty() ? buf : dir + "/" + buf;
+  std::string filename = base + ".pnpr";
+  // don't overwrite replays of matches started in the same second
+  for(unsigned int i=2; ; i++) {
+    FILE* fp = ::fopen(filename.c_str(), "rb");
+    if(fp == NULL) {
+      break;
+    }
+    ::fclose(fp);
+    filename = base + "-" + std::to_string(i) + ".pnpr";
+  }
+  return filename;
+}
+
+
+void ReplayRecorder::recordMatch(const GameInstance& instance)
+{
+  replay::Record rec;
+  replay::Match* rec_match = rec.mutable_match();
+  rec_match->set_tk_usec(instance.conf().tk_usec);
+  rec_match->set_tk_start_countdown(instance.conf().tk_start_countdown);
+  rec_match->set_start_time(::time(NULL));
+
+  for(auto& kv : instance.players()) {
+    const Player& pl = *kv.second;
+    const Field* fld = pl.field();
+    if(fld == NULL) {
+      continue;
+    }
+    replay::Match::Field* rec_field = rec_match->add_fields();
+    rec_field->set_fldid(fld->fldid());
+    rec_field->set_plid(pl.plid());
+    rec_field->set_nick(pl.nick());
+    fld->conf().toPacket(*rec_field->mutable_conf());
+    rec_field->set_seed(fld->seed());
+    fld->setGridColorsToBytes(*rec_field->mutable_grid());
+  }
+
+  inputs_.clear();
+  inputs_.resize(instance.match().fields().size());
+  for(auto& fld : instance.match().fields()) {
+    const bool simulated = instance.isFieldSimulated(*fld);
+    inputs_[fld->fldid()-1].simulated = simulated;
+    for(auto& rec_field : *rec_match->mutable_fields()) {
+      if(rec_field.fldid() == fld->fldid()) {
+        rec_field.set_simulated(simulated);
+      }
+    }
+  }
+  this->write(rec);
+}
+
+
+void ReplayRecorder::recordInput(const Field& fld, Tick tick, KeyState keys)
+{
+  InputStream& stream = this->inputStream(fld);
+  if(stream.count == 0 && stream.runs.empty()) {
+    stream.tick = tick;
+  }
+  assert( tick == stream.tick || tick == stream.next_tick );
+
+  if(stream.count > 0 && stream.keys == keys && stream.count < INPUT_RUN_MAX) {
+    stream.count++;
+  } else {
+    if(stream.count > 0) {
+      stream.runs.push_back(stream.count << 6 | stream.keys);
+      stream.count = 0;
+      if(stream.runs.size() >= INPUT_CHUNK_RUNS) {
+        this->flushInputs(fld, stream);
+      }
+    }
+    stream.keys = keys;
+    stream.count = 1;
+  }
+  stream.next_tick = tick + 1;
+
+  // keyframes of unsimulated fields would not be valid
+  if(stream.simulated && stream.next_tick % KEYFRAME_PERIOD == 0) {
+    this->flushInputs(fld, stream);
+    this->writeKeyframe(fld);
+  } else if(stream.simulated && stream.next_tick % HASH_PERIOD == 0) {
+    this->flushInputs(fld, stream);
+  }
+}
+
+
+void ReplayRecorder::recordDrop(const Field& fld, const Garbage& gb)
+{
+  // keep records of a field in tick order
+  this->flushInputs(fld, this->inputStream(fld));
+
+  replay::Record rec;
+  replay::Drop* rec_drop = rec.mutable_drop();
+  rec_drop->set_fldid(fld.fldid());
+  rec_drop->set_tick(fld.tick());
+  rec_drop->set_type(static_cast<netplay::GarbageType>(gb.type));
+  rec_drop->set_size_x(gb.size.x);
+  rec_drop->set_size_y(gb.size.y);
+  if(gb.from) {
+    rec_drop->set_from(gb.from->fldid());
+  }
+  this->write(rec);
+}
+
+
+void ReplayRecorder::recordFieldEnd(const Field& fld)
+{
+  this->flushInputs(fld, this->inputStream(fld));
+
+  replay::Record rec;
+  replay::FieldEnd* rec_end = rec.mutable_field_end();
+  rec_end->set_fldid(fld.fldid());
+  rec_end->set_tick(fld.tick());
+  rec_end->set_lost(fld.lost());
+  rec_end->set_rank(fld.rank());
+  if(this->inputStream(fld).simulated) {
+    rec_end->set_hash(fld.stateHash());
+    rec_end->set_events(fld.eventsDigest());
+  }
+  this->write(rec);
+}
+
+
+ReplayRecorder::InputStream& ReplayRecorder::inputStream(const Field& fld)
+{
+  if(fld.fldid() > inputs_.size()) {
+    inputs_.resize(fld.fldid());
+  }
+  return inputs_[fld.fldid()-1];
+}
+
+void ReplayRecorder::flushInputs(const Field& fld, InputStream& stream)
+{
+  if(stream.count > 0) {
+    stream.runs.push_back(stream.count << 6 | stream.keys);
+    stream.count = 0;
+  }
+  if(stream.runs.empty()) {
+    return;
+  }
+
+  replay::Record rec;
+  replay::Inputs* rec_inputs = rec.mutable_inputs();
+  rec_inputs->set_fldid(fld.fldid());
+  rec_inputs->set_tick(stream.tick);
+  for(uint32_t run : stream.runs) {
+    rec_inputs->add_runs(run);
+  }
+  if(stream.simulated) {
+    rec_inputs->set_hash(fld.stateHash());
+  }
+  this->write(rec);
+
+  stream.runs.clear();
+  stream.tick = stream.next_tick;
+}
+
+
+void ReplayRecorder::writeKeyframe(const Field& fld)
+{
+  replay::Index::Entry* entry = index_.add_keyframes();
+  entry->set_fldid(fld.fldid());
+  entry->set_tick(fld.tick());
+  entry->set_offset(offset_);
+
+  replay::Record rec;
+  replay::Keyframe* rec_keyframe = rec.mutable_keyframe();
+  rec_keyframe->set_fldid(fld.fldid());
+  fld.setStateToPacket(*rec_keyframe->mutable_state());
+  this->write(rec);
+}
+
+
+void ReplayRecorder::write(const replay::Record& rec)
+{
+  const uint32_t size = rec.ByteSizeLong();
+  std::string data;
+  data.reserve(4 + size);
+  appendUint32(data, size);
+  rec.AppendToString(&data);
+  this->writeData(std::move(data));
+}
+
+void ReplayRecorder::writeData(std::string data)
+{
+  offset_ += data.size();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(std::move(data));
+  }
+  cond_.notify_one();
+}
+
+
+void ReplayRecorder::run()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  for(;;) {
+    cond_.wait(lock, [this]{ return stop_ || !queue_.empty(); });
+    if(queue_.empty()) {
+      break;  // stopped, everything has been written
+    }
+    std::deque<std::string> queue;
+    queue.swap(queue_);
+    lock.unlock();
+    for(const std::string& data : queue) {
+      if(::fwrite(data.data(), 1, data.size(), fp_) != data.size()) {
+        LOG_ERROR("replay: write failed: %s", ::strerror(errno));
+      }
+    }
+    ::fflush(fp_);
+    lock.lock();
+  }
+}
+
+
+
+ReplayFile::ReplayFile(const std::string& filename):
+    data_(nullptr), size_(0)
+{
+#ifdef WIN32
+  FILE* fp = ::fopen(filename.c_str(), "rb");
+  if(fp == NULL) {
+    throw std::runtime_error(::strerror(errno));
+  }
+  char buf[16384];
+  size_t n;
+  while((n = ::fread(buf, 1, sizeof(buf), fp)) > 0) {
+    buffer_.append(buf, n);
+  }
+  const bool read_error = ::ferror(fp);
+  ::fclose(fp);
+  if(read_error) {
+    throw std::runtime_error("read error");
+  }
+  data_ = buffer_.data();
+  size_ = buffer_.size();
+#else
+  const int fd = ::open(filename.c_str(), O_RDONLY);
+  if(fd < 0) {
+    throw std::runtime_error(::strerror(errno));
+  }
+  struct stat st;
+  if(::fstat(fd, &st) != 0) {
+    ::close(fd);
+    throw std::runtime_error(::strerror(errno));
+  }
+  size_ = st.st_size;
+  if(size_ > 0) {
+    void* p = ::mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(p == MAP_FAILED) {
+      ::close(fd);
+      throw std::runtime_error(::strerror(errno));
+    }
+    data_ = static_cast<const char*>(p);
+  }
+  ::close(fd);
+#endif
+
+  try {
+    if(size_ < 8 || ::memcmp(data_, ReplayRecorder::MAGIC, 4) != 0) {
+      throw std::runtime_error("not a replay file");
+    }
+    const uint32_t version = readUint32(data_+4);
+    if(version == 0 || version > ReplayRecorder::VERSION) {
+      throw std::runtime_error("unsupported replay version");
+    }
+    records_end_ = size_;
+    if(size_ >= 8 + INDEX_TRAILER_SIZE && ::memcmp(data_+size_-4, ReplayRecorder::INDEX_MAGIC, 4) == 0) {
+      records_end_ = readUint64(data_+size_-INDEX_TRAILER_SIZE);
+      if(records_end_ < 8 || records_end_ > size_-INDEX_TRAILER_SIZE) {
+        throw std::runtime_error("invalid index offset");
+      }
+    }
+
+    replay::Record rec;
+    first_record_ = 8;
+    if(!this->readRecord(first_record_, rec) || !rec.has_match()) {
+      throw std::runtime_error("missing match record");
+    }
+    match_.Swap(rec.mutable_match());
+    for(int i=0; i<match_.fields_size(); i++) {
+      if(match_.fields(i).fldid() != static_cast<FldId>(i+1)) {
+        throw std::runtime_error("invalid field ID");
+      }
+    }
+    this->loadIndex();
+  } catch(const std::exception&) {
+#ifndef WIN32
+    if(data_) {
+      ::munmap(const_cast<char*>(data_), size_);
+    }
+#endif
+    throw;
+  }
+}
+
+ReplayFile::~ReplayFile()
+{
+#ifndef WIN32
+  if(data_) {
+    ::munmap(const_cast<char*>(data_), size_);
+  }
+#endif
+}
+
+
+bool ReplayFile::readRecord(size_t& pos, replay::Record& rec) const
+{
+  if(pos >= records_end_) {
+    return false;
+  }
+  if(records_end_ - pos < 4) {
+    throw std::runtime_error("truncated record");
+  }
+  const uint32_t size = readUint32(data_+pos);
+  if(size > records_end_ - pos - 4) {
+    throw std::runtime_error("truncated record");
+  }
+  if(!rec.ParseFromArray(data_+pos+4, size)) {
+    throw std::runtime_error("invalid record");
+  }
+  pos += 4 + size;
+  return true;
+}
+
+
+void ReplayFile::loadIndex()
+{
+  keyframes_.clear();
+  keyframes_.resize(match_.fields_size());
+  replay::Record rec;
+  if(records_end_ < size_) {
+    // the index is read as a record, then excluded from records
+    const size_t index_offset = records_end_;
+    size_t pos = index_offset;
+    records_end_ = size_ - INDEX_TRAILER_SIZE;
+    if(!this->readRecord(pos, rec) || !rec.has_index()) {
+      throw std::runtime_error("invalid index");
+    }
+    records_end_ = index_offset;
+    for(auto& entry : rec.index().keyframes()) {
+      if(entry.fldid() == 0 || entry.fldid() > keyframes_.size() || entry.offset() >= records_end_) {
+        throw std::runtime_error("invalid index");
+      }
+      keyframes_[entry.fldid()-1].emplace_back(entry.tick(), entry.offset());
+    }
+  } else {
+    // no index, read all records
+    size_t pos = first_record_;
+    for(;;) {
+      const size_t offset = pos;
+      if(!this->readRecord(pos, rec)) {
+        break;
+      }
+      if(rec.has_keyframe()) {
+        const replay::Keyframe& rec_keyframe = rec.keyframe();
+        if(rec_keyframe.fldid() == 0 || rec_keyframe.fldid() > keyframes_.size()) {
+          throw std::runtime_error("invalid field ID");
+        }
+        keyframes_[rec_keyframe.fldid()-1].emplace_back(rec_keyframe.state().tick(), offset);
+      }
+    }
+  }
+  for(auto& v : keyframes_) {
+    std::sort(v.begin(), v.end());
+  }
+}
+
+
+void ReplayFile::seek(Match& match, std::vector<FieldConf>& confs, Tick tick) const
+{
+  assert( !match.started() && match.fields().empty() );
+  // fields keep a reference to their configuration
+  confs.clear();
+  confs.resize(match_.fields_size());
+  for(auto& info : match_.fields()) {
+    FieldConf& conf = confs[info.fldid()-1];
+    conf.fromPacket(info.conf());
+    Field& fld = match.addField(conf, info.seed());
+    if(!fld.setGridColorsFromBytes(info.grid())) {
+      throw std::runtime_error("invalid grid");
+    }
+  }
+  match.start();
+
+  for(auto& fld : match.fields()) {
+    this->seekField(*fld, tick);
+  }
+  match.updateTick();
+  std::vector<const Field*> ranked;
+  match.updateRanks(ranked);
+}
+
+
+void ReplayFile::seekField(Field& fld, Tick tick) const
+{
+  const FldId fldid = fld.fldid();
+  replay::Record rec;
+
+  // restore the last keyframe
+  size_t pos = first_record_;
+  const auto& keyframes = keyframes_[fldid-1];
+  auto it = std::upper_bound(keyframes.begin(), keyframes.end(), std::make_pair(tick, ~size_t(0)));
+  if(it != keyframes.begin()) {
+    pos = (it-1)->second;
+    if(!this->readRecord(pos, rec) || !rec.has_keyframe() || rec.keyframe().fldid() != fldid) {
+      throw std::runtime_error("invalid keyframe");
+    }
+    if(!fld.setStateFromPacket(rec.keyframe().state())) {
+      throw std::runtime_error("invalid keyframe");
+    }
+  }
+
+  // simulate forward
+  const Tick tk_start_countdown = match_.tk_start_countdown();
+  while(fld.tick() < tick && !fld.lost() && this->readRecord(pos, rec)) {
+    if(rec.has_inputs()) {
+      const replay::Inputs& rec_inputs = rec.inputs();
+      if(rec_inputs.fldid() != fldid) {
+        continue;
+      }
+      Tick tk = rec_inputs.tick();
+      for(uint32_t run : rec_inputs.runs()) {
+        const KeyState keys = run & 0x3f;
+        for(uint32_t n = run >> 6; n > 0; n--, tk++) {
+          if(tk < fld.tick()) {
+            continue;
+          } else if(tk > fld.tick()) {
+            throw std::runtime_error("non-contiguous inputs");
+          } else if(fld.tick() >= tick || fld.lost()) {
+            break;
+          }
+          if(tk == tk_start_countdown) {
+            fld.enableSwap(true);
+            fld.enableRaise(true);
+          }
+          fld.step(keys);
+        }
+      }
+    } else if(rec.has_drop()) {
+      const replay::Drop& rec_drop = rec.drop();
+      if(rec_drop.fldid() != fldid || rec_drop.tick() < fld.tick()) {
+        continue;  // already in the keyframe
+      } else if(rec_drop.tick() > fld.tick()) {
+        throw std::runtime_error("unordered garbage drop");
+      }
+      if(rec_drop.size_x() > FIELD_WIDTH || rec_drop.size_y() > FIELD_HEIGHT) {
+        throw std::runtime_error("invalid garbage size");
+      }
+      fld.dropGarbage(static_cast<Garbage::Type>(rec_drop.type()),
+                      FieldPos(rec_drop.size_x(), rec_drop.size_y()));
+    } else if(rec.has_field_end()) {
+      const replay::FieldEnd& rec_end = rec.field_end();
+      if(rec_end.fldid() == fldid && rec_end.lost() && !fld.lost()) {
+        fld.abort();  // player left or has been aborted by the server
+      }
+    }
+  }
+}
+
+
+void Replay::load(const std::string& filename)
+{
+  ReplayFile file(filename);
+  match = file.match();
+  fields.clear();
+  fields.resize(match.fields_size());
+  for(auto& info : match.fields()) {
+    FieldData& field = fields[info.fldid()-1];
+    field.info = &info;
+    field.has_end = false;
+  }
+
+  replay::Record rec;
+  for(size_t pos=file.firstRecord(); file.readRecord(pos, rec); ) {
+    if(rec.has_inputs()) {
+      const replay::Inputs& rec_inputs = rec.inputs();
+      if(rec_inputs.fldid() == 0 || rec_inputs.fldid() > fields.size()) {
+        throw std::runtime_error("invalid field ID");
+      }
+      FieldData& field = fields[rec_inputs.fldid()-1];
+      if(rec_inputs.tick() != field.inputs.size()) {
+        throw std::runtime_error("non-contiguous inputs");
+      }
+      for(uint32_t run : rec_inputs.runs()) {
+        field.inputs.insert(field.inputs.end(), run >> 6, run & 0x3f);
+      }
+      if(field.info->simulated()) {
+        field.hashes.emplace_back(field.inputs.size(), rec_inputs.hash());
+      }
+    } else if(rec.has_drop()) {
+      const replay::Drop& rec_drop = rec.drop();
+      if(rec_drop.fldid() == 0 || rec_drop.fldid() > fields.size()) {
+        throw std::runtime_error("invalid field ID");
+      }
+      FieldData& field = fields[rec_drop.fldid()-1];
+      if(rec_drop.tick() < field.inputs.size() ||
+         (!field.drops.empty() && rec_drop.tick() < field.drops.back().tick)) {
+        throw std::runtime_error("unordered garbage drop");
+      }
+      if(rec_drop.size_x() > FIELD_WIDTH || rec_drop.size_y() > FIELD_HEIGHT) {
+        throw std::runtime_error("invalid garbage size");
+      }
+      field.drops.push_back({
+          rec_drop.tick(),
+          static_cast<Garbage::Type>(rec_drop.type()),
+          FieldPos(rec_drop.size_x(), rec_drop.size_y()),
+          rec_drop.from() <= fields.size() ? rec_drop.from() : 0});
+    } else if(rec.has_field_end()) {
+      const replay::FieldEnd& rec_end = rec.field_end();
+      if(rec_end.fldid() == 0 || rec_end.fldid() > fields.size()) {
+        throw std::runtime_error("invalid field ID");
+      }
+      FieldData& field = fields[rec_end.fldid()-1];
+      field.has_end = true;
+      field.end = rec_end;
+    }
+  }
+}
+
+
+ReplayVerifier::ReplayVerifier(const Replay& replay, bool collect_stats):
+    replay_(replay), ticks_(0), collect_stats_(collect_stats),
+    seek_file_(nullptr), seek_period_(0), seeks_(0),
+    seek_time_(Duration::zero()), seek_time_max_(Duration::zero())
+{
+}
+
+void ReplayVerifier::checkSeeks(const ReplayFile& file, Tick period)
+{
+  seek_file_ = period > 0 ? &file : nullptr;
+  seek_period_ = period;
+}
+
+bool ReplayVerifier::run()
+{
+  // fields keep a reference to their configuration
+  std::vector<FieldConf> confs(replay_.fields.size());
+  Match match;
+  for(auto& data : replay_.fields) {
+    FieldConf& conf = confs[data.info->fldid()-1];
+    conf.fromPacket(data.info->conf());
+    Field& fld = match.addField(conf, data.info->seed());
+    if(!fld.setGridColorsFromBytes(data.info->grid())) {
+      return this->fail("field %u: invalid grid", fld.fldid());
+    }
+  }
+  match.start();
+  stats_.clear();
+  if(collect_stats_) {
+    stats_.resize(replay_.fields.size());
+  }
+
+  const Tick tk_start_countdown = replay_.match.tk_start_countdown();
+  std::vector<size_t> drop_pos(replay_.fields.size(), 0);
+  std::vector<size_t> hash_pos(replay_.fields.size(), 0);
+  std::vector<const Field*> ranked;
+  for(Tick tk=0; ; tk++) {
+    if(seek_file_ != nullptr && tk > 0 && tk % seek_period_ == 0 && !this->checkSeek(match, tk)) {
+      return false;
+    }
+    bool stepped = false;
+    for(auto& ptr : match.fields()) {
+      Field& fld = *ptr;
+      const Replay::FieldData& data = replay_.fields[fld.fldid()-1];
+      if(fld.lost()) {
+        continue;
+      }
+      if(tk >= data.inputs.size()) {
+        if(tk == data.inputs.size() && data.has_end && data.end.lost()) {
+          fld.abort();  // player left or has been aborted by the server
+        }
+        continue;
+      }
+
+      if(tk == tk_start_countdown) {
+        fld.enableSwap(true);
+        fld.enableRaise(true);
+      }
+      size_t& drop_i = drop_pos[fld.fldid()-1];
+      while(drop_i < data.drops.size() && data.drops[drop_i].tick == tk) {
+        const Replay::Drop& drop = data.drops[drop_i++];
+        fld.dropGarbage(drop.type, drop.size);
+        if(collect_stats_) {
+          stats_[fld.fldid()-1].garbageReceived(drop.size);
+          if(drop.from != 0) {
+            stats_[drop.from-1].garbageSent(drop.size);
+          }
+        }
+      }
+      fld.step(data.inputs[tk]);
+      ticks_++;
+      if(collect_stats_) {
+        stats_[fld.fldid()-1].step(fld, data.inputs[tk]);
+      }
+      stepped = true;
+
+      size_t& hash_i = hash_pos[fld.fldid()-1];
+      if(hash_i < data.hashes.size() && data.hashes[hash_i].first == fld.tick()) {
+        if(data.hashes[hash_i].second != fld.stateHash()) {
+          return this->fail("field %u: state mismatch at tick %u", fld.fldid(), fld.tick());
+        }
+        hash_i++;
+      }
+      if(fld.lost() && fld.tick() < data.inputs.size()) {
+        return this->fail("field %u: unexpected loss at tick %u", fld.fldid(), fld.tick());
+      }
+    }
+    if(!stepped) {
+      break;
+    }
+    match.updateTick();
+    match.updateRanks(ranked);
+  }
+
+  for(auto& fld : match.fields()) {
+    if(!this->checkFieldEnd(*fld, replay_.fields[fld->fldid()-1])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ReplayVerifier::checkFieldEnd(const Field& fld, const Replay::FieldData& data)
+{
+  if(!data.has_end) {
+    return true;  // match has not been properly ended
+  }
+  const replay::FieldEnd& end = data.end;
+  if(fld.tick() != end.tick()) {
+    return this->fail("field %u: final tick mismatch: %u, expected %u", fld.fldid(), fld.tick(), end.tick());
+  }
+  if(fld.lost() != end.lost()) {
+    return this->fail("field %u: final lost state mismatch", fld.fldid());
+  }
+  // fields may have not been ranked if the match has been interrupted
+  if(end.rank() != 0 && fld.rank() != end.rank()) {
+    return this->fail("field %u: rank mismatch: %u, expected %u", fld.fldid(), fld.rank(), end.rank());
+  }
+  if(data.info->simulated() && (fld.stateHash() != end.hash() || fld.eventsDigest() != end.events())) {
+    return this->fail("field %u: final state mismatch", fld.fldid());
+  }
+  return true;
+}
+
+bool ReplayVerifier::checkSeek(const Match& match, Tick tick)
+{
+  std::vector<FieldConf> confs;
+  Match seek_match;
+  const auto t0 = std::chrono::steady_clock::now();
+  seek_file_->seek(seek_match, confs, tick);
+  const Duration dt = std::chrono::steady_clock::now() - t0;
+  seeks_++;
+  seek_time_ += dt;
+  seek_time_max_ = std::max(seek_time_max_, dt);
+
+  for(size_t i=0; i<match.fields().size(); i++) {
+    const Field& fld = *match.fields()[i];
+    const Field& seek_fld = *seek_match.fields()[i];
+    if(seek_fld.tick() != fld.tick() || seek_fld.lost() != fld.lost()) {
+      return this->fail("field %u: seek to tick %u: field tick %u, expected %u",
+                        fld.fldid(), tick, seek_fld.tick(), fld.tick());
+    }
+    if(seek_fld.stateHash() != fld.stateHash()) {
+      return this->fail("field %u: seek to tick %u: state mismatch", fld.fldid(), tick);
+    }
+  }
+  return true;
+}
+
+bool ReplayVerifier::fail(const char* fmt, ...)
+{
+  char buf[256];
+  va_list ap;
+  va_start(ap, fmt);
+  ::vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  error_ = buf;
+  return false;
+}
+
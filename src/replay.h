@@ -0,0 +1,265 @@
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+/** @file
+ * @brief Match replays.
+ *
+ * See replay.proto for file format.
+ */
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include "util.h"
+#include "game.h"
+#include "stats.h"
+#include "replay.pb.h"
+
+class GameInstance;
+
+
+/** @brief Record a match into a replay file.
+ *
+ * Records are serialized by the caller, then written by a background thread,
+ * file operations never block the game.
+ * Inputs are buffered and run-length encoded, per field.
+ */
+class ReplayRecorder
+{
+ public:
+  /// Replay file magic.
+  static const char MAGIC[4];
+  /// Index trailer magic.
+  static const char INDEX_MAGIC[4];
+  /// Current replay format version.
+  static const uint32_t VERSION;
+
+  /// Open a replay file, throw std::runtime_error on error.
+  ReplayRecorder(const std::string& filename);
+  /// Write the index, pending records and close the file.
+  ~ReplayRecorder();
+
+  /// Return a new replay filename, in a given directory.
+  static std::string newFileName(const std::string& dir);
+
+  /// Record match start, with fields of a started instance.
+  void recordMatch(const GameInstance& instance);
+  /// Record input of a field, for a given tick.
+  void recordInput(const Field& fld, Tick tick, KeyState keys);
+  /// Record a garbage drop on a field, before it is dropped.
+  void recordDrop(const Field& fld, const Garbage& gb);
+  /// Record the final state of a field.
+  void recordFieldEnd(const Field& fld);
+
+ private:
+  /// Maximum number of input runs in a single record.
+  static const size_t INPUT_CHUNK_RUNS;
+  /// Period of recorded state hashes, in ticks.
+  static const Tick HASH_PERIOD;
+  /// Period of keyframes, in ticks (multiple of HASH_PERIOD).
+  static const Tick KEYFRAME_PERIOD;
+
+  /// Pending inputs of a field.
+  struct InputStream {
+    Tick tick;  ///< tick of the first run
+    Tick next_tick;  ///< tick of the next input
+    KeyState keys;  ///< keys of the current run
+    uint32_t count;  ///< length of the current run
+    std::vector<uint32_t> runs;  ///< completed runs
+    bool simulated;  ///< field state hash is valid
+  };
+
+  /// Return the input stream of a field.
+  InputStream& inputStream(const Field& fld);
+  /// Write pending inputs of a field.
+  void flushInputs(const Field& fld, InputStream& stream);
+  /// Write a keyframe of a field, pending inputs must have been written.
+  void writeKeyframe(const Field& fld);
+  /// Serialize a record and queue it for writing.
+  void write(const replay::Record& rec);
+  /// Queue data for writing.
+  void writeData(std::string data);
+  /// Writing thread.
+  void run();
+
+  FILE* fp_;
+  /// Input streams, indexed by FldId-1.
+  std::vector<InputStream> inputs_;
+  /// Offset of the next queued record.
+  uint64_t offset_;
+  /// Keyframes index, written at the end of the file.
+  replay::Index index_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<std::string> queue_;
+  bool stop_;
+  std::thread thread_;
+};
+
+
+/** @brief Random access to a replay file.
+ *
+ * The file is memory-mapped, records are parsed on demand. Keyframes are
+ * located using the index, or by reading all records if it is missing.
+ */
+class ReplayFile
+{
+ public:
+  /// Open a replay file, throw std::runtime_error on error.
+  ReplayFile(const std::string& filename);
+  ~ReplayFile();
+  ReplayFile(const ReplayFile&) = delete;
+  ReplayFile& operator=(const ReplayFile&) = delete;
+
+  const replay::Match& match() const { return match_; }
+
+  /// Offset of the first record following the Match one.
+  size_t firstRecord() const { return first_record_; }
+  /** @brief Parse the record at a given offset.
+   *
+   * On success, \e pos is set to the offset of the next record.
+   * std::runtime_error is thrown on invalid record.
+   *
+   * @return \e false at the end of records.
+   */
+  bool readRecord(size_t& pos, replay::Record& rec) const;
+
+  /** @brief Initialize a match at a given tick.
+   *
+   * Each field is restored from its last keyframe before \e tick, then
+   * simulated forward. Fields which ended earlier are left in their final
+   * state.
+   *
+   * \e match must be stopped and empty, it is started. \e confs is filled
+   * with field configurations, it must outlive the match.
+   *
+   * std::runtime_error is thrown on invalid replay data.
+   */
+  void seek(Match& match, std::vector<FieldConf>& confs, Tick tick) const;
+
+ private:
+  /// Read the index, or build it from keyframe records.
+  void loadIndex();
+  /// Advance a field to a given tick, from its last keyframe.
+  void seekField(Field& fld, Tick tick) const;
+
+  const char* data_;
+  size_t size_;
+  /// End of records (start of index trailer, if any)
+  size_t records_end_;
+#ifdef WIN32
+  std::string buffer_;
+#endif
+  replay::Match match_;
+  size_t first_record_;
+  /// Keyframes (tick and offset) sorted by tick, indexed by FldId-1.
+  std::vector<std::vector<std::pair<Tick, size_t>>> keyframes_;
+};
+
+
+/// Replay content, loaded from a file.
+struct Replay
+{
+  /// Recorded garbage drop.
+  struct Drop {
+    Tick tick;
+    Garbage::Type type;
+    FieldPos size;
+    FldId from;  ///< 0 if unknown
+  };
+
+  /// Recorded data of a field.
+  struct FieldData {
+    const replay::Match::Field* info;  ///< field information, in match
+    /// Inputs, indexed by tick
+    std::vector<KeyState> inputs;
+    std::vector<Drop> drops;
+    /// Expected state hashes, with the field tick
+    std::vector<std::pair<Tick, uint32_t>> hashes;
+    bool has_end;
+    replay::FieldEnd end;
+  };
+
+  Replay() {}
+  Replay(const Replay&) = delete;
+  Replay& operator=(const Replay&) = delete;
+
+  /// Load a replay file, throw std::runtime_error on error.
+  void load(const std::string& filename);
+
+  replay::Match match;
+  /// Fields data, indexed by FldId-1.
+  std::vector<FieldData> fields;
+};
+
+
+/** @brief Re-simulate a replay and check recorded states.
+ *
+ * Fields are stepped in lockstep, using recorded inputs and garbage drops.
+ * State hashes, final field states and ranks are checked.
+ *
+ * Field statistics can be collected during the simulation.
+ * ReplayFile::seek() can also be checked against the simulation.
+ */
+class ReplayVerifier
+{
+ public:
+  typedef std::chrono::steady_clock::duration Duration;
+
+  ReplayVerifier(const Replay& replay, bool collect_stats=false);
+
+  /** @brief Check seeking in the replay file, every \e period ticks.
+   *
+   * Fields restored by ReplayFile::seek() are compared to simulated ones.
+   * \e file must be the one of the verified replay, and outlive run().
+   */
+  void checkSeeks(const ReplayFile& file, Tick period);
+
+  /// Simulate the match, return \e false on mismatch, see error().
+  bool run();
+
+  /// Number of simulated field ticks.
+  unsigned long ticks() const { return ticks_; }
+  const std::string& error() const { return error_; }
+  /// Field statistics, indexed by FldId-1 (empty if not collected).
+  const std::vector<FieldStats>& stats() const { return stats_; }
+
+  /** @name Seek checks. */
+  //@{
+  unsigned long seeks() const { return seeks_; }
+  Duration seekTime() const { return seek_time_; }
+  Duration seekTimeMax() const { return seek_time_max_; }
+  //@}
+
+ private:
+  /// Set error message, return false.
+  bool fail(const char* fmt, ...);
+  /// Check the final state of a field.
+  bool checkFieldEnd(const Field& fld, const Replay::FieldData& data);
+  /// Seek to the current tick, compare with simulated fields.
+  bool checkSeek(const Match& match, Tick tick);
+
+  const Replay& replay_;
+  unsigned long ticks_;
+  std::string error_;
+  const bool collect_stats_;
+  std::vector<FieldStats> stats_;
+
+  /** @name Seek checks. */
+  //@{
+  const ReplayFile* seek_file_;
+  Tick seek_period_;
+  unsigned long seeks_;
+  Duration seek_time_;
+  Duration seek_time_max_;
+  //@}
+};
+
+
+#endif
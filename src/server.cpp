@@ -1,4 +1,7 @@
 #include <memory>
+#include <chrono>
+#include <algorithm>
+#include <functional>
 #include "server.h"
 #include "netplay.pb.h"
 #include "inifile.h"
@@ -7,15 +10,28 @@
 
 
 const std::string ServerInstance::CONF_SECTION("Server");
+const unsigned int ServerInstance::HASH_HISTORY_MS = 10000;
 
 ServerInstance::ServerInstance(Observer& obs, boost::asio::io_service& io_service):
     observer_(obs), socket_(std::make_shared<netplay::ServerSocket>(*this, io_service)), gb_distributor_(match_, *this),
-    current_plid_(0)
+    current_plid_(0), player_counts_(), match_state_tick_(0), match_seed_(0), check_percent_(10), shadow_checkpoint_ticks_(3600),
+    step_timer_(io_service), step_timer_active_(false), step_budget_usec_(1000),
+    input_channel_(false), input_redundancy_(8), input_timer_(io_service), input_timer_active_(false),
+    watchdog_timer_(io_service), lag_budget_(300), auto_stepping_(false),
+    token_rng_(std::random_device()()), resume_timer_(io_service), resume_timeout_ms_(10000),
+    spectator_batch_ticks_(10), spectator_queue_max_(1024*1024),
+    spectator_timer_(io_service), spectator_delay_ms_(0), spectator_keyframe_ms_(5000),
+    compress_min_size_(1024)
 {
 }
 
 ServerInstance::~ServerInstance()
 {
+  step_timer_.cancel();
+  input_timer_.cancel();
+  watchdog_timer_.cancel();
+  resume_timer_.cancel();
+  spectator_timer_.cancel();
   if(socket_) {
     socket_->close();
   }
@@ -30,7 +46,7 @@ void ServerInstance::loadConf(const IniFile& cfg)
   SERVER_CONF_APPLY(SERVER_CONF_EXPR_LOAD);
 #undef SERVER_CONF_EXPR_LOAD
 
-  conf_.field_confs.clear();
+  std::vector<FieldConf> field_confs;
   const std::string s_conf = cfg.get({CONF_SECTION, "FieldConfsList"}, "");
   if( !s_conf.empty() ) {
     size_t pos = 0;
@@ -41,8 +57,8 @@ void ServerInstance::loadConf(const IniFile& cfg)
         throw std::runtime_error("empty field configuration name");
       }
       const std::string field_conf_section = IniFile::join("FieldConf", name);
-      conf_.field_confs.emplace_back();
-      FieldConf& field_conf = conf_.field_confs.back();
+      field_confs.emplace_back();
+      FieldConf& field_conf = field_confs.back();
       field_conf.name = name;
       field_conf.fromIniFile(cfg, field_conf_section);
       if( pos2 == std::string::npos ) {
@@ -52,19 +68,86 @@ void ServerInstance::loadConf(const IniFile& cfg)
     }
   }
 
-  if(conf_.field_confs.size() < 1) {
+  if(field_confs.size() < 1) {
     throw std::runtime_error("no field configuration defined");
   }
+  this->setServerFieldConfs(field_confs);
+
+  check_percent_ = cfg.get({CONF_SECTION, "CheckPercent"}, check_percent_);
+  if(check_percent_ > 100) {
+    throw std::runtime_error("invalid CheckPercent value");
+  }
+  shadow_checkpoint_ticks_ = cfg.get({CONF_SECTION, "ShadowCheckpointTicks"}, shadow_checkpoint_ticks_);
+  step_budget_usec_ = cfg.get({CONF_SECTION, "StepBudgetUsec"}, step_budget_usec_);
+
+  lag_budget_ = cfg.get({CONF_SECTION, "LagBudgetTicks"}, lag_budget_);
+  resume_timeout_ms_ = cfg.get({CONF_SECTION, "ResumeTimeoutMs"}, resume_timeout_ms_);
+  spectator_batch_ticks_ = cfg.get({CONF_SECTION, "SpectatorBatchTicks"}, spectator_batch_ticks_);
+  spectator_queue_max_ = cfg.get({CONF_SECTION, "SpectatorQueueMax"}, spectator_queue_max_);
+  spectator_delay_ms_ = cfg.get({CONF_SECTION, "SpectatorDelayMs"}, spectator_delay_ms_);
+  spectator_keyframe_ms_ = cfg.get({CONF_SECTION, "SpectatorKeyframeMs"}, spectator_keyframe_ms_);
+  if( spectator_delay_ms_ > 0 && spectator_keyframe_ms_ == 0 ) {
+    throw std::runtime_error("invalid SpectatorKeyframeMs value");
+  }
+  compress_min_size_ = cfg.get({CONF_SECTION, "CompressMinSize"}, compress_min_size_);
+  local_socket_ = cfg.get({CONF_SECTION, "LocalSocket"}, local_socket_);
+#ifndef BOOST_ASIO_HAS_LOCAL_SOCKETS
+  if( !local_socket_.empty() ) {
+    throw std::runtime_error("LocalSocket is not supported on this system");
+  }
+#endif
+  input_channel_ = cfg.get({CONF_SECTION, "InputChannel"}, input_channel_);
+  input_redundancy_ = cfg.get({CONF_SECTION, "InputRedundancyTicks"}, input_redundancy_);
+  if( input_redundancy_ == 0 || input_redundancy_ > 64 ) {
+    throw std::runtime_error("invalid InputRedundancyTicks value");
+  }
+
+  this->setReplayDir(cfg.get({CONF_SECTION, "ReplayDir"}, ""));
+  lobby_snapshot_.reset();
 }
 
 void ServerInstance::startServer(int port)
 {
   assert(state_ == State::NONE);
   LOG("starting server on port %d", port);
+  socket_->setSpectatorDelivery(spectator_batch_ticks_ * conf_.tk_usec, spectator_delay_ms_ * 1000, spectator_queue_max_);
+  socket_->setClock([this]() { return this->now(); });
+  socket_->setCompressMinSize(compress_min_size_);
+  socket_->setInputRedundancy(input_redundancy_);
+  if( input_channel_ ) {
+    socket_->enableInputChannel();
+  }
   socket_->start(port);
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+  if( !local_socket_.empty() ) {
+    LOG("listening on local socket %s", local_socket_.c_str());
+    socket_->listenLocal(local_socket_);
+  }
+#endif
   state_ = State::LOBBY;
 }
 
+void ServerInstance::startServer(std::shared_ptr<netplay::DatagramTransport> input_transport)
+{
+  assert(state_ == State::NONE);
+  LOG("starting server, without listening");
+  socket_->setSpectatorDelivery(spectator_batch_ticks_ * conf_.tk_usec, spectator_delay_ms_ * 1000, spectator_queue_max_);
+  socket_->setClock([this]() { return this->now(); });
+  socket_->setCompressMinSize(compress_min_size_);
+  socket_->setInputRedundancy(input_redundancy_);
+  if( input_channel_ && input_transport ) {
+    socket_->enableInputChannel(input_transport);
+  }
+  socket_->start();
+  state_ = State::LOBBY;
+}
+
+void ServerInstance::connectPeer(std::unique_ptr<netplay::Transport> transport)
+{
+  assert(state_ != State::NONE);
+  socket_->addPeer(std::move(transport));
+}
+
 void ServerInstance::stopServer()
 {
   state_ = State::NONE;
@@ -77,6 +160,30 @@ Player& ServerInstance::newLocalPlayer(const std::string& nick)
   return this->newPlayer(NULL, nick);
 }
 
+Tick ServerInstance::referenceTick() const
+{
+  if( state_ != State::GAME || conf_.tk_usec == 0 ) {
+    return 0;
+  }
+  const auto elapsed = this->now() - match_start_;
+  return elapsed / std::chrono::microseconds(conf_.tk_usec);
+}
+
+Tick ServerInstance::playerLag(const Player& pl) const
+{
+  const Field* fld = pl.field();
+  if( fld == nullptr ) {
+    return 0;
+  }
+  Tick tick = fld->tick();
+  auto it = pending_steps_.find(pl.plid());
+  if( it != pending_steps_.end() ) {
+    tick += (*it).second.size();
+  }
+  const Tick ref_tick = this->referenceTick();
+  return ref_tick > tick ? ref_tick - tick : 0;
+}
+
 
 void ServerInstance::playerSetNick(Player& pl, const std::string& nick)
 {
@@ -88,6 +195,7 @@ void ServerInstance::playerSetNick(Player& pl, const std::string& nick)
     return; // nothing to do
   }
   pl.setNick(nick);
+  lobby_snapshot_.reset();
   observer_.onPlayerChangeNick(pl, old_nick);
 
   auto event = std::make_unique<netplay::ServerEvent>();
@@ -102,14 +210,14 @@ void ServerInstance::playerSetFieldConf(Player& pl, const FieldConf& conf)
   assert(pl.local());
   assert(pl.state() == Player::State::LOBBY);
 
-  pl.setFieldConf(conf);
+  pl.setFieldConf(field_conf_table_.intern(conf));
+  lobby_snapshot_.reset();
   observer_.onPlayerChangeFieldConf(pl);
 
   auto event = std::make_unique<netplay::ServerEvent>();
   auto* np_conf = event->mutable_player_conf();
   np_conf->set_plid(pl.plid());
-  auto* np_fc = np_conf->mutable_field_conf();
-  conf.toPacket(*np_fc);
+  this->fieldConfToPacket(pl.fieldConf(), *np_conf, this->isFieldConfKnown(pl, nullptr));
   socket_->broadcastEvent(std::move(event));
 }
 
@@ -150,7 +258,7 @@ void ServerInstance::playerSetState(Player& pl, Player::State state)
     return;
   }
 
-  pl.setState(state);
+  this->setPlayerState(pl, state);
   LOG("%s(%u): state set to %d", pl.nick().c_str(), pl.plid(), static_cast<int>(state));
   observer_.onPlayerStateChange(pl);
 
@@ -184,7 +292,9 @@ void ServerInstance::playerStep(Player& pl, KeyState keys)
 
 void ServerInstance::onPeerConnect(netplay::PeerSocket& peer)
 {
-  if(state_ != State::LOBBY) {
+  if(state_ == State::GAME) {
+    // accept spectators, and peers resuming players
+  } else if(state_ != State::LOBBY) {
     throw netplay::CallbackError("match is running");
   } else if( players_.size() >= conf_.pl_nb_max ) {
     //TODO difference between player max and peer max
@@ -192,51 +302,19 @@ void ServerInstance::onPeerConnect(netplay::PeerSocket& peer)
   }
   LOG("peer connected");
 
-  {
-    // send server configuration
-    auto event = std::make_unique<netplay::ServerEvent>();
-    auto* np_conf = event->mutable_server_conf();
-#define SERVER_CONF_EXPR_PKT(n,ini) \
-    np_conf->set_##n(conf_.n);
-    SERVER_CONF_APPLY(SERVER_CONF_EXPR_PKT);
-#undef SERVER_CONF_EXPR_PKT
-    auto* np_fcs = np_conf->mutable_field_confs();
-    np_fcs->Reserve(conf_.field_confs.size());
-    for(auto& fc : conf_.field_confs) {
-      auto* np_fc = np_fcs->Add();
-      fc.toPacket(*np_fc);
-    }
-    peer.sendServerEvent(std::move(event));
-  }
-
-  {
-    // send server state
-    auto event = std::make_unique<netplay::ServerEvent>();
-    auto* np_state = event->mutable_server_state();
-    np_state->set_state(static_cast<netplay::PktServerState::State>(state_));
-    peer.sendServerEvent(std::move(event));
-  }
-
-  // send information on other players
-  PlayerContainer::const_iterator it;
-  for(auto const& kv : players_) {
-    const Player& pl = *kv.second.get();
-    {
-      auto event = std::make_unique<netplay::ServerEvent>();
-      auto* np_plconf = event->mutable_player_conf();
-      np_plconf->set_plid(pl.plid());
-      np_plconf->set_nick(pl.nick());
-      auto* np_fc = np_plconf->mutable_field_conf();
-      pl.fieldConf().toPacket(*np_fc);
-      peer.sendServerEvent(std::move(event));
-    }
-    {
-      auto event = std::make_unique<netplay::ServerEvent>();
-      auto* np_state = event->mutable_player_state();
-      np_state->set_plid(pl.plid());
-      np_state->set_state(static_cast<netplay::PktPlayerState::State>(pl.state()));
-      peer.sendServerEvent(std::move(event));
+  // send server configuration and state, information on other players
+  peer.sendServerEvents(this->lobbySnapshot());
+
+  if(state_ == State::GAME) {
+    // following events are batched, on top of the match state
+    socket_->setSpectator(peer, true);
+    if( spectator_delay_ms_ == 0 ) {
+      peer.sendServerEvents(this->matchStateSnapshot());
+    } else if( !socket_->hasSpectatorKeyframe() ) {
+      // don't wait for the next periodic keyframe
+      this->addSpectatorKeyframe();
     }
+    LOG("spectator connected, %zu spectators", socket_->spectatorCount());
   }
 
   // set read handler
@@ -246,14 +324,21 @@ void ServerInstance::onPeerConnect(netplay::PeerSocket& peer)
 
 void ServerInstance::onPeerDisconnect(netplay::PeerSocket& peer)
 {
-  for(auto it=peers_.begin(); it!=peers_.end(); ) {
-    if((*it).second == &peer) {
-      Player* pl = this->player(it->first);
-      assert(pl);
-      ++it;  // increment now to avoid invalidated iterator
+  input_peers_.erase(&peer);
+  field_conf_pins_.erase(&peer);
+  std::vector<PlId> plids;
+  for(auto const& p : peers_) {
+    if(p.second == &peer) {
+      plids.push_back(p.first);
+    }
+  }
+  for(auto plid : plids) {
+    Player* pl = this->player(plid);
+    if( pl == nullptr || peers_.find(plid) == peers_.end() ) {
+      continue;  // removed at the end of the match
+    }
+    if( !this->orphanPlayer(*pl) ) {
       this->removePlayer(*pl);
-    } else {
-      ++it;
     }
   }
 }
@@ -264,6 +349,10 @@ void ServerInstance::onPeerClientEvent(netplay::PeerSocket& peer, const netplay:
     this->processPktInput(peer, event.input());
   } else if(event.has_garbage_state()) {
     this->processPktGarbageState(peer, event.garbage_state());
+  } else if(event.has_field_report()) {
+    this->processPktFieldReport(peer, event.field_report());
+  } else if(event.has_ping()) {
+    this->processPktPing(peer, event.ping());
   } else {
     throw netplay::CallbackError("invalid packet field");
   }
@@ -282,6 +371,9 @@ void ServerInstance::onPeerClientCommand(netplay::PeerSocket& peer, const netpla
       this->processPktPlayerConf(peer, command.player_conf());
     } else if(command.has_player_state()) {
       this->processPktPlayerState(peer, command.player_state());
+    } else if(command.has_player_resume()) {
+      auto rpkt = this->processPktPlayerResume(peer, command.player_resume());
+      response->set_allocated_player_resume(rpkt.release());
     } else {
       throw netplay::CallbackError("invalid command field");
     }
@@ -293,6 +385,39 @@ void ServerInstance::onPeerClientCommand(netplay::PeerSocket& peer, const netpla
   peer.sendServerResponse(std::move(response));
 }
 
+void ServerInstance::onPeerDatagram(netplay::PeerSocket& peer, const netplay::Datagram& dgram)
+{
+  if(state_ != State::GAME) {
+    return;  // ignore remains of the previous match
+  }
+  InputPeer& input_peer = input_peers_[&peer];
+  for(auto& np_ack : dgram.acks()) {
+    Tick& tick = input_peer.acked[np_ack.plid()];
+    tick = std::max(tick, np_ack.tick());
+  }
+  if( !relays_.empty() ) {
+    return;
+  }
+
+  for(auto& np_input : dgram.inputs()) {
+    auto peer_it = peers_.find(np_input.plid());
+    if( peer_it == peers_.end() || (*peer_it).second != &peer ) {
+      continue;  // not a player of the peer, or removed since
+    }
+    Player& pl = *this->player(np_input.plid());
+    const Field* fld = pl.field();
+    if( fld == nullptr || fld->lost() ) {
+      continue;
+    }
+    auto steps_it = pending_steps_.find(pl.plid());
+    const Tick next_tick = fld->tick() + (steps_it == pending_steps_.end() ? 0 : (*steps_it).second.size());
+    // inputs exceeding the lag limit are ignored, they would be rejected
+    this->bufferDatagramInput(datagram_inputs_[pl.plid()], np_input, next_tick, match_.tick() + conf_.tk_lag_max - 1);
+    this->queueDatagramInputs(pl);
+  }
+  this->scheduleInputDatagrams();
+}
+
 
 void ServerInstance::onGarbageAdd(const Garbage& gb, unsigned int pos)
 {
@@ -330,17 +455,39 @@ void ServerInstance::onGarbageDrop(const Garbage& gb)
   np_state->set_gbid(gb.gbid);
   np_state->set_state(netplay::PktGarbageState::WAIT);
   match_.waitGarbageDrop(gb);
+  match_state_snapshot_.reset();
+  stats_[gb.to->fldid()-1].garbageReceived(gb.size);
+  if( gb.from != NULL ) {
+    stats_[gb.from->fldid()-1].garbageSent(gb.size);
+  }
   socket_->broadcastEvent(std::move(event));
 
-  // local player: drop immediately
-  if( pl_to->local() ) {
-    gb.to->dropNextGarbage();
-    auto event = std::make_unique<netplay::ServerEvent>();
-    auto* np_state = event->mutable_garbage_state();
-    np_state->set_gbid(gb.gbid);
-    np_state->set_state(netplay::PktGarbageState::DROP);
-    socket_->broadcastEvent(std::move(event));
+  // local player or orphan: drop immediately
+  if( pl_to->local() || this->isOrphan(*pl_to) ) {
+    this->dropWaitingGarbage(*pl_to);
+  } else {
+    garbage_wait_ticks_[gb.gbid] = gb.to->tick();
+  }
+}
+
+void ServerInstance::dropWaitingGarbage(Player& pl)
+{
+  Field& fld = *pl.field();
+  const Garbage& gb = *fld.waitingGarbages().front();
+  if( !relays_.empty() ) {
+    FieldRelay& relay = relays_[fld.fldid()-1];
+    if( !relay.simulated ) {
+      relay.drops.push_back({fld.tick(), gb.type, gb.size});
+    }
   }
+
+  auto event = std::make_unique<netplay::ServerEvent>();
+  auto* np_state = event->mutable_garbage_state();
+  np_state->set_gbid(gb.gbid);
+  np_state->set_state(netplay::PktGarbageState::DROP);
+  this->dropNextGarbage(fld);
+  match_state_snapshot_.reset();
+  socket_->broadcastEvent(std::move(event));
 }
 
 
@@ -350,13 +497,16 @@ Player& ServerInstance::newPlayer(netplay::PeerSocket* peer, const std::string&
   Player& pl = *pl_unique.get();
   PlId plid = pl.plid();
   LOG("init player: %d", plid);
-  pl.setState(Player::State::LOBBY);
   pl.setNick(nick);
   pl.setFieldConf(conf_.field_confs[0]);
   // put accepted player with his friends
   players_.emplace(plid, std::move(pl_unique));
+  this->playerCount(pl.state())++;
+  this->setPlayerState(pl, Player::State::LOBBY);
   if( peer != NULL ) {
+    socket_->setSpectator(*peer, false);
     peers_[plid] = peer; // associate the player to its peer
+    resume_tokens_[plid] = token_rng_();
   }
   observer_.onPlayerJoined(pl);
 
@@ -366,8 +516,7 @@ Player& ServerInstance::newPlayer(netplay::PeerSocket* peer, const std::string&
   auto* np_conf = event->mutable_player_conf();
   np_conf->set_plid(pl.plid());
   np_conf->set_nick(pl.nick());
-  auto* np_fc = np_conf->mutable_field_conf();
-  pl.fieldConf().toPacket(*np_fc);
+  this->fieldConfToPacket(pl.fieldConf(), *np_conf, this->isFieldConfKnown(pl, nullptr));
   socket_->broadcastEvent(std::move(event), peer);
 
   return pl;
@@ -375,7 +524,7 @@ Player& ServerInstance::newPlayer(netplay::PeerSocket* peer, const std::string&
 
 void ServerInstance::removePlayer(Player& pl)
 {
-  pl.setState(Player::State::QUIT);
+  this->setPlayerState(pl, Player::State::QUIT);
   LOG("%s(%u): state set to QUIT", pl.nick().c_str(), pl.plid());
   observer_.onPlayerStateChange(pl);
 
@@ -383,12 +532,20 @@ void ServerInstance::removePlayer(Player& pl)
     pl.field()->abort();
     match_.updateTick(); // field lost, tick must be updated
     this->updateRanks();
-    pl.setField(nullptr);
+    this->setPlayerField(pl, nullptr);
+    match_state_snapshot_.reset();
   }
 
   PlId plid = pl.plid();
+  this->playerCount(Player::State::QUIT)--;
   players_.erase(plid);
   peers_.erase(plid);
+  pending_steps_.erase(plid);
+  input_history_.erase(plid);
+  datagram_inputs_.erase(plid);
+  autostep_ticks_.erase(plid);
+  resume_tokens_.erase(plid);
+  orphans_.erase(plid);
 
   // tell other players
   auto event = std::make_unique<netplay::ServerEvent>();
@@ -412,27 +569,43 @@ void ServerInstance::processPktInput(netplay::PeerSocket& peer, const netplay::P
   Field* fld = pl.field();
   if( fld == NULL ) {
     throw netplay::CallbackError("player without a field");
+  } else if( fld->lost() ) {
+    return;  // field aborted by the server, ignore in-flight inputs
   }
 
+  std::deque<KeyState>& steps = pending_steps_[pl.plid()];
+  const Tick next_tick = fld->tick() + steps.size();
   Tick tick = pkt.tick();
-  if( tick < fld->tick() ) {
-    throw netplay::CallbackError("input tick in the past");
-  }
-  // skipped frames
-  while( fld->tick() < tick ) {
-    this->stepRemotePlayer(pl, 0);
-    if( !match_.started() ) {
-      return; // end of match
+  const int keys_nb = pkt.keys_size();
+  int first_key = 0;
+  if( tick < next_tick ) {
+    // inputs already received in datagrams, or of auto-stepped ticks
+    // arrived too late, discard them
+    auto autostep_it = autostep_ticks_.find(pl.plid());
+    if( !peer.inputChannel() && (autostep_it == autostep_ticks_.end() || tick >= (*autostep_it).second) ) {
+      throw netplay::CallbackError("input tick in the past");
+    }
+    if( static_cast<uint64_t>(tick) + keys_nb <= next_tick ) {
+      return;
     }
+    first_key = next_tick - tick;
+    tick = next_tick;
   }
+  // check lag now, it bounds the size of the queue
+  if( static_cast<uint64_t>(tick) + keys_nb - first_key >= match_.tick() + conf_.tk_lag_max ) {
+    throw netplay::CallbackError("maximum lag exceeded");
+  }
+
+  // skipped frames
+  steps.insert(steps.end(), tick - next_tick, 0);
   // provided frames
-  const int keys_nb = pkt.keys_size();
-  for( int i=0; i<keys_nb; i++ ) {
-    this->stepRemotePlayer(pl, pkt.keys(i));
-    if( !match_.started() ) {
-      return; // end of match
-    }
+  for( int i=first_key; i<keys_nb; i++ ) {
+    steps.push_back(pkt.keys(i));
   }
+  if( !steps.empty() ) {
+    this->queuePendingPlayer(pl.plid());
+  }
+  this->queueDatagramInputs(pl);
 }
 
 void ServerInstance::processPktGarbageState(netplay::PeerSocket& peer, const netplay::PktGarbageState& pkt)
@@ -444,7 +617,7 @@ void ServerInstance::processPktGarbageState(netplay::PeerSocket& peer, const net
     throw netplay::CallbackError("unexpected garbage state");
   }
 
-  const Match::GarbageMap gbs_wait = match_.waitingGarbages();
+  const Match::GarbageMap& gbs_wait = match_.waitingGarbages();
   Match::GarbageMap::const_iterator it = gbs_wait.find(pkt.gbid());
   if( it == gbs_wait.end() ) {
     throw netplay::CallbackError("garbage not found");
@@ -456,17 +629,86 @@ void ServerInstance::processPktGarbageState(netplay::PeerSocket& peer, const net
     throw netplay::CallbackError("invalid player");
   }
   this->checkPeerPlayer(pl->plid(), peer);
+  this->flushPendingSteps(*pl);
+  if( state_ != State::GAME || fld->lost() ) {
+    return;  // end of match, or aborted field
+  }
   if(fld->waitingGarbages().size() == 0 || fld->waitingGarbages().front()->gbid != gb.gbid) {
     throw netplay::CallbackError("invalid dropped garbage");
   }
 
+  if( !relays_.empty() ) {
+    FieldRelay& relay = relays_[fld->fldid()-1];
+    if( !relay.simulated ) {
+      relay.drops.push_back({fld->tick(), gb.type, gb.size});
+    }
+  }
+
+  garbage_wait_ticks_.erase(gb.gbid);
+
+  // the peer already dropped the garbage, don't send it back
   auto event = std::make_unique<netplay::ServerEvent>();
   auto* np_state = event->mutable_garbage_state();
   np_state->set_gbid(gb.gbid);
   np_state->set_state(netplay::PktGarbageState::DROP);
-  socket_->broadcastEvent(std::move(event));
+  socket_->broadcastEvent(std::move(event), &peer);
 
-  fld->dropNextGarbage();
+  this->dropNextGarbage(*fld);
+  match_state_snapshot_.reset();
+  this->queueDatagramInputs(*pl);
+}
+
+void ServerInstance::processPktFieldReport(netplay::PeerSocket& peer, const netplay::PktFieldReport& pkt)
+{
+  if(state_ != State::GAME) {
+    return;  // ignore remains of the previous match
+  }
+  if(conf_.tk_report_period == 0) {
+    throw netplay::CallbackError("unexpected field report");
+  }
+  Player* pl = this->player(pkt.plid());
+  if( pl == NULL || pl->field() == NULL ) {
+    return;  // player may have quit since the report was sent
+  }
+  const Field& fld = *pl->field();
+
+  auto peer_it = peers_.find(pl->plid());
+  if( peer_it == peers_.end() || (*peer_it).second != &peer ) {
+    // hash of a field of another player
+    if( pkt.tick() % conf_.tk_report_period != 0 ) {
+      throw netplay::CallbackError("invalid field report tick");
+    }
+    this->checkFieldHash(*pl, pkt.tick(), pkt.hash(), pkt.events());
+    return;
+  }
+
+  // report of an owned field, applied when stepping its input
+  this->flushPendingSteps(*pl);
+  if( state_ != State::GAME || fld.lost() ) {
+    return;  // end of match, or aborted field
+  }
+  FieldRelay& relay = relays_[fld.fldid()-1];
+  auto autostep_it = autostep_ticks_.find(pl->plid());
+  if( autostep_it != autostep_ticks_.end() && pkt.tick() <= (*autostep_it).second ) {
+    return;  // report of an auto-stepped tick, arrived too late
+  }
+  if( relay.has_report || pkt.tick() <= fld.tick() ) {
+    throw netplay::CallbackError("invalid field report tick");
+  }
+  relay.report = FieldReport{pkt.tick(), pkt.combo(), pkt.chain(), pkt.chain_end(), pkt.lost(), pkt.hash(), pkt.events()};
+  relay.has_report = true;
+}
+
+void ServerInstance::processPktPing(netplay::PeerSocket& peer, const netplay::PktPing& pkt)
+{
+  auto event = std::make_unique<netplay::ServerEvent>();
+  auto* np_pong = event->mutable_pong();
+  np_pong->set_client_time(pkt.client_time());
+  if(state_ == State::GAME) {
+    const auto elapsed = this->now() - match_start_;
+    np_pong->set_match_time(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+  }
+  peer.sendServerEvent(std::move(event));
 }
 
 void ServerInstance::processPktChat(netplay::PeerSocket& peer, const netplay::PktChat& pkt)
@@ -478,7 +720,7 @@ void ServerInstance::processPktChat(netplay::PeerSocket& peer, const netplay::Pk
 std::unique_ptr<netplay::PktPlayerConf> ServerInstance::processPktPlayerJoin(netplay::PeerSocket& peer, const netplay::PktPlayerJoin& pkt)
 {
   if(state_ != State::LOBBY) {
-    throw netplay::CallbackError("match is running");
+    throw netplay::CommandError("match is running");  // spectators may ask
   } else if( players_.size() > conf_.pl_nb_max ) {
     throw netplay::CommandError("server full");
   }
@@ -487,10 +729,46 @@ std::unique_ptr<netplay::PktPlayerConf> ServerInstance::processPktPlayerJoin(net
   auto response = std::make_unique<netplay::PktPlayerConf>();
   response->set_plid(pl.plid());
   response->set_nick(pl.nick());
-  pl.fieldConf().toPacket(*response->mutable_field_conf());
+  this->fieldConfToPacket(pl.fieldConf(), *response, this->isFieldConfKnown(pl, &peer));
+  response->set_resume_token(resume_tokens_[pl.plid()]);
   return std::move(response);
 }
 
+bool ServerInstance::isFieldConfKnown(const Player& pl, const netplay::PeerSocket* peer) const
+{
+  if( peer ? !peer->fieldConfHashes() : !socket_->fieldConfHashes() ) {
+    return false;
+  }
+  if( this->isServerFieldConf(pl.fieldConf()) ) {
+    return true;
+  }
+  // all peers received the configurations of players
+  for(auto const& kv : players_) {
+    const Player& other = *kv.second;
+    if( &other != &pl && other.state() != Player::State::QUIT && other.fieldConfPtr() == pl.fieldConfPtr() ) {
+      return true;
+    }
+  }
+  return false;
+}
+
+FieldConfTable::Ptr ServerInstance::peerFieldConfFromPacket(const netplay::PeerSocket& peer, const netplay::PktPlayerConf& pkt)
+{
+  FieldConfPins& pins = field_conf_pins_[&peer];
+  if( pkt.field_conf_hash() != 0 ) {
+    auto it = pins.find(pkt.field_conf_hash());
+    if( it != pins.end() ) {
+      return it->second;
+    }
+  }
+  auto fc = this->fieldConfFromPacket(pkt);
+  // the client refers to the first custom configurations it sent by hash
+  if( fc && pkt.has_field_conf() && pkt.field_conf().name().empty() && pins.size() < FIELD_CONF_PINS_MAX ) {
+    pins.emplace(fc->hash(), fc);
+  }
+  return fc;
+}
+
 void ServerInstance::processPktPlayerConf(netplay::PeerSocket& peer, const netplay::PktPlayerConf& pkt)
 {
   Player& pl = this->checkPeerPlayer(pkt.plid(), peer);
@@ -505,29 +783,23 @@ void ServerInstance::processPktPlayerConf(netplay::PeerSocket& peer, const netpl
   if(!pkt.nick().empty() && pkt.nick() != pl.nick() ) {
     const std::string old_nick = pl.nick();
     pl.setNick( pkt.nick() );
+    lobby_snapshot_.reset();
     observer_.onPlayerChangeNick(pl, old_nick);
     np_plconf->set_nick( pkt.nick() );
     do_send = true;
   }
-  if( pkt.has_field_conf() ) {
-    const std::string name = pkt.field_conf().name();
-    //TODO compare with previous conf/name, ignore if not changed
-    do_send = true;
-    if( name.empty() ) {
-      FieldConf conf;
-      conf.fromPacket(pkt.field_conf());
-      pl.setFieldConf(conf);
-    } else {
-      auto* fc = conf_.fieldConf(name);
-      if(!fc) {
-        throw netplay::CommandError("invalid configuration name: "+name);
-      }
-      pl.setFieldConf(*fc);
+  if( pkt.has_field_conf() || pkt.field_conf_hash() != 0 ) {
+    auto fc = this->peerFieldConfFromPacket(peer, pkt);
+    if(!fc) {
+      throw netplay::CommandError("invalid configuration name: "+pkt.field_conf().name());
     }
-    if( do_send ) {
-      netplay::FieldConf* np_fc = np_plconf->mutable_field_conf();
-      pl.fieldConf().toPacket(*np_fc);
+    // interned configurations are compared by address
+    if( fc != pl.fieldConfPtr() ) {
+      pl.setFieldConf(std::move(fc));
+      lobby_snapshot_.reset();
+      this->fieldConfToPacket(pl.fieldConf(), *np_plconf, this->isFieldConfKnown(pl, nullptr));
       observer_.onPlayerChangeFieldConf(pl);
+      do_send = true;
     }
   }
   if( do_send ) {
@@ -575,7 +847,7 @@ void ServerInstance::processPktPlayerState(netplay::PeerSocket& peer, const netp
     throw netplay::CommandError("invalid new state");
   }
 
-  pl.setState(new_state);
+  this->setPlayerState(pl, new_state);
   LOG("%s(%u): state set to %d", pl.nick().c_str(), pl.plid(), static_cast<int>(new_state));
   observer_.onPlayerStateChange(pl);
 
@@ -586,6 +858,34 @@ void ServerInstance::processPktPlayerState(netplay::PeerSocket& peer, const netp
   this->checkAllPlayersReady();
 }
 
+std::unique_ptr<netplay::PktMatchState> ServerInstance::processPktPlayerResume(netplay::PeerSocket& peer, const netplay::PktPlayerResume& pkt)
+{
+  if(state_ != State::GAME) {
+    throw netplay::CommandError("match is not running");
+  }
+  auto token_it = resume_tokens_.find(pkt.plid());
+  if( orphans_.find(pkt.plid()) == orphans_.end() || token_it == resume_tokens_.end() || (*token_it).second != pkt.token() ) {
+    throw netplay::CommandError("invalid player or token");
+  }
+  Player& pl = *this->player(pkt.plid());
+  orphans_.erase(pl.plid());
+  socket_->setSpectator(peer, false);
+  peers_[pl.plid()] = &peer;
+  this->scheduleResumeTimeout();
+  LOG("%s(%u): resumed at tick %u", pl.nick().c_str(), pl.plid(), pl.field()->tick());
+
+  // events sent after the response apply on top of this state
+  auto response = std::make_unique<netplay::PktMatchState>();
+  this->fillMatchState(*response);
+
+  auto event = std::make_unique<netplay::ServerEvent>();
+  auto* notif = event->mutable_notification();
+  notif->set_text(pl.nick()+": reconnected");
+  notif->set_severity(netplay::PktNotification::MESSAGE);
+  socket_->broadcastEvent(std::move(event), &peer);
+  return response;
+}
+
 
 Player& ServerInstance::checkPeerPlayer(PlId plid, const netplay::PeerSocket& peer)
 {
@@ -597,28 +897,556 @@ Player& ServerInstance::checkPeerPlayer(PlId plid, const netplay::PeerSocket& pe
 }
 
 
+bool ServerInstance::stepPendingInput(Player& pl)
+{
+  auto it = pending_steps_.find(pl.plid());
+  if( it == pending_steps_.end() || (*it).second.empty() ) {
+    return false;
+  }
+  const KeyState keys = (*it).second.front();
+  (*it).second.pop_front();
+  this->stepRemotePlayer(pl, keys);
+  // note: the match may have ended, clearing pending steps
+  it = pending_steps_.find(pl.plid());
+  return it != pending_steps_.end() && !(*it).second.empty();
+}
+
+void ServerInstance::flushPendingSteps(Player& pl)
+{
+  while( this->stepPendingInput(pl) ) {
+  }
+}
+
+void ServerInstance::queuePendingPlayer(PlId plid)
+{
+  if( queued_players_.insert(plid).second ) {
+    pending_players_.push_back(plid);
+  }
+  this->schedulePendingSteps();
+}
+
+void ServerInstance::schedulePendingSteps()
+{
+  if( step_timer_active_ ) {
+    return;
+  }
+  step_timer_active_ = true;
+  step_timer_.expires_from_now(boost::posix_time::microseconds(0));
+  step_timer_.async_wait(std::bind(&ServerInstance::onStepTimer, this, std::placeholders::_1));
+}
+
+void ServerInstance::onStepTimer(const boost::system::error_code& ec)
+{
+  if( ec == boost::asio::error::operation_aborted ) {
+    return;
+  }
+  step_timer_active_ = false;
+
+  // one step per player and per round, until the budget is exhausted
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(step_budget_usec_);
+  while( !pending_players_.empty() ) {
+    const PlId plid = pending_players_.front();
+    pending_players_.pop_front();
+    queued_players_.erase(plid);
+    Player* pl = this->player(plid);
+    if( pl == nullptr ) {
+      continue;  // removed player
+    }
+    bool pending;
+    try {
+      pending = this->stepPendingInput(*pl);
+    } catch(const netplay::CallbackError& e) {
+      LOG("%s(%u): input processing failed: %s", pl->nick().c_str(), plid, e.what());
+      pending_steps_.erase(plid);
+      auto peer_it = peers_.find(plid);
+      if( peer_it != peers_.end() ) {
+        (*peer_it).second->sendError(std::string("packet processing failed: ")+e.what());
+      }
+      continue;
+    }
+    if( pending && queued_players_.insert(plid).second ) {
+      pending_players_.push_back(plid);  // not queued again while stepping
+    }
+    if( std::chrono::steady_clock::now() >= deadline ) {
+      break;
+    }
+  }
+  if( !pending_players_.empty() ) {
+    this->schedulePendingSteps();  // let other handlers run
+  }
+}
+
+
+void ServerInstance::queueDatagramInputs(Player& pl)
+{
+  auto buffer_it = datagram_inputs_.find(pl.plid());
+  if( buffer_it == datagram_inputs_.end() ) {
+    return;
+  }
+  InputBuffer& buffer = (*buffer_it).second;
+  const Field& fld = *pl.field();
+  std::deque<KeyState>& steps = pending_steps_[pl.plid()];
+  Tick next_tick = fld.tick() + steps.size();
+  // drops flush pending steps first, queued inputs are stepped with the
+  // current drop count
+  const unsigned int drops = fld.droppedGarbageCount();
+  while( !buffer.empty() ) {
+    auto it = buffer.begin();
+    if( (*it).first < next_tick ) {
+      buffer.erase(it);  // already received in an event
+      continue;
+    } else if( (*it).first > next_tick || (*it).second.drops != drops ) {
+      break;
+    }
+    steps.push_back((*it).second.keys);
+    buffer.erase(it);
+    next_tick++;
+  }
+  if( buffer.empty() ) {
+    datagram_inputs_.erase(buffer_it);
+  }
+  if( !steps.empty() ) {
+    this->queuePendingPlayer(pl.plid());
+  }
+}
+
+Tick ServerInstance::nextInputTick(const Player& pl) const
+{
+  Tick tick = pl.field()->tick();
+  auto steps_it = pending_steps_.find(pl.plid());
+  if( steps_it != pending_steps_.end() ) {
+    tick += (*steps_it).second.size();
+  }
+  auto buffer_it = datagram_inputs_.find(pl.plid());
+  if( buffer_it != datagram_inputs_.end() ) {
+    tick = nextMissingTick((*buffer_it).second, tick);
+  }
+  return tick;
+}
+
+void ServerInstance::scheduleInputDatagrams()
+{
+  if( input_timer_active_ || !socket_->inputChannel() ) {
+    return;
+  }
+  input_timer_active_ = true;
+  input_timer_.expires_from_now(boost::posix_time::microseconds(0));
+  input_timer_.async_wait(std::bind(&ServerInstance::onInputTimer, this, std::placeholders::_1));
+}
+
+void ServerInstance::onInputTimer(const boost::system::error_code& ec)
+{
+  if( ec == boost::asio::error::operation_aborted ) {
+    return;
+  }
+  input_timer_active_ = false;
+  if( state_ != State::GAME ) {
+    return;
+  }
+
+  // a single datagram per peer, for all players
+  std::vector<netplay::PeerSocket*> peers;
+  for(auto const& p : peers_) {
+    if( p.second->inputChannel() && std::find(peers.begin(), peers.end(), p.second) == peers.end() ) {
+      peers.push_back(p.second);
+    }
+  }
+  for(auto* peer : peers) {
+    InputPeer& input_peer = input_peers_[peer];
+    netplay::Datagram dgram;
+    bool new_acks = false;
+    for(auto const& p : peers_) {
+      const Player* pl = this->player(p.first);
+      if( p.second != peer || pl == nullptr || pl->field() == nullptr || pl->field()->lost() ) {
+        continue;
+      }
+      const Tick tick = this->nextInputTick(*pl);
+      Tick& sent_tick = input_peer.sent_acks[pl->plid()];
+      new_acks = new_acks || tick != sent_tick;
+      sent_tick = tick;
+      auto* np_ack = dgram.add_acks();
+      np_ack->set_plid(pl->plid());
+      np_ack->set_tick(tick);
+    }
+    for(auto const& h : input_history_) {
+      auto peer_it = peers_.find(h.first);
+      if( peer_it != peers_.end() && (*peer_it).second == peer ) {
+        continue;  // don't send inputs back
+      }
+      h.second.toDatagram(dgram, h.first, input_peer.acked[h.first]);
+    }
+    if( new_acks || dgram.inputs_size() > 0 ) {
+      peer->sendDatagram(dgram);
+    }
+  }
+}
+
+
+void ServerInstance::scheduleWatchdog()
+{
+  watchdog_timer_.expires_from_now(boost::posix_time::microseconds(conf_.tk_usec));
+  watchdog_timer_.async_wait(std::bind(&ServerInstance::onWatchdogTimer, this, std::placeholders::_1));
+}
+
+void ServerInstance::onWatchdogTimer(const boost::system::error_code& ec)
+{
+  if( ec == boost::asio::error::operation_aborted ) {
+    return;
+  }
+  if( state_ != State::GAME ) {
+    return;
+  }
+
+  // players may be removed and the match may end while checking
+  std::vector<PlId> plids;
+  for(auto const& p : players_) {
+    const Player& pl = *p.second;
+    if( !pl.local() && pl.field() != nullptr && !pl.field()->lost() ) {
+      plids.push_back(pl.plid());
+    }
+  }
+  const Tick ref_tick = this->referenceTick();
+  for(auto plid : plids) {
+    Player* pl = this->player(plid);
+    if( pl == nullptr || pl->field() == nullptr || pl->field()->lost() ) {
+      continue;
+    }
+    try {
+      if( this->isOrphan(*pl) ) {
+        // nobody plays it, don't let it hold back other players
+        this->autoStepPlayer(*pl, ref_tick);
+      } else if( lag_budget_ > 0 ) {
+        this->checkPlayerLag(*pl);
+      }
+    } catch(const netplay::CallbackError& e) {
+      auto_stepping_ = false;
+      LOG("%s(%u): input processing failed: %s", pl->nick().c_str(), plid, e.what());
+      pending_steps_.erase(plid);
+      auto peer_it = peers_.find(plid);
+      if( peer_it != peers_.end() ) {
+        (*peer_it).second->sendError(std::string("packet processing failed: ")+e.what());
+      }
+    }
+    if( state_ != State::GAME ) {
+      return;  // end of match
+    }
+  }
+  if( lag_budget_ > 0 || !orphans_.empty() ) {
+    this->scheduleWatchdog();
+  }
+}
+
+void ServerInstance::checkPlayerLag(Player& pl)
+{
+  const Field& fld = *pl.field();
+
+  const auto& gbs_wait = fld.waitingGarbages();
+  if( !gbs_wait.empty() ) {
+    auto it = garbage_wait_ticks_.find(gbs_wait.front()->gbid);
+    if( it != garbage_wait_ticks_.end() && fld.tick() > (*it).second + lag_budget_ ) {
+      this->abortPlayerField(pl, "garbage drop not confirmed");
+      return;
+    }
+  }
+
+  if( this->playerLag(pl) <= lag_budget_ ) {
+    return;
+  }
+  this->abortPlayerField(pl, "maximum lag exceeded");
+}
+
+void ServerInstance::autoStepPlayer(Player& pl, Tick tick)
+{
+  // apply received inputs first
+  this->flushPendingSteps(pl);
+  if( state_ != State::GAME || pl.field() == nullptr ) {
+    return;
+  }
+  Field& fld = *pl.field();
+  if( fld.lost() || fld.tick() >= tick ) {
+    return;
+  }
+
+  auto_stepping_ = true;
+  // don't exceed the lag limit, other players will catch up
+  while( fld.tick() < tick && !fld.lost() && fld.tick()+1 < match_.tick() + conf_.tk_lag_max ) {
+    this->doStepPlayer(pl, 0);
+    if( state_ != State::GAME ) {
+      auto_stepping_ = false;
+      return;  // end of match
+    }
+  }
+  auto_stepping_ = false;
+  autostep_ticks_[pl.plid()] = fld.tick();
+}
+
+void ServerInstance::abortPlayerField(Player& pl, const std::string& reason)
+{
+  LOG("%s(%u): field aborted: %s", pl.nick().c_str(), pl.plid(), reason.c_str());
+  pending_steps_.erase(pl.plid());
+  // drops will never be confirmed
+  for(const auto& gb : pl.field()->waitingGarbages()) {
+    garbage_wait_ticks_.erase(gb->gbid);
+  }
+  auto peer_it = peers_.find(pl.plid());
+  if( peer_it != peers_.end() ) {
+    auto event = std::make_unique<netplay::ServerEvent>();
+    auto* notif = event->mutable_notification();
+    notif->set_text(pl.nick()+": field aborted: "+reason);
+    notif->set_severity(netplay::PktNotification::NOTICE);
+    (*peer_it).second->sendServerEvent(std::move(event));
+  }
+  // rank is broadcasted, clients abort the field on their side
+  pl.field()->abort();
+  match_state_snapshot_.reset();
+  match_.updateTick(); // field lost, tick must be updated
+  this->updateRanks();
+}
+
+
+bool ServerInstance::orphanPlayer(Player& pl)
+{
+  if( resume_timeout_ms_ == 0 || state_ != State::GAME || pl.field() == nullptr || pl.field()->lost() ) {
+    return false;
+  }
+  // apply received inputs, the server owns the field from now
+  try {
+    this->flushPendingSteps(pl);
+  } catch(const netplay::CallbackError& e) {
+    LOG("%s(%u): input processing failed: %s", pl.nick().c_str(), pl.plid(), e.what());
+    return false;
+  }
+  if( state_ != State::GAME || pl.field() == nullptr || pl.field()->lost() ) {
+    return false;
+  }
+
+  LOG("%s(%u): disconnected, waiting for resume", pl.nick().c_str(), pl.plid());
+  peers_.erase(pl.plid());
+  if( lag_budget_ == 0 && orphans_.empty() ) {
+    this->scheduleWatchdog();  // not running, needed to step orphans
+  }
+  orphans_[pl.plid()] = this->now() + std::chrono::milliseconds(resume_timeout_ms_);
+  // drops sent to the peer will never be confirmed
+  Field& fld = *pl.field();
+  while( !fld.waitingGarbages().empty() ) {
+    garbage_wait_ticks_.erase(fld.waitingGarbages().front()->gbid);
+    this->dropWaitingGarbage(pl);
+  }
+  if( !relays_.empty() ) {
+    relays_[fld.fldid()-1].has_report = false;
+  }
+  this->scheduleResumeTimeout();
+
+  auto event = std::make_unique<netplay::ServerEvent>();
+  auto* notif = event->mutable_notification();
+  notif->set_text(pl.nick()+": disconnected, waiting for reconnection");
+  notif->set_severity(netplay::PktNotification::MESSAGE);
+  socket_->broadcastEvent(std::move(event));
+  return true;
+}
+
+void ServerInstance::scheduleResumeTimeout()
+{
+  if( orphans_.empty() ) {
+    resume_timer_.cancel();
+    return;
+  }
+  auto deadline = (*orphans_.begin()).second;
+  for(auto const& p : orphans_) {
+    deadline = std::min(deadline, p.second);
+  }
+  const auto delay = std::chrono::duration_cast<std::chrono::microseconds>(deadline - this->now()).count();
+  resume_timer_.expires_from_now(boost::posix_time::microseconds(std::max<long>(0, delay)));
+  resume_timer_.async_wait(std::bind(&ServerInstance::onResumeTimer, this, std::placeholders::_1));
+}
+
+void ServerInstance::onResumeTimer(const boost::system::error_code& ec)
+{
+  if( ec == boost::asio::error::operation_aborted ) {
+    return;
+  }
+  const auto now = this->now();
+  std::vector<PlId> plids;
+  for(auto const& p : orphans_) {
+    if( p.second <= now ) {
+      plids.push_back(p.first);
+    }
+  }
+  for(auto plid : plids) {
+    // the match may end while removing players, removing the others
+    if( orphans_.erase(plid) == 0 ) {
+      continue;
+    }
+    Player* pl = this->player(plid);
+    assert(pl);
+    LOG("%s(%u): not resumed in time", pl->nick().c_str(), plid);
+    this->removePlayer(*pl);
+  }
+  this->scheduleResumeTimeout();
+}
+
+void ServerInstance::fillMatchState(netplay::PktMatchState& pkt)
+{
+  const auto elapsed = this->now() - match_start_;
+  pkt.set_match_time(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+
+  auto fill_garbage = [](netplay::PktMatchState::Garbage& np_gb, const Garbage& gb) {
+    np_gb.set_gbid(gb.gbid);
+    np_gb.set_fldid_from(gb.from == nullptr ? 0 : gb.from->fldid());
+    np_gb.set_type(static_cast<netplay::GarbageType>(gb.type));
+    np_gb.set_size(gb.size.x | gb.size.y << 8);
+  };
+
+  for(auto& fld_ptr : match_.fields()) {
+    Field& fld = *fld_ptr;
+    Player* pl = this->player(&fld);
+    auto* np_field = pkt.add_fields();
+    np_field->set_plid(pl == nullptr ? 0 : pl->plid());
+    fld.conf().toPacket(*np_field->mutable_field_conf());
+
+    const Field* state_fld = &fld;
+    if( pl != nullptr && !relays_.empty() ) {
+      FieldRelay& relay = relays_[fld.fldid()-1];
+      if( !relay.simulated ) {
+        // blind field, use the field re-simulated from logs
+        relay.watched = true;
+        this->simulateShadowField(*pl, relay, fld.tick());
+        state_fld = relay.shadow.get();
+      }
+    }
+    auto* np_state = np_field->mutable_state();
+    state_fld->setStateToPacket(*np_state);
+    np_state->set_rank(fld.rank());
+
+    for(size_t i=0; i<fld.hangingGarbageCount(); i++) {
+      fill_garbage(*np_field->add_hanging(), fld.hangingGarbage(i));
+    }
+    for(auto const& gb : fld.waitingGarbages()) {
+      fill_garbage(*np_field->add_waiting(), *gb);
+    }
+  }
+}
+
+std::shared_ptr<const std::string> ServerInstance::matchStateSnapshot()
+{
+  if( match_state_snapshot_ && match_state_tick_ == match_.tick() ) {
+    return match_state_snapshot_;
+  }
+  std::vector<std::unique_ptr<netplay::ServerEvent>> events;
+  auto event = std::make_unique<netplay::ServerEvent>();
+  this->fillMatchState(*event->mutable_match_state());
+  events.push_back(std::move(event));
+  match_state_snapshot_ = std::make_shared<const std::string>(netplay::ServerSocket::serializeEvents(std::move(events)));
+  match_state_tick_ = match_.tick();
+  return match_state_snapshot_;
+}
+
+std::vector<std::unique_ptr<netplay::ServerEvent>> ServerInstance::playerEvents() const
+{
+  std::vector<std::unique_ptr<netplay::ServerEvent>> events;
+  for(auto const& kv : players_) {
+    const Player& pl = *kv.second.get();
+    {
+      auto event = std::make_unique<netplay::ServerEvent>();
+      auto* np_plconf = event->mutable_player_conf();
+      np_plconf->set_plid(pl.plid());
+      np_plconf->set_nick(pl.nick());
+      // sent to new peers, whose support of hashes is not known yet
+      this->fieldConfToPacket(pl.fieldConf(), *np_plconf, false);
+      events.push_back(std::move(event));
+    }
+    {
+      auto event = std::make_unique<netplay::ServerEvent>();
+      auto* np_state = event->mutable_player_state();
+      np_state->set_plid(pl.plid());
+      np_state->set_state(static_cast<netplay::PktPlayerState::State>(pl.state()));
+      events.push_back(std::move(event));
+    }
+  }
+  return events;
+}
+
+std::shared_ptr<const std::string> ServerInstance::lobbySnapshot()
+{
+  if( lobby_snapshot_ ) {
+    return lobby_snapshot_;
+  }
+  std::vector<std::unique_ptr<netplay::ServerEvent>> events;
+  {
+    // server configuration
+    auto event = std::make_unique<netplay::ServerEvent>();
+    auto* np_conf = event->mutable_server_conf();
+#define SERVER_CONF_EXPR_PKT(n,ini) \
+    np_conf->set_##n(conf_.n);
+    SERVER_CONF_APPLY(SERVER_CONF_EXPR_PKT);
+#undef SERVER_CONF_EXPR_PKT
+    np_conf->set_compress_min_size(compress_min_size_);
+    np_conf->set_input_channel(socket_->inputChannel());
+    np_conf->set_field_conf_hash(true);
+    auto* np_fcs = np_conf->mutable_field_confs();
+    np_fcs->Reserve(conf_.field_confs.size());
+    for(auto& fc : conf_.field_confs) {
+      auto* np_fc = np_fcs->Add();
+      fc->toPacket(*np_fc);
+    }
+    events.push_back(std::move(event));
+  }
+  {
+    // server state
+    auto event = std::make_unique<netplay::ServerEvent>();
+    auto* np_state = event->mutable_server_state();
+    np_state->set_state(static_cast<netplay::PktServerState::State>(state_));
+    events.push_back(std::move(event));
+  }
+  for(auto& event : this->playerEvents()) {
+    events.push_back(std::move(event));
+  }
+  lobby_snapshot_ = std::make_shared<const std::string>(netplay::ServerSocket::serializeEvents(std::move(events)));
+  return lobby_snapshot_;
+}
+
+void ServerInstance::setPlayerState(Player& pl, Player::State state)
+{
+  this->playerCount(pl.state())--;
+  this->playerCount(state)++;
+  pl.setState(state);
+  lobby_snapshot_.reset();
+}
+
+void ServerInstance::addSpectatorKeyframe()
+{
+  std::string data = netplay::ServerSocket::serializeEvents(this->playerEvents());
+  data += *this->matchStateSnapshot();
+  socket_->addSpectatorKeyframe(std::make_shared<const std::string>(std::move(data)));
+
+  spectator_timer_.expires_from_now(boost::posix_time::milliseconds(spectator_keyframe_ms_));
+  spectator_timer_.async_wait(std::bind(&ServerInstance::onSpectatorTimer, this, std::placeholders::_1));
+}
+
+void ServerInstance::onSpectatorTimer(const boost::system::error_code& ec)
+{
+  if(ec == boost::asio::error::operation_aborted) {
+    return;
+  }
+  if(state_ == State::GAME) {
+    this->addSpectatorKeyframe();
+  }
+}
+
+
 void ServerInstance::checkAllPlayersReady()
 {
   if(state_ == State::LOBBY) {
     // check for pl_nb_max ready players
-    unsigned int nb_ready = 0;
-    for(auto const& p : players_) {
-      if(p.second->state() == Player::State::LOBBY_READY) {
-        nb_ready++;
-      }
-    }
-    if(nb_ready == conf_.pl_nb_max) {
+    if(this->playerCount(Player::State::LOBBY_READY) == conf_.pl_nb_max) {
       this->prepareMatch();
     }
 
   } else if(state_ == State::GAME_READY) {
     // no more players in GAME_INIT state
-    for(auto const& p : players_) {
-      if(p.second->state() == Player::State::GAME_INIT) {
-        return;
-      }
+    if(this->playerCount(Player::State::GAME_INIT) == 0) {
+      this->startMatch();
     }
-    this->startMatch();
 
   } else {
     // nothing to check
@@ -637,18 +1465,19 @@ void ServerInstance::setState(State state)
   if(state == State::GAME_INIT) {
     for(auto const& p : players_) {
       if(p.second->state() == Player::State::LOBBY_READY) {
-        p.second->setState(Player::State::GAME_INIT);
+        this->setPlayerState(*p.second, Player::State::GAME_INIT);
       }
     }
   } else if(state == State::GAME) {
     for(auto const& p : players_) {
       if(p.second->state() == Player::State::GAME_READY) {
-        p.second->setState(Player::State::GAME);
+        this->setPlayerState(*p.second, Player::State::GAME);
       }
     }
   }
 
   state_ = state;
+  lobby_snapshot_.reset();
   LOG("server: state set to %d", static_cast<int>(state));
   observer_.onStateChange();
 }
@@ -661,21 +1490,34 @@ void ServerInstance::prepareMatch()
   match_.clear();
   this->setState(State::GAME_INIT);
 
-  int seed = ::rand(); // common seed for all fields
+  match_seed_ = ::rand(); // common seed for all fields
+  match_state_snapshot_.reset();
+  relays_.clear();
   for(auto& kv : players_) {
     Player& pl = *kv.second.get();
     if(pl.state() != Player::State::GAME_INIT) {
       continue;
     }
-    Field& fld = match_.addField(pl.fieldConf(), seed);
-    pl.setField(&fld);
+    Field& fld = match_.addField(pl.fieldConf(), match_seed_);
+    this->setPlayerField(pl, &fld);
     fld.fillRandom(6);
 
+    if( conf_.tk_report_period > 0 ) {
+      // local fields are always simulated, others are sampled
+      relays_.emplace_back();
+      FieldRelay& relay = relays_.back();
+      relay.simulated = pl.local() || static_cast<unsigned int>(::rand() % 100) < check_percent_;
+      relay.watched = false;
+      relay.has_report = false;
+      relay.rejected = false;
+      relay.inputs_tick = 0;
+    }
+
     auto event = std::make_unique<netplay::ServerEvent>();
     auto* np_field = event->mutable_player_field();
     np_field->set_plid(pl.plid());
     np_field->set_seed(fld.seed()); //note: seed changed due to fillRandom()
-    fld.setGridContentToPacket(*np_field->mutable_blocks());
+    fld.setGridContentToBytes(*np_field->mutable_grid());
     socket_->broadcastEvent(std::move(event));
   }
 
@@ -688,7 +1530,17 @@ void ServerInstance::startMatch()
 
   gb_distributor_.reset();
   match_.start();
+  stats_.clear();
+  stats_.resize(match_.fields().size());
+  this->startReplay();
   this->setState(State::GAME);
+  match_start_ = this->now();
+  if( lag_budget_ > 0 ) {
+    this->scheduleWatchdog();
+  }
+  if( spectator_delay_ms_ > 0 ) {
+    this->addSpectatorKeyframe();
+  }
 }
 
 void ServerInstance::stopMatch()
@@ -699,19 +1551,71 @@ void ServerInstance::stopMatch()
   }
   LOG("stop match");
 
+  if(state_ == State::GAME) {
+    this->sendMatchStats();
+  }
+  this->stopReplay();
   PlayerContainer::iterator it;
   for(it=players_.begin(); it!=players_.end(); ++it) {
-    (*it).second->setField(NULL);
+    this->setPlayerField(*(*it).second, NULL);
   }
+  relays_.clear();
+  stats_.clear();
+  pending_steps_.clear();
+  pending_players_.clear();
+  queued_players_.clear();
+  input_history_.clear();
+  datagram_inputs_.clear();
+  input_peers_.clear();
+  input_timer_.cancel();
+  input_timer_active_ = false;
+  autostep_ticks_.clear();
+  garbage_wait_ticks_.clear();
+  watchdog_timer_.cancel();
+  spectator_timer_.cancel();
   match_.stop();
   this->setState(State::LOBBY);
+
+  // disconnected players cannot be resumed anymore
+  std::vector<PlId> orphans;
+  for(auto const& p : orphans_) {
+    orphans.push_back(p.first);
+  }
+  orphans_.clear();
+  resume_timer_.cancel();
+  for(auto plid : orphans) {
+    this->removePlayer(*this->player(plid));
+  }
+}
+
+
+void ServerInstance::sendMatchStats()
+{
+  auto event = std::make_unique<netplay::ServerEvent>();
+  auto* np_stats = event->mutable_match_stats();
+  for(auto& kv : players_) {
+    const Player& pl = *kv.second;
+    const Field* fld = pl.field();
+    if( fld == NULL ) {
+      continue;
+    }
+    auto* np_field = np_stats->add_fields();
+    np_field->set_plid(pl.plid());
+    stats_[fld->fldid()-1].toPacket(*np_field);
+  }
+  socket_->broadcastEvent(std::move(event));
 }
 
 
 void ServerInstance::doStepPlayer(Player& pl, KeyState keys)
 {
   Tick prev_tick = pl.field()->tick();
+  if( socket_->inputChannel() ) {
+    input_history_[pl.plid()].add(prev_tick, TickInput{keys, pl.field()->droppedGarbageCount()}, input_redundancy_);
+    this->scheduleInputDatagrams();
+  }
   GameInstance::doStepPlayer(pl, keys);
+  stats_[pl.field()->fldid()-1].step(*pl.field(), keys);
 
   //XXX Current implementation does not group Input packets.
   auto event = std::make_unique<netplay::ServerEvent>();
@@ -726,13 +1630,187 @@ void ServerInstance::doStepPlayer(Player& pl, KeyState keys)
   socket_->broadcastEvent(std::move(event), peer);
 
   // update garbages
-  //TODO check for clients who never send back the drop packets
+  // clients who never send back the drop packets are handled by the watchdog
   gb_distributor_.updateGarbages(*pl.field());
 
   this->updateRanks();
 }
 
 
+bool ServerInstance::isFieldSimulated(const Field& fld) const
+{
+  return relays_.empty() || relays_[fld.fldid()-1].simulated;
+}
+
+void ServerInstance::stepField(Player& pl, KeyState keys)
+{
+  match_state_snapshot_.reset();
+  if( relays_.empty() ) {
+    GameInstance::stepField(pl, keys);
+    return;
+  }
+
+  Field& fld = *pl.field();
+  FieldRelay& relay = relays_[fld.fldid()-1];
+  const FieldReport* report = nullptr;
+  if( relay.has_report ) {
+    if( auto_stepping_ && relay.report.tick <= fld.tick()+1 ) {
+      relay.has_report = false;  // the owner did not play this tick
+    } else if( relay.report.tick <= fld.tick() ) {
+      throw netplay::CallbackError("unused field report");
+    } else if( relay.report.tick == fld.tick()+1 ) {
+      report = &relay.report;
+      relay.has_report = false;
+    }
+  }
+
+  if( relay.simulated ) {
+    fld.step(keys);
+    if( !pl.local() && !auto_stepping_ ) {
+      // check the owner's report
+      const Field::StepInfo& info = fld.stepInfo();
+      if( report == nullptr ) {
+        if( info.combo > 0 || info.chain_end || fld.lost() ) {
+          throw netplay::CallbackError("missing field report");
+        }
+      } else if( report->combo != info.combo || report->chain_end != info.chain_end || report->lost != fld.lost() ||
+                (info.combo > 0 && report->chain != info.chain) ) {
+        throw netplay::CallbackError("field report mismatch");
+      }
+    }
+  } else {
+    relay.inputs.push_back(keys);
+    if( auto_stepping_ ) {
+      // no report from the owner, use the shadow field's results
+      relay.watched = true;
+      this->simulateShadowField(pl, relay, fld.tick()+1);
+      const Field& shadow = *relay.shadow;
+      const Field::StepInfo& info = shadow.stepInfo();
+      fld.stepBlind(info.combo, info.chain, info.chain_end, shadow.lost());
+    } else if( report == nullptr ) {
+      fld.stepBlind(0, 1, false, false);
+    } else {
+      fld.stepBlind(report->combo, report->chain, report->chain_end, report->lost);
+    }
+  }
+
+  if( fld.tick() % conf_.tk_report_period == 0 ) {
+    FieldHash& expected = relay.hashes[fld.tick()];
+    if( relay.simulated ) {
+      expected = FieldHash{fld.stateHash(), fld.eventsDigest(), true};
+      if( !pl.local() && !auto_stepping_ && (report == nullptr || report->hash != expected.hash || report->events != expected.events) ) {
+        throw netplay::CallbackError("field state mismatch");
+      }
+    } else if( auto_stepping_ ) {
+      const Field& shadow = *relay.shadow;
+      expected = FieldHash{shadow.stateHash(), shadow.eventsDigest(), true};
+    } else {
+      if( report == nullptr ) {
+        throw netplay::CallbackError("missing field report");
+      }
+      // claimed hash and events digest computed from the owner's reports
+      expected = FieldHash{report->hash, fld.eventsDigest(), false};
+      // catch up the shadow field periodically, to bound logs
+      if( relay.watched || (shadow_checkpoint_ticks_ > 0 && fld.tick() - relay.inputs_tick >= shadow_checkpoint_ticks_) ) {
+        this->simulateShadowField(pl, relay, fld.tick());
+      }
+    }
+    // older hashes are not checked anymore
+    const Tick history_ticks = static_cast<Tick>(uint64_t(HASH_HISTORY_MS) * 1000 / conf_.tk_usec);
+    if( fld.tick() > history_ticks ) {
+      relay.hashes.erase(relay.hashes.begin(), relay.hashes.lower_bound(fld.tick() - history_ticks));
+    }
+  }
+}
+
+void ServerInstance::checkFieldHash(Player& pl, Tick tick, uint32_t hash, uint32_t events)
+{
+  FieldRelay& relay = relays_[pl.field()->fldid()-1];
+  if( tick > pl.field()->tick() ) {
+    throw netplay::CallbackError("invalid field report tick");
+  }
+  auto it = relay.hashes.find(tick);
+  if( it == relay.hashes.end() ) {
+    return;  // too old, not kept anymore
+  }
+  const FieldHash& expected = (*it).second;
+  if( expected.hash == hash && expected.events == events ) {
+    return;
+  }
+  if( !expected.verified ) {
+    // disputed hash, re-simulate the field to get the actual one
+    LOG("%s(%u): hash disputed at tick %u", pl.nick().c_str(), pl.plid(), tick);
+    relay.watched = true;
+    this->simulateShadowField(pl, relay, pl.field()->tick());
+    if( !expected.verified ) {
+      return;  // field lost before, owner has been rejected
+    }
+  }
+  if( expected.hash != hash || expected.events != events ) {
+    throw netplay::CallbackError("field state mismatch");
+  }
+}
+
+void ServerInstance::simulateShadowField(Player& pl, FieldRelay& relay, Tick tick)
+{
+  const Field& fld = *pl.field();
+  if( !relay.shadow ) {
+    // initialize the field like in prepareMatch()
+    relay.shadow = std::make_unique<Field>(fld.fldid(), fld.conf(), match_seed_);
+    relay.shadow->fillRandom(6);
+    relay.shadow->initMatch();
+  }
+  Field& shadow = *relay.shadow;
+
+  auto drop_it = relay.drops.begin();
+  // once the owner is rejected, keep simulating: the shadow field is then
+  // used to auto-step the field
+  while( shadow.tick() < tick && !shadow.lost() ) {
+    const Tick tk = shadow.tick();
+    if( tk == conf_.tk_start_countdown ) {
+      shadow.enableSwap(true);
+      shadow.enableRaise(true);
+    }
+    while( drop_it != relay.drops.end() && (*drop_it).tick == tk ) {
+      shadow.dropGarbage((*drop_it).type, (*drop_it).size);
+      ++drop_it;
+    }
+    shadow.step(relay.inputs[tk - relay.inputs_tick]);
+
+    auto it = relay.hashes.find(shadow.tick());
+    if( it != relay.hashes.end() ) {
+      FieldHash& expected = (*it).second;
+      const FieldHash actual{shadow.stateHash(), shadow.eventsDigest(), true};
+      if( !expected.verified && (expected.hash != actual.hash || expected.events != actual.events) ) {
+        this->rejectPlayerField(pl, relay);
+      }
+      expected = actual;
+    }
+  }
+  // logs are only needed from the shadow field's tick
+  relay.drops.erase(relay.drops.begin(), drop_it);
+  relay.inputs.erase(relay.inputs.begin(), relay.inputs.begin() + (shadow.tick() - relay.inputs_tick));
+  relay.inputs_tick = shadow.tick();
+
+  if( shadow.lost() && shadow.tick() < tick ) {
+    this->rejectPlayerField(pl, relay);  // field should have been lost
+  }
+}
+
+void ServerInstance::rejectPlayerField(Player& pl, FieldRelay& relay)
+{
+  if( relay.rejected ) {
+    return;
+  }
+  relay.rejected = true;
+  LOG("%s(%u): invalid field state", pl.nick().c_str(), pl.plid());
+  auto peer_it = peers_.find(pl.plid());
+  if( peer_it != peers_.end() ) {
+    (*peer_it).second->sendError("field state mismatch");
+  }
+}
+
+
 void ServerInstance::updateRanks()
 {
   std::vector<const Field*> ranked;
@@ -2,10 +2,17 @@
 #define SERVER_H_
 
 #include <map>
+#include <set>
+#include <array>
+#include <deque>
+#include <vector>
 #include <memory>
+#include <chrono>
+#include <random>
 #include "instance.h"
 #include "netplay.h"
 #include "game.h"
+#include "stats.h"
 
 
 class IniFile;
@@ -27,14 +34,40 @@ class ServerInstance: public GameInstance,
   /// Set configuration values from a config file.
   void loadConf(const IniFile& cfg);
 
-  /// Start server on a given port.
+  /** @brief Start server on a given port.
+   *
+   * Peers are also accepted on the LocalSocket path, if configured.
+   */
   void startServer(int port);
+  /** @brief Start server without listening, for in-process peers only.
+   *
+   * If the input channel is enabled, \e input_transport is used for it;
+   * without transport, the channel is not available.
+   */
+  void startServer(std::shared_ptr<netplay::DatagramTransport> input_transport=nullptr);
+  /** @brief Connect a peer using an in-process transport.
+   *
+   * The server must have been started. Clients living in the server's
+   * process may use a netplay::PipeTransport.
+   */
+  void connectPeer(std::unique_ptr<netplay::Transport> transport);
   /// Stop the server.
   void stopServer();
 
   /// Create and return a new local player.
   Player& newLocalPlayer(const std::string& nick);
 
+  /// Return the reference tick of the running match, from server's clock.
+  Tick referenceTick() const;
+  /** @brief Return the lag of a player, in ticks.
+   *
+   * Lag is computed against referenceTick(), pending inputs are taken into
+   * account.
+   */
+  Tick playerLag(const Player& pl) const;
+
+  virtual bool isFieldSimulated(const Field& fld) const;
+
   /** @name Local player operations. */
   //@{
   virtual void playerSetNick(Player& pl, const std::string& nick);
@@ -50,6 +83,7 @@ class ServerInstance: public GameInstance,
   virtual void onPeerDisconnect(netplay::PeerSocket& peer);
   virtual void onPeerClientEvent(netplay::PeerSocket& peer, const netplay::ClientEvent& event);
   virtual void onPeerClientCommand(netplay::PeerSocket& peer, const netplay::ClientCommand& command);
+  virtual void onPeerDatagram(netplay::PeerSocket& peer, const netplay::Datagram& dgram);
   //@}
 
   /** @name GarbageDistributor::Observer interface. */
@@ -61,6 +95,8 @@ class ServerInstance: public GameInstance,
 
  protected:
   GameInstance::Observer& observer() const { return observer_; }
+  /// Step a field, simulated or from its owner's report.
+  virtual void stepField(Player& pl, KeyState keys);
 
  private:
   Observer& observer_;
@@ -96,10 +132,158 @@ class ServerInstance: public GameInstance,
 
   void processPktInput(netplay::PeerSocket& peer, const netplay::PktInput& pkt);
   void processPktGarbageState(netplay::PeerSocket& peer, const netplay::PktGarbageState& pkt);
+  void processPktFieldReport(netplay::PeerSocket& peer, const netplay::PktFieldReport& pkt);
+  void processPktPing(netplay::PeerSocket& peer, const netplay::PktPing& pkt);
   void processPktChat(netplay::PeerSocket& peer, const netplay::PktChat& pkt);
   std::unique_ptr<netplay::PktPlayerConf> processPktPlayerJoin(netplay::PeerSocket& peer, const netplay::PktPlayerJoin& pkt);
   void processPktPlayerConf(netplay::PeerSocket& peer, const netplay::PktPlayerConf& pkt);
   void processPktPlayerState(netplay::PeerSocket& peer, const netplay::PktPlayerState& pkt);
+  std::unique_ptr<netplay::PktMatchState> processPktPlayerResume(netplay::PeerSocket& peer, const netplay::PktPlayerResume& pkt);
+  //@}
+
+  /** @name Field configuration hashes.
+   *
+   * Custom configurations sent in full by a peer are kept for its
+   * connection, the peer may then send their hash instead.
+   */
+  //@{
+  /** @brief Return true if a player's configuration can be sent as a hash.
+   *
+   * \e peer is the receiver, \e nullptr for all peers.
+   */
+  bool isFieldConfKnown(const Player& pl, const netplay::PeerSocket* peer) const;
+  /// Like fieldConfFromPacket(), also use and update configurations kept for a peer.
+  FieldConfTable::Ptr peerFieldConfFromPacket(const netplay::PeerSocket& peer, const netplay::PktPlayerConf& pkt);
+  //@}
+
+  /** @name Player resume.
+   *
+   * When a peer disconnects during a match, its playing players are kept for
+   * resume_timeout_ms_. Their fields are owned by the server: they are
+   * stepped by the watchdog and their garbages are dropped immediately.
+   * A client resumes a player with the token sent in the join response; it
+   * receives the full match state, then the following events.
+   */
+  //@{
+  /** @brief Keep a player of a disconnected peer, if possible.
+   *
+   * @return \e false if the player must be removed.
+   */
+  bool orphanPlayer(Player& pl);
+  /// Return true if a player is waiting to be resumed.
+  bool isOrphan(const Player& pl) const { return orphans_.find(pl.plid()) != orphans_.end(); }
+  /// Set the resume timer to the earliest orphan deadline.
+  void scheduleResumeTimeout();
+  void onResumeTimer(const boost::system::error_code& ec);
+  /// Fill the state of the running match, for resuming clients and spectators.
+  void fillMatchState(netplay::PktMatchState& pkt);
+  /** @brief Return the serialized match state event, for new spectators.
+   *
+   * The event is cached for the current tick, until a field changes.
+   */
+  std::shared_ptr<const std::string> matchStateSnapshot();
+  //@}
+
+  /// Return events describing all players, as sent to new peers.
+  std::vector<std::unique_ptr<netplay::ServerEvent>> playerEvents() const;
+  /** @brief Return serialized events sent to new peers.
+   *
+   * Server configuration and state, and players. The snapshot is cached
+   * until one of them changes.
+   */
+  std::shared_ptr<const std::string> lobbySnapshot();
+
+  /// Change the state of a player, update counters.
+  void setPlayerState(Player& pl, Player::State state);
+  /// Return the number of players in a given state.
+  unsigned int& playerCount(Player::State state) { return player_counts_[static_cast<size_t>(state)]; }
+
+  /** @name Delayed spectators.
+   *
+   * Spectators see the match spectator_delay_ms_ late. Keyframes of the
+   * match state are added to the spectator stream periodically; new
+   * spectators start from the oldest one.
+   */
+  //@{
+  /// Add a keyframe to the spectator stream, schedule the next one.
+  void addSpectatorKeyframe();
+  void onSpectatorTimer(const boost::system::error_code& ec);
+  //@}
+
+  /** @brief Drop the next waiting garbage of a field owned by the server.
+   *
+   * Used for local players and orphans, which don't confirm drops.
+   */
+  void dropWaitingGarbage(Player& pl);
+
+  /** @name Pending remote steps.
+   *
+   * Inputs received from peers are queued, then stepped by onStepTimer(),
+   * round-robin among players and within a time budget. This way, a peer
+   * sending a lot of inputs cannot starve the other ones.
+   */
+  //@{
+  /** @brief Step the next pending input of a player.
+   *
+   * netplay::CallbackError is thrown on error.
+   *
+   * @return \e true if inputs are still pending.
+   */
+  bool stepPendingInput(Player& pl);
+  /** @brief Step all pending inputs of a player.
+   *
+   * Used before processing other events of the player's peer, to keep
+   * events in order.
+   */
+  void flushPendingSteps(Player& pl);
+  /// Queue a player with pending steps, if not already queued.
+  void queuePendingPlayer(PlId plid);
+  /// Schedule processing of pending steps, if not already scheduled.
+  void schedulePendingSteps();
+  void onStepTimer(const boost::system::error_code& ec);
+  //@}
+
+  /** @name Input channel.
+   *
+   * Inputs are also exchanged in datagrams with peers using the input
+   * channel. Datagrams sent to a peer repeat the inputs it did not
+   * acknowledge yet, up to input_redundancy_ ticks per field, and
+   * acknowledge the inputs received from it.
+   *
+   * Inputs received in datagrams are buffered. They are queued once they
+   * follow the pending inputs and the field dropped the same garbage count
+   * than the sender. They are ignored in light relay mode, since field
+   * reports are only sent in events, before their input.
+   */
+  //@{
+  /// Queue buffered datagram inputs of a player, if possible.
+  void queueDatagramInputs(Player& pl);
+  /// Return the next input tick of a player not received yet.
+  Tick nextInputTick(const Player& pl) const;
+  /// Schedule sending of datagrams, if not already scheduled.
+  void scheduleInputDatagrams();
+  void onInputTimer(const boost::system::error_code& ec);
+  //@}
+
+  /** @name Watchdog.
+   *
+   * A reference tick clock is started with the match. Remote fields lagging
+   * more than lag_budget_ ticks behind it, or not confirming garbage drops
+   * within the same budget, are aborted.
+   *
+   * Fields of orphans (see orphanPlayer()) are stepped with empty input up
+   * to the reference tick, regardless of the lag budget. They are resumed
+   * from the match state, thus never diverge from their owner.
+   */
+  //@{
+  void scheduleWatchdog();
+  void onWatchdogTimer(const boost::system::error_code& ec);
+  /// Check a remote player against the reference tick.
+  void checkPlayerLag(Player& pl);
+  /// Step an orphan with empty input, up to a given tick.
+  void autoStepPlayer(Player& pl, Tick tick);
+  /// Abort the field of a remote player, notify its peer.
+  void abortPlayerField(Player& pl, const std::string& reason);
   //@}
 
   /// Check if all players are ready and take actions
@@ -108,6 +292,77 @@ class ServerInstance: public GameInstance,
   /// Step a player field, process garbages, send Input packets.
   virtual void doStepPlayer(Player& pl, KeyState keys);
 
+  /** @name Light relay mode.
+   *
+   * When tk_report_period is not null, only a sample of the fields are
+   * simulated. Other fields are stepped blindly, using the reports of their
+   * owner. All clients report field hashes; when a hash is disputed, the
+   * field is re-simulated from logged inputs and garbage drops, and the
+   * cheater is disconnected. Fields are also re-simulated every
+   * shadow_checkpoint_ticks_, logs are only kept from the last one.
+   */
+  //@{
+
+  /// Step report of a field, as sent by its owner.
+  struct FieldReport {
+    Tick tick;
+    unsigned int combo;
+    unsigned int chain;
+    bool chain_end;
+    bool lost;
+    uint32_t hash;
+    uint32_t events;
+  };
+  /// Expected hash of a field.
+  struct FieldHash {
+    uint32_t hash;
+    uint32_t events;
+    bool verified;  ///< computed by the server
+  };
+  /// Logged garbage drop.
+  struct DropRecord {
+    Tick tick;
+    Garbage::Type type;
+    FieldPos size;
+  };
+  /// Relay state of a field.
+  struct FieldRelay {
+    bool simulated;  ///< field is fully simulated by the server
+    bool watched;  ///< field hashes are verified using the shadow field
+    bool has_report;  ///< report is set
+    bool rejected;  ///< owner has been rejected for invalid state
+    FieldReport report;  ///< pending report of the field's owner
+    /** @brief Logged inputs, from the shadow field's tick (unsimulated fields only)
+     *
+     * Index 0 is the input of tick \e inputs_tick.
+     */
+    std::vector<KeyState> inputs;
+    Tick inputs_tick;
+    /// Logged garbage drops, not applied to the shadow field yet (unsimulated fields only)
+    std::vector<DropRecord> drops;
+    /// Field re-simulated from logs, created on first dispute or checkpoint
+    std::unique_ptr<Field> shadow;
+    /// Expected hashes of the last HASH_HISTORY_MS, indexed by tick
+    std::map<Tick, FieldHash> hashes;
+  };
+  /// Duration for which field hashes can be checked against reports
+  static const unsigned int HASH_HISTORY_MS;
+
+  /// Check a field hash reported by another player than the owner.
+  void checkFieldHash(Player& pl, Tick tick, uint32_t hash, uint32_t events);
+  /** @brief Advance the shadow field of a player up to a given tick.
+   *
+   * Expected hashes of passed ticks are verified. On mismatch, the owner's
+   * peer is disconnected. Logs of passed ticks are dropped.
+   */
+  void simulateShadowField(Player& pl, FieldRelay& relay, Tick tick);
+  /** @brief Disconnect the owner of a field with invalid state.
+   *
+   * The owner is rejected only once, further calls are ignored.
+   */
+  void rejectPlayerField(Player& pl, FieldRelay& relay);
+  //@}
+
   /// Update fields ranks, stop the match if needed
   void updateRanks();
 
@@ -117,6 +372,8 @@ class ServerInstance: public GameInstance,
   void prepareMatch();
   void startMatch();
   void stopMatch();
+  /// Broadcast statistics of the running match.
+  void sendMatchStats();
 
   typedef std::map<PlId, netplay::PeerSocket*> PeerContainer;
 
@@ -124,6 +381,96 @@ class ServerInstance: public GameInstance,
   GarbageDistributor gb_distributor_;
   PeerContainer peers_;
   PlId current_plid_;
+  /// Number of players in each state
+  std::array<unsigned int, static_cast<size_t>(Player::State::GAME)+1> player_counts_;
+  /// Cached lobbySnapshot(), null if outdated
+  std::shared_ptr<const std::string> lobby_snapshot_;
+  /// Cached matchStateSnapshot(), null if outdated
+  std::shared_ptr<const std::string> match_state_snapshot_;
+  /// Match tick of match_state_snapshot_
+  Tick match_state_tick_;
+
+  /// Common seed of the current match fields
+  int match_seed_;
+  /// Relay states of fields, indexed by FldId-1 (light relay mode).
+  std::vector<FieldRelay> relays_;
+  /// Percentage of fields simulated in light relay mode
+  unsigned int check_percent_;
+  /// Period of shadow field catch-ups of unsimulated fields, 0 to disable
+  Tick shadow_checkpoint_ticks_;
+  /** @brief Statistics of fields, indexed by FldId-1.
+   *
+   * Updated after each step and on garbage drops. Unsimulated fields in
+   * light relay mode only have input and combo/chain statistics.
+   */
+  std::vector<FieldStats> stats_;
+
+  /// Pending inputs of remote players.
+  std::map<PlId, std::deque<KeyState>> pending_steps_;
+  /// Players with pending inputs, in processing order.
+  std::deque<PlId> pending_players_;
+  /// Players in pending_players_, each one is queued once
+  std::set<PlId> queued_players_;
+  boost::asio::monotone_timer step_timer_;
+  bool step_timer_active_;
+  /// Time budget for processing pending steps, in microseconds
+  unsigned int step_budget_usec_;
+
+  /// Enable the input channel
+  bool input_channel_;
+  /// Maximum count of input ticks per field in a datagram
+  unsigned int input_redundancy_;
+  /// Last inputs of all players
+  std::map<PlId, InputHistory> input_history_;
+  /// Inputs of remote players received in datagrams, not queued yet
+  std::map<PlId, InputBuffer> datagram_inputs_;
+  /// Input channel state of a peer
+  struct InputPeer {
+    /// Next input tick not acknowledged by the peer, per player
+    std::map<PlId, Tick> acked;
+    /// Acknowledgements last sent to the peer, per player
+    std::map<PlId, Tick> sent_acks;
+  };
+  std::map<const netplay::PeerSocket*, InputPeer> input_peers_;
+  /// Configurations kept for each peer
+  std::map<const netplay::PeerSocket*, FieldConfPins> field_conf_pins_;
+  boost::asio::monotone_timer input_timer_;
+  bool input_timer_active_;
+
+  boost::asio::monotone_timer watchdog_timer_;
+  /// Start time of the current match, for the reference tick
+  std::chrono::steady_clock::time_point match_start_;
+  /// Maximum lag of remote players, in ticks (0 to disable the watchdog)
+  Tick lag_budget_;
+  /// Last auto-stepped tick of remote players
+  std::map<PlId, Tick> autostep_ticks_;
+  /// Field tick at which waiting garbages have been sent
+  std::map<GbId, Tick> garbage_wait_ticks_;
+  /// Set when stepping fields with auto-generated inputs
+  bool auto_stepping_;
+
+  /// Resume tokens of remote players
+  std::map<PlId, uint64_t> resume_tokens_;
+  std::mt19937_64 token_rng_;
+  /// Players waiting to be resumed, with their deadline
+  std::map<PlId, std::chrono::steady_clock::time_point> orphans_;
+  boost::asio::monotone_timer resume_timer_;
+  /// Delay to resume players of a disconnected peer (0 to disable)
+  unsigned int resume_timeout_ms_;
+
+  /// Delay between sends of events to spectators, in ticks
+  unsigned int spectator_batch_ticks_;
+  /// Maximum size of data waiting to be sent to a spectator
+  unsigned int spectator_queue_max_;
+  boost::asio::monotone_timer spectator_timer_;
+  /// Delay of events sent to spectators (0 to disable)
+  unsigned int spectator_delay_ms_;
+  /// Period of match state keyframes, for delayed spectators
+  unsigned int spectator_keyframe_ms_;
+  /// Minimum size of compressed packets (0 to disable)
+  unsigned int compress_min_size_;
+  /// Path of the Unix-domain socket (empty to disable)
+  std::string local_socket_;
 };
 
 
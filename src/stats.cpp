@@ -0,0 +1,171 @@
+#include <algorithm>
+#include <limits>
+#include "stats.h"
+
+
+constexpr unsigned int FieldStats::COMBO_MAX;
+
+
+void FieldStats::step(const Field& fld, KeyState keys)
+{
+  const Field::StepInfo& info = fld.stepInfo();
+  ticks++;
+  if(keys & ~prev_keys_) {
+    actions++;
+  }
+  prev_keys_ = keys;
+  if(info.swap) {
+    swaps++;
+  }
+  if(info.move) {
+    moves++;
+  }
+  if(info.raised) {
+    raises++;
+  }
+  if(info.combo > 0) {
+    combos[std::min(std::max(info.combo, 3u), COMBO_MAX) - 3]++;
+    if(info.chain == 2) {
+      chains++;
+    }
+    max_chain = std::max(max_chain, info.chain);
+  }
+  gb_cleared += info.blocks.mutated;
+  if(fld.stopDelay() > 0) {
+    stop_ticks++;
+  }
+  raise_speed_index = std::max(raise_speed_index, fld.raiseSpeedIndex());
+}
+
+
+void FieldStats::toPacket(netplay::PktMatchStats::Field& pkt) const
+{
+  pkt.set_ticks(ticks);
+  pkt.set_actions(actions);
+  pkt.set_swaps(swaps);
+  pkt.set_moves(moves);
+  pkt.set_raises(raises);
+  pkt.set_max_chain(max_chain);
+  pkt.set_chains(chains);
+  // trailing zeros are not sent
+  size_t n = combos.size();
+  while(n > 0 && combos[n-1] == 0) {
+    n--;
+  }
+  pkt.clear_combos();
+  for(size_t i=0; i<n; i++) {
+    pkt.add_combos(combos[i]);
+  }
+  pkt.set_gb_sent(gb_sent);
+  pkt.set_gb_received(gb_received);
+  pkt.set_gb_cleared(gb_cleared);
+  pkt.set_stop_ticks(stop_ticks);
+  pkt.set_raise_speed_index(raise_speed_index);
+}
+
+void FieldStats::fromPacket(const netplay::PktMatchStats::Field& pkt)
+{
+  *this = FieldStats();
+  ticks = pkt.ticks();
+  actions = pkt.actions();
+  swaps = pkt.swaps();
+  moves = pkt.moves();
+  raises = pkt.raises();
+  max_chain = pkt.max_chain();
+  chains = pkt.chains();
+  for(int i=0; i<pkt.combos_size(); i++) {
+    // larger combos are merged
+    combos[std::min<size_t>(i, combos.size()-1)] += pkt.combos(i);
+  }
+  gb_sent = pkt.gb_sent();
+  gb_received = pkt.gb_received();
+  gb_cleared = pkt.gb_cleared();
+  stop_ticks = pkt.stop_ticks();
+  raise_speed_index = pkt.raise_speed_index();
+}
+
+
+double FieldStats::apm(unsigned int tk_usec) const
+{
+  if(ticks == 0) {
+    return 0;
+  }
+  return actions * 60e6 / (static_cast<double>(ticks) * tk_usec);
+}
+
+
+constexpr unsigned int LatencyHistogram::SUB_BITS;
+
+LatencyHistogram::LatencyHistogram():
+    count_(0), sum_(0), min_(std::numeric_limits<uint64_t>::max()), max_(0)
+{
+}
+
+void LatencyHistogram::add(uint64_t usec)
+{
+  const unsigned int idx = bucketIndex(usec);
+  if(idx >= buckets_.size()) {
+    buckets_.resize(idx+1);
+  }
+  buckets_[idx]++;
+  count_++;
+  sum_ += usec;
+  min_ = std::min(min_, usec);
+  max_ = std::max(max_, usec);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& o)
+{
+  if(o.buckets_.size() > buckets_.size()) {
+    buckets_.resize(o.buckets_.size());
+  }
+  for(size_t i=0; i<o.buckets_.size(); i++) {
+    buckets_[i] += o.buckets_[i];
+  }
+  count_ += o.count_;
+  sum_ += o.sum_;
+  min_ = std::min(min_, o.min_);
+  max_ = std::max(max_, o.max_);
+}
+
+uint64_t LatencyHistogram::percentile(double p) const
+{
+  if(count_ == 0) {
+    return 0;
+  }
+  // rank of the sample, 1-based
+  const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(p / 100 * count_ + 0.5));
+  uint64_t n = 0;
+  for(size_t i=0; i<buckets_.size(); i++) {
+    n += buckets_[i];
+    if(n >= rank) {
+      return std::max(min_, std::min(max_, bucketValue(i)));
+    }
+  }
+  return max_;
+}
+
+unsigned int LatencyHistogram::bucketIndex(uint64_t v)
+{
+  const uint64_t sub = 1 << SUB_BITS;
+  if(v < 2*sub) {
+    return v;
+  }
+  unsigned int msb = 0;
+  while(v >> (msb+1)) {
+    msb++;
+  }
+  const unsigned int shift = msb - SUB_BITS;
+  return (shift << SUB_BITS) + (v >> shift);
+}
+
+uint64_t LatencyHistogram::bucketValue(unsigned int idx)
+{
+  const unsigned int sub = 1 << SUB_BITS;
+  if(idx < 2*sub) {
+    return idx;
+  }
+  const unsigned int shift = (idx >> SUB_BITS) - 1;
+  const uint64_t low = static_cast<uint64_t>(idx - (shift << SUB_BITS)) << shift;
+  return low + ((uint64_t(1) << shift) >> 1);
+}
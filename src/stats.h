@@ -0,0 +1,99 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+/** @file
+ * @brief Player and network statistics.
+ */
+
+#include <stdint.h>
+#include <array>
+#include <vector>
+#include "game.h"
+
+
+/** @brief Statistics of a field, during a match.
+ *
+ * Statistics are updated after each step, from step information and a few
+ * field values. They never scan the grid.
+ */
+struct FieldStats
+{
+  /// Largest combo size with its own counter, larger combos are merged.
+  static constexpr unsigned int COMBO_MAX = 10;
+
+  Tick ticks = 0;  ///< stepped ticks
+  unsigned long actions = 0;  ///< key presses
+  unsigned long swaps = 0;
+  unsigned long moves = 0;  ///< cursor moves
+  unsigned long raises = 0;  ///< raised lines, manual or not
+  unsigned int max_chain = 1;
+  unsigned long chains = 0;  ///< chains of at least 2
+  /// Combos by size, from 3 to COMBO_MAX (larger ones included)
+  std::array<unsigned long, COMBO_MAX-2> combos = {};
+  unsigned long gb_sent = 0;  ///< sent garbage lines, when dropped
+  unsigned long gb_received = 0;  ///< received garbage lines, when dropped
+  unsigned long gb_cleared = 0;  ///< mutated garbage blocks
+  Tick stop_ticks = 0;  ///< ticks with raise stopped
+  unsigned int raise_speed_index = 0;  ///< highest raise speed index reached
+
+  /// Update after a field step.
+  void step(const Field& fld, KeyState keys);
+  /// Count a garbage dropped on an opponent.
+  void garbageSent(const FieldPos& size) { gb_sent += garbageLines(size); }
+  /// Count a garbage dropped on the field.
+  void garbageReceived(const FieldPos& size) { gb_received += garbageLines(size); }
+
+  /// Return the number of combos of a given size (COMBO_MAX for larger).
+  unsigned long comboCount(unsigned int size) const { return combos[size-3]; }
+  /// Return actions per minute, for a given tick duration.
+  double apm(unsigned int tk_usec) const;
+
+  void toPacket(netplay::PktMatchStats::Field& pkt) const;
+  void fromPacket(const netplay::PktMatchStats::Field& pkt);
+
+ private:
+  static unsigned int garbageLines(const FieldPos& size) { return size.y; }
+
+  KeyState prev_keys_ = 0;
+};
+
+
+/** @brief Histogram of latencies, for percentiles.
+ *
+ * Values are stored in log-linear buckets: exact below 32, then 16 buckets
+ * per power of two. Memory does not depend on the number of samples, and
+ * the relative error of percentiles is below 1/16.
+ */
+class LatencyHistogram
+{
+ public:
+  LatencyHistogram();
+
+  /// Add a sample, in microseconds.
+  void add(uint64_t usec);
+  /// Add all samples of another histogram.
+  void merge(const LatencyHistogram& o);
+  void clear() { *this = LatencyHistogram(); }
+
+  uint64_t count() const { return count_; }
+  uint64_t min() const { return count_ ? min_ : 0; }
+  uint64_t max() const { return max_; }
+  double mean() const { return count_ ? static_cast<double>(sum_) / count_ : 0; }
+  /// Return the value below which a given percentage of samples fall.
+  uint64_t percentile(double p) const;
+
+ private:
+  static constexpr unsigned int SUB_BITS = 4;
+  static unsigned int bucketIndex(uint64_t v);
+  /// Return the middle value of a bucket.
+  static uint64_t bucketValue(unsigned int idx);
+
+  std::vector<uint64_t> buckets_;
+  uint64_t count_;
+  uint64_t sum_;
+  uint64_t min_;
+  uint64_t max_;
+};
+
+
+#endif